@@ -0,0 +1,1389 @@
+// bench.c
+// Benchmarks for the portable parts of the library (no Lua, no console).
+// Build with "make bench"; run as "bench [name-prefix]".
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cells.h"
+#include "cellops.h"
+#include "cmdlist.h"
+#include "coalesce.h"
+#include "compose.h"
+#include "layout.h"
+#include "loop.h"
+#include "mpsc.h"
+#include "outbuf.h"
+#include "pump.h"
+#include "rec.h"
+#include "render.h"
+#include "scroll.h"
+#include "scrollback.h"
+#include "service.h"
+#include "spsc.h"
+#include "term.h"
+#include "thread.h"
+#include "utf8.h"
+#include "vt.h"
+
+#ifdef _WIN32
+# include <windows.h>
+static double now_ns (void)
+{
+  static LARGE_INTEGER freq;
+  LARGE_INTEGER t;
+  if (!freq.QuadPart)
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart * 1e9 / (double)freq.QuadPart;
+}
+#else
+# include <time.h>
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+#endif
+
+#ifdef _WIN32
+# define yield_cpu()  Sleep(0)
+#else
+# include <sched.h>
+# define yield_cpu()  sched_yield()
+#endif
+
+// results found wrong by the benchmarks that check theirs: the exit status
+static int wrong;
+
+static void report (const char *name, double ns, long ops, const char *extra)
+{
+  printf("%-32s %12.1f ns/op  %s\n", name, ns / ops, extra ? extra : "");
+}
+
+static cell_t* alloc_cells (int width, int height)
+{
+  cell_t *p = (cell_t*)malloc((size_t)width * height * sizeof(cell_t));
+  if (!p) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+//---------------------------------------------------------------------------
+// render: a 200x60 dashboard where a clock and a few fields change per frame
+//---------------------------------------------------------------------------
+typedef struct {
+  long calls;
+  long cells;
+} recorder;
+
+static int record_write (void *ctx, const cellbuf *src, const cell_rect *r)
+{
+  recorder *rec = (recorder*)ctx;
+  (void)src;
+  rec->calls++;
+  rec->cells += (long)(r->Right - r->Left + 1) * (r->Bottom - r->Top + 1);
+  return 1;
+}
+
+static int record_scroll (void *ctx, int top, int bottom, int shift, cell_t fill)
+{
+  recorder *rec = (recorder*)ctx;
+  (void)top; (void)bottom; (void)shift; (void)fill;
+  rec->calls++;
+  return 1;
+}
+
+static void dashboard_frame (cellbuf *cb, int frame)
+{
+  char text[64];
+  int i;
+  sprintf(text, "%02d:%02d:%02d", frame / 3600 % 24, frame / 60 % 60, frame % 60);
+  cellbuf_put_string(cb, cb->width - 9, 0, text, strlen(text), 0x1F);
+  for (i=0; i<8; i++) {
+    sprintf(text, "field %d: %8d", i, frame * (i + 1) % 100000);
+    cellbuf_put_string(cb, 4 + (i % 2) * 60, 5 + i * 6, text, strlen(text), 0x0A);
+  }
+  sprintf(text, "frame %d", frame);
+  cellbuf_put_string(cb, 0, cb->height - 1, text, strlen(text), 0x70);
+}
+
+static void bench_render (void)
+{
+  const int W = 200, H = 60, FRAMES = 20000;
+  cellbuf front, back;
+  render_params prm;
+  render_stats stats;
+  render_sink sink;
+  recorder rec;
+  cell_t blank = { ' ', 0x07 };
+  char extra[128];
+  double t0;
+  int i;
+
+  cellbuf_init(&front, W, H, alloc_cells(W, H));
+  cellbuf_init(&back, W, H, alloc_cells(W, H));
+  cellbuf_clear(&back, blank);
+  render_init_params(&prm);
+  memset(&stats, 0, sizeof(stats));
+  memset(&rec, 0, sizeof(rec));
+  sink.write = record_write;
+  sink.scroll = NULL;
+  sink.ctx = &rec;
+  render_present(&front, &back, &prm, 1, &sink, &stats);
+
+  memset(&rec, 0, sizeof(rec));
+  t0 = now_ns();
+  for (i=1; i<=FRAMES; i++) {
+    dashboard_frame(&back, i);
+    render_present(&front, &back, &prm, 0, &sink, &stats);
+  }
+  sprintf(extra, "%.1f calls/frame, %.0f cells/frame (full frame %d)",
+    (double)rec.calls / FRAMES, (double)rec.cells / FRAMES, W * H);
+  report("render/dashboard-200x60", now_ns() - t0, FRAMES, extra);
+
+  // nothing changed at all: the cost of the diff alone
+  t0 = now_ns();
+  for (i=0; i<FRAMES; i++)
+    render_present(&front, &back, &prm, 0, &sink, &stats);
+  report("render/unchanged-200x60", now_ns() - t0, FRAMES, NULL);
+
+  // a log tail: every frame the text moves up by one line
+  prm.scroll = 1;
+  sink.scroll = record_scroll;
+  memset(&rec, 0, sizeof(rec));
+  t0 = now_ns();
+  for (i=1; i<=FRAMES; i++) {
+    cell_rect r;
+    char text[128];
+    int y;
+    for (y=0; y<H; y++) {
+      r.Left = 0; r.Right = W - 1; r.Top = r.Bottom = y;
+      cellbuf_fill_rect(&back, r, ' ', 0x07);
+      sprintf(text, "%08d log message number %d with some payload", i + y, (i + y) * 7);
+      cellbuf_put_string(&back, 0, y, text, strlen(text), 0x07);
+    }
+    render_present(&front, &back, &prm, 0, &sink, &stats);
+  }
+  sprintf(extra, "%.1f calls/frame, %.0f cells/frame", (double)rec.calls / FRAMES,
+    (double)rec.cells / FRAMES);
+  report("render/logtail-200x60", now_ns() - t0, FRAMES, extra);
+
+  free(front.cells);
+  free(back.cells);
+}
+
+//---------------------------------------------------------------------------
+// scroll: shift detection over synthetic frames
+//---------------------------------------------------------------------------
+static void bench_scroll (void)
+{
+  const int W = 200, H = 60, REPS = 20000;
+  cellbuf a, b;
+  cell_t blank = { ' ', 0x07 };
+  char text[128], extra[64];
+  double t0;
+  int i, y, shift = 0, matched = 0;
+
+  cellbuf_init(&a, W, H, alloc_cells(W, H));
+  cellbuf_init(&b, W, H, alloc_cells(W, H));
+  cellbuf_clear(&a, blank);
+  cellbuf_clear(&b, blank);
+  for (y=0; y<H; y++) {
+    sprintf(text, "line %d", y);
+    cellbuf_put_string(&a, 0, y, text, strlen(text), 0x07);
+    sprintf(text, "line %d", y + 3);
+    cellbuf_put_string(&b, 0, y, text, strlen(text), 0x07);
+  }
+  t0 = now_ns();
+  for (i=0; i<REPS; i++)
+    shift = scroll_detect(&a, &b, 0, H - 1, 0, &matched);
+  if (shift != 3 || matched != H - 3)
+    wrong++;
+  sprintf(extra, "shift %d, %d rows matched%s", shift, matched,
+          shift != 3 || matched != H - 3 ? ", WRONG SHIFT" : "");
+  report("scroll/detect-200x60", now_ns() - t0, REPS, extra);
+  free(a.cells);
+  free(b.cells);
+}
+
+//---------------------------------------------------------------------------
+// compose: panes stacked over a 200x60 screen and a popup moving over them,
+// against composing the whole screen every frame
+//---------------------------------------------------------------------------
+static void bench_compose_with (int layers)
+{
+  const int W = 200, H = 60, FRAMES = 20000;
+  compositor c;
+  cellbuf screen, popup, *panes;
+  render_sink sink;
+  recorder rec;
+  cell_t blank = { ' ', 0x07 }, border = { '#', 0x4F };
+  cell_rect inner = { 10, 5, 89, 24 };
+  char name[64], extra[128];
+  double t0;
+  int i, id;
+
+  panes = (cellbuf*)malloc(layers * sizeof(cellbuf));
+  cellbuf_init(&screen, W, H, alloc_cells(W, H));
+  compose_init(&c, screen, blank);
+  for (i=0; i<layers; i++) {
+    // overlapping panes, every other one with transparent blanks
+    cell_t fill = { 'a' + i % 26, (unsigned short)(0x10 * (i % 8) + 7) };
+    cellbuf_init(&panes[i], 100, 30, alloc_cells(100, 30));
+    cellbuf_clear(&panes[i], fill);
+    cellbuf_fill_rect(&panes[i], inner, ' ', -1);
+    id = compose_add(&c, &panes[i], (i * 13) % (W - 100), (i * 7) % (H - 30), i);
+    if (i % 2)
+      compose_set_key(&c, id, CELL32(' ', 0), CELL32_CHAR);
+  }
+  cellbuf_init(&popup, 40, 10, alloc_cells(40, 10));
+  cellbuf_clear(&popup, border);
+  id = compose_add(&c, &popup, 0, 0, layers);
+  memset(&rec, 0, sizeof(rec));
+  sink.write = record_write;
+  sink.scroll = NULL;
+  sink.ctx = &rec;
+  compose_update(&c, &sink);
+
+  memset(&rec, 0, sizeof(rec));
+  memset(&c.stats, 0, sizeof(c.stats));
+  t0 = now_ns();
+  for (i=0; i<FRAMES; i++) {
+    compose_move(&c, id, i % (W - 40), (i / (W - 40)) % (H - 10));
+    compose_update(&c, &sink);
+  }
+  sprintf(name, "compose/popup-move/%d", layers);
+  sprintf(extra, "%.0f cells composed, %.1f rects, %.0f cells sent per frame",
+          (double)c.stats.cells / FRAMES, (double)rec.calls / FRAMES,
+          (double)rec.cells / FRAMES);
+  report(name, now_ns() - t0, FRAMES, extra);
+
+  memset(&rec, 0, sizeof(rec));
+  memset(&c.stats, 0, sizeof(c.stats));
+  t0 = now_ns();
+  for (i=0; i<FRAMES / 10; i++) {
+    compose_damage_screen(&c, NULL);
+    compose_update(&c, &sink);
+  }
+  sprintf(name, "compose/full/%d", layers);
+  sprintf(extra, "%.0f plane segments per frame",
+          (double)c.stats.layers / (FRAMES / 10));
+  report(name, now_ns() - t0, FRAMES / 10, extra);
+
+  compose_free(&c);
+  for (i=0; i<layers; i++)
+    free(panes[i].cells);
+  free(panes);
+  free(popup.cells);
+  free(screen.cells);
+}
+
+static void bench_compose (void)
+{
+  bench_compose_with(4);
+  bench_compose_with(32);
+}
+
+//---------------------------------------------------------------------------
+// cmdlist: a status screen recorded once, patched and replayed per frame
+//---------------------------------------------------------------------------
+typedef struct {
+  long calls;
+  long bytes;
+} cmd_log;
+
+static int log_cursor_pos (void *ctx, int x, int y)
+{
+  (void)x; (void)y;
+  ((cmd_log*)ctx)->calls++;
+  return 1;
+}
+
+static int log_text_attr (void *ctx, int attr)
+{
+  (void)attr;
+  ((cmd_log*)ctx)->calls++;
+  return 1;
+}
+
+static int log_write (void *ctx, const char *s, size_t len)
+{
+  (void)s;
+  ((cmd_log*)ctx)->calls++;
+  ((cmd_log*)ctx)->bytes += (long)len;
+  return 1;
+}
+
+static int log_fill (void *ctx, int v, int n, int x, int y)
+{
+  (void)v; (void)n; (void)x; (void)y;
+  ((cmd_log*)ctx)->calls++;
+  return 1;
+}
+
+static int log_cursor_info (void *ctx, int size, int visible)
+{
+  (void)size; (void)visible;
+  ((cmd_log*)ctx)->calls++;
+  return 1;
+}
+
+static void bench_cmdlist (void)
+{
+  const int FRAMES = 200000, ROWS = 8;
+  cmdlist cl;
+  cmd_backend be;
+  cmd_log log;
+  int values[8], i, frame, args[4];
+  char text[64], extra[64];
+  double t0;
+
+  cmdlist_init(&cl);
+  args[0] = 0; args[1] = 1;
+  cmdlist_add(&cl, CMD_CURSOR_INFO, args);
+  for (i=0; i<ROWS; i++) {
+    // chrome: a filled label area and a label
+    args[0] = ' '; args[1] = 80; args[2] = 0; args[3] = i;
+    cmdlist_add(&cl, CMD_FILL_CHAR, args);
+    args[0] = 0x17;
+    cmdlist_add(&cl, CMD_FILL_ATTR, args);
+    args[0] = 2; args[1] = i;
+    cmdlist_add(&cl, CMD_CURSOR_POS, args);
+    args[0] = 0x1F;
+    cmdlist_add(&cl, CMD_TEXT_ATTR, args);
+    sprintf(text, "counter %d:", i);
+    cmdlist_add_text(&cl, text, strlen(text), 0);
+    // the value, patched every frame
+    args[0] = 20; args[1] = i;
+    cmdlist_add(&cl, CMD_CURSOR_POS, args);
+    values[i] = cmdlist_add_text(&cl, "", 0, 16);
+  }
+
+  memset(&log, 0, sizeof(log));
+  be.cursor_pos = log_cursor_pos;
+  be.text_attr = log_text_attr;
+  be.write = log_write;
+  be.fill_char = log_fill;
+  be.fill_attr = log_fill;
+  be.cursor_info = log_cursor_info;
+  be.ctx = &log;
+
+  t0 = now_ns();
+  for (frame=0; frame<FRAMES; frame++) {
+    for (i=0; i<ROWS; i++) {
+      sprintf(text, "%10d", frame * (i + 1));
+      cmdlist_patch_text(&cl, values[i], text, strlen(text));
+    }
+    cmdlist_run(&cl, &be);
+  }
+  sprintf(extra, "%d commands/frame, %ld bytes of text/frame", (int)cl.nops,
+    log.bytes / FRAMES);
+  report("cmdlist/patch-replay-frame", now_ns() - t0, FRAMES, extra);
+  cmdlist_free(&cl);
+}
+
+//---------------------------------------------------------------------------
+// loop: the timer heap, and a thread waking the loop through an event; the
+// latency is from the event being set to loop_next() returning it
+//---------------------------------------------------------------------------
+#ifdef _WIN32
+static double cpu_ms (void)
+{
+  FILETIME created, exited, kernel, user;
+  GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user);
+  return ((double)((ULONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+          (double)((ULONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime)) / 1e4;
+}
+#else
+static double cpu_ms (void)
+{
+  return clock() * 1e3 / CLOCKS_PER_SEC;
+}
+#endif
+
+typedef struct {
+  sys_event ev, never;
+  int wakes, period_ms;
+  volatile double set_at;
+} waker;
+
+static int event_wait (void *ctx, const intptr_t *handles, int n, int timeout_ms)
+{
+  waker *w = (waker*)ctx;
+  if (n == 0) {
+    sys_event_wait(&w->never, timeout_ms);
+    return LOOP_TIMEOUT;
+  }
+  return sys_event_wait((sys_event*)handles[0], timeout_ms) ? 0 : LOOP_TIMEOUT;
+}
+
+static THREAD_PROC(waker_proc, arg)
+{
+  waker *w = (waker*)arg;
+  int i;
+  for (i=0; i<w->wakes; i++) {
+    sys_event_wait(&w->never, w->period_ms);
+    w->set_at = loop_now();
+    sys_event_set(&w->ev);
+  }
+  THREAD_RETURN;
+}
+
+static void bench_loop (void)
+{
+  const int N = 200000, WAKES = 200, TICKS = 200;
+  event_loop lp;
+  loop_backend be;
+  loop_event ev;
+  waker w;
+  sys_thread th;
+  char extra[128];
+  double t0, cpu, sum = 0, worst = 0;
+  int i;
+
+  // N timers that are all due, in scrambled order
+  loop_init(&lp);
+  be.wait = event_wait;
+  be.ctx = &w;
+  sys_event_init(&w.ev);
+  sys_event_init(&w.never);
+  t0 = now_ns();
+  for (i=0; i<N; i++)
+    loop_add_timer(&lp, i, (double)((unsigned)i * 2654435761u % N) / N, 0);
+  while (loop_next(&lp, &be, -1, &ev) > 0)
+    ;
+  report("loop/timers", now_ns() - t0, N, "add and fire");
+  loop_free(&lp);
+
+  // woken by another thread every 2 ms
+  loop_init(&lp);
+  loop_add_handle(&lp, 1, (intptr_t)&w.ev);
+  w.wakes = WAKES;
+  w.period_ms = 2;
+  cpu = cpu_ms();
+  t0 = now_ns();
+  sys_thread_start(&th, waker_proc, &w);
+  for (i=0; i<WAKES && loop_next(&lp, &be, -1, &ev) > 0; i++) {
+    double late = loop_now() - w.set_at;
+    sum += late;
+    if (worst < late)
+      worst = late;
+  }
+  sys_thread_join(&th);
+  sprintf(extra, "wake latency %.1f us on average, %.1f us at worst; CPU %.1f%%",
+          sum / WAKES * 1e3, worst * 1e3, (cpu_ms() - cpu) * 1e8 / (now_ns() - t0));
+  report("loop/wake", now_ns() - t0, WAKES, extra);
+  loop_free(&lp);
+
+  // an idle loop with a 1 ms interval timer
+  loop_init(&lp);
+  loop_add_timer(&lp, 1, loop_now() + 1, 1);
+  sum = worst = 0;
+  cpu = cpu_ms();
+  t0 = now_ns();
+  for (i=0; i<TICKS && loop_next(&lp, &be, -1, &ev) > 0; i++) {
+    double late = loop_now() - ev.at;
+    sum += late;
+    if (worst < late)
+      worst = late;
+  }
+  sprintf(extra, "late %.1f us on average, %.1f us at worst; CPU %.1f%%",
+          sum / TICKS * 1e3, worst * 1e3, (cpu_ms() - cpu) * 1e8 / (now_ns() - t0));
+  report("loop/tick-1ms", now_ns() - t0, TICKS, extra);
+  loop_free(&lp);
+  sys_event_free(&w.ev);
+  sys_event_free(&w.never);
+}
+
+//---------------------------------------------------------------------------
+// outbuf: a log of short lines, one sink call per line vs. buffered
+//---------------------------------------------------------------------------
+typedef struct {
+  long calls;
+  long bytes;
+  unsigned sum;
+} sink_log;
+
+static int log_sink (void *ctx, const char *s, size_t len)
+{
+  sink_log *log = (sink_log*)ctx;
+  log->calls++;
+  log->bytes += (long)len;
+  log->sum += (unsigned char)s[len - 1];  // touch the data
+  return 1;
+}
+
+static void run_outbuf (const char *name, size_t cap, unsigned flush_ms)
+{
+  const int LINES = 1000000;
+  static char storage[OUTBUF_DEFAULT_BUFFER];
+  char line[96], extra[96];
+  sink_log log;
+  outbuf_sink sink;
+  outbuf ob;
+  int i, len;
+  double t0;
+
+  memset(&log, 0, sizeof(log));
+  sink.write = log_sink;
+  sink.ctx = &log;
+  outbuf_init(&ob, storage, cap, flush_ms, &sink);
+  t0 = now_ns();
+  for (i=0; i<LINES; i++) {
+    // 50 lines per (fake) millisecond
+    len = sprintf(line, "[%8d] worker %d: processed item %d\n", i / 50, i % 7, i);
+    if (cap)
+      outbuf_write(&ob, line, len, i / 50);
+    else
+      log_sink(&log, line, len);
+  }
+  outbuf_flush(&ob);
+  t0 = now_ns() - t0;
+  sprintf(extra, "%ld sink calls, %.0f lines/call", log.calls, (double)LINES / log.calls);
+  report(name, t0, LINES, extra);
+}
+
+static void bench_outbuf (void)
+{
+  run_outbuf("outbuf/unbuffered", 0, 0);
+  run_outbuf("outbuf/64k", OUTBUF_DEFAULT_BUFFER, 0);
+  run_outbuf("outbuf/64k-16ms", OUTBUF_DEFAULT_BUFFER, OUTBUF_DEFAULT_FLUSH_MS);
+  run_outbuf("outbuf/4k-16ms", 4096, OUTBUF_DEFAULT_FLUSH_MS);
+}
+
+//---------------------------------------------------------------------------
+// coalesce: a held key, a mouse drag and a resize storm, interleaved
+//---------------------------------------------------------------------------
+static void make_input (INPUT_RECORD *r, size_t n)
+{
+  size_t i;
+  memset(r, 0, n * sizeof(INPUT_RECORD));
+  for (i=0; i<n; i++) {
+    switch (i / 32 % 4) {
+      case 0: case 1:   // auto-repeat of 'a'
+        r[i].EventType = KEY_EVENT;
+        r[i].Event.KeyEvent.bKeyDown = 1;
+        r[i].Event.KeyEvent.wRepeatCount = 1;
+        r[i].Event.KeyEvent.wVirtualKeyCode = 'A';
+        r[i].Event.KeyEvent.uChar.UnicodeChar = 'a';
+        break;
+      case 2:           // a drag with the left button down
+        r[i].EventType = MOUSE_EVENT;
+        r[i].Event.MouseEvent.dwMousePosition.X = (SHORT)(i % 80);
+        r[i].Event.MouseEvent.dwMousePosition.Y = (SHORT)(i % 25);
+        r[i].Event.MouseEvent.dwButtonState = 1;
+        r[i].Event.MouseEvent.dwEventFlags = MOUSE_MOVED;
+        break;
+      case 3:           // resizes mixed with key-ups
+        if (i % 2) {
+          r[i].EventType = WINDOW_BUFFER_SIZE_EVENT;
+          r[i].Event.WindowBufferSizeEvent.dwSize.X = (SHORT)(80 + i % 40);
+          r[i].Event.WindowBufferSizeEvent.dwSize.Y = 25;
+        }
+        else {
+          r[i].EventType = KEY_EVENT;
+          r[i].Event.KeyEvent.wVirtualKeyCode = 'A';
+        }
+        break;
+    }
+  }
+}
+
+static void bench_coalesce (void)
+{
+  const size_t N = 4096;
+  const int REPS = 5000;
+  INPUT_RECORD *src = (INPUT_RECORD*)malloc(N * sizeof(INPUT_RECORD));
+  INPUT_RECORD *work = (INPUT_RECORD*)malloc(N * sizeof(INPUT_RECORD));
+  coalesce_policy pol;
+  coalesce_stats stats;
+  char extra[128];
+  size_t left = 0;
+  double t0, tcopy;
+  int rep;
+
+  if (!src || !work) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  make_input(src, N);
+  coalesce_init_policy(&pol);
+  memset(&stats, 0, sizeof(stats));
+
+  // the copy that restores the input each time is timed apart and taken off
+  t0 = now_ns();
+  for (rep=0; rep<REPS; rep++)
+    memcpy(work, src, N * sizeof(INPUT_RECORD));
+  tcopy = now_ns() - t0;
+
+  t0 = now_ns();
+  for (rep=0; rep<REPS; rep++) {
+    memcpy(work, src, N * sizeof(INPUT_RECORD));
+    left = coalesce_records(work, N, &pol, &stats);
+  }
+  t0 = now_ns() - t0 - tcopy;
+  sprintf(extra, "%u records -> %u (keys %lu, moves %lu, resizes %lu per call)",
+    (unsigned)N, (unsigned)left, stats.keys / REPS, stats.mouse_moves / REPS,
+    stats.resizes / REPS);
+  report("coalesce/mixed-4096", t0, (long)N * REPS, extra);
+  free(src);
+  free(work);
+}
+
+//---------------------------------------------------------------------------
+// pump: a synthetic source standing in for the console input handle
+//---------------------------------------------------------------------------
+typedef struct {
+  unsigned short type;
+  unsigned short pad;
+  unsigned seq;
+  unsigned data[3];
+} fake_record;               // the size of an INPUT_RECORD
+
+typedef struct {
+  unsigned next, limit;      // sequence numbers still to deliver
+  int burst;                 // records available per wait()
+  unsigned window;           // if set, stay at most this far ahead of 'seen'
+  unsigned seen;             // advanced by the consumer
+} fake_source;
+
+static int fake_wait (void *ctx, int timeout_ms)
+{
+  fake_source *fs = (fake_source*)ctx;
+  (void)timeout_ms;
+  if (fs->window && fs->next - __atomic_load_n(&fs->seen, __ATOMIC_ACQUIRE) > fs->window) {
+    yield_cpu();  // like blocking on a handle: let the reader run
+    return 0;
+  }
+  return fs->next < fs->limit;
+}
+
+static int fake_read (void *ctx, void *buf, int max)
+{
+  fake_source *fs = (fake_source*)ctx;
+  fake_record *r = (fake_record*)buf;
+  int i, n = fs->burst < max ? fs->burst : max;
+  for (i=0; i<n && fs->next < fs->limit; i++) {
+    memset(&r[i], 0, sizeof(r[i]));
+    r[i].type = 1;
+    r[i].seq = fs->next++;
+  }
+  return i;
+}
+
+// feed N records through a pump; return the time taken and fill 'st'
+static double run_pump (fake_source *fs, unsigned N, pump_stats *st, unsigned *bad)
+{
+  fake_record out[64];
+  pump_source src;
+  input_pump *p;
+  unsigned next = 0;
+  double t0;
+
+  fs->next = 0; fs->limit = N; fs->seen = 0;
+  src.wait = fake_wait; src.read = fake_read; src.ctx = fs;
+  p = pump_start(&src, 4096, sizeof(fake_record));
+  if (!p) {
+    fprintf(stderr, "pump_start failed\n");
+    exit(1);
+  }
+  *bad = 0;
+  t0 = now_ns();
+  for (;;) {
+    int k, n;
+    pump_wait(p, 10);
+    while ((n = pump_poll(p, out, 64)) > 0) {
+      // drops leave gaps in the sequence but must never reorder it
+      for (k=0; k<n; k++) {
+        *bad += out[k].seq < next;
+        next = out[k].seq + 1;
+      }
+      __atomic_store_n(&fs->seen, next, __ATOMIC_RELEASE);
+    }
+    pump_get_stats(p, st);
+    if (st->received == N && st->pending == 0)
+      break;
+  }
+  t0 = now_ns() - t0;
+  pump_stop(p);
+  return t0;
+}
+
+static void bench_pump (void)
+{
+  const unsigned N = 2000000;
+  fake_record out[2];
+  fake_source fs;
+  pump_stats st;
+  spsc_queue q;
+  char extra[128];
+  unsigned i, bad;
+  double t0;
+
+  // the queue alone, one thread
+  spsc_init(&q, 1024, sizeof(fake_record));
+  memset(out, 0, sizeof(out));
+  t0 = now_ns();
+  for (i=0; i<N; i++) {
+    spsc_push(&q, &out[0]);
+    spsc_pop(&q, &out[1], 1);
+  }
+  report("pump/spsc-push-pop", now_ns() - t0, N, NULL);
+  spsc_free(&q);
+
+  // a source that never gets more than half the queue ahead of the reader
+  fs.burst = 16;
+  fs.window = 2048;
+  t0 = run_pump(&fs, N, &st, &bad);
+  wrong += bad != 0;
+  sprintf(extra, "%lu dropped%s", st.dropped, bad ? ", OUT OF ORDER" : "");
+  report("pump/thread-to-poll", t0, (long)N, extra);
+
+  // a source that floods the queue: the drop and overflow counters at work
+  fs.window = 0;
+  t0 = run_pump(&fs, N, &st, &bad);
+  wrong += bad != 0;
+  sprintf(extra, "%lu dropped in %lu overflows%s", st.dropped, st.overflows,
+    bad ? ", OUT OF ORDER" : "");
+  report("pump/flood", t0, (long)N, extra);
+}
+
+//---------------------------------------------------------------------------
+// service: producer threads render through one owner; each keeps to a band
+// of rows and overlaps its own updates, so that the screen must end up as
+// each of them expects
+//---------------------------------------------------------------------------
+#define SVC_WIDTH      200
+#define SVC_PRODUCERS  8
+#define SVC_BAND       8
+
+typedef struct {
+  render_service *s;
+  int id, updates, credit;
+  cell_t expect[SVC_BAND * SVC_WIDTH];
+  producer_stats st;
+  int failed;
+} svc_worker;
+
+static int screen_write (void *ctx, const cellbuf *src, const cell_rect *r)
+{
+  cellbuf_copy_rect((cellbuf*)ctx, r->Left, r->Top, src, *r);
+  return 1;
+}
+
+static THREAD_PROC(svc_worker_proc, arg)
+{
+  svc_worker *w = (svc_worker*)arg;
+  service_producer *p = service_open(w->s, w->credit, -1);
+  cell_t cells[SVC_BAND * 24];
+  cellbuf block, expect;
+  unsigned seed = 12345u * (w->id + 1);
+  int i, j;
+  cellbuf_init(&expect, SVC_WIDTH, SVC_BAND, w->expect);
+  for (i=0; i<w->updates && p; i++) {
+    cell_rect r;
+    int x, y, bw, bh;
+    seed = seed * 1103515245u + 12345u;
+    bw = 1 + (seed >> 8) % 24;
+    bh = 1 + (seed >> 16) % SVC_BAND;
+    x = (seed >> 4) % (SVC_WIDTH - bw + 1);
+    y = (seed >> 20) % (SVC_BAND - bh + 1);
+    cellbuf_init(&block, bw, bh, cells);
+    for (j=0; j<bw*bh; j++) {
+      cells[j].Char = (unsigned short)('A' + w->id);
+      cells[j].Attributes = (unsigned short)(i + j);
+    }
+    r.Left = r.Top = 0;
+    r.Right = bw - 1;
+    r.Bottom = bh - 1;
+    if (service_submit(p, &block, r, x, w->id * SVC_BAND + y) != 1) {
+      w->failed = 1;
+      break;
+    }
+    cellbuf_copy_rect(&expect, x, y, &block, r);
+  }
+  if (p) {
+    service_sync(p, -1);
+    service_producer_stats(p, &w->st);
+    service_close(p);
+  }
+  else
+    w->failed = 1;
+  THREAD_RETURN;
+}
+
+static void run_service (const char *name, unsigned capacity, int credit, int frame_ms)
+{
+  const int UPDATES = 100000;
+  static svc_worker workers[SVC_PRODUCERS];
+  static cell_t target_cells[SVC_PRODUCERS * SVC_BAND * SVC_WIDTH];
+  sys_thread threads[SVC_PRODUCERS];
+  service_params prm;
+  service_stats st;
+  render_sink sink;
+  render_service *s;
+  cellbuf target;
+  unsigned long waits = 0;
+  char extra[160];
+  int i, bad = 0;
+  double t0;
+
+  memset(target_cells, 0, sizeof(target_cells));
+  cellbuf_init(&target, SVC_WIDTH, SVC_PRODUCERS * SVC_BAND, target_cells);
+  service_init_params(&prm);
+  prm.width = target.width;
+  prm.height = target.height;
+  prm.capacity = capacity;
+  prm.frame_ms = frame_ms;
+  sink.write = screen_write;
+  sink.scroll = NULL;
+  sink.ctx = &target;
+  s = service_start(&prm, &sink, NULL);
+  if (!s) {
+    fprintf(stderr, "service_start failed\n");
+    exit(1);
+  }
+  t0 = now_ns();
+  for (i=0; i<SVC_PRODUCERS; i++) {
+    svc_worker *w = &workers[i];
+    memset(w, 0, sizeof(*w));
+    w->s = s;
+    w->id = i;
+    w->updates = UPDATES;
+    w->credit = credit;
+    sys_thread_start(&threads[i], svc_worker_proc, w);
+  }
+  for (i=0; i<SVC_PRODUCERS; i++)
+    sys_thread_join(&threads[i]);
+  t0 = now_ns() - t0;
+  service_get_stats(s, &st);
+  service_stop(s);
+  for (i=0; i<SVC_PRODUCERS; i++) {
+    svc_worker *w = &workers[i];
+    bad += w->failed || w->st.flushed != (unsigned long)UPDATES ||
+           memcmp(CELLBUF_AT(&target, 0, i * SVC_BAND), w->expect, sizeof(w->expect)) != 0;
+    waits += w->st.waits;
+  }
+  sprintf(extra, "%lu frames, %.1f%% of cells sent, depth %.1f avg %lu max, %lu waits%s",
+          st.frames, 100.0 * st.sent / st.cells, st.depth_avg, st.depth_max, waits,
+          bad ? ", WRONG SCREEN" : "");
+  wrong += bad;
+  report(name, t0, (long)UPDATES * SVC_PRODUCERS, extra);
+}
+
+static void bench_service (void)
+{
+  const unsigned N = 2000000;
+  mpsc_queue q;
+  unsigned i;
+  double t0;
+  int x;
+
+  // the queue alone, one thread
+  mpsc_init(&q, 1024);
+  t0 = now_ns();
+  for (i=0; i<N; i++) {
+    mpsc_push(&q, &x);
+    mpsc_pop(&q);
+  }
+  report("service/mpsc-push-pop", now_ns() - t0, N, NULL);
+  mpsc_free(&q);
+
+  run_service("service/8-producers", SERVICE_DEFAULT_CAPACITY, SERVICE_DEFAULT_CREDIT, 0);
+  // a short queue and little credit: the producers wait for the owner
+  run_service("service/8-producers-tight", 16, 4, 0);
+  // at most one flush per millisecond: more overlap merged per frame
+  run_service("service/8-producers-1ms", SERVICE_DEFAULT_CAPACITY, SERVICE_DEFAULT_CREDIT, 1);
+}
+
+//---------------------------------------------------------------------------
+// cellops: each kernel with each implementation the CPU supports
+//---------------------------------------------------------------------------
+static void bench_cellops (void)
+{
+  static const char *backends[] = { "scalar", "sse2", "avx2" };
+  const size_t N = 12000;       // one 200x60 screen
+  const int REPS = 20000;
+  cell_t *a = alloc_cells(N, 1), *b = alloc_cells(N, 1), *b2 = alloc_cells(N, 1);
+  cell_t c = { 'x', 0x1F };
+  char name[64], extra[64];
+  size_t first, last;
+  unsigned i;
+  int k, rep;
+  double t0;
+
+  for (i=0; i<N; i++) {
+    a[i].Char = b[i].Char = (unsigned short)('a' + i % 26);
+    a[i].Attributes = b[i].Attributes = (unsigned short)(i & 0x77);
+  }
+  memcpy(b2, b, N * sizeof(cell_t));  // compare scans the whole of equal rows
+  for (k=0; k<3; k++) {
+    if (!cellops_select(backends[k]))
+      continue;
+#define KERNEL(kname, stmt) \
+    t0 = now_ns(); \
+    for (rep=0; rep<REPS; rep++) { stmt; } \
+    t0 = now_ns() - t0; \
+    sprintf(name, "cellops/%s/%s", kname, backends[k]); \
+    sprintf(extra, "%.0f Mcells/s", (double)N * REPS / t0 * 1e3); \
+    report(name, t0, REPS, extra)
+
+    KERNEL("fill",    cellops_fill(a, N, c));
+    KERNEL("and_or",  cellops_and_or(a, N, 0xFF0FFFFF, 0x00400000));
+    KERNEL("compare", cellops_compare(b, b2, N, &first, &last));
+    KERNEL("blit",    cellops_blit(a, b, N, CELL32('a', 0), CELL32_CHAR));
+#undef KERNEL
+  }
+  cellops_init();
+  free(a);
+  free(b);
+  free(b2);
+}
+
+//---------------------------------------------------------------------------
+// term: streams a child process might send, fed in pipe-sized chunks
+//---------------------------------------------------------------------------
+typedef struct {
+  char *data;
+  size_t len, cap;
+} stream;
+
+static void stream_add (stream *st, const char *s)
+{
+  size_t n = strlen(s);
+  if (st->len + n > st->cap) {
+    st->cap = (st->len + n) * 2;
+    if (!(st->data = (char*)realloc(st->data, st->cap))) {
+      fprintf(stderr, "out of memory\n");
+      exit(1);
+    }
+  }
+  memcpy(st->data + st->len, s, n);
+  st->len += n;
+}
+
+static void run_term (const char *name, const stream *st)
+{
+  const size_t CHUNK = 4096;
+  const int REPS = 20;
+  cellbuf grid;
+  term t;
+  char extra[64];
+  double t0;
+  size_t i;
+  int rep;
+
+  cellbuf_init(&grid, 120, 40, alloc_cells(120, 40));
+  term_init(&t, &grid);
+  t0 = now_ns();
+  for (rep=0; rep<REPS; rep++) {
+    for (i=0; i<st->len; i+=CHUNK)
+      term_feed(&t, st->data + i, st->len - i < CHUNK ? st->len - i : CHUNK);
+  }
+  t0 = now_ns() - t0;
+  sprintf(extra, "%.0f MB/s", (double)st->len * REPS / t0 * 1e3);
+  report(name, t0, REPS, extra);
+  free(grid.cells);
+}
+
+static void bench_term (void)
+{
+  const int LINES = 50000;
+  stream st;
+  char line[256];
+  int i;
+
+  // cat of a log file
+  memset(&st, 0, sizeof(st));
+  for (i=0; i<LINES; i++) {
+    sprintf(line, "2024-01-01 12:00:%02d.%03d INFO  worker-%d processed request %d in %d ms\r\n",
+      i / 1000 % 60, i % 1000, i % 8, i, i * 7 % 500);
+    stream_add(&st, line);
+  }
+  run_term("term/cat-ascii", &st);
+
+  // colored listing
+  st.len = 0;
+  for (i=0; i<LINES; i++) {
+    sprintf(line, "\x1b[0m\x1b[01;34mdir%d\x1b[0m  \x1b[01;32mrun%d.sh\x1b[0m  file%d.txt  "
+      "\x1b[38;5;208marchive%d.tar\x1b[0m\r\n", i, i, i, i);
+    stream_add(&st, line);
+  }
+  run_term("term/ls-color", &st);
+
+  // UTF-8 text
+  st.len = 0;
+  for (i=0; i<LINES; i++) {
+    sprintf(line, "%6d \xd0\xa1\xd1\x82\xd1\x80\xd0\xbe\xd0\xba\xd0\xb0 \xd1\x82\xd0\xb5\xd0\xba"
+      "\xd1\x81\xd1\x82\xd0\xb0 \xe2\x80\x94 \xe6\x96\x87\xe5\xad\x97 \xe2\x9c\x93\r\n", i);
+    stream_add(&st, line);
+  }
+  run_term("term/utf8-text", &st);
+
+  // a full-screen program: cursor addressing and colours everywhere
+  st.len = 0;
+  for (i=0; i<LINES; i++) {
+    sprintf(line, "\x1b[%d;%dH\x1b[%d;%dm%5.1f%%\x1b[K\x1b[%d;1H\x1b[7m PID %d \x1b[27m",
+      i % 40 + 1, i % 7 * 15 + 1, 30 + i % 8, 40 + i % 3, i % 1000 / 10.0, (i + 5) % 40 + 1, i);
+    stream_add(&st, line);
+  }
+  run_term("term/fullscreen", &st);
+  free(st.data);
+}
+
+//---------------------------------------------------------------------------
+// utf8: transcoding throughput on a few kinds of text, per implementation
+//---------------------------------------------------------------------------
+static void fill_text (char *p, size_t n, const char *sample)
+{
+  size_t i, len = strlen(sample);
+  for (i=0; i+len<=n; i+=len)
+    memcpy(p + i, sample, len);
+  memset(p + i, ' ', n - i);
+}
+
+static void bench_utf8 (void)
+{
+  static const char *backends[] = { "scalar", "sse2", "avx2" };
+  static const struct { const char *name, *sample; } texts[] = {
+    { "ascii",    "The quick brown fox jumps over the lazy dog. 0123456789\r\n" },
+    { "mixed",    "Status: \xd0\xb3\xd0\xbe\xd1\x82\xd0\xbe\xd0\xb2\xd0\xbe, "
+                  "files \xd1\x84\xd0\xb0\xd0\xb9\xd0\xbb\xd1\x8b 42 ok\r\n" },
+    { "cjk",      "\xe6\x96\x87\xe5\xad\x97\xe5\x8c\x96\xe3\x81\x91\xe3\x81\xae"
+                  "\xe6\xb8\xac\xe5\xae\x9a\xe3\x80\x82" },
+    { "invalid",  "abc\xff\xfe\xc3(\xe2\x82\xf0\x9f\x98x\xed\xa0\x80" },
+  };
+  const size_t N = 12000;       // one 200x60 screen of bytes
+  const int REPS = 20000;
+  char *text = (char*)malloc(N);
+  unsigned short *out = (unsigned short*)malloc(N * sizeof(unsigned short));
+  char name[64], extra[64];
+  size_t units = 0;
+  int k, t, rep;
+  double t0;
+
+  if (!text || !out) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  for (t=0; t<(int)(sizeof(texts)/sizeof(texts[0])); t++) {
+    fill_text(text, N, texts[t].sample);
+    for (k=0; k<3; k++) {
+      if (!utf8_select(backends[k]))
+        continue;
+      t0 = now_ns();
+      for (rep=0; rep<REPS; rep++)
+        units = utf8_to_utf16(text, N, out, NULL);
+      t0 = now_ns() - t0;
+      sprintf(name, "utf8/%s/%s", texts[t].name, backends[k]);
+      sprintf(extra, "%.0f MB/s, %lu units", (double)N * REPS / t0 * 1e3, (unsigned long)units);
+      report(name, t0, REPS, extra);
+    }
+  }
+  utf8_init();
+  free(text);
+  free(out);
+}
+
+//---------------------------------------------------------------------------
+// vt: the render dashboard as escape streams, whole frames and differences
+//---------------------------------------------------------------------------
+static void colorful_screen (cellbuf *cb)
+{
+  char text[64];
+  int y;
+  for (y=0; y<cb->height; y++) {
+    cell_rect r;
+    r.Left = 0; r.Right = cb->width - 1; r.Top = r.Bottom = y;
+    cellbuf_fill_rect(cb, r, ' ', y % 3 ? 0x07 : 0x17);
+    sprintf(text, "row %d: status %s", y, y % 5 ? "ok" : "WARNING");
+    cellbuf_put_string(cb, 2, y, text, strlen(text), y % 5 ? 0x0A : 0x4E);
+  }
+}
+
+static void bench_vt (void)
+{
+  const int W = 200, H = 60, FRAMES = 20000, FULL_FRAMES = 2000;
+  cellbuf front, back;
+  cell_rect all;
+  vt_encoder e;
+  char extra[128];
+  double t0;
+  int i;
+
+  cellbuf_init(&front, W, H, alloc_cells(W, H));
+  cellbuf_init(&back, W, H, alloc_cells(W, H));
+  all.Left = all.Top = 0;
+  all.Right = W - 1; all.Bottom = H - 1;
+  vt_init(&e);
+
+  colorful_screen(&back);
+  t0 = now_ns();
+  for (i=0; i<FULL_FRAMES; i++) {
+    e.len = 0;
+    vt_reset(&e);
+    vt_encode(&e, &back, NULL, 0, 0);
+  }
+  sprintf(extra, "%lu bytes/frame, %lu SGRs", (unsigned long)e.len,
+    e.stats.sgr / FULL_FRAMES);
+  report("vt/full-200x60", now_ns() - t0, FULL_FRAMES, extra);
+
+  cellbuf_copy_rect(&front, 0, 0, &back, all);
+  memset(&e.stats, 0, sizeof(e.stats));
+  t0 = now_ns();
+  for (i=1; i<=FRAMES; i++) {
+    dashboard_frame(&back, i);
+    e.len = 0;
+    vt_encode(&e, &back, &front, 0, 0);
+    cellbuf_copy_rect(&front, 0, 0, &back, all);
+  }
+  sprintf(extra, "%.0f bytes/frame, %.1f moves/frame, %.1f cells/frame",
+    (double)e.stats.bytes / FRAMES, (double)e.stats.moves / FRAMES,
+    (double)e.stats.cells / FRAMES);
+  report("vt/dashboard-200x60", now_ns() - t0, FRAMES, extra);
+
+  vt_free(&e);
+  free(front.cells);
+  free(back.cells);
+}
+
+//---------------------------------------------------------------------------
+// rec: the dashboard of bench_render recorded, played back and sought in
+//---------------------------------------------------------------------------
+static void bench_rec (void)
+{
+  const int W = 200, H = 60, FRAMES = 10000, SEEKS = 20000;
+  const char *path = "bench.rec";
+  cellbuf screen;
+  cell_t blank = { ' ', 0x07 };
+  rec_writer w;
+  rec_reader r;
+  rec_frame fr;
+  char extra[128];
+  double t0;
+  int i, n;
+
+  cellbuf_init(&screen, W, H, alloc_cells(W, H));
+  cellbuf_clear(&screen, blank);
+  memset(&fr, 0, sizeof(fr));
+  fr.cursor_visible = 1;
+  fr.cursor_size = 25;
+  if (!rec_writer_open(&w, path, 0)) {
+    fprintf(stderr, "rec: cannot create %s\n", path);
+    return;
+  }
+  t0 = now_ns();
+  for (i=1; i<=FRAMES; i++) {
+    dashboard_frame(&screen, i);
+    fr.time = i * 16;
+    rec_writer_frame(&w, &screen, &fr, 0, H - 1);
+  }
+  sprintf(extra, "%.0f bytes/frame (%lu keyframes, full frame %d cells)",
+    (double)w.stats.bytes / FRAMES, w.stats.keyframes, W * H);
+  report("rec/encode-200x60", now_ns() - t0, FRAMES, extra);
+  rec_writer_close(&w);
+
+  if (!rec_reader_open(&r, path)) {
+    fprintf(stderr, "rec: cannot read %s\n", path);
+    remove(path);
+    return;
+  }
+  t0 = now_ns();
+  for (n=0; rec_reader_next(&r); n++) {}
+  sprintf(extra, "%d frames, last one %s", n,
+    n == FRAMES && !memcmp(r.screen.cells, screen.cells, (size_t)W * H * sizeof(cell_t))
+    ? "matches" : "DIFFERS");
+  report("rec/decode-200x60", now_ns() - t0, FRAMES, extra);
+
+  srand(1);
+  t0 = now_ns();
+  for (i=0, n=0; i<SEEKS; i++) {
+    unsigned time = (unsigned)(rand() % FRAMES + 1) * 16;
+    n += rec_reader_seek(&r, time) && r.cur.time == time;
+  }
+  sprintf(extra, "%d of %d on the frame asked for", n, SEEKS);
+  report("rec/seek-200x60", now_ns() - t0, SEEKS, extra);
+  rec_reader_close(&r);
+  remove(path);
+  free(screen.cells);
+}
+
+//---------------------------------------------------------------------------
+// layout: paragraphs wrapped into a box, clipped, and only measured
+//---------------------------------------------------------------------------
+static void bench_layout (void)
+{
+  static const struct { const char *name, *sample; } texts[] = {
+    { "ascii",    "The quick brown fox jumps over the lazy dog. 0123456789 " },
+    { "mixed",    "Status: \xd0\xb3\xd0\xbe\xd1\x82\xd0\xbe\xd0\xb2\xd0\xbe, "
+                  "files \xd1\x84\xd0\xb0\xd0\xb9\xd0\xbb\xd1\x8b 42 ok. " },
+    { "cjk",      "\xe6\x96\x87\xe5\xad\x97\xe5\x8c\x96\xe3\x81\x91\xe3\x81\xae"
+                  "\xe6\xb8\xac\xe5\xae\x9a\xe3\x80\x82" },
+  };
+  static const struct { const char *name; int wrap, draw; } modes[] = {
+    { "word",     LAYOUT_WRAP_WORD, 1 },
+    { "char",     LAYOUT_WRAP_CHAR, 1 },
+    { "measure",  LAYOUT_WRAP_WORD, 0 },
+  };
+  const size_t N = 12000;
+  const int W = 200, H = 60, REPS = 5000;
+  char *text = (char*)malloc(N);
+  char name[64], extra[128];
+  cellbuf cb;
+  layout_params prm;
+  layout_extent ext;
+  size_t chars, i;
+  int t, m, rep;
+  double t0;
+
+  if (!text) {
+    fprintf(stderr, "out of memory\n");
+    exit(1);
+  }
+  cellbuf_init(&cb, W, H, alloc_cells(W, H));
+  for (t=0; t<(int)(sizeof(texts)/sizeof(texts[0])); t++) {
+    fill_text(text, N, texts[t].sample);
+    for (i=0, chars=0; i<N; i++)
+      chars += ((unsigned char)text[i] & 0xC0) != 0x80;
+    for (m=0; m<(int)(sizeof(modes)/sizeof(modes[0])); m++) {
+      layout_init_params(&prm, W);
+      prm.wrap = modes[m].wrap;
+      prm.attr = 0x07;
+      t0 = now_ns();
+      for (rep=0; rep<REPS; rep++)
+        layout_text(modes[m].draw ? &cb : NULL, 0, 0, text, N, &prm, &ext);
+      t0 = now_ns() - t0;
+      sprintf(name, "layout/%s/%s", texts[t].name, modes[m].name);
+      sprintf(extra, "%.0f Mchars/s, %d lines of %d cells", (double)chars * REPS / t0 * 1e3,
+        ext.lines, ext.width);
+      report(name, t0, REPS, extra);
+    }
+  }
+  free(cb.cells);
+  free(text);
+}
+
+//---------------------------------------------------------------------------
+// scrollback: a million log lines appended, looked up at random and shown a
+// 200x60 window at a time, in memory and spilled to a file
+//---------------------------------------------------------------------------
+static void bench_scrollback_with (const char *spill)
+{
+  const long LINES = 1000000;
+  const int W = 200, H = 60, SEEKS = 1000000, RENDERS = 20000;
+  enum { POOL = 1024 };
+  static unsigned short text[POOL][128];
+  int len[POOL];
+  scrollback sb;
+  scrollback_stats st;
+  cellbuf cb;
+  cell_t blank = { ' ', 0x07 }, line[256];
+  char s[128], name[64], extra[128];
+  double t0;
+  long i, bytes = 0, sum = 0;
+  int n, k;
+
+  // the text of the lines is made first, so as to time the store alone
+  for (i=0; i<POOL; i++) {
+    n = sprintf(s, "2024-05-01 12:%02ld:%02ld.%03ld INFO worker-%ld: request %ld done in %ld ms",
+      i / 60 % 60, i % 60, i * 37 % 1000, i % 8, i * 7919, i * 7 % 1000);
+    for (k=0; k<n; k++)
+      text[i][k] = (unsigned short)s[k];
+    len[i] = n;
+  }
+  scrollback_init(&sb, 0, 0);
+  if (spill && !scrollback_spill(&sb, spill, 0)) {
+    fprintf(stderr, "scrollback: cannot create %s\n", spill);
+    return;
+  }
+  t0 = now_ns();
+  for (i=0; i<LINES; i++) {
+    scrollback_append_text(&sb, text[i % POOL], len[i % POOL], 0x07);
+    bytes += len[i % POOL];
+  }
+  scrollback_get_stats(&sb, &st);
+  sprintf(name, "scrollback/append%s", spill ? "/spill" : "");
+  sprintf(extra, "%.1f MB/s of text, %.1f bytes/line in memory, %.1f in the file",
+    (double)bytes / (now_ns() - t0) * 1e3, (double)st.bytes / LINES,
+    (double)st.spill_bytes / LINES);
+  report(name, now_ns() - t0, LINES, extra);
+
+  // lines of a few colours
+  for (k=0; k<80; k++) {
+    line[k].Char = (unsigned short)('a' + k % 26);
+    line[k].Attributes = (unsigned short)(k < 23 ? 0x08 : k < 28 ? 0x0E : 0x07);
+  }
+  t0 = now_ns();
+  for (i=0; i<LINES / 10; i++)
+    scrollback_append_cells(&sb, line, 80);
+  sprintf(name, "scrollback/append-cells%s", spill ? "/spill" : "");
+  report(name, now_ns() - t0, LINES / 10, "80 cells in 3 runs");
+
+  srand(1);
+  t0 = now_ns();
+  for (i=0; i<SEEKS; i++)
+    sum += scrollback_line(&sb, (long)((double)rand() / RAND_MAX * (sb.count - 1)), line, 256);
+  sprintf(name, "scrollback/seek%s", spill ? "/spill" : "");
+  sprintf(extra, "%.1f cells/line", (double)sum / SEEKS);
+  report(name, now_ns() - t0, SEEKS, extra);
+
+  cellbuf_init(&cb, W, H, alloc_cells(W, H));
+  t0 = now_ns();
+  for (i=0; i<RENDERS; i++)
+    scrollback_render(&sb, (long)((double)rand() / RAND_MAX * sb.count), 0, &cb, blank);
+  sprintf(name, "scrollback/render-200x60%s", spill ? "/spill" : "");
+  scrollback_get_stats(&sb, &st);
+  sprintf(extra, "%d chunks, %d of them spilled", st.chunks, st.spilled);
+  report(name, now_ns() - t0, RENDERS, extra);
+
+  free(cb.cells);
+  scrollback_free(&sb);
+}
+
+static void bench_scrollback (void)
+{
+  bench_scrollback_with(NULL);
+  bench_scrollback_with("bench.spill");
+}
+
+typedef struct {
+  const char *name;
+  void (*run) (void);
+} bench_case;
+
+static const bench_case cases[] = {
+  {"cellops", bench_cellops},
+  {"cmdlist", bench_cmdlist},
+  {"coalesce", bench_coalesce},
+  {"compose", bench_compose},
+  {"layout", bench_layout},
+  {"loop", bench_loop},
+  {"outbuf", bench_outbuf},
+  {"pump", bench_pump},
+  {"rec", bench_rec},
+  {"render", bench_render},
+  {"scroll", bench_scroll},
+  {"scrollback", bench_scrollback},
+  {"service", bench_service},
+  {"term", bench_term},
+  {"utf8", bench_utf8},
+  {"vt", bench_vt},
+  {NULL, NULL}
+};
+
+int main (int argc, char **argv)
+{
+  const bench_case *c;
+  cellops_init();
+  utf8_init();
+  term_init_tables();
+  for (c=cases; c->name; c++) {
+    if (argc < 2 || !strncmp(c->name, argv[1], strlen(argv[1])))
+      c->run();
+  }
+  return wrong != 0;
+}
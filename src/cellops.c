@@ -0,0 +1,285 @@
+// cellops.c
+// Bulk kernels over runs of cells, with SSE2/AVX2 versions picked at run time.
+
+#include <string.h>
+#include "cellops.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define CELLOPS_X86 1
+# include <immintrin.h>
+#endif
+
+static unsigned pack (cell_t c)
+{
+  return CELL32(c.Char, c.Attributes);
+}
+
+static cell_t unpack (unsigned v)
+{
+  cell_t c;
+  c.Char = (unsigned short)v;
+  c.Attributes = (unsigned short)(v >> 16);
+  return c;
+}
+
+//---------------------------------------------------------------------------
+// scalar versions: the reference, and the tails of the vector loops
+//---------------------------------------------------------------------------
+static void fill_scalar (cell_t *p, size_t n, cell_t c)
+{
+  size_t i;
+  for (i=0; i<n; i++)
+    p[i] = c;
+}
+
+static void and_or_scalar (cell_t *p, size_t n, unsigned and_mask, unsigned or_mask)
+{
+  size_t i;
+  for (i=0; i<n; i++)
+    p[i] = unpack((pack(p[i]) & and_mask) | or_mask);
+}
+
+static int compare_scalar (const cell_t *a, const cell_t *b, size_t n, size_t *first, size_t *last)
+{
+  size_t i, j;
+  for (i=0; i<n && pack(a[i]) == pack(b[i]); i++) {}
+  if (i == n)
+    return 0;
+  for (j=n-1; j>i && pack(a[j]) == pack(b[j]); j--) {}
+  *first = i;
+  *last = j;
+  return 1;
+}
+
+static void blit_scalar (cell_t *dst, const cell_t *src, size_t n, unsigned key, unsigned mask)
+{
+  size_t i;
+  for (i=0; i<n; i++) {
+    if ((pack(src[i]) & mask) != key)
+      dst[i] = src[i];
+  }
+}
+
+#ifdef CELLOPS_X86
+//---------------------------------------------------------------------------
+// SSE2: 4 cells per step
+//---------------------------------------------------------------------------
+#define LOAD128(p)      _mm_loadu_si128((const __m128i*)(const void*)(p))
+#define STORE128(p, v)  _mm_storeu_si128((__m128i*)(void*)(p), v)
+
+__attribute__((target("sse2")))
+static void fill_sse2 (cell_t *p, size_t n, cell_t c)
+{
+  __m128i v = _mm_set1_epi32((int)pack(c));
+  size_t i;
+  for (i=0; i+4<=n; i+=4)
+    STORE128(p + i, v);
+  fill_scalar(p + i, n - i, c);
+}
+
+__attribute__((target("sse2")))
+static void and_or_sse2 (cell_t *p, size_t n, unsigned and_mask, unsigned or_mask)
+{
+  __m128i va = _mm_set1_epi32((int)and_mask);
+  __m128i vo = _mm_set1_epi32((int)or_mask);
+  size_t i;
+  for (i=0; i+4<=n; i+=4)
+    STORE128(p + i, _mm_or_si128(_mm_and_si128(LOAD128(p + i), va), vo));
+  and_or_scalar(p + i, n - i, and_mask, or_mask);
+}
+
+__attribute__((target("sse2")))
+static int compare_sse2 (const cell_t *a, const cell_t *b, size_t n, size_t *first, size_t *last)
+{
+  size_t i, j;
+  unsigned m;
+  for (i=0; i+4<=n; i+=4) {
+    m = _mm_movemask_epi8(_mm_cmpeq_epi32(LOAD128(a + i), LOAD128(b + i))) ^ 0xFFFF;
+    if (m) {
+      i += __builtin_ctz(m) >> 2;
+      goto found;
+    }
+  }
+  for (; i<n && pack(a[i]) == pack(b[i]); i++) {}
+  if (i == n)
+    return 0;
+found:
+  *first = i;
+  for (j=n; j-i >= 4; ) {
+    j -= 4;
+    m = _mm_movemask_epi8(_mm_cmpeq_epi32(LOAD128(a + j), LOAD128(b + j))) ^ 0xFFFF;
+    if (m) {
+      *last = j + ((31 - __builtin_clz(m)) >> 2);
+      return 1;
+    }
+  }
+  for (j--; j>i && pack(a[j]) == pack(b[j]); j--) {}
+  *last = j;
+  return 1;
+}
+
+__attribute__((target("sse2")))
+static void blit_sse2 (cell_t *dst, const cell_t *src, size_t n, unsigned key, unsigned mask)
+{
+  __m128i vk = _mm_set1_epi32((int)key);
+  __m128i vm = _mm_set1_epi32((int)mask);
+  size_t i;
+  for (i=0; i+4<=n; i+=4) {
+    __m128i s = LOAD128(src + i);
+    __m128i t = _mm_cmpeq_epi32(_mm_and_si128(s, vm), vk);
+    STORE128(dst + i, _mm_or_si128(_mm_and_si128(t, LOAD128(dst + i)), _mm_andnot_si128(t, s)));
+  }
+  blit_scalar(dst + i, src + i, n - i, key, mask);
+}
+
+//---------------------------------------------------------------------------
+// AVX2: 8 cells per step
+//---------------------------------------------------------------------------
+#define LOAD256(p)      _mm256_loadu_si256((const __m256i*)(const void*)(p))
+#define STORE256(p, v)  _mm256_storeu_si256((__m256i*)(void*)(p), v)
+
+__attribute__((target("avx2")))
+static void fill_avx2 (cell_t *p, size_t n, cell_t c)
+{
+  __m256i v = _mm256_set1_epi32((int)pack(c));
+  size_t i;
+  for (i=0; i+8<=n; i+=8)
+    STORE256(p + i, v);
+  fill_scalar(p + i, n - i, c);
+}
+
+__attribute__((target("avx2")))
+static void and_or_avx2 (cell_t *p, size_t n, unsigned and_mask, unsigned or_mask)
+{
+  __m256i va = _mm256_set1_epi32((int)and_mask);
+  __m256i vo = _mm256_set1_epi32((int)or_mask);
+  size_t i;
+  for (i=0; i+8<=n; i+=8)
+    STORE256(p + i, _mm256_or_si256(_mm256_and_si256(LOAD256(p + i), va), vo));
+  and_or_scalar(p + i, n - i, and_mask, or_mask);
+}
+
+__attribute__((target("avx2")))
+static int compare_avx2 (const cell_t *a, const cell_t *b, size_t n, size_t *first, size_t *last)
+{
+  size_t i, j;
+  unsigned m;
+  for (i=0; i+8<=n; i+=8) {
+    m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(LOAD256(a + i), LOAD256(b + i)));
+    if (m) {
+      i += __builtin_ctz(m) >> 2;
+      goto found;
+    }
+  }
+  for (; i<n && pack(a[i]) == pack(b[i]); i++) {}
+  if (i == n)
+    return 0;
+found:
+  *first = i;
+  for (j=n; j-i >= 8; ) {
+    j -= 8;
+    m = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi32(LOAD256(a + j), LOAD256(b + j)));
+    if (m) {
+      *last = j + ((31 - __builtin_clz(m)) >> 2);
+      return 1;
+    }
+  }
+  for (j--; j>i && pack(a[j]) == pack(b[j]); j--) {}
+  *last = j;
+  return 1;
+}
+
+__attribute__((target("avx2")))
+static void blit_avx2 (cell_t *dst, const cell_t *src, size_t n, unsigned key, unsigned mask)
+{
+  __m256i vk = _mm256_set1_epi32((int)key);
+  __m256i vm = _mm256_set1_epi32((int)mask);
+  size_t i;
+  for (i=0; i+8<=n; i+=8) {
+    __m256i s = LOAD256(src + i);
+    __m256i t = _mm256_cmpeq_epi32(_mm256_and_si256(s, vm), vk);
+    STORE256(dst + i, _mm256_blendv_epi8(s, LOAD256(dst + i), t));
+  }
+  blit_scalar(dst + i, src + i, n - i, key, mask);
+}
+#endif // CELLOPS_X86
+
+//---------------------------------------------------------------------------
+// dispatch
+//---------------------------------------------------------------------------
+typedef struct {
+  const char *name;
+  void (*fill)    (cell_t*, size_t, cell_t);
+  void (*and_or)  (cell_t*, size_t, unsigned, unsigned);
+  int  (*compare) (const cell_t*, const cell_t*, size_t, size_t*, size_t*);
+  void (*blit)    (cell_t*, const cell_t*, size_t, unsigned, unsigned);
+} cellops_impl;
+
+static const cellops_impl impls[] = {
+#ifdef CELLOPS_X86
+  { "avx2",   fill_avx2,   and_or_avx2,   compare_avx2,   blit_avx2   },
+  { "sse2",   fill_sse2,   and_or_sse2,   compare_sse2,   blit_sse2   },
+#endif
+  { "scalar", fill_scalar, and_or_scalar, compare_scalar, blit_scalar },
+};
+
+#define NIMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const cellops_impl *impl = &impls[NIMPLS - 1];
+
+static int supported (const cellops_impl *p)
+{
+#ifdef CELLOPS_X86
+  __builtin_cpu_init();
+  if (!strcmp(p->name, "avx2")) return __builtin_cpu_supports("avx2");
+  if (!strcmp(p->name, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+  (void)p;
+  return 1;
+}
+
+// pick the fastest implementation this CPU can run
+void cellops_init (void)
+{
+  int i;
+  for (i=0; i<NIMPLS && !supported(&impls[i]); i++) {}
+  impl = &impls[i < NIMPLS ? i : NIMPLS - 1];
+}
+
+// force an implementation by name; return 0 if unknown or not supported
+int cellops_select (const char *name)
+{
+  int i;
+  for (i=0; i<NIMPLS; i++) {
+    if (!strcmp(impls[i].name, name) && supported(&impls[i])) {
+      impl = &impls[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char* cellops_backend (void)
+{
+  return impl->name;
+}
+
+void cellops_fill (cell_t *p, size_t n, cell_t c)
+{
+  impl->fill(p, n, c);
+}
+
+void cellops_and_or (cell_t *p, size_t n, unsigned and_mask, unsigned or_mask)
+{
+  impl->and_or(p, n, and_mask, or_mask);
+}
+
+int cellops_compare (const cell_t *a, const cell_t *b, size_t n, size_t *first, size_t *last)
+{
+  return impl->compare(a, b, n, first, last);
+}
+
+void cellops_blit (cell_t *dst, const cell_t *src, size_t n, unsigned key, unsigned mask)
+{
+  impl->blit(dst, src, n, key, mask);
+}
@@ -0,0 +1,30 @@
+// cellops.h
+// Bulk kernels over runs of cells, with SSE2/AVX2 versions picked at run time.
+//
+// For the and/or and masked-blit kernels a cell is seen as a 32-bit value:
+// Char in the low 16 bits, Attributes in the high 16 bits (see CELL32).
+
+#ifndef CELLOPS_H
+#define CELLOPS_H
+
+#include <stddef.h>
+#include "cells.h"
+
+#define CELL32(ch, attr)  ((unsigned)(unsigned short)(ch) | (unsigned)(unsigned short)(attr) << 16)
+#define CELL32_CHAR       0x0000FFFFu
+#define CELL32_ATTR       0xFFFF0000u
+
+void        cellops_init    (void);
+int         cellops_select  (const char *name);
+const char* cellops_backend (void);
+
+// p[i] = c
+void cellops_fill    (cell_t *p, size_t n, cell_t c);
+// p[i] = (p[i] & and_mask) | or_mask
+void cellops_and_or  (cell_t *p, size_t n, unsigned and_mask, unsigned or_mask);
+// Find the first and last i where a[i] != b[i]; return 0 if there is none.
+int  cellops_compare (const cell_t *a, const cell_t *b, size_t n, size_t *first, size_t *last);
+// dst[i] = src[i] unless (src[i] & mask) == key, i.e. 'key' is transparent
+void cellops_blit    (cell_t *dst, const cell_t *src, size_t n, unsigned key, unsigned mask);
+
+#endif
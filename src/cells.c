@@ -0,0 +1,151 @@
+// cells.c
+// Portable cell arrays: the storage behind CellBuffer and the renderers.
+
+#include <string.h>
+#include "cells.h"
+#include "cellops.h"
+
+void cellbuf_init (cellbuf *cb, int width, int height, cell_t *storage)
+{
+  cb->width = width;
+  cb->height = height;
+  cb->cells = storage;
+}
+
+void cellbuf_clear (cellbuf *cb, cell_t c)
+{
+  cellops_fill(cb->cells, (size_t)cb->width * cb->height, c);
+}
+
+// clip a rectangle to the buffer; return 0 if nothing is left of it
+int cellbuf_clip (const cellbuf *cb, cell_rect *r)
+{
+  if (r->Left < 0) r->Left = 0;
+  if (r->Top < 0) r->Top = 0;
+  if (r->Right >= cb->width) r->Right = cb->width - 1;
+  if (r->Bottom >= cb->height) r->Bottom = cb->height - 1;
+  return r->Left <= r->Right && r->Top <= r->Bottom;
+}
+
+// Fill a rectangle (clipped to the buffer).
+// A negative ch or attr leaves that half of the target cells untouched.
+void cellbuf_fill_rect (cellbuf *cb, cell_rect r, int ch, int attr)
+{
+  unsigned and_mask = 0xFFFFFFFFu, or_mask = 0;
+  size_t w;
+  int y;
+  if (!cellbuf_clip(cb, &r))
+    return;
+  if (ch >= 0)   { and_mask &= ~CELL32_CHAR; or_mask |= CELL32(ch, 0); }
+  if (attr >= 0) { and_mask &= ~CELL32_ATTR; or_mask |= CELL32(0, attr); }
+  w = r.Right - r.Left + 1;
+  for (y=r.Top; y<=r.Bottom; y++) {
+    if (and_mask == 0) {
+      cell_t c;
+      c.Char = (unsigned short)ch;
+      c.Attributes = (unsigned short)attr;
+      cellops_fill(CELLBUF_AT(cb, r.Left, y), w, c);
+    }
+    else
+      cellops_and_or(CELLBUF_AT(cb, r.Left, y), w, and_mask, or_mask);
+  }
+}
+
+// Put a byte string into one row starting at (x,y), clipped to the buffer.
+// A negative attr leaves the attributes of the target cells untouched.
+// Return the number of cells written.
+int cellbuf_put_string (cellbuf *cb, int x, int y, const char *s, size_t len, int attr)
+{
+  cell_t *p;
+  int n;
+  if (y < 0 || y >= cb->height || x >= cb->width)
+    return 0;
+  if (x < 0) {
+    if ((size_t)-x >= len)
+      return 0;
+    s += -x;
+    len -= -x;
+    x = 0;
+  }
+  if (len > (size_t)(cb->width - x))
+    len = cb->width - x;
+  p = CELLBUF_AT(cb, x, y);
+  for (n=0; n<(int)len; n++, p++) {
+    p->Char = (unsigned char)s[n];
+    if (attr >= 0)
+      p->Attributes = (unsigned short)attr;
+  }
+  return n;
+}
+
+// Same for UTF-16 text: one unit per cell, as the console stores it.
+int cellbuf_put_wide (cellbuf *cb, int x, int y, const unsigned short *s, size_t len, int attr)
+{
+  cell_t *p;
+  int n;
+  if (y < 0 || y >= cb->height || x >= cb->width)
+    return 0;
+  if (x < 0) {
+    if ((size_t)-x >= len)
+      return 0;
+    s += -x;
+    len -= -x;
+    x = 0;
+  }
+  if (len > (size_t)(cb->width - x))
+    len = cb->width - x;
+  p = CELLBUF_AT(cb, x, y);
+  for (n=0; n<(int)len; n++, p++) {
+    p->Char = s[n];
+    if (attr >= 0)
+      p->Attributes = (unsigned short)attr;
+  }
+  return n;
+}
+
+// Clip a copy of rectangle r of src to (dx,dy) in dst against both buffers.
+static int clip_copy (cellbuf *dst, int *dx, int *dy, const cellbuf *src, cell_rect *r)
+{
+  if (!cellbuf_clip(src, r))
+    return 0;
+  if (*dx < 0) { r->Left -= *dx; *dx = 0; }
+  if (*dy < 0) { r->Top -= *dy; *dy = 0; }
+  if (r->Right - r->Left >= dst->width - *dx) r->Right = r->Left + dst->width - *dx - 1;
+  if (r->Bottom - r->Top >= dst->height - *dy) r->Bottom = r->Top + dst->height - *dy - 1;
+  return r->Left <= r->Right && r->Top <= r->Bottom;
+}
+
+// Copy rectangle r of src into dst with its upper-left corner at (dx,dy).
+// Both sides are clipped; src and dst may be the same buffer.
+void cellbuf_copy_rect (cellbuf *dst, int dx, int dy, const cellbuf *src, cell_rect r)
+{
+  int y, w;
+  if (!clip_copy(dst, &dx, &dy, src, &r))
+    return;
+  w = r.Right - r.Left + 1;
+  if (dst == src && dy > r.Top) {
+    for (y=r.Bottom; y>=r.Top; y--)
+      memmove(CELLBUF_AT(dst, dx, dy + y - r.Top), CELLBUF_AT(src, r.Left, y), w * sizeof(cell_t));
+  }
+  else {
+    for (y=r.Top; y<=r.Bottom; y++)
+      memmove(CELLBUF_AT(dst, dx, dy + y - r.Top), CELLBUF_AT(src, r.Left, y), w * sizeof(cell_t));
+  }
+}
+
+// Like cellbuf_copy_rect, but source cells with (CELL32 & mask) == key are
+// transparent. src and dst must be different buffers.
+void cellbuf_blit (cellbuf *dst, int dx, int dy, const cellbuf *src, cell_rect r,
+                   unsigned key, unsigned mask)
+{
+  int y;
+  if (mask == 0) {
+    cellbuf_copy_rect(dst, dx, dy, src, r);
+    return;
+  }
+  if (!clip_copy(dst, &dx, &dy, src, &r))
+    return;
+  for (y=r.Top; y<=r.Bottom; y++)
+    cellops_blit(CELLBUF_AT(dst, dx, dy + y - r.Top), CELLBUF_AT(src, r.Left, y),
+                 r.Right - r.Left + 1, key, mask);
+}
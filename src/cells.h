@@ -0,0 +1,40 @@
+// cells.h
+// Portable cell arrays: the storage behind CellBuffer and the renderers.
+// Nothing in here depends on Lua or on the Windows API.
+
+#ifndef CELLS_H
+#define CELLS_H
+
+#include <stddef.h>
+
+// Same layout as CHAR_INFO: a 16-bit character followed by 16-bit attributes.
+typedef struct {
+  unsigned short Char;
+  unsigned short Attributes;
+} cell_t;
+
+// Inclusive rectangle, same convention as SMALL_RECT.
+typedef struct {
+  int Left, Top, Right, Bottom;
+} cell_rect;
+
+typedef struct {
+  int width;
+  int height;
+  cell_t *cells;   // width*height cells, row-major
+} cellbuf;
+
+#define CELLBUF_AT(cb, x, y)  ((cb)->cells + (size_t)(y) * (cb)->width + (x))
+
+void cellbuf_init       (cellbuf *cb, int width, int height, cell_t *storage);
+void cellbuf_clear      (cellbuf *cb, cell_t c);
+int  cellbuf_clip       (const cellbuf *cb, cell_rect *r);
+void cellbuf_fill_rect  (cellbuf *cb, cell_rect r, int ch, int attr);
+int  cellbuf_put_string (cellbuf *cb, int x, int y, const char *s, size_t len, int attr);
+int  cellbuf_put_wide   (cellbuf *cb, int x, int y, const unsigned short *s, size_t len,
+                         int attr);
+void cellbuf_copy_rect  (cellbuf *dst, int dx, int dy, const cellbuf *src, cell_rect r);
+void cellbuf_blit       (cellbuf *dst, int dx, int dy, const cellbuf *src, cell_rect r,
+                         unsigned key, unsigned mask);
+
+#endif
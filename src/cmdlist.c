@@ -0,0 +1,145 @@
+// cmdlist.c
+// Command lists: console calls recorded as compact bytecode and replayed in
+// one go against a backend.
+
+#include <stdlib.h>
+#include <string.h>
+#include "cmdlist.h"
+
+#define HEADER(op, size)  ((op) | (int)(size) << 8)
+#define HDR_OP(w)         ((w) & 0xFF)
+#define HDR_SIZE(w)       ((size_t)((unsigned)(w) >> 8))
+#define TEXT_WORDS(cap)   (((cap) + sizeof(int) - 1) / sizeof(int))
+
+static const int nargs[CMD_LAST + 1] = { 0, 2, 1, 0, 4, 4, 2 };
+
+void cmdlist_init (cmdlist *cl)
+{
+  memset(cl, 0, sizeof(cmdlist));
+}
+
+void cmdlist_free (cmdlist *cl)
+{
+  free(cl->code);
+  free(cl->ops);
+  cmdlist_init(cl);
+}
+
+// forget the commands, keep the memory
+void cmdlist_clear (cmdlist *cl)
+{
+  cl->len = cl->nops = 0;
+}
+
+int cmdlist_nargs (int op)
+{
+  return op > 0 && op <= CMD_LAST ? nargs[op] : -1;
+}
+
+// opcode of command 'id', 0 if there is no such command
+int cmdlist_op (const cmdlist *cl, int id)
+{
+  if (id < 0 || (size_t)id >= cl->nops)
+    return 0;
+  return HDR_OP(cl->code[cl->ops[id]]);
+}
+
+// make room for a command of 'words' words; return its offset or -1
+static long reserve (cmdlist *cl, size_t words)
+{
+  if (cl->len + words > cl->cap) {
+    size_t cap = cl->cap ? cl->cap * 2 : 64;
+    int *p;
+    while (cap < cl->len + words) cap *= 2;
+    if (!(p = (int*)realloc(cl->code, cap * sizeof(int))))
+      return -1;
+    cl->code = p;
+    cl->cap = cap;
+  }
+  if (cl->nops == cl->opscap) {
+    size_t cap = cl->opscap ? cl->opscap * 2 : 16;
+    size_t *p = (size_t*)realloc(cl->ops, cap * sizeof(size_t));
+    if (!p)
+      return -1;
+    cl->ops = p;
+    cl->opscap = cap;
+  }
+  cl->ops[cl->nops] = cl->len;
+  cl->len += words;
+  return (long)cl->ops[cl->nops];
+}
+
+// Record a command other than CMD_WRITE; return its id or -1 if out of memory.
+int cmdlist_add (cmdlist *cl, int op, const int *args)
+{
+  int n = cmdlist_nargs(op);
+  long at;
+  if (n < 0 || op == CMD_WRITE || (at = reserve(cl, 1 + n)) < 0)
+    return -1;
+  cl->code[at] = HEADER(op, 1 + n);
+  memcpy(cl->code + at + 1, args, n * sizeof(int));
+  return (int)cl->nops++;
+}
+
+// Record a CMD_WRITE with room for texts of up to max(len, reserve) bytes.
+int cmdlist_add_text (cmdlist *cl, const char *s, size_t len, size_t room)
+{
+  size_t cap = len > room ? len : room;
+  size_t words = 3 + TEXT_WORDS(cap);
+  long at;
+  if (words >= (size_t)1 << 23 || (at = reserve(cl, words)) < 0)
+    return -1;
+  cl->code[at] = HEADER(CMD_WRITE, words);
+  cl->code[at+1] = (int)len;
+  cl->code[at+2] = (int)cap;
+  memcpy(cl->code + at + 3, s, len);
+  return (int)cl->nops++;
+}
+
+// Replace the arguments of a command; return 0 if 'id' is invalid or is a
+// CMD_WRITE.
+int cmdlist_patch (cmdlist *cl, int id, const int *args)
+{
+  int op = cmdlist_op(cl, id);
+  if (op == 0 || op == CMD_WRITE)
+    return 0;
+  memcpy(cl->code + cl->ops[id] + 1, args, nargs[op] * sizeof(int));
+  return 1;
+}
+
+// Replace the text of a CMD_WRITE; return 0 if 'id' is not one or the text
+// is longer than the room recorded for it.
+int cmdlist_patch_text (cmdlist *cl, int id, const char *s, size_t len)
+{
+  int *p;
+  if (cmdlist_op(cl, id) != CMD_WRITE)
+    return 0;
+  p = cl->code + cl->ops[id];
+  if (len > (size_t)p[2])
+    return 0;
+  p[1] = (int)len;
+  memcpy(p + 3, s, len);
+  return 1;
+}
+
+// Replay the list; return -1 if every call succeeded, else the id of the
+// command that failed (the rest is not run).
+int cmdlist_run (const cmdlist *cl, const cmd_backend *be)
+{
+  const int *p = cl->code, *end = cl->code + cl->len;
+  int id, ok = 1;
+  for (id=0; p < end; id++, p += HDR_SIZE(*p)) {
+    const int *a = p + 1;
+    switch (HDR_OP(*p)) {
+      case CMD_CURSOR_POS:  ok = be->cursor_pos(be->ctx, a[0], a[1]); break;
+      case CMD_TEXT_ATTR:   ok = be->text_attr(be->ctx, a[0]); break;
+      case CMD_WRITE:       ok = be->write(be->ctx, (const char*)(a + 2), (size_t)a[0]); break;
+      case CMD_FILL_CHAR:   ok = be->fill_char(be->ctx, a[0], a[1], a[2], a[3]); break;
+      case CMD_FILL_ATTR:   ok = be->fill_attr(be->ctx, a[0], a[1], a[2], a[3]); break;
+      case CMD_CURSOR_INFO: ok = be->cursor_info(be->ctx, a[0], a[1]); break;
+    }
+    if (!ok)
+      return id;
+  }
+  return -1;
+}
@@ -0,0 +1,57 @@
+// cmdlist.h
+// Command lists: console calls recorded as compact bytecode and replayed in
+// one go against a backend. Every recorded command gets an id (its index)
+// through which its arguments can be patched later, so a list is built once
+// and replayed many times.
+
+#ifndef CMDLIST_H
+#define CMDLIST_H
+
+#include <stddef.h>
+
+enum {
+  CMD_CURSOR_POS = 1,  // x, y
+  CMD_TEXT_ATTR,       // attr
+  CMD_WRITE,           // text
+  CMD_FILL_CHAR,       // ch, n, x, y
+  CMD_FILL_ATTR,       // attr, n, x, y
+  CMD_CURSOR_INFO,     // size, visible
+  CMD_LAST = CMD_CURSOR_INFO
+};
+
+#define CMD_MAX_ARGS 4
+
+// The calls a list replays; each returns 0 on failure.
+typedef struct {
+  int (*cursor_pos)  (void *ctx, int x, int y);
+  int (*text_attr)   (void *ctx, int attr);
+  int (*write)       (void *ctx, const char *s, size_t len);
+  int (*fill_char)   (void *ctx, int ch, int n, int x, int y);
+  int (*fill_attr)   (void *ctx, int attr, int n, int x, int y);
+  int (*cursor_info) (void *ctx, int size, int visible);
+  void *ctx;
+} cmd_backend;
+
+// Code is a sequence of 32-bit words: a header (opcode in the low 8 bits,
+// size in words above them) and the arguments. CMD_WRITE stores the text
+// length and capacity, then the bytes.
+typedef struct {
+  int *code;
+  size_t len, cap;      // in words
+  size_t *ops;          // offset of each command, by id
+  size_t nops, opscap;
+} cmdlist;
+
+void cmdlist_init  (cmdlist *cl);
+void cmdlist_free  (cmdlist *cl);
+void cmdlist_clear (cmdlist *cl);
+
+int  cmdlist_nargs (int op);
+int  cmdlist_op    (const cmdlist *cl, int id);
+int  cmdlist_add   (cmdlist *cl, int op, const int *args);
+int  cmdlist_add_text (cmdlist *cl, const char *s, size_t len, size_t reserve);
+int  cmdlist_patch (cmdlist *cl, int id, const int *args);
+int  cmdlist_patch_text (cmdlist *cl, int id, const char *s, size_t len);
+int  cmdlist_run   (const cmdlist *cl, const cmd_backend *be);
+
+#endif
@@ -0,0 +1,92 @@
+// coalesce.c
+// Collapse floods of near-identical input records (key auto-repeat, mouse
+// drags, window resizes) so that they are handled once rather than many
+// times over.
+
+#include "coalesce.h"
+
+void coalesce_init_policy (coalesce_policy *pol)
+{
+  pol->keys = 1;
+  pol->mouse_moves = 1;
+  pol->resizes = 1;
+  pol->max_repeat = 0xFFFF;
+}
+
+// same key, same character, same modifiers: a repeat of the same keystroke
+static int same_keydown (const KEY_EVENT_RECORD *a, const KEY_EVENT_RECORD *b)
+{
+  return a->bKeyDown && b->bKeyDown &&
+    a->wVirtualKeyCode   == b->wVirtualKeyCode &&
+    a->wVirtualScanCode  == b->wVirtualScanCode &&
+    a->uChar.UnicodeChar == b->uChar.UnicodeChar &&
+    a->dwControlKeyState == b->dwControlKeyState;
+}
+
+// a move that only changes the position of the one before it
+static int same_drag (const MOUSE_EVENT_RECORD *a, const MOUSE_EVENT_RECORD *b)
+{
+  return a->dwEventFlags == MOUSE_MOVED && b->dwEventFlags == MOUSE_MOVED &&
+    a->dwButtonState     == b->dwButtonState &&
+    a->dwControlKeyState == b->dwControlKeyState;
+}
+
+// Coalesce recs[0..n-1] in place, keeping the order of what remains; return
+// the new number of records. Only adjacent records are folded, except for
+// resizes, where each one makes all earlier ones stale.
+size_t coalesce_records (INPUT_RECORD *recs, size_t n, const coalesce_policy *pol,
+                         coalesce_stats *stats)
+{
+  size_t i, out = 0, last_resize = n;
+  unsigned max_repeat = pol->max_repeat > 0 && pol->max_repeat < 0xFFFF ?
+                        (unsigned)pol->max_repeat : 0xFFFF;
+
+  if (pol->resizes) {
+    for (i=n; i-- > 0; ) {
+      if (recs[i].EventType == WINDOW_BUFFER_SIZE_EVENT) {
+        last_resize = i;
+        break;
+      }
+    }
+  }
+
+  for (i=0; i<n; i++) {
+    const INPUT_RECORD *r = &recs[i];
+    INPUT_RECORD *prev = out ? &recs[out-1] : NULL;
+    switch (r->EventType) {
+      case KEY_EVENT:
+        if (pol->keys && prev && prev->EventType == KEY_EVENT &&
+            same_keydown(&prev->Event.KeyEvent, &r->Event.KeyEvent)) {
+          unsigned sum = prev->Event.KeyEvent.wRepeatCount + r->Event.KeyEvent.wRepeatCount;
+          if (sum <= max_repeat) {
+            prev->Event.KeyEvent.wRepeatCount = (WORD)sum;
+            stats->keys++;
+            continue;
+          }
+        }
+        break;
+
+      case MOUSE_EVENT:
+        if (pol->mouse_moves && prev && prev->EventType == MOUSE_EVENT &&
+            same_drag(&prev->Event.MouseEvent, &r->Event.MouseEvent)) {
+          *prev = *r;
+          stats->mouse_moves++;
+          continue;
+        }
+        break;
+
+      case WINDOW_BUFFER_SIZE_EVENT:
+        if (pol->resizes && i != last_resize) {
+          stats->resizes++;
+          continue;
+        }
+        break;
+    }
+    if (out != i)
+      recs[out] = *r;
+    out++;
+  }
+  stats->calls++;
+  stats->records += n;
+  return out;
+}
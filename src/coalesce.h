@@ -0,0 +1,31 @@
+// coalesce.h
+// Collapse floods of near-identical input records (key auto-repeat, mouse
+// drags, window resizes) so that they are handled once rather than many
+// times over.
+
+#ifndef COALESCE_H
+#define COALESCE_H
+
+#include <stddef.h>
+#include "winport.h"
+
+typedef struct {
+  int keys;         // fold consecutive identical key-downs, summing wRepeatCount
+  int mouse_moves;  // keep only the last of consecutive MOUSE_MOVED events
+  int resizes;      // keep only the last WINDOW_BUFFER_SIZE_EVENT
+  int max_repeat;   // cap for a folded wRepeatCount (at most 0xFFFF)
+} coalesce_policy;
+
+typedef struct {
+  unsigned long calls;
+  unsigned long records;      // records looked at
+  unsigned long keys;         // key-downs folded into a previous one
+  unsigned long mouse_moves;  // mouse moves dropped
+  unsigned long resizes;      // resize events dropped
+} coalesce_stats;
+
+void   coalesce_init_policy (coalesce_policy *pol);
+size_t coalesce_records (INPUT_RECORD *recs, size_t n, const coalesce_policy *pol,
+                         coalesce_stats *stats);
+
+#endif
@@ -0,0 +1,307 @@
+// compose.c
+// The compositor of compose.h. Planes are kept in slots that keep their ids,
+// and in an array of ids sorted back to front; dirty cells are a span of
+// columns per row, which is as precise as the console output needs: a span
+// goes out as part of one rectangle anyway.
+
+#include <stdlib.h>
+#include <string.h>
+#include "compose.h"
+#include "cellops.h"
+
+#define MIN(a,b)  ((a) < (b) ? (a) : (b))
+#define MAX(a,b)  ((a) > (b) ? (a) : (b))
+
+static void clear_dirty (compositor *c)
+{
+  int y;
+  for (y=c->top; y<=c->bottom; y++) {
+    c->lo[y] = c->screen.width;
+    c->hi[y] = -1;
+  }
+  c->top = c->screen.height;
+  c->bottom = -1;
+}
+
+int compose_init (compositor *c, cellbuf screen, cell_t background)
+{
+  memset(c, 0, sizeof(*c));
+  c->screen = screen;
+  c->background = background;
+  c->call_cost = RENDER_DEFAULT_CALL_COST;
+  c->lo = (int*)malloc(screen.height * sizeof(int));
+  c->hi = (int*)malloc(screen.height * sizeof(int));
+  if (!c->lo || !c->hi) {
+    compose_free(c);
+    return 0;
+  }
+  c->top = 0;
+  c->bottom = screen.height - 1;
+  clear_dirty(c);
+  compose_damage_screen(c, NULL);
+  return 1;
+}
+
+void compose_free (compositor *c)
+{
+  free(c->lo);
+  free(c->hi);
+  free(c->planes);
+  free(c->order);
+  memset(c, 0, sizeof(*c));
+}
+
+//---------------------------------------------------------------------------
+// damage
+//---------------------------------------------------------------------------
+void compose_damage_screen (compositor *c, const cell_rect *r)
+{
+  cell_rect d;
+  int y;
+  if (r)
+    d = *r;
+  else {
+    d.Left = d.Top = 0;
+    d.Right = c->screen.width - 1;
+    d.Bottom = c->screen.height - 1;
+  }
+  if (!cellbuf_clip(&c->screen, &d))
+    return;
+  for (y=d.Top; y<=d.Bottom; y++) {
+    if (c->lo[y] > d.Left)  c->lo[y] = d.Left;
+    if (c->hi[y] < d.Right) c->hi[y] = d.Right;
+  }
+  if (c->top > d.Top)       c->top = d.Top;
+  if (c->bottom < d.Bottom) c->bottom = d.Bottom;
+}
+
+// the screen cells of a visible plane
+static void damage_plane (compositor *c, const compose_plane *p)
+{
+  cell_rect r;
+  if (!p->visible)
+    return;
+  r.Left = p->x;
+  r.Top = p->y;
+  r.Right = p->x + p->cells->width - 1;
+  r.Bottom = p->y + p->cells->height - 1;
+  compose_damage_screen(c, &r);
+}
+
+void compose_damage (compositor *c, int id, const cell_rect *r)
+{
+  compose_plane *p = compose_get(c, id);
+  cell_rect d;
+  if (!p || !p->visible)
+    return;
+  if (!r) {
+    damage_plane(c, p);
+    return;
+  }
+  d = *r;
+  if (!cellbuf_clip(p->cells, &d))
+    return;
+  d.Left += p->x;
+  d.Right += p->x;
+  d.Top += p->y;
+  d.Bottom += p->y;
+  compose_damage_screen(c, &d);
+}
+
+void compose_set_background (compositor *c, cell_t background)
+{
+  c->background = background;
+  compose_damage_screen(c, NULL);
+}
+
+//---------------------------------------------------------------------------
+// planes
+//---------------------------------------------------------------------------
+compose_plane* compose_get (compositor *c, int id)
+{
+  if (id < 0 || id >= c->nslots || !c->planes[id].cells)
+    return NULL;
+  return c->planes + id;
+}
+
+static int in_front (const compose_plane *a, const compose_plane *b)
+{
+  return a->z > b->z || (a->z == b->z && a->seq > b->seq);
+}
+
+// put id into the order, which does not have it
+static void insert_order (compositor *c, int id)
+{
+  const compose_plane *p = c->planes + id;
+  int i = c->nplanes;
+  while (i > 0 && in_front(c->planes + c->order[i-1], p)) {
+    c->order[i] = c->order[i-1];
+    i--;
+  }
+  c->order[i] = id;
+  c->nplanes++;
+}
+
+static void remove_order (compositor *c, int id)
+{
+  int i = 0;
+  while (c->order[i] != id)
+    i++;
+  memmove(c->order + i, c->order + i + 1, (c->nplanes - i - 1) * sizeof(int));
+  c->nplanes--;
+}
+
+int compose_add (compositor *c, const cellbuf *cells, int x, int y, int z)
+{
+  compose_plane *p;
+  int id = 0;
+  while (id < c->nslots && c->planes[id].cells)
+    id++;
+  if (id == c->cap) {
+    int cap = c->cap ? 2 * c->cap : 8;
+    compose_plane *planes = (compose_plane*)realloc(c->planes, cap * sizeof(compose_plane));
+    int *order;
+    if (!planes)
+      return -1;
+    c->planes = planes;
+    if (!(order = (int*)realloc(c->order, cap * sizeof(int))))
+      return -1;
+    c->order = order;
+    c->cap = cap;
+  }
+  if (id == c->nslots)
+    c->nslots++;
+  p = c->planes + id;
+  p->cells = cells;
+  p->x = x;
+  p->y = y;
+  p->z = z;
+  p->visible = 1;
+  p->key = p->mask = 0;
+  p->seq = c->seq++;
+  insert_order(c, id);
+  damage_plane(c, p);
+  return id;
+}
+
+void compose_remove (compositor *c, int id)
+{
+  compose_plane *p = compose_get(c, id);
+  if (!p)
+    return;
+  damage_plane(c, p);
+  remove_order(c, id);
+  p->cells = NULL;
+  while (c->nslots > 0 && !c->planes[c->nslots-1].cells)
+    c->nslots--;
+}
+
+void compose_move (compositor *c, int id, int x, int y)
+{
+  compose_plane *p = compose_get(c, id);
+  if (!p || (p->x == x && p->y == y))
+    return;
+  damage_plane(c, p);
+  p->x = x;
+  p->y = y;
+  damage_plane(c, p);
+}
+
+void compose_set_z (compositor *c, int id, int z)
+{
+  compose_plane *p = compose_get(c, id);
+  if (!p || p->z == z)
+    return;
+  remove_order(c, id);
+  p->z = z;
+  insert_order(c, id);
+  damage_plane(c, p);
+}
+
+void compose_show (compositor *c, int id, int visible)
+{
+  compose_plane *p = compose_get(c, id);
+  if (!p || !p->visible == !visible)
+    return;
+  p->visible = 1;
+  damage_plane(c, p);
+  p->visible = visible != 0;
+}
+
+void compose_set_key (compositor *c, int id, unsigned key, unsigned mask)
+{
+  compose_plane *p = compose_get(c, id);
+  if (!p)
+    return;
+  p->key = key & mask;
+  p->mask = mask;
+  damage_plane(c, p);
+}
+
+//---------------------------------------------------------------------------
+// composition
+//---------------------------------------------------------------------------
+static int on_row (const compose_plane *p, int y)
+{
+  return p->visible && y >= p->y && y < p->y + p->cells->height;
+}
+
+// Columns a..b of row y: from the frontmost opaque plane that covers them
+// all (or the background) to the front.
+static void compose_span (compositor *c, int y, int a, int b)
+{
+  cell_t *row = CELLBUF_AT(&c->screen, 0, y);
+  int i, first;
+  for (i=c->nplanes-1; i>=0; i--) {
+    const compose_plane *p = c->planes + c->order[i];
+    if (p->mask == 0 && on_row(p, y) && p->x <= a && p->x + p->cells->width > b)
+      break;
+  }
+  if (i < 0) {
+    cellops_fill(row + a, b - a + 1, c->background);
+    first = 0;
+  }
+  else {
+    c->stats.covered++;
+    first = i;
+  }
+  for (i=first; i<c->nplanes; i++) {
+    const compose_plane *p = c->planes + c->order[i];
+    const cell_t *src;
+    int l, r;
+    if (!on_row(p, y))
+      continue;
+    l = MAX(a, p->x);
+    r = MIN(b, p->x + p->cells->width - 1);
+    if (l > r)
+      continue;
+    src = CELLBUF_AT(p->cells, l - p->x, y - p->y);
+    if (p->mask)
+      cellops_blit(row + l, src, r - l + 1, p->key, p->mask);
+    else
+      memcpy(row + l, src, (r - l + 1) * sizeof(cell_t));
+    c->stats.layers++;
+  }
+  c->stats.rows++;
+  c->stats.cells += b - a + 1;
+}
+
+int compose_update (compositor *c, const render_sink *sink)
+{
+  int y, n = 0;
+  c->stats.updates++;
+  for (y=c->top; y<=c->bottom; y++)
+    if (c->lo[y] <= c->hi[y])
+      compose_span(c, y, c->lo[y], c->hi[y]);
+  if (sink) {
+    render_stats rs;
+    memset(&rs, 0, sizeof(rs));
+    n = render_spans(&c->screen, c->lo, c->hi, c->top, c->bottom, c->call_cost, sink, &rs);
+    c->stats.rects += rs.rects;
+    c->stats.sent += rs.cells;
+    if (n < 0)
+      return -1;
+  }
+  clear_dirty(c);
+  return n;
+}
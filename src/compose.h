@@ -0,0 +1,75 @@
+// compose.h
+// A compositor: cell planes stacked in z order over a background, composed
+// into a screen-sized cellbuf. Moving, hiding, restacking or drawing into a
+// plane marks the screen cells it touches dirty, a span of columns per row;
+// compose_update composes those spans only, top plane first so that what an
+// opaque plane covers is not drawn, and sends them as a few rectangles.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include "cells.h"
+#include "render.h"
+
+typedef struct {
+  const cellbuf *cells;   // contents, not owned; NULL for a free slot
+  int x, y;               // screen position of the upper-left corner
+  int z;                  // planes of higher z are in front; for equal z the
+                          // one added later is
+  int visible;
+  unsigned key, mask;     // transparent cells, as for cellbuf_blit;
+                          // mask 0: the plane is opaque
+  unsigned long seq;
+} compose_plane;
+
+typedef struct {
+  unsigned long updates;  // compose_update calls
+  unsigned long rows;     // row spans composed
+  unsigned long cells;    // cells composed
+  unsigned long layers;   // plane segments drawn
+  unsigned long covered;  // row spans an opaque plane covered entirely
+  unsigned long rects;    // rectangles sent
+  unsigned long sent;     // cells sent
+} compose_stats;
+
+typedef struct {
+  cellbuf screen;         // the composition, not owned
+  cell_t background;
+  int *lo, *hi;           // dirty columns lo..hi of each row; lo > hi: none
+  int top, bottom;        // no row outside top..bottom is dirty
+  compose_plane *planes;  // slots, by id
+  int nslots, cap;
+  int *order;             // ids of the planes, back to front
+  int nplanes;
+  unsigned long seq;
+  int call_cost;          // cost of an output call in cells, for merging rows
+  compose_stats stats;
+} compositor;
+
+// 'screen' is the storage of the composition; all of it starts dirty.
+int  compose_init (compositor *c, cellbuf screen, cell_t background);
+void compose_free (compositor *c);
+
+// Add a visible plane; return its id, or -1 if out of memory. The cells are
+// read on every compose_update until the plane is removed.
+int  compose_add (compositor *c, const cellbuf *cells, int x, int y, int z);
+void compose_remove (compositor *c, int id);
+compose_plane* compose_get (compositor *c, int id);   // NULL if no such plane
+
+void compose_move    (compositor *c, int id, int x, int y);
+void compose_set_z   (compositor *c, int id, int z);
+void compose_show    (compositor *c, int id, int visible);
+void compose_set_key (compositor *c, int id, unsigned key, unsigned mask);
+
+// Cells of plane 'id' changed: r in its coordinates, or NULL for all of them.
+void compose_damage (compositor *c, int id, const cell_rect *r);
+// Screen cells to compose again: r, or NULL for the whole screen.
+void compose_damage_screen (compositor *c, const cell_rect *r);
+void compose_set_background (compositor *c, cell_t background);
+
+// Compose the dirty cells and send them to sink (if not NULL); return the
+// number of rectangles sent, or -1 if the sink failed (the cells stay dirty).
+int  compose_update (compositor *c, const render_sink *sink);
+
+#endif
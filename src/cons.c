@@ -4,10 +4,54 @@
 #include <windows.h>
 #include <lua.h>
 #include <lauxlib.h>
-extern void push_flags_table (lua_State *L);
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cells.h"
+#include "cellops.h"
+#include "cmdlist.h"
+#include "coalesce.h"
+#include "flags.h"
+#include "pump.h"
+#include "render.h"
+#include "scroll.h"
+#include "term.h"
+#include "utf8.h"
+#include "vt.h"
+#include "outbuf.h"
+#include "rec.h"
+#include "layout.h"
+#include "scrollback.h"
+#include "compose.h"
+#include "loop.h"
+#include "service.h"
+
+#ifdef CONS_STATS
+# include <time.h>
+# if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#  include <x86intrin.h>
+#  define STATS_TSC
+# elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#  include <intrin.h>
+#  define STATS_TSC
+# endif
+#endif
+
+// a count shared by the Lua states of all threads ('recording')
+#ifdef _MSC_VER
+# define COUNT_GET(p)  (*(volatile LONG*)(p))
+# define COUNT_INC(p)  InterlockedIncrement((volatile LONG*)(p))
+# define COUNT_DEC(p)  InterlockedDecrement((volatile LONG*)(p))
+#else
+# define COUNT_GET(p)  __atomic_load_n(p, __ATOMIC_RELAXED)
+# define COUNT_INC(p)  __atomic_add_fetch(p, 1, __ATOMIC_RELAXED)
+# define COUNT_DEC(p)  __atomic_sub_fetch(p, 1, __ATOMIC_RELAXED)
+#endif
 
 #if LUA_VERSION_NUM < 502
   #define ALG_ENVIRONINDEX LUA_ENVIRONINDEX
+  #define lua_getuservalue lua_getfenv
+  #define lua_setuservalue lua_setfenv
 #else
   #define lua_objlen lua_rawlen
   #define ALG_ENVIRONINDEX lua_upvalueindex(1)
@@ -24,10 +68,32 @@ extern void push_flags_table (lua_State *L);
                          lua_gettop(L) + (i) + 1)
 
 static const char ConsoleHandleType[] = "StandardConsoleHandle";
+static const char CellBufferType[]    = "CellBuffer";
+static const char RendererType[]      = "Renderer";
+static const char InputRingType[]     = "InputRing";
+static const char InputPumpType[]     = "InputPump";
+static const char CoalescerType[]     = "Coalescer";
+static const char CommandListType[]   = "CommandList";
+static const char WriterType[]        = "Writer";
+static const char VTEncoderType[]     = "VTEncoder";
+static const char TerminalType[]      = "Terminal";
+static const char SwapChainType[]     = "SwapChain";
+static const char RecorderType[]      = "Recorder";
+static const char PlayerType[]        = "Player";
+static const char ScrollbackType[]    = "Scrollback";
+static const char CompositorType[]    = "Compositor";
+static const char LoopType[]          = "Loop";
+static const char RenderServiceType[] = "RenderService";
+static const char RenderProducerType[] = "RenderProducer";
+
+// cell_t must be a drop-in replacement for CHAR_INFO (no copying on output)
+typedef char cell_layout_check[sizeof(cell_t) == sizeof(CHAR_INFO) &&
+  offsetof(CHAR_INFO, Attributes) == offsetof(cell_t, Attributes) ? 1 : -1];
 
 typedef enum {
   STANDARD_CONSOLE,
-  SCREEN_BUFFER
+  SCREEN_BUFFER,
+  POOLED_BUFFER      // owned by a SwapChain: not closed with the userdata
 } ud_type;
 
 typedef struct {
@@ -35,6 +101,145 @@ typedef struct {
   ud_type type;
 } cons_ud;
 
+// flush the buffered Writers before reading input (see the Writer section)
+static void FlushWriters (lua_State *L);
+
+// Output to handles being recorded is reported to their Recorder (see the
+// Recorder section): rows top..bottom of the buffer may have changed, or
+// only the cursor if top > bottom. The recorders are per state; 'recording'
+// counts those of all states, so that output goes without a lookup while
+// there are none.
+static int recording;
+static void RecordOutput (lua_State *L, HANDLE h, int top, int bottom);
+#define RECORD_OUTPUT(L, h, top, bottom) \
+  (COUNT_GET(&recording) ? \
+   RecordOutput((L), (h), (top), (bottom)) : (void)0)
+#define RECORD_ALL(L, h)     RECORD_OUTPUT(L, h, 0, 0x7FFF)
+#define RECORD_CURSOR(L, h)  RECORD_OUTPUT(L, h, 1, 0)
+
+// room for the data of one call, and giving it back (see the Scratch space
+// section)
+static void* GetScratch (lua_State *L, size_t size);
+static void ReleaseScratch (lua_State *L, void *p);
+
+// Units moved by the console call in progress of state L: bytes or UTF-16
+// units of text, cells, or input records; counted for cons.stats() (built
+// with CONS_STATS, see the Statistics section). L is NULL where the units are
+// not the caller's (e.g. on a thread of a RenderService).
+#ifdef CONS_STATS
+static void StatsMoved (lua_State *L, unsigned long n);
+# define STATS_MOVED(L, n)  StatsMoved(L, (unsigned long)(n))
+#else
+# define STATS_MOVED(L, n)  ((void)0)
+#endif
+
+// registry key of the cache of parsed "NAME|NAME|..." strings
+static const char FlagCacheKey = 0;
+#define FLAG_CACHE_MAX 256
+
+// parse "NAME|NAME|..." (numbers are accepted too); return false if a part
+// is not a known flag. 'fixed' is cleared if a part was found in the flags
+// table only, which the user may change.
+static bool ParseFlagString (lua_State *L, const char *s, size_t len, int *trg, bool *fixed)
+{
+  const char *end = s + len;
+  *trg = 0;
+  *fixed = true;
+  for (;;) {
+    const char *p, *q;
+    int flag;
+    while (s < end && (*s == ' ' || *s == '\t')) s++;
+    for (p = s; p < end && *p != '|'; p++) {}
+    for (q = p; q > s && (q[-1] == ' ' || q[-1] == '\t'); q--) {}
+    if (q == s)
+      return false;
+    if (!flag_lookup(s, q - s, &flag)) {
+      char *numend;
+      lua_pushlstring(L, s, q - s);
+      flag = (int)strtoul(lua_tostring(L, -1), &numend, 0);
+      if (*numend) {
+        // not a number: a name added to the flags table, maybe
+        lua_gettable(L, ALG_ENVIRONINDEX);
+        if (!lua_isnumber(L, -1)) {
+          lua_pop(L, 1);
+          return false;
+        }
+        flag = lua_tointeger(L, -1);
+        *fixed = false;
+      }
+      lua_pop(L, 1);
+    }
+    *trg |= flag;
+    if (p == end)
+      return true;
+    s = p + 1;
+  }
+}
+
+// Resolve a flag name or "NAME|NAME|..." string. A name costs one probe of
+// the generated perfect hash; a combination is parsed once, then found in
+// the cache by its (interned) string. Only combinations of built-in names and
+// numbers are cached: names added to the flags table are looked up each time.
+static bool GetStringFlags (lua_State *L, int stack_pos, int *trg)
+{
+  size_t len;
+  const char *s = lua_tolstring(L, stack_pos, &len);
+  bool fixed;
+  if (flag_lookup(s, len, trg))
+    return true;
+  if (memchr(s, '|', len)) {
+    lua_pushlightuserdata(L, (void*)&FlagCacheKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, stack_pos);
+    lua_rawget(L, -2);
+    if (lua_isnumber(L, -1)) {
+      *trg = lua_tointeger(L, -1);
+      lua_pop(L, 2);
+      return true;
+    }
+    lua_pop(L, 1);
+    if (!ParseFlagString(L, s, len, trg, &fixed)) {
+      lua_pop(L, 1);
+      return false;
+    }
+    if (!fixed) {
+      lua_pop(L, 1);
+      return true;
+    }
+    // the count is kept at [1]; start over rather than grow without bound
+    lua_rawgeti(L, -1, 1);
+    if (lua_tointeger(L, -1) >= FLAG_CACHE_MAX) {
+      lua_pop(L, 2);
+      lua_pushlightuserdata(L, (void*)&FlagCacheKey);
+      lua_newtable(L);
+      lua_pushinteger(L, 0);
+      lua_rawseti(L, -2, 1);
+      lua_pushvalue(L, -1);
+      lua_insert(L, -3);
+      lua_rawset(L, LUA_REGISTRYINDEX);
+      lua_pushinteger(L, 0);
+    }
+    lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+    lua_rawseti(L, -3, 1);
+    lua_pop(L, 1);
+    lua_pushvalue(L, stack_pos);
+    lua_pushinteger(L, *trg);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+    return true;
+  }
+  // not a built-in name: it may have been added to the flags table
+  lua_getfield (L, ALG_ENVIRONINDEX, s);
+  if (lua_isnumber(L, -1)) {
+    *trg = lua_tointeger (L, -1);
+    lua_pop (L, 1);
+    return true;
+  }
+  lua_pop (L, 1);
+  *trg = 0;
+  return false;
+}
+
 static bool get_env_flag (lua_State *L, int stack_pos, int *trg)
 {
   *trg = 0;
@@ -45,15 +250,8 @@ static bool get_env_flag (lua_State *L, int stack_pos, int *trg)
   }
   else if (type == LUA_TNONE || type == LUA_TNIL)
     return true;
-  if (type == LUA_TSTRING) {
-    lua_getfield (L, ALG_ENVIRONINDEX, lua_tostring(L, stack_pos));
-    if (lua_isnumber(L, -1)) {
-      *trg = lua_tointeger (L, -1);
-      lua_pop (L, 1);
-      return true;
-    }
-    lua_pop (L, 1);
-  }
+  if (type == LUA_TSTRING)
+    return GetStringFlags (L, abs_index(L, stack_pos), trg);
   return false;
 }
 
@@ -107,12 +305,94 @@ static int CheckFlags(lua_State* L, int stackpos)
   return Flags;
 }
 
+// cons.GetFlags(): the table of flags by name. The built-in names are
+// constants: changing their values here has no effect. Names added to it are
+// accepted wherever a flag is.
 static int f_GetFlags (lua_State *L)
 {
   lua_pushvalue (L, ALG_ENVIRONINDEX);
   return 1;
 }
 
+// cons.flags(x): the value of a flag name, "NAME|NAME|..." string, array of
+// names or number
+static int f_flags (lua_State *L)
+{
+  int val;
+  luaL_argcheck(L, GetFlagCombination(L, 1, &val), 1, "invalid flag combination");
+  lua_pushinteger(L, val);
+  return 1;
+}
+
+static bool MatchesPrefix (const char *name, const char *prefixes)
+{
+  while (*prefixes) {
+    const char *p = strchr(prefixes, '|');
+    size_t len = p ? (size_t)(p - prefixes) : strlen(prefixes);
+    if (len && !strncmp(name, prefixes, len))
+      return true;
+    if (!p)
+      break;
+    prefixes = p + 1;
+  }
+  return false;
+}
+
+// cons.flagnames(value [, prefixes]): decode a value into "NAME|NAME|...",
+// using only names that start with one of the '|'-separated prefixes (e.g.
+// "ENABLE_" or "FOREGROUND_|BACKGROUND_"). A name with exactly that value is
+// preferred; otherwise single flags are taken from the largest down. Returns
+// the string and the bits no name accounts for.
+static int f_flagnames (lua_State *L)
+{
+  int value = luaL_checkinteger(L, 1);
+  const char *prefixes = luaL_optstring(L, 2, "");
+  int i, v, n = flag_slots(), rest = value;
+  const char *picked[32], *name, *best = NULL;
+  int npicked = 0, bv = 0;
+  luaL_Buffer b;
+
+  // the flags are few: each pass scans them all. A name with exactly this
+  // value: the first by name
+  for (i=0; i<n; i++) {
+    name = flag_at(i, &v);
+    if (name && v == value && (!*prefixes || MatchesPrefix(name, prefixes)) &&
+        (!best || strcmp(name, best) < 0))
+      best = name;
+  }
+  if (best) {
+    lua_pushstring(L, best);
+    lua_pushinteger(L, 0);
+    return 2;
+  }
+
+  // the largest value that fits in what is left (of equal ones, the last by
+  // name), until nothing fits
+  while (rest && npicked < 32) {
+    best = NULL;
+    for (i=0; i<n; i++) {
+      name = flag_at(i, &v);
+      if (name && v > 0 && (v & rest) == v && (!*prefixes || MatchesPrefix(name, prefixes)) &&
+          (!best || v > bv || (v == bv && strcmp(name, best) > 0))) {
+        best = name;
+        bv = v;
+      }
+    }
+    if (!best)
+      break;
+    picked[npicked++] = best;
+    rest &= ~bv;
+  }
+  luaL_buffinit(L, &b);
+  for (i=npicked-1; i>=0; i--) {
+    luaL_addstring(&b, picked[i]);
+    if (i) luaL_addchar(&b, '|');
+  }
+  luaL_pushresult(&b);
+  lua_pushinteger(L, rest);
+  return 2;
+}
+
 static int GetOptIntFromTable(lua_State *L, const char* key, int dflt)
 {
   int ret = dflt;
@@ -131,6 +411,22 @@ static bool GetOptBoolFromTable(lua_State *L, const char* key, bool dflt)
   return ret;
 }
 
+// one of 'names' (the index of it), or 'dflt' if the field is nil
+static int GetOptOptionFromTable(lua_State *L, const char* key, const char *const names[],
+                                 int dflt)
+{
+  int ret = dflt;
+  lua_getfield(L, -1, key);
+  if (!lua_isnil(L, -1)) {
+    const char *s = lua_tostring(L, -1);
+    for (ret = 0; names[ret] && !(s && !strcmp(s, names[ret])); ret++) {}
+    if (!names[ret])
+      luaL_error(L, "invalid %s: %s", key, s ? s : luaL_typename(L, -1));
+  }
+  lua_pop(L, 1);
+  return ret;
+}
+
 static void PutIntToTable (lua_State *L, const char* key, int val)
 {
   lua_pushinteger(L, val);
@@ -213,6 +509,22 @@ static void FillInputRecord(lua_State *L, int pos, INPUT_RECORD *ir)
   lua_pop(L, 1);
 }
 
+// check that FillInputRecord takes each of the n elements of the array at
+// 'pos' without an error, before the buffer they go to is taken
+static void CheckInputRecords(lua_State *L, int pos, DWORD n)
+{
+  DWORD i;
+  int temp;
+  for (i=0; i < n; i++) {
+    lua_pushinteger(L, i+1);
+    lua_gettable(L, pos);
+    luaL_argcheck(L, lua_istable(L, -1), pos, "array of tables expected");
+    lua_getfield(L, -1, "EventType");
+    luaL_argcheck(L, get_env_flag(L, -1, &temp), pos, "EventType field is missing or invalid");
+    lua_pop(L, 2);
+  }
+}
+
 static cons_ud* check_console_ud (lua_State *L, int index)
 {
   index = abs_index(L, index);
@@ -226,6 +538,20 @@ static HANDLE check_console_handle (lua_State *L, int index)
   return ud->hnd;
 }
 
+// like luaL_checkudata but returns NULL instead of raising an error
+static void* test_udata (lua_State *L, int index, const char *tname)
+{
+  void *p = lua_touserdata(L, index);
+  if (p && lua_getmetatable(L, index)) {
+    luaL_getmetatable(L, tname);
+    if (!lua_rawequal(L, -1, -2))
+      p = NULL;
+    lua_pop(L, 2);
+    return p;
+  }
+  return NULL;
+}
+
 static int consolehandle_tostring (lua_State *L)
 {
   HANDLE h = check_console_handle (L, 1);
@@ -299,8 +625,10 @@ static int f_SetConsoleCursorInfo (lua_State* L)
   HANDLE h = check_console_handle(L, 1);
   info.dwSize = luaL_checkinteger(L, 2);
   info.bVisible = lua_toboolean(L, 3);
-  lua_pushboolean(L, SetConsoleCursorInfo(h, &info));
-  return 1;
+  if (!SetConsoleCursorInfo(h, &info))
+    return lua_pushboolean(L, 0), 1;
+  RECORD_CURSOR(L, h);
+  return lua_pushboolean(L, 1), 1;
 }
 
 static int f_SetConsoleCursorPosition (lua_State* L)
@@ -309,8 +637,10 @@ static int f_SetConsoleCursorPosition (lua_State* L)
   HANDLE h = check_console_handle(L, 1);
   coord.X = luaL_checkinteger(L, 2);
   coord.Y = luaL_checkinteger(L, 3);
-  lua_pushboolean(L, SetConsoleCursorPosition(h, coord));
-  return 1;
+  if (!SetConsoleCursorPosition(h, coord))
+    return lua_pushboolean(L, 0), 1;
+  RECORD_CURSOR(L, h);
+  return lua_pushboolean(L, 1), 1;
 }
 
 static int f_GetConsoleScreenBufferInfo (lua_State* L)
@@ -392,17 +722,20 @@ static int ReadOrPeekConsoleInput (lua_State* L, int op)
   DWORD nLength = luaL_checkinteger(L, 2);
   luaL_argcheck(L, nLength > 0, 2, "invalid number of records");
 
+  FlushWriters(L);
+  // not the scratch space: building the tables may run out of memory
   pBuffer = (INPUT_RECORD*)lua_newuserdata(L, nLength*sizeof(INPUT_RECORD));
   bResult = (op == 'R') ? ReadConsoleInput(h, pBuffer, nLength, &nRead) :
                           PeekConsoleInput(h, pBuffer, nLength, &nRead);
   if (!bResult)
     return lua_pushnil(L), 1;
+  STATS_MOVED(L, nRead);
 
   lua_createtable(L, nRead, 0);
   for (i=0; i<nRead; i++)
   {
     lua_pushinteger(L, i+1);
-    lua_createtable(L, 0, 0);
+    lua_createtable(L, 0, 8);
     InputRecordToTable(L, pBuffer+i);
     lua_rawset(L, -3);
   }
@@ -419,368 +752,4752 @@ static int f_PeekConsoleInput (lua_State *L)
   return ReadOrPeekConsoleInput(L, 'P');
 }
 
-static int f_WriteConsoleInput (lua_State *L)
-{
-  HANDLE h;                      // handle to a console input buffer
-  INPUT_RECORD *lpBuffer;        // pointer to the buffer for write data
-  DWORD nLength;                 // number of records to write
-  DWORD NumberOfEventsWritten;   // number of records written
-  DWORD i;
-
-  h = check_console_handle(L, 1);
-  luaL_checktype(L, 2, LUA_TTABLE);
-  nLength = lua_objlen(L, 2);
-  luaL_argcheck(L, nLength, 2, "empty array");
+//---------------------------------------------------------------------------
+// InputRing: events are read into a reusable ring of INPUT_RECORDs and handed
+// to Lua as multiple values, so reading input allocates nothing per event
+//---------------------------------------------------------------------------
+typedef struct {
+  DWORD cap;         // capacity in records
+  DWORD head;        // index of the oldest pending record
+  DWORD count;       // number of pending records
+  INPUT_RECORD recs[1];
+} inputring_ud;
 
-  lpBuffer = (INPUT_RECORD*)lua_newuserdata(L, nLength * sizeof(INPUT_RECORD));
-  for (i=0; i < nLength; i++)
-  {
-    lua_pushinteger(L, i+1);
-    lua_gettable(L, 2);
-    FillInputRecord(L, -1, lpBuffer + i);
-    lua_pop(L, 1);
-  }
-  if (!WriteConsoleInput(h, lpBuffer, nLength, &NumberOfEventsWritten))
-    return lua_pushnil(L), 1;
-  lua_pushinteger(L, NumberOfEventsWritten);
-  return 1;
+static inputring_ud* check_inputring (lua_State *L, int index)
+{
+  return (inputring_ud*)luaL_checkudata(L, index, InputRingType);
 }
 
-static int f_WriteConsoleOutput (lua_State *L)
+// push the EventType (as an integer) followed by the fields of the event,
+// in the order InputRecordToTable uses; return the number of values
+static int PushInputRecord (lua_State *L, const INPUT_RECORD *ir)
 {
-  CHAR_INFO *lpBuffer;    // pointer to buffer with data to write
-  COORD dwBufferSize;     // column-row size of source buffer
-  COORD dwBufferCoord;    // upper-left cell to write from
-  SMALL_RECT WriteRegion; // pointer to rectangle to write to
-  int src_size, i;
-
-  HANDLE h = check_console_handle(L, 1);
-
-  luaL_checktype(L, 2, LUA_TTABLE); // character array
-  src_size = lua_objlen(L, 2);
-  luaL_argcheck(L, src_size, 2, "empty array");
+  lua_pushinteger(L, ir->EventType);
+  switch(ir->EventType) {
+    case KEY_EVENT:
+      lua_pushboolean(L, ir->Event.KeyEvent.bKeyDown);
+      lua_pushinteger(L, ir->Event.KeyEvent.wRepeatCount);
+      lua_pushinteger(L, ir->Event.KeyEvent.wVirtualKeyCode);
+      lua_pushinteger(L, ir->Event.KeyEvent.wVirtualScanCode);
+      lua_pushinteger(L, ir->Event.KeyEvent.uChar.UnicodeChar);
+      lua_pushinteger(L, (unsigned char)ir->Event.KeyEvent.uChar.AsciiChar);
+      lua_pushinteger(L, ir->Event.KeyEvent.dwControlKeyState);
+      return 8;
 
-  luaL_checktype(L, 3, LUA_TTABLE); // attribute array
-  luaL_argcheck(L, (int)lua_objlen(L, 3) == src_size, 3,
-    "different sizes of character and attribute arrays");
+    case MOUSE_EVENT:
+      lua_pushinteger(L, ir->Event.MouseEvent.dwMousePosition.X);
+      lua_pushinteger(L, ir->Event.MouseEvent.dwMousePosition.Y);
+      lua_pushinteger(L, ir->Event.MouseEvent.dwButtonState);
+      lua_pushinteger(L, ir->Event.MouseEvent.dwControlKeyState);
+      lua_pushinteger(L, ir->Event.MouseEvent.dwEventFlags);
+      return 6;
 
-  luaL_checktype(L, 4, LUA_TTABLE); // parameters
-  lua_settop(L, 4);
-  dwBufferSize.X     = GetOptIntFromTable(L, "dwBufferSizeX", 0);
-  dwBufferSize.Y     = GetOptIntFromTable(L, "dwBufferSizeY", 0);
-  luaL_argcheck(L, src_size >= dwBufferSize.X * dwBufferSize.Y, 4,
-    "SizeX*SizeY is greater than character array size");
-  dwBufferCoord.X    = GetOptIntFromTable(L, "dwBufferCoordX", 0);
-  dwBufferCoord.Y    = GetOptIntFromTable(L, "dwBufferCoordY", 0);
-  WriteRegion.Top    = GetOptIntFromTable(L, "WriteRegionTop", 0);
-  WriteRegion.Left   = GetOptIntFromTable(L, "WriteRegionLeft", 0);
-  WriteRegion.Bottom = GetOptIntFromTable(L, "WriteRegionBottom", 0);
-  WriteRegion.Right  = GetOptIntFromTable(L, "WriteRegionRight", 0);
+    case WINDOW_BUFFER_SIZE_EVENT:
+      lua_pushinteger(L, ir->Event.WindowBufferSizeEvent.dwSize.X);
+      lua_pushinteger(L, ir->Event.WindowBufferSizeEvent.dwSize.Y);
+      return 3;
 
-  lpBuffer = (CHAR_INFO*) lua_newuserdata(L, src_size * sizeof(CHAR_INFO));
-  for (i=0; i<src_size; i++,lua_pop(L,2))
-  {
-    const char* s;
-    lua_pushinteger(L, i+1);
-    lua_gettable(L, 2);
-    s = lua_tostring(L, -1);
-    luaL_argcheck(L, s, 2, "non-string in the array");
-    lpBuffer[i].Char.AsciiChar = *(const char*)s;
-    //lpBuffer[i].Char.UnicodeChar = *(const wchar_t*)s;
+    case MENU_EVENT:
+      lua_pushinteger(L, ir->Event.MenuEvent.dwCommandId);
+      return 2;
 
-    lua_pushinteger(L, i+1);
-    lua_gettable(L, 3);
-    luaL_argcheck(L, lua_isnumber(L,-1), 3, "non-number in the array");
-    lpBuffer[i].Attributes = lua_tointeger(L, -1);
+    case FOCUS_EVENT:
+      lua_pushboolean(L, ir->Event.FocusEvent.bSetFocus);
+      return 2;
   }
-
-  if (!WriteConsoleOutput(h, lpBuffer, dwBufferSize, dwBufferCoord, &WriteRegion))
-    return lua_pushnil(L), 1;
-
-  lua_createtable(L, 0, 4);
-  PutNumToTable(L, "WriteRegionTop",    WriteRegion.Top);
-  PutNumToTable(L, "WriteRegionLeft",   WriteRegion.Left);
-  PutNumToTable(L, "WriteRegionBottom", WriteRegion.Bottom);
-  PutNumToTable(L, "WriteRegionRight",  WriteRegion.Right);
   return 1;
 }
 
-static int f_GetConsoleMode (lua_State *L)
+static int f_InputRing (lua_State *L)
 {
-  HANDLE h = check_console_handle(L, 1);
-  DWORD Mode;
-  if (!GetConsoleMode(h, &Mode))
-    return lua_pushnil(L), 1;
-  lua_pushinteger(L, Mode);
+  int cap = luaL_optinteger(L, 1, 256);
+  inputring_ud *ud;
+  luaL_argcheck(L, cap > 0, 1, "invalid capacity");
+  ud = (inputring_ud*)lua_newuserdata(L, offsetof(inputring_ud, recs) + cap*sizeof(INPUT_RECORD));
+  ud->cap = cap;
+  ud->head = ud->count = 0;
+  luaL_getmetatable(L, InputRingType);
+  lua_setmetatable(L, -2);
   return 1;
 }
 
-static int f_SetConsoleMode (lua_State *L)
+static int inputring_tostring (lua_State *L)
 {
-  HANDLE h = check_console_handle(L, 1);
-  DWORD Mode = CheckFlags(L, 2);
-  lua_pushboolean(L, SetConsoleMode(h, Mode));
+  inputring_ud *ud = check_inputring(L, 1);
+  lua_pushfstring(L, "%s (%d/%d)", InputRingType, (int)ud->count, (int)ud->cap);
   return 1;
 }
 
-static int f_AllocConsole (lua_State *L)
+// ring:read(h [, max]): append up to 'max' events read from the console
+// (blocks like ReadConsoleInput); returns the number read or nil on failure
+static int inputring_read (lua_State *L)
 {
-  return lua_pushboolean(L, AllocConsole()), 1;
+  inputring_ud *ud = check_inputring(L, 1);
+  HANDLE h = check_console_handle(L, 2);
+  DWORD room = ud->cap - ud->count;
+  DWORD tail = (ud->head + ud->count) % ud->cap;
+  DWORD nMax = luaL_optinteger(L, 3, room);
+  DWORD nRead;
+  if (nMax > room) nMax = room;
+  if (nMax > ud->cap - tail) nMax = ud->cap - tail;  // contiguous part only
+  if (nMax == 0)
+    return lua_pushinteger(L, 0), 1;
+  FlushWriters(L);
+  if (!ReadConsoleInput(h, ud->recs + tail, nMax, &nRead))
+    return lua_pushnil(L), 1;
+  ud->count += nRead;
+  lua_pushinteger(L, nRead);
+  return 1;
 }
 
-static int f_FreeConsole (lua_State *L)
+// ring:pop(): EventType and fields of the oldest event, removing it;
+// nothing if the ring is empty
+static int inputring_pop (lua_State *L)
 {
-  return lua_pushboolean(L, FreeConsole()), 1;
+  inputring_ud *ud = check_inputring(L, 1);
+  INPUT_RECORD *ir;
+  if (ud->count == 0)
+    return 0;
+  ir = ud->recs + ud->head;
+  ud->head = (ud->head + 1) % ud->cap;
+  ud->count--;
+  return PushInputRecord(L, ir);
 }
 
-static int f_CreateConsoleScreenBuffer (lua_State *L)
+// ring:get(i): like pop() for the i-th pending event (1-based), without removing it
+static int inputring_get (lua_State *L)
 {
-  DWORD dwDesiredAccess = CheckFlags(L, 1); // access flag
-  DWORD dwShareMode = CheckFlags(L, 2);     // buffer share mode
-  DWORD dwFlags = CheckFlags(L, 3);         // type of buffer to create
-
-  HANDLE h = CreateConsoleScreenBuffer(dwDesiredAccess, dwShareMode, 0, dwFlags, 0);
-  if (h == INVALID_HANDLE_VALUE)
-    lua_pushnil(L);
-  else {
-    cons_ud *ud = (cons_ud*)lua_newuserdata(L, sizeof(cons_ud));
-    ud->hnd = h;
-    ud->type = SCREEN_BUFFER;
-    luaL_getmetatable (L, ConsoleHandleType);
-    lua_setmetatable (L, -2);
-  }
-  return 1;
+  inputring_ud *ud = check_inputring(L, 1);
+  DWORD i = luaL_checkinteger(L, 2);
+  if (i < 1 || i > ud->count)
+    return lua_pushnil(L), 1;
+  return PushInputRecord(L, ud->recs + (ud->head + i - 1) % ud->cap);
 }
 
-static int f_GetConsoleCP (lua_State *L)
+// for type, ... in ring:events() do ... end -- consumes the pending events
+static int inputring_events (lua_State *L)
 {
-  return lua_pushinteger(L, GetConsoleCP()), 1;
+  check_inputring(L, 1);
+  lua_getmetatable(L, 1);
+  lua_getfield(L, -1, "pop");
+  lua_pushvalue(L, 1);
+  return 2;
 }
 
-static int f_GetConsoleOutputCP (lua_State *L)
+static int inputring_count (lua_State *L)
 {
-  return lua_pushinteger(L, GetConsoleOutputCP()), 1;
+  lua_pushinteger(L, check_inputring(L, 1)->count);
+  return 1;
 }
 
-static int f_SetConsoleCP (lua_State *L)
+static int inputring_clear (lua_State *L)
 {
-  UINT wCodePageID = luaL_checkinteger(L, 1);
-  return lua_pushboolean(L, SetConsoleCP(wCodePageID)), 1;
+  inputring_ud *ud = check_inputring(L, 1);
+  ud->head = ud->count = 0;
+  return 0;
 }
 
-static int f_SetConsoleOutputCP (lua_State *L)
+//---------------------------------------------------------------------------
+// Coalescer: folds key-repeat, mouse-move and resize floods in an InputRing
+//---------------------------------------------------------------------------
+typedef struct {
+  coalesce_policy pol;
+  coalesce_stats stats;
+} coalescer_ud;
+
+static coalescer_ud* check_coalescer (lua_State *L, int index)
 {
-  UINT wCodePageID = luaL_checkinteger(L, 1);
-  return lua_pushboolean(L, SetConsoleOutputCP(wCodePageID)), 1;
+  return (coalescer_ud*)luaL_checkudata(L, index, CoalescerType);
 }
 
-static int f_GetConsoleTitle (lua_State *L)
+static void reverse_records (INPUT_RECORD *p, DWORD n)
 {
-  int size = luaL_optinteger(L, 1, 512);
-  if (size < 512) size = 512;
-  char *ptr = (char*)lua_newuserdata(L, size);
-  if (GetConsoleTitle(ptr, size))
-    return lua_pushstring(L, ptr), 1;
-  return lua_pushnil(L), 1;
+  DWORD i;
+  for (i=0; i < n/2; i++) {
+    INPUT_RECORD t = p[i];
+    p[i] = p[n-1-i];
+    p[n-1-i] = t;
+  }
 }
 
-static int f_SetConsoleTitle (lua_State *L)
+// rotate the ring in place so that its pending records start at index 0
+static void inputring_linearize (inputring_ud *ud)
 {
-  return lua_pushboolean(L, SetConsoleTitle(luaL_checkstring(L, 1))), 1;
+  if (ud->head + ud->count > ud->cap) {
+    reverse_records(ud->recs, ud->head);
+    reverse_records(ud->recs + ud->head, ud->cap - ud->head);
+    reverse_records(ud->recs, ud->cap);
+    ud->head = 0;
+  }
 }
 
-static int f_GetLargestConsoleWindowSize (lua_State *L)
+// cons.Coalescer([policy]): policy fields (all on by default) are keys,
+// mouse_moves, resizes (booleans) and max_repeat
+static int f_Coalescer (lua_State *L)
 {
-  HANDLE h = check_console_handle(L, 1);
-  COORD coord = GetLargestConsoleWindowSize(h);
-  lua_pushinteger(L, coord.X);
-  lua_pushinteger(L, coord.Y);
-  return 2;
+  coalescer_ud *ud;
+  coalesce_policy pol;
+  coalesce_init_policy(&pol);
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushvalue(L, 1);
+    pol.keys = GetOptBoolFromTable(L, "keys", pol.keys);
+    pol.mouse_moves = GetOptBoolFromTable(L, "mouse_moves", pol.mouse_moves);
+    pol.resizes = GetOptBoolFromTable(L, "resizes", pol.resizes);
+    pol.max_repeat = GetOptIntFromTable(L, "max_repeat", pol.max_repeat);
+    lua_pop(L, 1);
+    luaL_argcheck(L, pol.max_repeat > 0, 1, "invalid max_repeat");
+  }
+  ud = (coalescer_ud*)lua_newuserdata(L, sizeof(coalescer_ud));
+  memset(ud, 0, sizeof(coalescer_ud));
+  ud->pol = pol;
+  luaL_getmetatable(L, CoalescerType);
+  lua_setmetatable(L, -2);
+  return 1;
 }
 
-static int f_SetConsoleScreenBufferSize (lua_State *L)
+// co:apply(ring): coalesce the pending events of an InputRing; returns the
+// number of events removed
+static int coalescer_apply (lua_State *L)
 {
-  COORD coord;
-  HANDLE h = check_console_handle(L, 1);
-  coord.X = luaL_checkinteger(L, 2);
-  coord.Y = luaL_checkinteger(L, 3);
-  return lua_pushboolean(L, SetConsoleScreenBufferSize(h, coord)), 1;
+  coalescer_ud *ud = check_coalescer(L, 1);
+  inputring_ud *ring = check_inputring(L, 2);
+  DWORD n = ring->count;
+  inputring_linearize(ring);
+  ring->count = coalesce_records(ring->recs + ring->head, ring->count, &ud->pol, &ud->stats);
+  lua_pushinteger(L, n - ring->count);
+  return 1;
 }
 
-static int f_SetConsoleTextAttribute (lua_State *L)
+static int coalescer_stats (lua_State *L)
 {
-  HANDLE h = check_console_handle(L, 1);
-  WORD wAttributes = CheckFlags(L, 2);
-  return lua_pushboolean(L, SetConsoleTextAttribute(h, wAttributes)), 1;
+  coalescer_ud *ud = check_coalescer(L, 1);
+  lua_createtable(L, 0, 6);
+  PutNumToTable(L, "calls", ud->stats.calls);
+  PutNumToTable(L, "records", ud->stats.records);
+  PutNumToTable(L, "keys", ud->stats.keys);
+  PutNumToTable(L, "mouse_moves", ud->stats.mouse_moves);
+  PutNumToTable(L, "resizes", ud->stats.resizes);
+  PutNumToTable(L, "collapsed", ud->stats.keys + ud->stats.mouse_moves + ud->stats.resizes);
+  return 1;
 }
 
-static int f_SetConsoleActiveScreenBuffer (lua_State *L)
+static int coalescer_reset (lua_State *L)
 {
-  HANDLE h = check_console_handle(L, 1);
-  return lua_pushboolean(L, SetConsoleActiveScreenBuffer(h)), 1;
+  coalescer_ud *ud = check_coalescer(L, 1);
+  memset(&ud->stats, 0, sizeof(ud->stats));
+  return 0;
 }
 
-static int f_GetNumberOfConsoleInputEvents (lua_State *L)
+static int coalescer_tostring (lua_State *L)
 {
-  DWORD n;
-  HANDLE h = check_console_handle(L, 1);
+  coalescer_ud *ud = check_coalescer(L, 1);
+  lua_pushfstring(L, "%s (%s%s%s)", CoalescerType, ud->pol.keys ? "k" : "-",
+    ud->pol.mouse_moves ? "m" : "-", ud->pol.resizes ? "r" : "-");
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// InputPump: a thread blocks on the input handle and queues the records, so
+// that Lua can poll without blocking and wait without spinning
+//---------------------------------------------------------------------------
+typedef struct {
+  input_pump *pump;  // NULL once closed
+  HANDLE h;          // read on the pump thread
+} inputpump_ud;
+
+static int console_input_wait (void *ctx, int timeout_ms)
+{
+  switch (WaitForSingleObject(*(HANDLE*)ctx, timeout_ms)) {
+    case WAIT_OBJECT_0: return 1;
+    case WAIT_TIMEOUT:  return 0;
+  }
+  return -1;
+}
+
+static int console_input_read (void *ctx, void *buf, int max)
+{
+  HANDLE h = *(HANDLE*)ctx;
+  DWORD n;
+  // the handle may be signaled with nothing to read; don't block then
+  if (!GetNumberOfConsoleInputEvents(h, &n))
+    return -1;
+  if (n == 0)
+    return 0;
+  if (n > (DWORD)max) n = max;
+  if (!ReadConsoleInput(h, (INPUT_RECORD*)buf, n, &n))
+    return -1;
+  return n;
+}
+
+static inputpump_ud* check_inputpump (lua_State *L, int index)
+{
+  inputpump_ud *ud = (inputpump_ud*)luaL_checkudata(L, index, InputPumpType);
+  luaL_argcheck(L, ud->pump != NULL, index, "input pump is closed");
+  return ud;
+}
+
+static int f_InputPump (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  int cap = luaL_optinteger(L, 2, PUMP_DEFAULT_CAPACITY);
+  inputpump_ud *ud;
+  pump_source src;
+  luaL_argcheck(L, cap > 0, 2, "invalid capacity");
+  ud = (inputpump_ud*)lua_newuserdata(L, sizeof(inputpump_ud));
+  ud->pump = NULL;
+  ud->h = h;
+  luaL_getmetatable(L, InputPumpType);
+  lua_setmetatable(L, -2);
+  // keep the console handle object alive while the thread uses its handle
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  src.wait = console_input_wait;
+  src.read = console_input_read;
+  src.ctx = &ud->h;
+  ud->pump = pump_start(&src, cap, sizeof(INPUT_RECORD));
+  if (!ud->pump)
+    return lua_pushnil(L), 1;
+  return 1;
+}
+
+static int inputpump_close (lua_State *L)
+{
+  inputpump_ud *ud = (inputpump_ud*)luaL_checkudata(L, 1, InputPumpType);
+  if (ud->pump) {
+    pump_stop(ud->pump);
+    ud->pump = NULL;
+  }
+  return 0;
+}
+
+static int inputpump_tostring (lua_State *L)
+{
+  inputpump_ud *ud = (inputpump_ud*)luaL_checkudata(L, 1, InputPumpType);
+  if (ud->pump)
+    lua_pushfstring(L, "%s (%p)", InputPumpType, ud->pump);
+  else
+    lua_pushfstring(L, "%s (closed)", InputPumpType);
+  return 1;
+}
+
+// pump:poll(): EventType and fields of the next event, or nothing if none
+// is queued; pump:poll(ring): move as many queued events as fit into an
+// InputRing and return their number. Never blocks.
+static int inputpump_poll (lua_State *L)
+{
+  inputpump_ud *ud = check_inputpump(L, 1);
+  FlushWriters(L);
+  if (lua_isnoneornil(L, 2)) {
+    INPUT_RECORD ir;
+    if (!pump_poll(ud->pump, &ir, 1))
+      return 0;
+    return PushInputRecord(L, &ir);
+  }
+  else {
+    inputring_ud *ring = check_inputring(L, 2);
+    int total = 0, n;
+    do {
+      DWORD tail = (ring->head + ring->count) % ring->cap;
+      DWORD room = ring->cap - ring->count;
+      if (room > ring->cap - tail) room = ring->cap - tail;  // contiguous part
+      n = pump_poll(ud->pump, ring->recs + tail, room);
+      ring->count += n;
+      total += n;
+    } while (n > 0 && ring->count < ring->cap);
+    lua_pushinteger(L, total);
+    return 1;
+  }
+}
+
+// pump:wait([timeout_ms]): wait for events (forever if no timeout is given);
+// true if some are queued
+static int inputpump_wait (lua_State *L)
+{
+  inputpump_ud *ud = check_inputpump(L, 1);
+  int timeout = luaL_optinteger(L, 2, -1);
+  FlushWriters(L);
+  lua_pushboolean(L, pump_wait(ud->pump, timeout));
+  return 1;
+}
+
+static int inputpump_stats (lua_State *L)
+{
+  inputpump_ud *ud = check_inputpump(L, 1);
+  pump_stats st;
+  pump_get_stats(ud->pump, &st);
+  lua_createtable(L, 0, 6);
+  PutNumToTable(L, "received", st.received);
+  PutNumToTable(L, "dropped", st.dropped);
+  PutNumToTable(L, "overflows", st.overflows);
+  PutNumToTable(L, "errors", st.errors);
+  PutNumToTable(L, "pending", st.pending);
+  PutBoolToTable(L, "running", pump_alive(ud->pump));
+  return 1;
+}
+
+static int f_WriteConsoleInput (lua_State *L)
+{
+  HANDLE h;                      // handle to a console input buffer
+  INPUT_RECORD *lpBuffer;        // pointer to the buffer for write data
+  DWORD nLength;                 // number of records to write
+  DWORD NumberOfEventsWritten;   // number of records written
+  DWORD i;
+  BOOL bResult;
+
+  h = check_console_handle(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  nLength = lua_objlen(L, 2);
+  luaL_argcheck(L, nLength, 2, "empty array");
+  CheckInputRecords(L, 2, nLength);
+
+  lpBuffer = (INPUT_RECORD*)GetScratch(L, nLength * sizeof(INPUT_RECORD));
+  for (i=0; i < nLength; i++)
+  {
+    lua_pushinteger(L, i+1);
+    lua_gettable(L, 2);
+    FillInputRecord(L, -1, lpBuffer + i);
+    lua_pop(L, 1);
+  }
+  bResult = WriteConsoleInput(h, lpBuffer, nLength, &NumberOfEventsWritten);
+  ReleaseScratch(L, lpBuffer);
+  if (!bResult)
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumberOfEventsWritten);
+  lua_pushinteger(L, NumberOfEventsWritten);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// CellBuffer: a contiguous block of CHAR_INFO cells owned by a userdata
+//---------------------------------------------------------------------------
+typedef struct {
+  cellbuf cb;
+  int x0, y0;        // default screen position (where a snapshot was read from)
+  cell_t data[1];
+} cellbuf_ud;
+
+static const cell_t DefaultCell = { ' ', FOREGROUND_RED|FOREGROUND_GREEN|FOREGROUND_BLUE };
+
+static cellbuf* check_cellbuf (lua_State *L, int index)
+{
+  return &((cellbuf_ud*)luaL_checkudata(L, index, CellBufferType))->cb;
+}
+
+static cellbuf* push_cellbuf (lua_State *L, int width, int height)
+{
+  size_t n = (size_t)width * height;
+  cellbuf_ud *ud = (cellbuf_ud*)lua_newuserdata(L, offsetof(cellbuf_ud, data) + n*sizeof(cell_t));
+  cellbuf_init(&ud->cb, width, height, ud->data);
+  ud->x0 = ud->y0 = 0;
+  luaL_getmetatable(L, CellBufferType);
+  lua_setmetatable(L, -2);
+  return &ud->cb;
+}
+
+// character argument: a string (its first byte is taken) or a code;
+// nil yields 'dflt'
+static int opt_cell_char (lua_State *L, int pos, int dflt)
+{
+  int type = lua_type(L, pos);
+  if (type == LUA_TNUMBER)
+    return (unsigned short)lua_tointeger(L, pos);
+  else if (type == LUA_TNONE || type == LUA_TNIL)
+    return dflt;
+  return *(const unsigned char*)luaL_checkstring(L, pos);
+}
+
+// attribute argument: anything CheckFlags accepts; nil yields 'dflt'
+static int opt_cell_attr (lua_State *L, int pos, int dflt)
+{
+  return lua_isnoneornil(L, pos) ? dflt : (WORD)CheckFlags(L, pos);
+}
+
+static int f_CellBuffer (lua_State *L)
+{
+  int width = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+  cell_t c;
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 1, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 2, "invalid height");
+  c.Char = opt_cell_char(L, 3, DefaultCell.Char);
+  c.Attributes = opt_cell_attr(L, 4, DefaultCell.Attributes);
+  cellbuf_clear(push_cellbuf(L, width, height), c);
+  return 1;
+}
+
+static int cellbuffer_tostring (lua_State *L)
+{
+  cellbuf *cb = check_cellbuf(L, 1);
+  lua_pushfstring(L, "%s (%dx%d)", CellBufferType, cb->width, cb->height);
+  return 1;
+}
+
+static int cellbuffer_size (lua_State *L)
+{
+  cellbuf *cb = check_cellbuf(L, 1);
+  lua_pushinteger(L, cb->width);
+  lua_pushinteger(L, cb->height);
+  return 2;
+}
+
+static int cellbuffer_get (lua_State *L)
+{
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  char ch;
+  cell_t *p;
+  if (x < 0 || x >= cb->width || y < 0 || y >= cb->height)
+    return lua_pushnil(L), 1;
+  p = CELLBUF_AT(cb, x, y);
+  ch = (char)p->Char;
+  lua_pushlstring(L, &ch, 1);
+  lua_pushinteger(L, p->Attributes);
+  return 2;
+}
+
+static int cellbuffer_set (lua_State *L)
+{
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int ch = opt_cell_char(L, 4, -1);
+  int attr = opt_cell_attr(L, 5, -1);
+  if (x >= 0 && x < cb->width && y >= 0 && y < cb->height) {
+    cell_t *p = CELLBUF_AT(cb, x, y);
+    if (ch >= 0)   p->Char = ch;
+    if (attr >= 0) p->Attributes = attr;
+  }
+  return 0;
+}
+
+static int cellbuffer_fill_rect (lua_State *L)
+{
+  cell_rect r;
+  cellbuf *cb = check_cellbuf(L, 1);
+  r.Left   = luaL_checkinteger(L, 2);
+  r.Top    = luaL_checkinteger(L, 3);
+  r.Right  = luaL_checkinteger(L, 4);
+  r.Bottom = luaL_checkinteger(L, 5);
+  cellbuf_fill_rect(cb, r, opt_cell_char(L, 6, -1), opt_cell_attr(L, 7, -1));
+  return 0;
+}
+
+static int cellbuffer_put_string (lua_State *L)
+{
+  size_t len;
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  const char *s = luaL_checklstring(L, 4, &len);
+  int attr = opt_cell_attr(L, 5, -1);
+  lua_pushinteger(L, cellbuf_put_string(cb, x, y, s, len, attr));
+  return 1;
+}
+
+// buf:origin([x, y]): get or set the default screen position of the buffer
+static int cellbuffer_origin (lua_State *L)
+{
+  cellbuf_ud *ud = (cellbuf_ud*)luaL_checkudata(L, 1, CellBufferType);
+  if (lua_gettop(L) > 1) {
+    ud->x0 = luaL_checkinteger(L, 2);
+    ud->y0 = luaL_checkinteger(L, 3);
+    return 0;
+  }
+  lua_pushinteger(L, ud->x0);
+  lua_pushinteger(L, ud->y0);
+  return 2;
+}
+
+// check row y and the optional column range [left, right] at stack positions 2..4
+static cell_t* check_row (lua_State *L, cellbuf *cb, int *len)
+{
+  int y = luaL_checkinteger(L, 2);
+  int left = luaL_optinteger(L, 3, 0);
+  int right = luaL_optinteger(L, 4, cb->width - 1);
+  luaL_argcheck(L, y >= 0 && y < cb->height, 2, "row out of range");
+  if (left < 0) left = 0;
+  if (right >= cb->width) right = cb->width - 1;
+  *len = right >= left ? right - left + 1 : 0;
+  return CELLBUF_AT(cb, left, y);
+}
+
+// buf:row(y [, left, right]): the characters of a row as a string
+static int cellbuffer_row (lua_State *L)
+{
+  luaL_Buffer b;
+  int i, len;
+  cell_t *p = check_row(L, check_cellbuf(L, 1), &len);
+  luaL_buffinit(L, &b);
+  for (i=0; i<len; i++)
+    luaL_addchar(&b, (char)p[i].Char);
+  luaL_pushresult(&b);
+  return 1;
+}
+
+// buf:attrs(y [, left, right]): the attributes of a row as a string of WORDs,
+// in the format WriteConsoleOutputAttribute takes
+static int cellbuffer_attrs (lua_State *L)
+{
+  luaL_Buffer b;
+  int i, len;
+  cell_t *p = check_row(L, check_cellbuf(L, 1), &len);
+  luaL_buffinit(L, &b);
+  for (i=0; i<len; i++)
+    luaL_addlstring(&b, (const char*)&p[i].Attributes, sizeof(WORD));
+  luaL_pushresult(&b);
+  return 1;
+}
+
+static int cellbuffer_recolor (lua_State *L)
+{
+  cell_rect r;
+  int y;
+  cellbuf *cb = check_cellbuf(L, 1);
+  unsigned and_mask, or_mask;
+  r.Left   = luaL_checkinteger(L, 2);
+  r.Top    = luaL_checkinteger(L, 3);
+  r.Right  = luaL_checkinteger(L, 4);
+  r.Bottom = luaL_checkinteger(L, 5);
+  and_mask = CELL32(0xFFFF, CheckFlags(L, 6));
+  or_mask = CELL32(0, CheckFlags(L, 7));
+  if (cellbuf_clip(cb, &r)) {
+    for (y=r.Top; y<=r.Bottom; y++)
+      cellops_and_or(CELLBUF_AT(cb, r.Left, y), r.Right - r.Left + 1, and_mask, or_mask);
+  }
+  return 0;
+}
+
+// the transparent KeyChar and/or KeyAttr of the table on top of the stack,
+// as a key and a mask for cellbuf_blit (mask 0: none)
+static unsigned GetKeyFromTable (lua_State *L, unsigned *mask)
+{
+  unsigned key = 0;
+  *mask = 0;
+  lua_getfield(L, -1, "KeyChar");
+  if (!lua_isnil(L, -1)) {
+    key |= CELL32(opt_cell_char(L, -1, 0), 0);
+    *mask |= CELL32_CHAR;
+  }
+  lua_getfield(L, -2, "KeyAttr");
+  if (!lua_isnil(L, -1)) {
+    key |= CELL32(0, CheckFlags(L, -1));
+    *mask |= CELL32_ATTR;
+  }
+  lua_pop(L, 2);
+  return key;
+}
+
+// dst:blit(src, x, y [, params]): params may give the source rectangle
+// (Left, Top, Right, Bottom) and a transparent KeyChar and/or KeyAttr
+static int cellbuffer_blit (lua_State *L)
+{
+  cellbuf *dst = check_cellbuf(L, 1);
+  cellbuf *src = check_cellbuf(L, 2);
+  int dx = luaL_checkinteger(L, 3);
+  int dy = luaL_checkinteger(L, 4);
+  unsigned key = 0, mask = 0;
+  cell_rect r;
+  r.Left = r.Top = 0;
+  r.Right = src->width - 1;
+  r.Bottom = src->height - 1;
+  if (lua_istable(L, 5)) {
+    lua_settop(L, 5);
+    r.Left   = GetOptIntFromTable(L, "Left", r.Left);
+    r.Top    = GetOptIntFromTable(L, "Top", r.Top);
+    r.Right  = GetOptIntFromTable(L, "Right", r.Right);
+    r.Bottom = GetOptIntFromTable(L, "Bottom", r.Bottom);
+    key = GetKeyFromTable(L, &mask);
+  }
+  if (dst == src && mask)
+    return luaL_argerror(L, 2, "transparent blit within one buffer");
+  cellbuf_blit(dst, dx, dy, src, r, key, mask);
+  return 0;
+}
+
+// a:compare_row(b, y): first and last differing column of row y, or nil
+static int cellbuffer_compare_row (lua_State *L)
+{
+  cellbuf *a = check_cellbuf(L, 1);
+  cellbuf *b = check_cellbuf(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  size_t first, last;
+  luaL_argcheck(L, a->width == b->width, 2, "buffer widths differ");
+  luaL_argcheck(L, y >= 0 && y < a->height && y < b->height, 3, "row out of range");
+  if (!cellops_compare(CELLBUF_AT(a, 0, y), CELLBUF_AT(b, 0, y), a->width, &first, &last))
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, first);
+  lua_pushinteger(L, last);
+  return 2;
+}
+
+// The console moves WriteConsoleOutput/ReadConsoleOutput data through a heap
+// of about 64K, so larger blocks are transferred in bands of rows.
+#define MAX_CELLS_PER_CALL 8000
+
+// op: 'W'/'R' to write/read with the ANSI API, 'w'/'r' with the wide one;
+// writes are reported to the recorders of state L
+static BOOL CallTransfer (lua_State *L, int op, HANDLE h, const cellbuf *cb, COORD dwBufferCoord,
+                          SMALL_RECT *region)
+{
+  COORD dwBufferSize;
+  BOOL ok;
+  dwBufferSize.X = cb->width;
+  dwBufferSize.Y = cb->height;
+  switch (op) {
+    case 'W': ok = WriteConsoleOutput(h, (const CHAR_INFO*)cb->cells, dwBufferSize, dwBufferCoord, region); break;
+    case 'w': ok = WriteConsoleOutputW(h, (const CHAR_INFO*)cb->cells, dwBufferSize, dwBufferCoord, region); break;
+    case 'R': ok = ReadConsoleOutput(h, (CHAR_INFO*)cb->cells, dwBufferSize, dwBufferCoord, region); break;
+    default:  ok = ReadConsoleOutputW(h, (CHAR_INFO*)cb->cells, dwBufferSize, dwBufferCoord, region); break;
+  }
+  if (ok && region->Right >= region->Left && region->Bottom >= region->Top) {
+    STATS_MOVED(L, (region->Right - region->Left + 1) * (region->Bottom - region->Top + 1));
+    if (op == 'W' || op == 'w')
+      RECORD_OUTPUT(L, h, region->Top, region->Bottom);
+  }
+  return ok;
+}
+
+static BOOL TransferCells (lua_State *L, int op, HANDLE h, const cellbuf *cb, COORD dwBufferCoord,
+                           SMALL_RECT *region)
+{
+  SMALL_RECT total, band;
+  int width = region->Right - region->Left + 1;
+  int rows = region->Bottom - region->Top + 1;
+  int step = width > 0 ? MAX_CELLS_PER_CALL / width : rows;
+  int y;
+
+  if (step < 1)
+    step = 1;
+  if (rows <= step)
+    return CallTransfer(L, op, h, cb, dwBufferCoord, region);
+
+  for (y=0; y<rows; y+=step) {
+    COORD coord = dwBufferCoord;
+    coord.Y += y;
+    band = *region;
+    band.Top += y;
+    if (band.Bottom > band.Top + step - 1)
+      band.Bottom = band.Top + step - 1;
+    if (!CallTransfer(L, op, h, cb, coord, &band))
+      return FALSE;
+    if (y == 0)
+      total = band;
+  }
+  total.Bottom = band.Bottom;
+  *region = total;
+  return TRUE;
+}
+
+static BOOL WriteCells (lua_State *L, HANDLE h, const cellbuf *cb, COORD dwBufferCoord,
+                        SMALL_RECT *region, bool wide)
+{
+  return TransferCells(L, wide ? 'w' : 'W', h, cb, dwBufferCoord, region);
+}
+
+static BOOL ReadCells (lua_State *L, HANDLE h, cellbuf *cb, COORD dwBufferCoord,
+                       SMALL_RECT *region, bool wide)
+{
+  return TransferCells(L, wide ? 'r' : 'R', h, cb, dwBufferCoord, region);
+}
+
+// h:WriteConsoleOutput(buf [, params]): the cells go to the console as they are;
+// without params the whole buffer goes to its origin
+static int WriteCellBuffer (lua_State *L, HANDLE h, cellbuf_ud *ud, bool wide)
+{
+  cellbuf *cb = &ud->cb;
+  COORD dwBufferCoord;
+  SMALL_RECT WriteRegion;
+
+  if (lua_istable(L, 3)) {
+    lua_settop(L, 3);
+    dwBufferCoord.X    = GetOptIntFromTable(L, "dwBufferCoordX", 0);
+    dwBufferCoord.Y    = GetOptIntFromTable(L, "dwBufferCoordY", 0);
+    WriteRegion.Left   = GetOptIntFromTable(L, "WriteRegionLeft", ud->x0);
+    WriteRegion.Top    = GetOptIntFromTable(L, "WriteRegionTop", ud->y0);
+    WriteRegion.Right  = GetOptIntFromTable(L, "WriteRegionRight",
+                           WriteRegion.Left + cb->width - dwBufferCoord.X - 1);
+    WriteRegion.Bottom = GetOptIntFromTable(L, "WriteRegionBottom",
+                           WriteRegion.Top + cb->height - dwBufferCoord.Y - 1);
+  }
+  else {
+    luaL_argcheck(L, lua_isnoneornil(L, 3), 3, "table or nil expected");
+    dwBufferCoord.X = dwBufferCoord.Y = 0;
+    WriteRegion.Left = ud->x0;
+    WriteRegion.Top = ud->y0;
+    WriteRegion.Right = ud->x0 + cb->width - 1;
+    WriteRegion.Bottom = ud->y0 + cb->height - 1;
+  }
+  luaL_argcheck(L, dwBufferCoord.X >= 0 && dwBufferCoord.X < cb->width &&
+    dwBufferCoord.Y >= 0 && dwBufferCoord.Y < cb->height, 3, "buffer coordinates out of range");
+
+  if (!WriteCells(L, h, cb, dwBufferCoord, &WriteRegion, wide))
+    return lua_pushnil(L), 1;
+
+  lua_createtable(L, 0, 4);
+  PutNumToTable(L, "WriteRegionTop",    WriteRegion.Top);
+  PutNumToTable(L, "WriteRegionLeft",   WriteRegion.Left);
+  PutNumToTable(L, "WriteRegionBottom", WriteRegion.Bottom);
+  PutNumToTable(L, "WriteRegionRight",  WriteRegion.Right);
+  return 1;
+}
+
+// with 'wide' set the characters are UTF-8 and go through WriteConsoleOutputW
+static int WriteConsoleOutputImpl (lua_State *L, bool wide)
+{
+  CHAR_INFO *lpBuffer;    // pointer to buffer with data to write
+  COORD dwBufferSize;     // column-row size of source buffer
+  COORD dwBufferCoord;    // upper-left cell to write from
+  SMALL_RECT WriteRegion; // pointer to rectangle to write to
+  int src_size, i;
+  BOOL ok;
+
+  HANDLE h = check_console_handle(L, 1);
+  cellbuf_ud *ud = (cellbuf_ud*)test_udata(L, 2, CellBufferType);
+  if (ud)
+    return WriteCellBuffer(L, h, ud, wide);
+
+  luaL_checktype(L, 2, LUA_TTABLE); // character array
+  src_size = lua_objlen(L, 2);
+  luaL_argcheck(L, src_size, 2, "empty array");
+
+  luaL_checktype(L, 3, LUA_TTABLE); // attribute array
+  luaL_argcheck(L, (int)lua_objlen(L, 3) == src_size, 3,
+    "different sizes of character and attribute arrays");
+
+  luaL_checktype(L, 4, LUA_TTABLE); // parameters
+  lua_settop(L, 4);
+  dwBufferSize.X     = GetOptIntFromTable(L, "dwBufferSizeX", 0);
+  dwBufferSize.Y     = GetOptIntFromTable(L, "dwBufferSizeY", 0);
+  luaL_argcheck(L, src_size >= dwBufferSize.X * dwBufferSize.Y, 4,
+    "SizeX*SizeY is greater than character array size");
+  dwBufferCoord.X    = GetOptIntFromTable(L, "dwBufferCoordX", 0);
+  dwBufferCoord.Y    = GetOptIntFromTable(L, "dwBufferCoordY", 0);
+  WriteRegion.Top    = GetOptIntFromTable(L, "WriteRegionTop", 0);
+  WriteRegion.Left   = GetOptIntFromTable(L, "WriteRegionLeft", 0);
+  WriteRegion.Bottom = GetOptIntFromTable(L, "WriteRegionBottom", 0);
+  WriteRegion.Right  = GetOptIntFromTable(L, "WriteRegionRight", 0);
+
+  lpBuffer = (CHAR_INFO*) GetScratch(L, src_size * sizeof(CHAR_INFO));
+  for (i=0; i<src_size; i++,lua_pop(L,2))
+  {
+    const char* s;
+    lua_pushinteger(L, i+1);
+    lua_gettable(L, 2);
+    s = lua_tostring(L, -1);
+    if (!s) {
+      ReleaseScratch(L, lpBuffer);
+      luaL_argerror(L, 2, "non-string in the array");
+    }
+    if (wide) {
+      unsigned cp;
+      utf8_decode(s, lua_objlen(L, -1), &cp);
+      lpBuffer[i].Char.UnicodeChar = cp < 0x10000 ? cp : UTF8_REPLACEMENT;
+    }
+    else
+      lpBuffer[i].Char.AsciiChar = *(const char*)s;
+
+    lua_pushinteger(L, i+1);
+    lua_gettable(L, 3);
+    if (!lua_isnumber(L, -1)) {
+      ReleaseScratch(L, lpBuffer);
+      luaL_argerror(L, 3, "non-number in the array");
+    }
+    lpBuffer[i].Attributes = lua_tointeger(L, -1);
+  }
+
+  ok = wide ? WriteConsoleOutputW(h, lpBuffer, dwBufferSize, dwBufferCoord, &WriteRegion)
+            : WriteConsoleOutput(h, lpBuffer, dwBufferSize, dwBufferCoord, &WriteRegion);
+  ReleaseScratch(L, lpBuffer);
+  if (!ok)
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, (WriteRegion.Right - WriteRegion.Left + 1) * (WriteRegion.Bottom - WriteRegion.Top + 1));
+  RECORD_OUTPUT(L, h, WriteRegion.Top, WriteRegion.Bottom);
+
+  lua_createtable(L, 0, 4);
+  PutNumToTable(L, "WriteRegionTop",    WriteRegion.Top);
+  PutNumToTable(L, "WriteRegionLeft",   WriteRegion.Left);
+  PutNumToTable(L, "WriteRegionBottom", WriteRegion.Bottom);
+  PutNumToTable(L, "WriteRegionRight",  WriteRegion.Right);
+  return 1;
+}
+
+static int f_WriteConsoleOutput (lua_State *L)
+{
+  return WriteConsoleOutputImpl(L, false);
+}
+
+static int f_WriteConsoleOutputW (lua_State *L)
+{
+  return WriteConsoleOutputImpl(L, true);
+}
+
+//---------------------------------------------------------------------------
+// Renderer: front/back cell arrays; present() sends only what has changed
+//---------------------------------------------------------------------------
+typedef struct {
+  render_params prm;
+  render_stats stats;
+  bool full;         // the next present() sends the whole buffer
+  bool wide;         // output through WriteConsoleOutputW
+  bool vt;           // output as one VT stream through WriteConsoleW
+  vt_encoder enc;
+  cellbuf front;     // what the console is believed to show
+  cell_t data[1];
+} renderer_ud;
+
+// defined with the UTF-8 functions below
+static long WriteUtf8 (lua_State *L, HANDLE h, const char *s, size_t len);
+
+typedef struct {
+  lua_State *L;      // whose recorders see the output
+  HANDLE h;
+  int x, y;          // screen position of the buffer's upper-left corner
+  int width;
+  bool wide;
+} console_target;
+
+static int console_write_rect (void *ctx, const cellbuf *src, const cell_rect *r)
+{
+  console_target *t = (console_target*)ctx;
+  COORD dwBufferCoord;
+  SMALL_RECT WriteRegion;
+  dwBufferCoord.X = r->Left;
+  dwBufferCoord.Y = r->Top;
+  WriteRegion.Left   = r->Left + t->x;
+  WriteRegion.Top    = r->Top + t->y;
+  WriteRegion.Right  = r->Right + t->x;
+  WriteRegion.Bottom = r->Bottom + t->y;
+  return WriteCells(t->L, t->h, src, dwBufferCoord, &WriteRegion, t->wide) != 0;
+}
+
+static int console_scroll_rows (void *ctx, int top, int bottom, int shift, cell_t fill)
+{
+  console_target *t = (console_target*)ctx;
+  SMALL_RECT ScrollRectangle;
+  COORD dwDestinationOrigin;
+  ScrollRectangle.Left   = t->x;
+  ScrollRectangle.Right  = t->x + t->width - 1;
+  ScrollRectangle.Top    = t->y + top;
+  ScrollRectangle.Bottom = t->y + bottom;
+  dwDestinationOrigin.X = t->x;
+  dwDestinationOrigin.Y = t->y + top - shift;
+  if (!ScrollConsoleScreenBuffer(t->h, &ScrollRectangle, &ScrollRectangle,
+                                 dwDestinationOrigin, (const CHAR_INFO*)&fill))
+    return 0;
+  RECORD_OUTPUT(t->L, t->h, ScrollRectangle.Top, ScrollRectangle.Bottom);
+  return 1;
+}
+
+static renderer_ud* check_renderer (lua_State *L, int index)
+{
+  return (renderer_ud*)luaL_checkudata(L, index, RendererType);
+}
+
+// push the back buffer (kept in the renderer's uservalue table)
+static cellbuf* push_renderer_back (lua_State *L, int index)
+{
+  lua_getuservalue(L, index);
+  lua_rawgeti(L, -1, 1);
+  lua_remove(L, -2);
+  return (cellbuf*)lua_touserdata(L, -1);
+}
+
+static int f_Renderer (lua_State *L)
+{
+  int width = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+  size_t n = (size_t)width * height;
+  renderer_ud *ud;
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 1, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 2, "invalid height");
+
+  ud = (renderer_ud*)lua_newuserdata(L, offsetof(renderer_ud, data) + n*sizeof(cell_t));
+  memset(ud, 0, offsetof(renderer_ud, data));
+  render_init_params(&ud->prm);
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+    ud->prm.call_cost = GetOptIntFromTable(L, "call_cost", ud->prm.call_cost);
+    ud->prm.max_rects = GetOptIntFromTable(L, "max_rects", ud->prm.max_rects);
+    ud->prm.scroll    = GetOptBoolFromTable(L, "scroll", false);
+    ud->prm.max_shift = GetOptIntFromTable(L, "max_shift", 0);
+    ud->wide          = GetOptBoolFromTable(L, "wide", false);
+    ud->vt            = GetOptBoolFromTable(L, "vt", false);
+    lua_pop(L, 1);
+  }
+  vt_init(&ud->enc);
+  ud->full = true;
+  cellbuf_init(&ud->front, width, height, ud->data);
+  luaL_getmetatable(L, RendererType);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, 1, 0);
+  cellbuf_clear(push_cellbuf(L, width, height), DefaultCell);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int renderer_gc (lua_State *L)
+{
+  vt_free(&check_renderer(L, 1)->enc);
+  return 0;
+}
+
+static int renderer_tostring (lua_State *L)
+{
+  renderer_ud *ud = check_renderer(L, 1);
+  lua_pushfstring(L, "%s (%dx%d)", RendererType, ud->front.width, ud->front.height);
+  return 1;
+}
+
+static int renderer_buffer (lua_State *L)
+{
+  check_renderer(L, 1);
+  push_renderer_back(L, 1);
+  return 1;
+}
+
+// r:scroll_region(top, bottom): detect scrolling of these rows on present();
+// r:scroll_region(nil) turns the detection off
+static int renderer_scroll_region (lua_State *L)
+{
+  renderer_ud *ud = check_renderer(L, 1);
+  if (lua_isnoneornil(L, 2))
+    ud->prm.scroll = false;
+  else {
+    ud->prm.scroll = true;
+    ud->prm.scroll_top = luaL_checkinteger(L, 2);
+    ud->prm.scroll_bottom = luaL_optinteger(L, 3, ud->front.height - 1);
+  }
+  return 0;
+}
+
+static int renderer_invalidate (lua_State *L)
+{
+  check_renderer(L, 1)->full = true;
+  return 0;
+}
+
+// VT output: the difference goes out as one escape stream; return the
+// number of output calls (0 or 1) or -1 on failure
+static int present_vt (lua_State *L, renderer_ud *ud, const cellbuf *back,
+                       const console_target *t)
+{
+  unsigned long cells = ud->enc.stats.cells;
+  cell_rect all;
+  ud->enc.len = 0;
+  if (ud->full)
+    vt_reset(&ud->enc);
+  if (!vt_encode(&ud->enc, back, ud->full ? NULL : &ud->front, t->x, t->y))
+    return -1;
+  ud->stats.frames++;
+  ud->stats.cells += ud->enc.stats.cells - cells;
+  if (ud->enc.len == 0)
+    return 0;
+  if (WriteUtf8(L, t->h, ud->enc.data, ud->enc.len) < 0) {
+    vt_reset(&ud->enc);
+    return -1;
+  }
+  all.Left = all.Top = 0;
+  all.Right = back->width - 1;
+  all.Bottom = back->height - 1;
+  cellbuf_copy_rect(&ud->front, 0, 0, back, all);
+  ud->stats.rects++;
+  return 1;
+}
+
+// r:present(h [, x, y]): returns the number of rectangles and cells sent
+// (with the vt option: output calls, and cells written)
+static int renderer_present (lua_State *L)
+{
+  renderer_ud *ud = check_renderer(L, 1);
+  unsigned long cells = ud->stats.cells;
+  console_target t;
+  render_sink sink;
+  cellbuf *back;
+  int n;
+  t.L = L;
+  t.h = check_console_handle(L, 2);
+  t.x = luaL_optinteger(L, 3, 0);
+  t.y = luaL_optinteger(L, 4, 0);
+  t.width = ud->front.width;
+  t.wide = ud->wide;
+  sink.write = console_write_rect;
+  sink.scroll = console_scroll_rows;
+  sink.ctx = &t;
+  back = push_renderer_back(L, 1);
+  if (ud->vt)
+    n = present_vt(L, ud, back, &t);
+  else
+    n = render_present(&ud->front, back, &ud->prm, ud->full, &sink, &ud->stats);
+  if (n < 0) {
+    ud->full = true;
+    return lua_pushnil(L), 1;
+  }
+  ud->full = false;
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, ud->stats.cells - cells);
+  return 2;
+}
+
+static int renderer_stats (lua_State *L)
+{
+  renderer_ud *ud = check_renderer(L, 1);
+  lua_createtable(L, 0, 4);
+  PutNumToTable(L, "frames",  ud->stats.frames);
+  PutNumToTable(L, "rects",   ud->stats.rects);
+  PutNumToTable(L, "cells",   ud->stats.cells);
+  PutNumToTable(L, "scrolls", ud->stats.scrolls);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Compositor: CellBuffers stacked as planes (see compose.h); present() sends
+// only the screen cells that their changes touched
+//---------------------------------------------------------------------------
+typedef struct {
+  compositor c;
+  bool wide;         // output through WriteConsoleOutputW
+} compositor_ud;
+
+static compositor_ud* check_compositor (lua_State *L, int pos)
+{
+  return (compositor_ud*)luaL_checkudata(L, pos, CompositorType);
+}
+
+// the id of a plane of the compositor at index 1
+static int check_plane (lua_State *L, compositor_ud *ud, int pos)
+{
+  int id = luaL_checkinteger(L, pos);
+  luaL_argcheck(L, compose_get(&ud->c, id) != NULL, pos, "invalid plane");
+  return id;
+}
+
+// push the table (in the uservalue) of the CellBuffers of the planes by id
+static void push_planes (lua_State *L, int pos)
+{
+  lua_getuservalue(L, pos);
+  lua_rawgeti(L, -1, 2);
+  lua_remove(L, -2);
+}
+
+// cons.Compositor(width, height [, params]): params.char and attr make the
+// background (a blank by default), call_cost is as for a Renderer, and wide
+// makes output go through WriteConsoleOutputW
+static int f_Compositor (lua_State *L)
+{
+  int width = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+  cell_t bg = DefaultCell;
+  compositor_ud *ud;
+  cellbuf *screen;
+  int call_cost = RENDER_DEFAULT_CALL_COST;
+  bool wide = false;
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 1, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 2, "invalid height");
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+    lua_getfield(L, -1, "char");
+    bg.Char = opt_cell_char(L, -1, bg.Char);
+    lua_getfield(L, -2, "attr");
+    bg.Attributes = opt_cell_attr(L, -1, bg.Attributes);
+    lua_pop(L, 2);
+    call_cost = GetOptIntFromTable(L, "call_cost", call_cost);
+    wide      = GetOptBoolFromTable(L, "wide", false);
+    lua_pop(L, 1);
+  }
+  ud = (compositor_ud*)lua_newuserdata(L, sizeof(compositor_ud));
+  memset(ud, 0, sizeof(*ud));
+  ud->wide = wide;
+  lua_createtable(L, 2, 0);
+  screen = push_cellbuf(L, width, height);
+  lua_rawseti(L, -2, 1);
+  lua_newtable(L);
+  lua_rawseti(L, -2, 2);
+  lua_setuservalue(L, -2);
+  if (!compose_init(&ud->c, *screen, bg))
+    return lua_pushnil(L), 1;
+  ud->c.call_cost = call_cost;
+  luaL_getmetatable(L, CompositorType);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int compositor_gc (lua_State *L)
+{
+  compose_free(&check_compositor(L, 1)->c);
+  return 0;
+}
+
+static int compositor_tostring (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  lua_pushfstring(L, "%s (%dx%d, %d planes)", CompositorType, ud->c.screen.width,
+                  ud->c.screen.height, ud->c.nplanes);
+  return 1;
+}
+
+// comp:add(buf, x, y [, z [, params]]): a plane showing the CellBuffer buf
+// with its upper-left corner at (x, y); params may give a transparent
+// KeyChar and/or KeyAttr, and hidden. Returns the id of the plane. What is
+// drawn into buf later shows after comp:damage(id).
+static int compositor_add (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  const cellbuf *cb = check_cellbuf(L, 2);
+  int x = luaL_checkinteger(L, 3);
+  int y = luaL_checkinteger(L, 4);
+  int z = luaL_optinteger(L, 5, 0);
+  unsigned key = 0, mask = 0;
+  bool hidden = false;
+  int id;
+  if (lua_istable(L, 6)) {
+    lua_pushvalue(L, 6);
+    key = GetKeyFromTable(L, &mask);
+    hidden = GetOptBoolFromTable(L, "hidden", false);
+    lua_pop(L, 1);
+  }
+  if ((id = compose_add(&ud->c, cb, x, y, z)) < 0)
+    return lua_pushnil(L), 1;
+  if (mask)
+    compose_set_key(&ud->c, id, key, mask);
+  if (hidden)
+    compose_show(&ud->c, id, 0);
+  push_planes(L, 1);
+  lua_pushvalue(L, 2);
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+static int compositor_remove (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  compose_remove(&ud->c, id);
+  push_planes(L, 1);
+  lua_pushnil(L);
+  lua_rawseti(L, -2, id);
+  return 0;
+}
+
+static int compositor_move (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  compose_move(&ud->c, id, luaL_checkinteger(L, 3), luaL_checkinteger(L, 4));
+  return 0;
+}
+
+static int compositor_set_z (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  compose_set_z(&ud->c, id, luaL_checkinteger(L, 3));
+  return 0;
+}
+
+// comp:show(id [, visible]): visible is true by default
+static int compositor_show (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  compose_show(&ud->c, id, lua_isnone(L, 3) || lua_toboolean(L, 3));
+  return 0;
+}
+
+// comp:set_key(id [, params]): the transparent KeyChar and/or KeyAttr of a
+// plane; none makes it opaque
+static int compositor_set_key (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  unsigned key = 0, mask = 0;
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+    key = GetKeyFromTable(L, &mask);
+    lua_pop(L, 1);
+  }
+  compose_set_key(&ud->c, id, key, mask);
+  return 0;
+}
+
+// comp:plane(id): x, y, z and visibility of a plane, or nil
+static int compositor_plane (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  const compose_plane *p = compose_get(&ud->c, luaL_checkinteger(L, 2));
+  if (!p)
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, p->x);
+  lua_pushinteger(L, p->y);
+  lua_pushinteger(L, p->z);
+  lua_pushboolean(L, p->visible);
+  return 4;
+}
+
+// comp:damage(id [, left, top, right, bottom]): cells of the plane's buffer
+// that were drawn into (all of them by default)
+static int compositor_damage (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  int id = check_plane(L, ud, 2);
+  cell_rect r;
+  if (lua_isnoneornil(L, 3))
+    compose_damage(&ud->c, id, NULL);
+  else {
+    r.Left   = luaL_checkinteger(L, 3);
+    r.Top    = luaL_checkinteger(L, 4);
+    r.Right  = luaL_checkinteger(L, 5);
+    r.Bottom = luaL_checkinteger(L, 6);
+    compose_damage(&ud->c, id, &r);
+  }
+  return 0;
+}
+
+// comp:invalidate([left, top, right, bottom]): screen cells to compose and
+// send again (all of them by default)
+static int compositor_invalidate (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  cell_rect r;
+  if (lua_isnoneornil(L, 2))
+    compose_damage_screen(&ud->c, NULL);
+  else {
+    r.Left   = luaL_checkinteger(L, 2);
+    r.Top    = luaL_checkinteger(L, 3);
+    r.Right  = luaL_checkinteger(L, 4);
+    r.Bottom = luaL_checkinteger(L, 5);
+    compose_damage_screen(&ud->c, &r);
+  }
+  return 0;
+}
+
+// comp:background([char [, attr]])
+static int compositor_background (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  cell_t bg;
+  bg.Char = opt_cell_char(L, 2, DefaultCell.Char);
+  bg.Attributes = opt_cell_attr(L, 3, DefaultCell.Attributes);
+  compose_set_background(&ud->c, bg);
+  return 0;
+}
+
+// comp:buffer(): the CellBuffer holding the composition
+static int compositor_buffer (lua_State *L)
+{
+  check_compositor(L, 1);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+// comp:present([h [, x, y]]): compose what changed and send it to h, with
+// the upper-left corner at (x, y); without h only compose. Returns the
+// number of rectangles and cells sent, or nil if output failed.
+static int compositor_present (lua_State *L)
+{
+  compositor_ud *ud = check_compositor(L, 1);
+  unsigned long sent = ud->c.stats.sent;
+  console_target t;
+  render_sink sink;
+  int n;
+  if (lua_isnoneornil(L, 2))
+    n = compose_update(&ud->c, NULL);
+  else {
+    t.L = L;
+    t.h = check_console_handle(L, 2);
+    t.x = luaL_optinteger(L, 3, 0);
+    t.y = luaL_optinteger(L, 4, 0);
+    t.width = ud->c.screen.width;
+    t.wide = ud->wide;
+    sink.write = console_write_rect;
+    sink.scroll = NULL;
+    sink.ctx = &t;
+    n = compose_update(&ud->c, &sink);
+  }
+  if (n < 0)
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, n);
+  lua_pushinteger(L, ud->c.stats.sent - sent);
+  return 2;
+}
+
+static int compositor_stats (lua_State *L)
+{
+  const compose_stats *st = &check_compositor(L, 1)->c.stats;
+  lua_createtable(L, 0, 7);
+  PutNumToTable(L, "updates", st->updates);
+  PutNumToTable(L, "rows",    st->rows);
+  PutNumToTable(L, "cells",   st->cells);
+  PutNumToTable(L, "layers",  st->layers);
+  PutNumToTable(L, "covered", st->covered);
+  PutNumToTable(L, "rects",   st->rects);
+  PutNumToTable(L, "sent",    st->sent);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// RenderService: an owner thread sends to the console what RenderProducers
+// submit, from this Lua state or from others on other threads (see service.h)
+//---------------------------------------------------------------------------
+typedef struct {
+  render_service *s;  // NULL once closed
+  console_target t;   // for the owner thread
+} renderservice_ud;
+
+typedef struct {
+  service_producer *p;  // NULL once closed
+} renderproducer_ud;
+
+// Output on the owner thread: straight through the console API, in bands as
+// TransferCells does, but neither counted by cons.stats() nor seen by the
+// Recorders, which belong to the Lua side.
+static int service_write_rect (void *ctx, const cellbuf *src, const cell_rect *r)
+{
+  const console_target *t = (const console_target*)ctx;
+  int step = MAX_CELLS_PER_CALL / (r->Right - r->Left + 1), y;
+  COORD dwBufferSize, dwBufferCoord;
+  SMALL_RECT WriteRegion;
+  BOOL ok;
+  if (step < 1)
+    step = 1;
+  dwBufferSize.X = src->width;
+  dwBufferSize.Y = src->height;
+  for (y=r->Top; y<=r->Bottom; y+=step) {
+    dwBufferCoord.X = r->Left;
+    dwBufferCoord.Y = y;
+    WriteRegion.Left   = r->Left + t->x;
+    WriteRegion.Right  = r->Right + t->x;
+    WriteRegion.Top    = y + t->y;
+    WriteRegion.Bottom = (y + step - 1 < r->Bottom ? y + step - 1 : r->Bottom) + t->y;
+    if (t->wide)
+      ok = WriteConsoleOutputW(t->h, (const CHAR_INFO*)src->cells, dwBufferSize, dwBufferCoord, &WriteRegion);
+    else
+      ok = WriteConsoleOutput(t->h, (const CHAR_INFO*)src->cells, dwBufferSize, dwBufferCoord, &WriteRegion);
+    if (!ok)
+      return 0;
+  }
+  return 1;
+}
+
+static renderservice_ud* check_renderservice (lua_State *L, int index)
+{
+  renderservice_ud *ud = (renderservice_ud*)luaL_checkudata(L, index, RenderServiceType);
+  luaL_argcheck(L, ud->s != NULL, index, "render service is closed");
+  return ud;
+}
+
+static renderproducer_ud* check_renderproducer (lua_State *L, int index)
+{
+  renderproducer_ud *ud = (renderproducer_ud*)luaL_checkudata(L, index, RenderProducerType);
+  luaL_argcheck(L, ud->p != NULL, index, "render producer is closed");
+  return ud;
+}
+
+// cons.RenderService(h [, params]): params.x, y, width and height give the
+// area of the screen buffer it owns (all of it by default), capacity the
+// queue size, frame_ms the least time between two flushes, and wide makes
+// output go through WriteConsoleOutputW.
+// The area is read back first: the service takes it to be what the console
+// shows, and no one else should write there while it runs.
+static int f_RenderService (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  service_params prm;
+  render_sink sink;
+  renderservice_ud *ud;
+  cellbuf shown;
+  COORD dwBufferCoord;
+  SMALL_RECT ReadRegion;
+  int x = 0, y = 0;
+  bool wide = false;
+
+  if (!GetConsoleScreenBufferInfo(h, &info))
+    return lua_pushnil(L), 1;
+  service_init_params(&prm);
+  prm.width = info.dwSize.X;
+  prm.height = info.dwSize.Y;
+  if (lua_istable(L, 2)) {
+    lua_settop(L, 2);
+    x             = GetOptIntFromTable(L, "x", 0);
+    y             = GetOptIntFromTable(L, "y", 0);
+    prm.width     = GetOptIntFromTable(L, "width", info.dwSize.X - x);
+    prm.height    = GetOptIntFromTable(L, "height", info.dwSize.Y - y);
+    prm.capacity  = GetOptIntFromTable(L, "capacity", prm.capacity);
+    prm.frame_ms  = GetOptIntFromTable(L, "frame_ms", 0);
+    wide          = GetOptBoolFromTable(L, "wide", false);
+  }
+  luaL_argcheck(L, x >= 0 && x < info.dwSize.X, 2, "invalid x");
+  luaL_argcheck(L, y >= 0 && y < info.dwSize.Y, 2, "invalid y");
+  luaL_argcheck(L, prm.width > 0 && prm.width <= info.dwSize.X - x, 2, "invalid width");
+  luaL_argcheck(L, prm.height > 0 && prm.height <= info.dwSize.Y - y, 2, "invalid height");
+
+  ud = (renderservice_ud*)lua_newuserdata(L, sizeof(renderservice_ud));
+  ud->s = NULL;
+  luaL_getmetatable(L, RenderServiceType);
+  lua_setmetatable(L, -2);
+  ud->t.L = NULL;      // not recorded: the owner thread writes
+  ud->t.h = h;
+  ud->t.x = x;
+  ud->t.y = y;
+  ud->t.width = prm.width;
+  ud->t.wide = wide;
+  sink.write = service_write_rect;
+  sink.scroll = NULL;
+  sink.ctx = &ud->t;
+
+  cellbuf_init(&shown, prm.width, prm.height,
+               (cell_t*)GetScratch(L, (size_t)prm.width * prm.height * sizeof(cell_t)));
+  dwBufferCoord.X = dwBufferCoord.Y = 0;
+  ReadRegion.Left   = x;
+  ReadRegion.Top    = y;
+  ReadRegion.Right  = x + prm.width - 1;
+  ReadRegion.Bottom = y + prm.height - 1;
+  if (ReadCells(L, h, &shown, dwBufferCoord, &ReadRegion, wide))
+    ud->s = service_start(&prm, &sink, &shown);
+  ReleaseScratch(L, shown.cells);
+  if (!ud->s)
+    return lua_pushnil(L), 1;
+  return 1;
+}
+
+// svc:close(): send what is queued and stop the owner thread; producers
+// still open fail to submit from then on
+static int renderservice_close (lua_State *L)
+{
+  renderservice_ud *ud = (renderservice_ud*)luaL_checkudata(L, 1, RenderServiceType);
+  if (ud->s) {
+    service_stop(ud->s);
+    ud->s = NULL;
+  }
+  return 0;
+}
+
+static int renderservice_tostring (lua_State *L)
+{
+  renderservice_ud *ud = (renderservice_ud*)luaL_checkudata(L, 1, RenderServiceType);
+  if (ud->s)
+    lua_pushfstring(L, "%s (%p)", RenderServiceType, ud->s);
+  else
+    lua_pushfstring(L, "%s (closed)", RenderServiceType);
+  return 1;
+}
+
+// svc:handle(): a number to pass to cons.RenderProducer in another Lua
+// state; once svc is closed (or collected), producers for it fail to open
+static int renderservice_handle (lua_State *L)
+{
+  lua_pushnumber(L, service_id(check_renderservice(L, 1)->s));
+  return 1;
+}
+
+static int renderservice_stats (lua_State *L)
+{
+  service_stats st;
+  service_get_stats(check_renderservice(L, 1)->s, &st);
+  lua_createtable(L, 0, 11);
+  PutNumToTable(L, "frames",    st.frames);
+  PutNumToTable(L, "updates",   st.updates);
+  PutNumToTable(L, "cells",     st.cells);
+  PutNumToTable(L, "dirty",     st.dirty);
+  PutNumToTable(L, "rects",     st.rects);
+  PutNumToTable(L, "sent",      st.sent);
+  PutNumToTable(L, "errors",    st.errors);
+  PutNumToTable(L, "depth",     st.depth);
+  PutNumToTable(L, "depth_max", st.depth_max);
+  PutNumToTable(L, "depth_avg", st.depth_avg);
+  PutNumToTable(L, "producers", st.producers);
+  return 1;
+}
+
+// cons.RenderProducer(svc [, params]): svc is a RenderService or what its
+// handle() returned; params.credit is how many updates may be on their way
+// before submit() waits, and timeout (ms) how long it waits at most (by
+// default, as long as it takes). A producer is for the Lua state that made it.
+// Returns nil if the service is closed.
+static int f_RenderProducer (lua_State *L)
+{
+  render_service *s = NULL;
+  unsigned id = 0;
+  renderproducer_ud *ud;
+  int credit = SERVICE_DEFAULT_CREDIT, timeout = -1;
+  if (lua_type(L, 1) == LUA_TNUMBER) {
+    lua_Number n = lua_tonumber(L, 1);
+    luaL_argcheck(L, n >= 1 && n <= 0xFFFFFFFFu && n == (unsigned)n, 1, "invalid handle");
+    id = (unsigned)n;
+  }
+  else
+    s = check_renderservice(L, 1)->s;
+  if (lua_istable(L, 2)) {
+    lua_settop(L, 2);
+    credit  = GetOptIntFromTable(L, "credit", credit);
+    timeout = GetOptIntFromTable(L, "timeout", timeout);
+    luaL_argcheck(L, credit > 0, 2, "invalid credit");
+  }
+  ud = (renderproducer_ud*)lua_newuserdata(L, sizeof(renderproducer_ud));
+  ud->p = NULL;
+  luaL_getmetatable(L, RenderProducerType);
+  lua_setmetatable(L, -2);
+  ud->p = s ? service_open(s, credit, timeout) : service_open_id(id, credit, timeout);
+  if (!ud->p)
+    return lua_pushnil(L), 1;
+  return 1;
+}
+
+// what was submitted still goes out
+static int renderproducer_close (lua_State *L)
+{
+  renderproducer_ud *ud = (renderproducer_ud*)luaL_checkudata(L, 1, RenderProducerType);
+  if (ud->p) {
+    service_close(ud->p);
+    ud->p = NULL;
+  }
+  return 0;
+}
+
+static int renderproducer_tostring (lua_State *L)
+{
+  renderproducer_ud *ud = (renderproducer_ud*)luaL_checkudata(L, 1, RenderProducerType);
+  if (ud->p)
+    lua_pushfstring(L, "%s (%p)", RenderProducerType, ud->p);
+  else
+    lua_pushfstring(L, "%s (closed)", RenderProducerType);
+  return 1;
+}
+
+// p:submit(buf, x, y [, params]): queue the CellBuffer buf (params may give
+// a rectangle of it: Left, Top, Right, Bottom) for the service's area at
+// (x, y). Returns true, false if there was no room within the timeout, or
+// nil if the service is closed.
+static int renderproducer_submit (lua_State *L)
+{
+  renderproducer_ud *ud = check_renderproducer(L, 1);
+  const cellbuf *src = check_cellbuf(L, 2);
+  int x = luaL_checkinteger(L, 3);
+  int y = luaL_checkinteger(L, 4);
+  cell_rect r;
+  int res;
+  r.Left = r.Top = 0;
+  r.Right = src->width - 1;
+  r.Bottom = src->height - 1;
+  if (lua_istable(L, 5)) {
+    lua_settop(L, 5);
+    r.Left   = GetOptIntFromTable(L, "Left", r.Left);
+    r.Top    = GetOptIntFromTable(L, "Top", r.Top);
+    r.Right  = GetOptIntFromTable(L, "Right", r.Right);
+    r.Bottom = GetOptIntFromTable(L, "Bottom", r.Bottom);
+  }
+  res = service_submit(ud->p, src, r, x, y);
+  if (res < 0)
+    return lua_pushnil(L), 1;
+  lua_pushboolean(L, res);
+  return 1;
+}
+
+// p:sync([timeout_ms]): wait until what p submitted is on the console (for
+// as long as it takes if no timeout is given); returns true if it is
+static int renderproducer_sync (lua_State *L)
+{
+  renderproducer_ud *ud = check_renderproducer(L, 1);
+  lua_pushboolean(L, service_sync(ud->p, luaL_optinteger(L, 2, -1)));
+  return 1;
+}
+
+static int renderproducer_stats (lua_State *L)
+{
+  producer_stats st;
+  service_producer_stats(check_renderproducer(L, 1)->p, &st);
+  lua_createtable(L, 0, 7);
+  PutNumToTable(L, "submitted", st.submitted);
+  PutNumToTable(L, "cells",     st.cells);
+  PutNumToTable(L, "flushed",   st.flushed);
+  PutNumToTable(L, "inflight",  st.inflight);
+  PutNumToTable(L, "waits",     st.waits);
+  PutNumToTable(L, "timeouts",  st.timeouts);
+  PutNumToTable(L, "wait_ms",   st.wait_ms);
+  return 1;
+}
+
+// cons.detect_scroll(old, new [, top, bottom [, max_shift]]): the row shift
+// (new row y == old row y + shift) that fixes most rows, and how many it fixes
+static int f_detect_scroll (lua_State *L)
+{
+  cellbuf *old = check_cellbuf(L, 1);
+  cellbuf *cur = check_cellbuf(L, 2);
+  int top = luaL_optinteger(L, 3, 0);
+  int bottom = luaL_optinteger(L, 4, cur->height - 1);
+  int max_shift = luaL_optinteger(L, 5, 0);
+  int matched;
+  luaL_argcheck(L, old->width == cur->width && old->height == cur->height, 2,
+    "buffer sizes differ");
+  lua_pushinteger(L, scroll_detect(old, cur, top, bottom, max_shift, &matched));
+  lua_pushinteger(L, matched);
+  return 2;
+}
+
+// cons.cellops([name]): name of the kernel set in use; a name forces one
+static int f_cellops (lua_State *L)
+{
+  if (!lua_isnoneornil(L, 1) && !cellops_select(luaL_checkstring(L, 1)))
+    return lua_pushnil(L), 1;
+  lua_pushstring(L, cellops_backend());
+  return 1;
+}
+
+// h:ReadConsoleOutput([params]): read a region (ReadRegionLeft, ReadRegionTop,
+// ReadRegionRight, ReadRegionBottom; the whole screen buffer by default) into
+// a CellBuffer whose origin is the region's upper-left corner;
+// h:ReadConsoleOutputW does the same through the wide API
+static int ReadConsoleOutputImpl (lua_State *L, bool wide)
+{
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  SMALL_RECT ReadRegion;
+  COORD dwBufferCoord;
+  cellbuf_ud *ud;
+  HANDLE h = check_console_handle(L, 1);
+
+  if (!GetConsoleScreenBufferInfo(h, &info))
+    return lua_pushnil(L), 1;
+  ReadRegion.Left = ReadRegion.Top = 0;
+  ReadRegion.Right = info.dwSize.X - 1;
+  ReadRegion.Bottom = info.dwSize.Y - 1;
+  if (lua_istable(L, 2)) {
+    lua_settop(L, 2);
+    ReadRegion.Left   = GetOptIntFromTable(L, "ReadRegionLeft", ReadRegion.Left);
+    ReadRegion.Top    = GetOptIntFromTable(L, "ReadRegionTop", ReadRegion.Top);
+    ReadRegion.Right  = GetOptIntFromTable(L, "ReadRegionRight", ReadRegion.Right);
+    ReadRegion.Bottom = GetOptIntFromTable(L, "ReadRegionBottom", ReadRegion.Bottom);
+    if (ReadRegion.Left < 0) ReadRegion.Left = 0;
+    if (ReadRegion.Top < 0) ReadRegion.Top = 0;
+    if (ReadRegion.Right >= info.dwSize.X) ReadRegion.Right = info.dwSize.X - 1;
+    if (ReadRegion.Bottom >= info.dwSize.Y) ReadRegion.Bottom = info.dwSize.Y - 1;
+  }
+  else
+    luaL_argcheck(L, lua_isnoneornil(L, 2), 2, "table or nil expected");
+  luaL_argcheck(L, ReadRegion.Left <= ReadRegion.Right && ReadRegion.Top <= ReadRegion.Bottom,
+    2, "empty region");
+
+  push_cellbuf(L, ReadRegion.Right - ReadRegion.Left + 1, ReadRegion.Bottom - ReadRegion.Top + 1);
+  ud = (cellbuf_ud*)lua_touserdata(L, -1);
+  ud->x0 = ReadRegion.Left;
+  ud->y0 = ReadRegion.Top;
+  dwBufferCoord.X = dwBufferCoord.Y = 0;
+  if (!ReadCells(L, h, &ud->cb, dwBufferCoord, &ReadRegion, wide))
+    return lua_pushnil(L), 1;
+  return 1;
+}
+
+static int f_ReadConsoleOutput (lua_State *L)
+{
+  return ReadConsoleOutputImpl(L, false);
+}
+
+static int f_ReadConsoleOutputW (lua_State *L)
+{
+  return ReadConsoleOutputImpl(L, true);
+}
+
+//---------------------------------------------------------------------------
+// CommandList: console calls recorded from Lua and replayed by h:execute()
+// in a single C call. The recording methods take the same arguments as the
+// console handle methods of the same name and return the command's id.
+//---------------------------------------------------------------------------
+typedef struct {
+  cmdlist cl;
+} commandlist_ud;
+
+static commandlist_ud* check_commandlist (lua_State *L, int index)
+{
+  return (commandlist_ud*)luaL_checkudata(L, index, CommandListType);
+}
+
+static int f_CommandList (lua_State *L)
+{
+  commandlist_ud *ud = (commandlist_ud*)lua_newuserdata(L, sizeof(commandlist_ud));
+  cmdlist_init(&ud->cl);
+  luaL_getmetatable(L, CommandListType);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int commandlist_gc (lua_State *L)
+{
+  cmdlist_free(&check_commandlist(L, 1)->cl);
+  return 0;
+}
+
+static int commandlist_tostring (lua_State *L)
+{
+  commandlist_ud *ud = check_commandlist(L, 1);
+  lua_pushfstring(L, "%s (%d commands, %d bytes)", CommandListType, (int)ud->cl.nops,
+    (int)(ud->cl.len * sizeof(int)));
+  return 1;
+}
+
+static int commandlist_count (lua_State *L)
+{
+  lua_pushinteger(L, check_commandlist(L, 1)->cl.nops);
+  return 1;
+}
+
+static int commandlist_clear (lua_State *L)
+{
+  cmdlist_clear(&check_commandlist(L, 1)->cl);
+  return 0;
+}
+
+// read the arguments of a command (other than WriteConsole) starting at 'pos'
+static void CheckCommandArgs (lua_State *L, int op, int pos, int *args)
+{
+  switch (op) {
+    case CMD_CURSOR_POS:
+      args[0] = luaL_checkinteger(L, pos);
+      args[1] = luaL_checkinteger(L, pos + 1);
+      break;
+    case CMD_TEXT_ATTR:
+      args[0] = (WORD)CheckFlags(L, pos);
+      break;
+    case CMD_FILL_CHAR:
+    case CMD_FILL_ATTR:
+      args[0] = op == CMD_FILL_CHAR ? *(const unsigned char*)luaL_checkstring(L, pos)
+                                    : (WORD)CheckFlags(L, pos);
+      args[1] = luaL_checkinteger(L, pos + 1);
+      args[2] = luaL_checkinteger(L, pos + 2);
+      args[3] = luaL_checkinteger(L, pos + 3);
+      break;
+    case CMD_CURSOR_INFO:
+      args[0] = luaL_checkinteger(L, pos);
+      args[1] = lua_toboolean(L, pos + 1);
+      break;
+  }
+}
+
+static int RecordCommand (lua_State *L, int op)
+{
+  commandlist_ud *ud = check_commandlist(L, 1);
+  int args[CMD_MAX_ARGS], id;
+  CheckCommandArgs(L, op, 2, args);
+  if ((id = cmdlist_add(&ud->cl, op, args)) < 0)
+    return luaL_error(L, "not enough memory");
+  lua_pushinteger(L, id + 1);
+  return 1;
+}
+
+static int commandlist_SetConsoleCursorPosition (lua_State *L)   { return RecordCommand(L, CMD_CURSOR_POS); }
+static int commandlist_SetConsoleTextAttribute (lua_State *L)    { return RecordCommand(L, CMD_TEXT_ATTR); }
+static int commandlist_FillConsoleOutputCharacter (lua_State *L) { return RecordCommand(L, CMD_FILL_CHAR); }
+static int commandlist_FillConsoleOutputAttribute (lua_State *L) { return RecordCommand(L, CMD_FILL_ATTR); }
+static int commandlist_SetConsoleCursorInfo (lua_State *L)       { return RecordCommand(L, CMD_CURSOR_INFO); }
+
+// list:WriteConsole(text [, reserve]): 'reserve' is the longest text the
+// command can later be patched with
+static int commandlist_WriteConsole (lua_State *L)
+{
+  commandlist_ud *ud = check_commandlist(L, 1);
+  size_t len;
+  const char *s = luaL_checklstring(L, 2, &len);
+  int room = luaL_optinteger(L, 3, 0);
+  int id;
+  if ((id = cmdlist_add_text(&ud->cl, s, len, room > 0 ? room : 0)) < 0)
+    return luaL_error(L, "not enough memory");
+  lua_pushinteger(L, id + 1);
+  return 1;
+}
+
+// list:patch(id, ...): replace the arguments of a recorded command; they are
+// given as when it was recorded
+static int commandlist_patch (lua_State *L)
+{
+  commandlist_ud *ud = check_commandlist(L, 1);
+  int id = luaL_checkinteger(L, 2) - 1;
+  int op = cmdlist_op(&ud->cl, id);
+  luaL_argcheck(L, op != 0, 2, "no such command");
+  if (op == CMD_WRITE) {
+    size_t len;
+    const char *s = luaL_checklstring(L, 3, &len);
+    luaL_argcheck(L, cmdlist_patch_text(&ud->cl, id, s, len), 3, "text longer than recorded");
+  }
+  else {
+    int args[CMD_MAX_ARGS];
+    CheckCommandArgs(L, op, 3, args);
+    cmdlist_patch(&ud->cl, id, args);
+  }
+  return 0;
+}
+
+static int console_cursor_pos (void *ctx, int x, int y)
+{
+  COORD c;
+  c.X = x; c.Y = y;
+  return SetConsoleCursorPosition((HANDLE)ctx, c);
+}
+
+static int console_text_attr (void *ctx, int attr)
+{
+  return SetConsoleTextAttribute((HANDLE)ctx, attr);
+}
+
+static int console_write (void *ctx, const char *s, size_t len)
+{
+  DWORD n;
+  return WriteConsole((HANDLE)ctx, s, len / sizeof(TCHAR), &n, 0);
+}
+
+static int console_fill_char (void *ctx, int ch, int n, int x, int y)
+{
+  COORD c;
+  DWORD written;
+  c.X = x; c.Y = y;
+  return FillConsoleOutputCharacter((HANDLE)ctx, (TCHAR)ch, n, c, &written);
+}
+
+static int console_fill_attr (void *ctx, int attr, int n, int x, int y)
+{
+  COORD c;
+  DWORD written;
+  c.X = x; c.Y = y;
+  return FillConsoleOutputAttribute((HANDLE)ctx, attr, n, c, &written);
+}
+
+static int console_cursor_info (void *ctx, int size, int visible)
+{
+  CONSOLE_CURSOR_INFO info;
+  info.dwSize = size;
+  info.bVisible = visible;
+  return SetConsoleCursorInfo((HANDLE)ctx, &info);
+}
+
+// h:execute(list): replay a CommandList; returns true, or nil and the id of
+// the command that failed (the commands after it are not run)
+static int f_execute (lua_State *L)
+{
+  cmd_backend be;
+  int failed;
+  be.ctx = check_console_handle(L, 1);
+  be.cursor_pos = console_cursor_pos;
+  be.text_attr = console_text_attr;
+  be.write = console_write;
+  be.fill_char = console_fill_char;
+  be.fill_attr = console_fill_attr;
+  be.cursor_info = console_cursor_info;
+  failed = cmdlist_run(&check_commandlist(L, 2)->cl, &be);
+  RECORD_ALL(L, (HANDLE)be.ctx);
+  if (failed < 0)
+    return lua_pushboolean(L, 1), 1;
+  lua_pushnil(L);
+  lua_pushinteger(L, failed + 1);
+  return 2;
+}
+
+static int f_GetConsoleMode (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  DWORD Mode;
+  if (!GetConsoleMode(h, &Mode))
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, Mode);
+  return 1;
+}
+
+static int f_SetConsoleMode (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  DWORD Mode = CheckFlags(L, 2);
+  lua_pushboolean(L, SetConsoleMode(h, Mode));
+  return 1;
+}
+
+static int f_AllocConsole (lua_State *L)
+{
+  return lua_pushboolean(L, AllocConsole()), 1;
+}
+
+static int f_FreeConsole (lua_State *L)
+{
+  return lua_pushboolean(L, FreeConsole()), 1;
+}
+
+static int f_CreateConsoleScreenBuffer (lua_State *L)
+{
+  DWORD dwDesiredAccess = CheckFlags(L, 1); // access flag
+  DWORD dwShareMode = CheckFlags(L, 2);     // buffer share mode
+  DWORD dwFlags = CheckFlags(L, 3);         // type of buffer to create
+
+  HANDLE h = CreateConsoleScreenBuffer(dwDesiredAccess, dwShareMode, 0, dwFlags, 0);
+  if (h == INVALID_HANDLE_VALUE)
+    lua_pushnil(L);
+  else {
+    cons_ud *ud = (cons_ud*)lua_newuserdata(L, sizeof(cons_ud));
+    ud->hnd = h;
+    ud->type = SCREEN_BUFFER;
+    luaL_getmetatable (L, ConsoleHandleType);
+    lua_setmetatable (L, -2);
+  }
+  return 1;
+}
+
+static int f_GetConsoleCP (lua_State *L)
+{
+  return lua_pushinteger(L, GetConsoleCP()), 1;
+}
+
+static int f_GetConsoleOutputCP (lua_State *L)
+{
+  return lua_pushinteger(L, GetConsoleOutputCP()), 1;
+}
+
+static int f_SetConsoleCP (lua_State *L)
+{
+  UINT wCodePageID = luaL_checkinteger(L, 1);
+  return lua_pushboolean(L, SetConsoleCP(wCodePageID)), 1;
+}
+
+static int f_SetConsoleOutputCP (lua_State *L)
+{
+  UINT wCodePageID = luaL_checkinteger(L, 1);
+  return lua_pushboolean(L, SetConsoleOutputCP(wCodePageID)), 1;
+}
+
+static int f_GetConsoleTitle (lua_State *L)
+{
+  int size = luaL_optinteger(L, 1, 512);
+  if (size < 512) size = 512;
+  char *ptr = (char*)GetScratch(L, size);
+  if (GetConsoleTitle(ptr, size))
+    lua_pushstring(L, ptr);
+  else
+    lua_pushnil(L);
+  ReleaseScratch(L, ptr);
+  return 1;
+}
+
+static int f_SetConsoleTitle (lua_State *L)
+{
+  return lua_pushboolean(L, SetConsoleTitle(luaL_checkstring(L, 1))), 1;
+}
+
+static int f_GetLargestConsoleWindowSize (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  COORD coord = GetLargestConsoleWindowSize(h);
+  lua_pushinteger(L, coord.X);
+  lua_pushinteger(L, coord.Y);
+  return 2;
+}
+
+static int f_SetConsoleScreenBufferSize (lua_State *L)
+{
+  COORD coord;
+  HANDLE h = check_console_handle(L, 1);
+  coord.X = luaL_checkinteger(L, 2);
+  coord.Y = luaL_checkinteger(L, 3);
+  if (!SetConsoleScreenBufferSize(h, coord))
+    return lua_pushboolean(L, 0), 1;
+  RECORD_ALL(L, h);
+  return lua_pushboolean(L, 1), 1;
+}
+
+static int f_SetConsoleTextAttribute (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  WORD wAttributes = CheckFlags(L, 2);
+  return lua_pushboolean(L, SetConsoleTextAttribute(h, wAttributes)), 1;
+}
+
+static int f_SetConsoleActiveScreenBuffer (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  return lua_pushboolean(L, SetConsoleActiveScreenBuffer(h)), 1;
+}
+
+static int f_GetNumberOfConsoleInputEvents (lua_State *L)
+{
+  DWORD n;
+  HANDLE h = check_console_handle(L, 1);
   GetNumberOfConsoleInputEvents(h, &n) ? lua_pushinteger(L, n) : lua_pushnil(L);
   return 1;
 }
 
-static int f_GetNumberOfConsoleMouseButtons (lua_State *L)
+static int f_GetNumberOfConsoleMouseButtons (lua_State *L)
+{
+  DWORD n;
+  GetNumberOfConsoleMouseButtons(&n) ? lua_pushinteger(L, n) : lua_pushnil(L);
+  return 1;
+}
+
+static int f_GenerateConsoleCtrlEvent (lua_State *L)
+{
+  DWORD dwCtrlEvent = check_env_flag(L, 1);
+  DWORD dwProcessGroupId = luaL_checkinteger(L, 2);
+  lua_pushboolean(L, GenerateConsoleCtrlEvent(dwCtrlEvent, dwProcessGroupId));
+  return 1;
+}
+
+static int f_SetConsoleCtrlHandler (lua_State *L)
+{
+  BOOL Add = lua_toboolean(L, 1);
+  return lua_pushboolean(L, SetConsoleCtrlHandler(NULL, Add)), 1;
+}
+
+static int f_FillConsoleOutputAttribute (lua_State *L)
+{
+  COORD dwWriteCoord;
+  DWORD NumOfAttrsWritten;
+  HANDLE h = check_console_handle(L, 1);
+  WORD wAttribute = CheckFlags(L, 2);
+  DWORD nLength = luaL_checkinteger(L, 3);
+  dwWriteCoord.X = luaL_checkinteger(L, 4);
+  dwWriteCoord.Y = luaL_checkinteger(L, 5);
+  if (!FillConsoleOutputAttribute(h, wAttribute, nLength, dwWriteCoord, &NumOfAttrsWritten))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfAttrsWritten);
+  RECORD_OUTPUT(L, h, dwWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, NumOfAttrsWritten);
+  return 1;
+}
+
+static int f_FillConsoleOutputCharacter (lua_State *L)
+{
+  COORD dwWriteCoord;
+  DWORD NumOfAttrsWritten;
+  HANDLE h = check_console_handle(L, 1);
+  TCHAR cCharacter = *(const TCHAR*)luaL_checkstring(L, 2);
+  DWORD nLength = luaL_checkinteger(L, 3);
+  dwWriteCoord.X = luaL_checkinteger(L, 4);
+  dwWriteCoord.Y = luaL_checkinteger(L, 5);
+  if (!FillConsoleOutputCharacter(h, cCharacter, nLength, dwWriteCoord, &NumOfAttrsWritten))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfAttrsWritten);
+  RECORD_OUTPUT(L, h, dwWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, NumOfAttrsWritten);
+  return 1;
+}
+
+static int f_ReadConsole (lua_State *L)
+{
+  HANDLE hConsoleInput = check_console_handle(L, 1);
+  DWORD NumOfCharsToRead = luaL_checkinteger(L, 2);
+  DWORD NumOfCharsRead;
+  LPVOID lpBuffer;
+  BOOL bResult;
+  FlushWriters(L);
+  lpBuffer = GetScratch(L, NumOfCharsToRead * sizeof(TCHAR));
+  bResult = ReadConsole(hConsoleInput, lpBuffer, NumOfCharsToRead, &NumOfCharsRead, NULL);
+  if (!bResult) {
+    ReleaseScratch(L, lpBuffer);
+    return lua_pushnil(L), 1;
+  }
+  STATS_MOVED(L, NumOfCharsRead);
+  lua_pushinteger(L, NumOfCharsRead);
+  lua_pushlstring(L, (const char*)lpBuffer, NumOfCharsRead * sizeof(TCHAR));
+  ReleaseScratch(L, lpBuffer);
+  return 2;
+}
+
+static int f_ReadConsoleOutputAttribute (lua_State *L)
+{
+  COORD dwReadCoord;
+  DWORD NumOfAttrsRead, i;
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  DWORD nLength = luaL_checkinteger(L, 2);
+  dwReadCoord.X = luaL_checkinteger(L, 3);
+  dwReadCoord.Y = luaL_checkinteger(L, 4);
+  // not the scratch space: building the table may run out of memory
+  LPWORD lpAttribute = (LPWORD)lua_newuserdata(L, nLength * sizeof(WORD));
+  if (!ReadConsoleOutputAttribute(hConsoleOutput, lpAttribute, nLength,
+                                  dwReadCoord, &NumOfAttrsRead))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfAttrsRead);
+  lua_createtable(L, NumOfAttrsRead, 0);
+  for (i=0; i < NumOfAttrsRead; i++) {
+    lua_pushinteger(L, i+1);
+    lua_pushinteger(L, lpAttribute[i]);
+    lua_rawset(L, -3);
+  }
+  return 1;
+}
+
+static int f_ReadConsoleOutputCharacter (lua_State *L)
+{
+  COORD dwReadCoord;
+  DWORD NumOfCharsRead;
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  DWORD nLength = luaL_checkinteger(L, 2);
+  dwReadCoord.X = luaL_checkinteger(L, 3);
+  dwReadCoord.Y = luaL_checkinteger(L, 4);
+  LPTSTR lpCharacter = (LPTSTR)GetScratch(L, nLength * sizeof(TCHAR));
+  if (!ReadConsoleOutputCharacter(hConsoleOutput, lpCharacter, nLength,
+                                  dwReadCoord, &NumOfCharsRead))
+  {
+    ReleaseScratch(L, lpCharacter);
+    return lua_pushnil(L), 1;
+  }
+  STATS_MOVED(L, NumOfCharsRead);
+  lua_pushlstring(L, lpCharacter, NumOfCharsRead * sizeof(TCHAR));
+  ReleaseScratch(L, lpCharacter);
+  return 1;
+}
+
+// h:ScrollConsoleScreenBuffer(params): ScrollRectangle{Left,Top,Right,Bottom},
+// optional ClipRectangle{Left,Top,Right,Bottom} (all four or none),
+// dwDestinationOrigin{X,Y}, FillChar and FillAttributes
+static int f_ScrollConsoleScreenBuffer (lua_State *L)
+{
+  SMALL_RECT ScrollRectangle, ClipRectangle;
+  COORD dwDestinationOrigin;
+  cell_t fill;
+  bool clip;
+  HANDLE h = check_console_handle(L, 1);
+  luaL_checktype(L, 2, LUA_TTABLE);
+  lua_settop(L, 2);
+  ScrollRectangle.Left   = GetOptIntFromTable(L, "ScrollRectangleLeft", 0);
+  ScrollRectangle.Top    = GetOptIntFromTable(L, "ScrollRectangleTop", 0);
+  ScrollRectangle.Right  = GetOptIntFromTable(L, "ScrollRectangleRight", 0);
+  ScrollRectangle.Bottom = GetOptIntFromTable(L, "ScrollRectangleBottom", 0);
+  lua_getfield(L, 2, "ClipRectangleLeft");
+  clip = !lua_isnil(L, -1);
+  lua_pop(L, 1);
+  if (clip) {
+    ClipRectangle.Left   = GetOptIntFromTable(L, "ClipRectangleLeft", 0);
+    ClipRectangle.Top    = GetOptIntFromTable(L, "ClipRectangleTop", 0);
+    ClipRectangle.Right  = GetOptIntFromTable(L, "ClipRectangleRight", 0);
+    ClipRectangle.Bottom = GetOptIntFromTable(L, "ClipRectangleBottom", 0);
+  }
+  dwDestinationOrigin.X = GetOptIntFromTable(L, "dwDestinationOriginX", 0);
+  dwDestinationOrigin.Y = GetOptIntFromTable(L, "dwDestinationOriginY", 0);
+  lua_getfield(L, 2, "FillChar");
+  fill.Char = opt_cell_char(L, -1, ' ');
+  lua_getfield(L, 2, "FillAttributes");
+  fill.Attributes = opt_cell_attr(L, -1, DefaultCell.Attributes);
+  lua_pop(L, 2);
+  if (!ScrollConsoleScreenBuffer(h, &ScrollRectangle, clip ? &ClipRectangle : NULL,
+                                 dwDestinationOrigin, (const CHAR_INFO*)&fill))
+    return lua_pushboolean(L, 0), 1;
+  RECORD_ALL(L, h);
+  return lua_pushboolean(L, 1), 1;
+}
+
+static int f_SetConsoleWindowInfo (lua_State *L)
+{
+  SMALL_RECT rect;
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  BOOL bAbsolute = lua_toboolean(L, 2);
+  rect.Left = luaL_checkinteger(L, 3);
+  rect.Top = luaL_checkinteger(L, 4);
+  rect.Right = luaL_checkinteger(L, 5);
+  rect.Bottom = luaL_checkinteger(L, 6);
+  if (!SetConsoleWindowInfo(hConsoleOutput, bAbsolute, &rect))
+    return lua_pushboolean(L, 0), 1;
+  RECORD_ALL(L, hConsoleOutput);
+  return lua_pushboolean(L, 1), 1;
+}
+
+//---------------------------------------------------------------------------
+// Writer: output gathered in a buffer and sent with one WriteConsole call
+// when it fills, when its oldest byte is 'flush_ms' old, on flush(), or
+// before any input is read through this library. Output done directly on
+// the handle is not ordered with it: flush() first.
+//---------------------------------------------------------------------------
+// registry key of the (weak) set of live Writers
+static const char WritersKey = 0;
+
+typedef struct {
+  outbuf w;
+  HANDLE h;
+  lua_State *L;      // of the call that may flush: whose recorders see it
+  char data[1];
+} writer_ud;
+
+// the writer at 'pos', flushing for state L from now on
+static writer_ud* check_writer (lua_State *L, int pos)
+{
+  writer_ud *ud = (writer_ud*)luaL_checkudata(L, pos, WriterType);
+  ud->L = L;
+  return ud;
+}
+
+// the console takes about 64K per call
+#define MAX_CHARS_PER_CALL 32000
+
+static int console_write_all (void *ctx, const char *s, size_t len)
+{
+  writer_ud *ud = (writer_ud*)ctx;
+  HANDLE h = ud->h;
+  DWORD n = (DWORD)(len / sizeof(TCHAR)), done = 0;
+  while (done < n) {
+    DWORD chunk = n - done, written;
+    if (chunk > MAX_CHARS_PER_CALL)
+      chunk = MAX_CHARS_PER_CALL;
+    if (!WriteConsole(h, (const TCHAR*)s + done, chunk, &written, 0) || written == 0)
+      return 0;
+    done += written;
+  }
+  RECORD_ALL(ud->L, h);
+  return 1;
+}
+
+static void FlushWriters (lua_State *L)
+{
+  lua_pushlightuserdata(L, (void*)&WritersKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    writer_ud *ud = (writer_ud*)lua_touserdata(L, -2);
+    ud->L = L;
+    outbuf_flush(&ud->w);
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+
+// cons.Writer(h [, {buffer=65536, flush_ms=16}]): flush_ms=0 means no
+// deadline
+static int f_Writer (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  int cap = OUTBUF_DEFAULT_BUFFER, flush_ms = OUTBUF_DEFAULT_FLUSH_MS;
+  outbuf_sink sink;
+  writer_ud *ud;
+  if (lua_istable(L, 2)) {
+    lua_pushvalue(L, 2);
+    cap      = GetOptIntFromTable(L, "buffer", cap);
+    flush_ms = GetOptIntFromTable(L, "flush_ms", flush_ms);
+    lua_pop(L, 1);
+    luaL_argcheck(L, cap > 0, 2, "invalid buffer size");
+    luaL_argcheck(L, flush_ms >= 0, 2, "invalid flush_ms");
+  }
+  ud = (writer_ud*)lua_newuserdata(L, offsetof(writer_ud, data) + cap);
+  ud->h = h;
+  ud->L = L;
+  sink.write = console_write_all;
+  sink.ctx = ud;
+  outbuf_init(&ud->w, ud->data, cap, flush_ms, &sink);
+  luaL_getmetatable(L, WriterType);
+  lua_setmetatable(L, -2);
+  lua_pushvalue(L, 1);                      // keep the handle alive
+  lua_setuservalue(L, -2);
+
+  lua_pushlightuserdata(L, (void*)&WritersKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_pushvalue(L, -2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  return 1;
+}
+
+static int writer_gc (lua_State *L)
+{
+  outbuf_flush(&check_writer(L, 1)->w);
+  return 0;
+}
+
+static int writer_tostring (lua_State *L)
+{
+  writer_ud *ud = check_writer(L, 1);
+  lua_pushfstring(L, "%s (%d/%d bytes)", WriterType, (int)ud->w.len, (int)ud->w.cap);
+  return 1;
+}
+
+// w:write(s, ...): strings and numbers, as file:write takes them; true, or
+// nil if an output call failed
+static int writer_write (lua_State *L)
+{
+  writer_ud *ud = check_writer(L, 1);
+  int i, top = lua_gettop(L);
+  bool ok = true;
+  DWORD now = GetTickCount();
+  for (i=2; i<=top; i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+    if (!outbuf_write(&ud->w, s, len, now))
+      ok = false;
+  }
+  ok ? lua_pushboolean(L, 1) : lua_pushnil(L);
+  return 1;
+}
+
+static int writer_flush (lua_State *L)
+{
+  writer_ud *ud = check_writer(L, 1);
+  outbuf_flush(&ud->w) ? lua_pushboolean(L, 1) : lua_pushnil(L);
+  return 1;
+}
+
+// w:tick(): flush if the pending output has waited 'flush_ms'; to be called
+// from an idle loop, as nothing flushes on its own between writes
+static int writer_tick (lua_State *L)
+{
+  writer_ud *ud = check_writer(L, 1);
+  outbuf_tick(&ud->w, GetTickCount()) ? lua_pushboolean(L, 1) : lua_pushnil(L);
+  return 1;
+}
+
+static int writer_pending (lua_State *L)
+{
+  lua_pushinteger(L, check_writer(L, 1)->w.len);
+  return 1;
+}
+
+static int writer_stats (lua_State *L)
+{
+  writer_ud *ud = check_writer(L, 1);
+  const outbuf_stats *st = &ud->w.stats;
+  lua_createtable(L, 0, 6);
+  PutNumToTable(L, "writes", st->writes);
+  PutNumToTable(L, "flushes", st->flushes);
+  PutNumToTable(L, "bytes", st->bytes);
+  PutNumToTable(L, "errors", st->errors);
+  PutNumToTable(L, "pending", ud->w.len);
+  PutNumToTable(L, "saved", st->writes > st->flushes ? st->writes - st->flushes : 0);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Scratch space: one growable block per state for the arrays the wrappers
+// hand to the console and get back from it, instead of a userdata per call
+// that lives until the next collection.
+//---------------------------------------------------------------------------
+#define SCRATCH_MIN     4096    // never smaller than that
+#define SCRATCH_WINDOW  256     // calls over which the high-water mark is taken
+
+typedef struct {
+  char *data;
+  size_t cap;
+  bool held;                // taken and not released yet
+  size_t window_high;       // the most asked for in this window
+  unsigned window_calls;
+  // stats
+  size_t high;              // the most asked for ever
+  unsigned long calls;
+  unsigned long grows;
+  unsigned long shrinks;
+  unsigned long fallbacks;  // calls made while it was held
+} scratch;
+
+// registry: the scratch of the state
+static const char ScratchKey = 0;
+
+static void scratch_resize (lua_State *L, scratch *sc, size_t cap)
+{
+  void *ud;
+  lua_Alloc alloc = lua_getallocf(L, &ud);
+  // the contents need not be kept: free first, so that the two blocks never
+  // exist together
+  if (sc->data)
+    alloc(ud, sc->data, sc->cap, 0);
+  sc->data = (char*)alloc(ud, NULL, 0, cap);
+  sc->cap = sc->data ? cap : 0;
+  if (!sc->data)
+    luaL_error(L, "not enough memory");
+}
+
+static int scratch_gc (lua_State *L)
+{
+  scratch *sc = (scratch*)lua_touserdata(L, 1);
+  if (sc->data) {
+    void *ud;
+    lua_getallocf(L, &ud)(ud, sc->data, sc->cap, 0);
+    sc->data = NULL;
+  }
+  return 0;
+}
+
+static void CreateScratch (lua_State *L)
+{
+  scratch *sc;
+  lua_pushlightuserdata(L, (void*)&ScratchKey);
+  sc = (scratch*)lua_newuserdata(L, sizeof(scratch));
+  memset(sc, 0, sizeof(*sc));
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, scratch_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static scratch* get_scratch (lua_State *L)
+{
+  scratch *sc;
+  lua_pushlightuserdata(L, (void*)&ScratchKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  sc = (scratch*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return sc;
+}
+
+// Return room for 'size' bytes, to be given back with ReleaseScratch() before
+// the wrapper returns. Grows by half again what is asked; shrinks when a
+// whole window of calls used less than a quarter of it.
+// Lua code run while it is held (a metamethod, a finalizer) may call another
+// wrapper: that one gets a userdata of its own, left on the stack, as all
+// did before.
+// An error raised while it is held would leave it so for good (each call
+// after that falls back to a userdata): the wrappers check their arguments
+// before taking it, and between the two calls do nothing that raises one
+// but running out of memory for their result string. Those that build
+// tables from what they read take a userdata instead.
+static void* GetScratch (lua_State *L, size_t size)
+{
+  scratch *sc = get_scratch(L);
+  if (sc->held) {
+    sc->fallbacks++;
+    return lua_newuserdata(L, size);
+  }
+  sc->calls++;
+  if (size > sc->high)
+    sc->high = size;
+  if (size > sc->window_high)
+    sc->window_high = size;
+  if (++sc->window_calls == SCRATCH_WINDOW) {
+    size_t want = sc->window_high + sc->window_high / 2;
+    if (want < SCRATCH_MIN)
+      want = SCRATCH_MIN;
+    if (sc->cap > SCRATCH_MIN && sc->window_high < sc->cap / 4) {
+      scratch_resize(L, sc, want);
+      sc->shrinks++;
+    }
+    sc->window_calls = 0;
+    sc->window_high = 0;
+  }
+  if (size > sc->cap) {
+    size_t cap = size + size / 2;
+    scratch_resize(L, sc, cap < SCRATCH_MIN ? SCRATCH_MIN : cap);
+    sc->grows++;
+  }
+  sc->held = true;           // only now: resizing may raise an error
+  return sc->data;
+}
+
+// p: what GetScratch returned; only the call that took the block gives it
+// back (one that got a userdata of its own has nothing to give)
+static void ReleaseScratch (lua_State *L, void *p)
+{
+  scratch *sc = get_scratch(L);
+  if (p == sc->data)
+    sc->held = false;
+}
+
+// cons.scratch_stats(): { capacity=, high=, calls=, grows=, shrinks=,
+// fallbacks= }; the sizes are in bytes
+static int f_scratch_stats (lua_State *L)
+{
+  const scratch *sc = get_scratch(L);
+  lua_createtable(L, 0, 6);
+  PutNumToTable(L, "capacity", sc->cap);
+  PutNumToTable(L, "high", sc->high);
+  PutNumToTable(L, "calls", sc->calls);
+  PutNumToTable(L, "grows", sc->grows);
+  PutNumToTable(L, "shrinks", sc->shrinks);
+  PutNumToTable(L, "fallbacks", sc->fallbacks);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// UTF-8 variants of the text functions, going through the wide API
+//---------------------------------------------------------------------------
+// room for n WCHARs in the scratch space
+static WCHAR* GetWideBuffer (lua_State *L, size_t n)
+{
+  return (WCHAR*)GetScratch(L, n * sizeof(WCHAR));
+}
+
+// convert the UTF-8 string at stack index 'pos' into the wide buffer, to be
+// released by the caller
+static WCHAR* CheckWideString (lua_State *L, int pos, DWORD *n)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, pos, &len);
+  WCHAR *w = GetWideBuffer(L, len + 1);
+  *n = (DWORD)utf8_to_utf16(s, len, (unsigned short*)w, NULL);
+  return w;
+}
+
+// the console takes about 64K per call; a chunk never ends inside a
+// surrogate pair
+#define MAX_WCHARS_PER_CALL 16000
+
+// return the number of units written, or -1 on failure
+static long WriteWide (lua_State *L, HANDLE h, const WCHAR *w, DWORD n)
+{
+  DWORD done = 0;
+  while (done < n) {
+    DWORD chunk = n - done, written;
+    if (chunk > MAX_WCHARS_PER_CALL) {
+      chunk = MAX_WCHARS_PER_CALL;
+      if (w[done + chunk - 1] >= 0xD800 && w[done + chunk - 1] < 0xDC00)
+        chunk--;
+    }
+    if (!WriteConsoleW(h, w + done, chunk, &written, 0))
+      return -1;
+    done += written;
+    STATS_MOVED(L, written);
+    if (written < chunk)
+      break;
+  }
+  RECORD_ALL(L, h);
+  return (long)done;
+}
+
+static long WriteUtf8 (lua_State *L, HANDLE h, const char *s, size_t len)
+{
+  WCHAR *w = GetWideBuffer(L, len + 1);
+  long done = WriteWide(L, h, w, (DWORD)utf8_to_utf16(s, len, (unsigned short*)w, NULL));
+  ReleaseScratch(L, w);
+  return done;
+}
+
+// h:WriteConsoleW(utf8): returns the number of UTF-16 units written
+static int f_WriteConsoleW (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  DWORD n;
+  WCHAR *w = CheckWideString(L, 2, &n);
+  long done = WriteWide(L, h, w, n);
+  ReleaseScratch(L, w);
+  done < 0 ? lua_pushnil(L) : lua_pushinteger(L, done);
+  return 1;
+}
+
+// h:WriteConsoleOutputCharacterW(utf8, x, y)
+static int f_WriteConsoleOutputCharacterW (lua_State *L)
+{
+  COORD dwWriteCoord;
+  DWORD n, written;
+  HANDLE h = check_console_handle(L, 1);
+  WCHAR *w;
+  BOOL ok;
+  dwWriteCoord.X = luaL_checkinteger(L, 3);
+  dwWriteCoord.Y = luaL_checkinteger(L, 4);
+  w = CheckWideString(L, 2, &n);
+  ok = WriteConsoleOutputCharacterW(h, w, n, dwWriteCoord, &written);
+  ReleaseScratch(L, w);
+  if (!ok)
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, written);
+  RECORD_OUTPUT(L, h, dwWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+// h:FillConsoleOutputCharacterW(utf8char, n, x, y): the character must be in
+// the Basic Multilingual Plane (a console cell holds one UTF-16 unit)
+static int f_FillConsoleOutputCharacterW (lua_State *L)
+{
+  COORD dwWriteCoord;
+  DWORD written;
+  size_t len;
+  unsigned cp;
+  HANDLE h = check_console_handle(L, 1);
+  const char *s = luaL_checklstring(L, 2, &len);
+  DWORD nLength = luaL_checkinteger(L, 3);
+  utf8_decode(s, len, &cp);
+  luaL_argcheck(L, len > 0 && cp < 0x10000, 2, "invalid character");
+  dwWriteCoord.X = luaL_checkinteger(L, 4);
+  dwWriteCoord.Y = luaL_checkinteger(L, 5);
+  if (!FillConsoleOutputCharacterW(h, (WCHAR)cp, nLength, dwWriteCoord, &written))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, written);
+  RECORD_OUTPUT(L, h, dwWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, written);
+  return 1;
+}
+
+// buf:put_utf8(x, y, utf8 [, attr]): like put_string, one UTF-16 unit per cell
+static int cellbuffer_put_utf8 (lua_State *L)
+{
+  DWORD n;
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int attr = opt_cell_attr(L, 5, -1);
+  WCHAR *w = CheckWideString(L, 4, &n);
+  n = cellbuf_put_wide(cb, x, y, (const unsigned short*)w, n, attr);
+  ReleaseScratch(L, w);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
+// buf:get_utf8(x, y): the character of a cell as UTF-8, and its attributes
+static int cellbuffer_get_utf8 (lua_State *L)
+{
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  char s[4];
+  cell_t *p;
+  if (x < 0 || x >= cb->width || y < 0 || y >= cb->height)
+    return lua_pushnil(L), 1;
+  p = CELLBUF_AT(cb, x, y);
+  lua_pushlstring(L, s, utf8_encode(p->Char, s));
+  lua_pushinteger(L, p->Attributes);
+  return 2;
+}
+
+// layout parameters at 'pos', a table or nothing: width, height, align
+// ("left", "center", "right"), wrap ("none", "char", "word"), ellipsis, tab, attr
+static void check_layout_params (lua_State *L, int pos, layout_params *prm)
+{
+  static const char *const aligns[] = { "left", "center", "right", NULL };
+  static const char *const wraps[] = { "none", "char", "word", NULL };
+  if (lua_isnoneornil(L, pos))
+    return;
+  luaL_checktype(L, pos, LUA_TTABLE);
+  lua_pushvalue(L, pos);
+  prm->width    = GetOptIntFromTable(L, "width", prm->width);
+  prm->height   = GetOptIntFromTable(L, "height", prm->height);
+  prm->align    = GetOptOptionFromTable(L, "align", aligns, prm->align);
+  prm->wrap     = GetOptOptionFromTable(L, "wrap", wraps, prm->wrap);
+  prm->ellipsis = GetOptBoolFromTable(L, "ellipsis", prm->ellipsis);
+  prm->tab      = GetOptIntFromTable(L, "tab", prm->tab);
+  lua_getfield(L, -1, "attr");
+  prm->attr = opt_cell_attr(L, lua_gettop(L), prm->attr);
+  lua_pop(L, 2);
+  luaL_argcheck(L, prm->width > 0 && prm->width <= 0x7FFF, pos, "invalid width");
+  luaL_argcheck(L, prm->height >= 0, pos, "invalid height");
+  luaL_argcheck(L, prm->tab >= 0, pos, "invalid tab");
+}
+
+static int push_layout_extent (lua_State *L, const layout_extent *ext)
+{
+  lua_pushinteger(L, ext->lines);
+  lua_pushinteger(L, ext->width);
+  lua_pushinteger(L, (lua_Integer)ext->used);
+  lua_pushboolean(L, ext->truncated);
+  return 4;
+}
+
+// buf:layout(x, y, utf8 [, params]): lay out text in the box of params.width
+// by params.height cells at (x,y), by default the rest of the buffer; return
+// the lines, the width of the widest, the bytes laid out and whether any text
+// was cut off
+static int cellbuffer_layout (lua_State *L)
+{
+  size_t len;
+  layout_params prm;
+  layout_extent ext;
+  cellbuf *cb = check_cellbuf(L, 1);
+  int x = luaL_checkinteger(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  const char *s = luaL_checklstring(L, 4, &len);
+  layout_init_params(&prm, cb->width - x);
+  prm.height = cb->height - y > 0 ? cb->height - y : 1;
+  check_layout_params(L, 5, &prm);
+  layout_text(cb, x, y, s, len, &prm, &ext);
+  return push_layout_extent(L, &ext);
+}
+
+// cons.measure(utf8 [, params]): what buf:layout would return, without a
+// buffer; the width is unlimited unless given
+static int f_measure (lua_State *L)
+{
+  size_t len;
+  layout_params prm;
+  layout_extent ext;
+  const char *s = luaL_checklstring(L, 1, &len);
+  layout_init_params(&prm, 0x7FFF);
+  check_layout_params(L, 2, &prm);
+  layout_text(NULL, 0, 0, s, len, &prm, &ext);
+  return push_layout_extent(L, &ext);
+}
+
+//---------------------------------------------------------------------------
+// VTEncoder: cell frames turned into VT/ANSI escape streams (see vt.h)
+//---------------------------------------------------------------------------
+typedef struct {
+  vt_encoder enc;
+} vtencoder_ud;
+
+static vtencoder_ud* check_vtencoder (lua_State *L, int pos)
+{
+  return (vtencoder_ud*)luaL_checkudata(L, pos, VTEncoderType);
+}
+
+static int f_VTEncoder (lua_State *L)
+{
+  vtencoder_ud *ud = (vtencoder_ud*)lua_newuserdata(L, sizeof(vtencoder_ud));
+  vt_init(&ud->enc);
+  luaL_getmetatable(L, VTEncoderType);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+static int vtencoder_gc (lua_State *L)
+{
+  vt_free(&check_vtencoder(L, 1)->enc);
+  return 0;
+}
+
+static int vtencoder_tostring (lua_State *L)
+{
+  check_vtencoder(L, 1);
+  lua_pushstring(L, VTEncoderType);
+  return 1;
+}
+
+// enc:encode(buf [, prev]): the stream that draws buf at its origin, or
+// only what differs from prev (a buffer of the same size the screen shows)
+static int vtencoder_encode (lua_State *L)
+{
+  vtencoder_ud *ud = check_vtencoder(L, 1);
+  cellbuf_ud *back = (cellbuf_ud*)luaL_checkudata(L, 2, CellBufferType);
+  cellbuf *front = lua_isnoneornil(L, 3) ? NULL : check_cellbuf(L, 3);
+  luaL_argcheck(L, !front || (front->width == back->cb.width &&
+    front->height == back->cb.height), 3, "buffer sizes differ");
+  ud->enc.len = 0;
+  if (!vt_encode(&ud->enc, &back->cb, front, back->x0, back->y0))
+    return luaL_error(L, "not enough memory");
+  lua_pushlstring(L, ud->enc.data, ud->enc.len);
+  return 1;
+}
+
+// enc:reset(): forget the cursor position and attributes, e.g. after other
+// output went to the screen
+static int vtencoder_reset (lua_State *L)
+{
+  vt_reset(&check_vtencoder(L, 1)->enc);
+  return 0;
+}
+
+static int vtencoder_stats (lua_State *L)
+{
+  const vt_stats *st = &check_vtencoder(L, 1)->enc.stats;
+  lua_createtable(L, 0, 5);
+  PutNumToTable(L, "frames", st->frames);
+  PutNumToTable(L, "bytes", st->bytes);
+  PutNumToTable(L, "cells", st->cells);
+  PutNumToTable(L, "moves", st->moves);
+  PutNumToTable(L, "sgr", st->sgr);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Terminal: escape streams (e.g. a child process' output) parsed into a
+// CellBuffer, for panes of our own screen buffers (see term.h)
+//---------------------------------------------------------------------------
+typedef struct {
+  term t;
+} terminal_ud;
+
+static terminal_ud* check_terminal (lua_State *L, int pos)
+{
+  return (terminal_ud*)luaL_checkudata(L, pos, TerminalType);
+}
+
+// cons.Terminal(width, height [, {newline=false}]): with newline set LF
+// also returns the carriage
+static int f_Terminal (lua_State *L)
+{
+  int width = luaL_checkinteger(L, 1);
+  int height = luaL_checkinteger(L, 2);
+  terminal_ud *ud;
+  cellbuf *grid;
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 1, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 2, "invalid height");
+  ud = (terminal_ud*)lua_newuserdata(L, sizeof(terminal_ud));
+  luaL_getmetatable(L, TerminalType);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);
+  grid = push_cellbuf(L, width, height);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  term_init(&ud->t, grid);
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+    ud->t.newline = GetOptBoolFromTable(L, "newline", false);
+    lua_pop(L, 1);
+  }
+  return 1;
+}
+
+static int terminal_tostring (lua_State *L)
+{
+  terminal_ud *ud = check_terminal(L, 1);
+  lua_pushfstring(L, "%s (%dx%d)", TerminalType, ud->t.grid->width, ud->t.grid->height);
+  return 1;
+}
+
+// term:feed(s, ...): apply the strings to the grid
+static int terminal_feed (lua_State *L)
+{
+  terminal_ud *ud = check_terminal(L, 1);
+  int i, top = lua_gettop(L);
+  for (i=2; i<=top; i++) {
+    size_t len;
+    const char *s = luaL_checklstring(L, i, &len);
+    term_feed(&ud->t, s, len);
+  }
+  return 0;
+}
+
+// term:buffer(): the CellBuffer the terminal draws into
+static int terminal_buffer (lua_State *L)
+{
+  check_terminal(L, 1);
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+// term:cursor(): x, y, visible
+static int terminal_cursor (lua_State *L)
+{
+  terminal_ud *ud = check_terminal(L, 1);
+  lua_pushinteger(L, ud->t.x);
+  lua_pushinteger(L, ud->t.y);
+  lua_pushboolean(L, ud->t.cursor_visible);
+  return 3;
+}
+
+// term:dirty(): first and last row changed since the last call, or nil
+static int terminal_dirty (lua_State *L)
+{
+  int top, bottom;
+  if (!term_take_dirty(&check_terminal(L, 1)->t, &top, &bottom))
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, top);
+  lua_pushinteger(L, bottom);
+  return 2;
+}
+
+static int terminal_reset (lua_State *L)
+{
+  term_reset(&check_terminal(L, 1)->t);
+  return 0;
+}
+
+static int terminal_title (lua_State *L)
+{
+  lua_pushstring(L, check_terminal(L, 1)->t.title);
+  return 1;
+}
+
+static int terminal_stats (lua_State *L)
+{
+  const term_stats *st = &check_terminal(L, 1)->t.stats;
+  lua_createtable(L, 0, 5);
+  PutNumToTable(L, "bytes", st->bytes);
+  PutNumToTable(L, "text", st->text);
+  PutNumToTable(L, "controls", st->controls);
+  PutNumToTable(L, "sequences", st->sequences);
+  PutNumToTable(L, "scrolls", st->scrolls);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// SwapChain: 2 or 3 screen buffers of one size for page flipping. Drawing
+// goes to the back buffer and present() makes it the active one, so nothing
+// is seen half drawn. The buffers come from a per-state pool of handles and
+// go back to it, instead of being created and closed again.
+//---------------------------------------------------------------------------
+#define SWAP_MAX  3
+#define POOL_MAX  8
+
+typedef struct {
+  HANDLE h[POOL_MAX];
+  int n;
+} buffer_pool;
+
+// registry: the buffer_pool of the state (closes what it holds on __gc)
+static const char BufferPoolKey = 0;
+
+typedef struct {
+  unsigned long presents;
+  unsigned long created;    // buffers created
+  unsigned long reused;     // buffers taken from the pool
+  unsigned long resizes;    // buffers resized
+} swap_stats;
+
+typedef struct {
+  int n;                   // buffers
+  int back;                // index of the back buffer
+  int front;               // index of the active one; -1 until present()
+  int width, height;       // size of the buffers wanted
+  COORD size[SWAP_MAX];    // size each buffer has
+  HANDLE prev;             // active before, made active again by close()
+  bool closed;
+  swap_stats stats;
+} swapchain_ud;
+
+static int pool_gc (lua_State *L)
+{
+  buffer_pool *p = (buffer_pool*)lua_touserdata(L, 1);
+  while (p->n > 0)
+    CloseHandle(p->h[--p->n]);
+  return 0;
+}
+
+static void CreateBufferPool (lua_State *L)
+{
+  buffer_pool *p;
+  lua_pushlightuserdata(L, (void*)&BufferPoolKey);
+  p = (buffer_pool*)lua_newuserdata(L, sizeof(buffer_pool));
+  p->n = 0;
+  lua_createtable(L, 0, 1);
+  lua_pushcfunction(L, pool_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_setmetatable(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static buffer_pool* get_pool (lua_State *L)
+{
+  buffer_pool *p;
+  lua_pushlightuserdata(L, (void*)&BufferPoolKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  p = (buffer_pool*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return p;
+}
+
+static HANDLE pool_take (lua_State *L, swap_stats *st)
+{
+  buffer_pool *p = get_pool(L);
+  if (p->n > 0) {
+    st->reused++;
+    return p->h[--p->n];
+  }
+  st->created++;
+  return CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE,
+    FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+}
+
+static void pool_give (lua_State *L, HANDLE h)
+{
+  buffer_pool *p = get_pool(L);
+  if (p->n < POOL_MAX)
+    p->h[p->n++] = h;
+  else
+    CloseHandle(h);
+}
+
+// A buffer can not be made smaller than its window: if that is why the new
+// size is refused, shrink the window and try again.
+static BOOL ResizeBuffer (HANDLE h, COORD size)
+{
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  SMALL_RECT win;
+  if (SetConsoleScreenBufferSize(h, size))
+    return TRUE;
+  if (!GetConsoleScreenBufferInfo(h, &info))
+    return FALSE;
+  win.Left = win.Top = 0;
+  win.Right = info.srWindow.Right - info.srWindow.Left;
+  win.Bottom = info.srWindow.Bottom - info.srWindow.Top;
+  if (win.Right > size.X - 1) win.Right = size.X - 1;
+  if (win.Bottom > size.Y - 1) win.Bottom = size.Y - 1;
+  return SetConsoleWindowInfo(h, TRUE, &win) && SetConsoleScreenBufferSize(h, size);
+}
+
+static swapchain_ud* check_swapchain (lua_State *L, int pos)
+{
+  swapchain_ud *ud = (swapchain_ud*)luaL_checkudata(L, pos, SwapChainType);
+  luaL_argcheck(L, !ud->closed, pos, "swap chain is closed");
+  return ud;
+}
+
+// push the handle userdata of buffer i
+static cons_ud* push_buffer (lua_State *L, int pos, int i)
+{
+  cons_ud *h;
+  lua_getuservalue(L, pos);
+  lua_rawgeti(L, -1, i + 1);
+  lua_remove(L, -2);
+  h = (cons_ud*)lua_touserdata(L, -1);
+  return h;
+}
+
+// chain:close(): the buffers go back to the pool (their handles from back()
+// and front() become closed ones); if one was on the screen, the buffer
+// active before the chain is made active again
+static int swapchain_close (lua_State *L)
+{
+  swapchain_ud *ud = (swapchain_ud*)luaL_checkudata(L, 1, SwapChainType);
+  int i;
+  if (ud->closed)
+    return 0;
+  if (ud->front >= 0)
+    SetConsoleActiveScreenBuffer(ud->prev);
+  for (i=0; i<ud->n; i++) {
+    cons_ud *h = push_buffer(L, 1, i);
+    pool_give(L, h->hnd);
+    h->hnd = INVALID_HANDLE_VALUE;
+    lua_pop(L, 1);
+  }
+  ud->closed = true;
+  return 0;
+}
+
+// cons.SwapChain([n [, {width=, height=}]]): n is 2 (default) or 3; the size
+// is that of the window of the standard output by default
+static int f_SwapChain (lua_State *L)
+{
+  int n = luaL_optinteger(L, 1, 2), i;
+  HANDLE out = GetStdHandle(STD_OUTPUT_HANDLE);
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  swapchain_ud *ud;
+  luaL_argcheck(L, n >= 2 && n <= SWAP_MAX, 1, "2 or 3 buffers expected");
+
+  ud = (swapchain_ud*)lua_newuserdata(L, sizeof(swapchain_ud));
+  memset(ud, 0, sizeof(*ud));
+  ud->n = n;
+  ud->front = -1;
+  ud->prev = out;
+  if (GetConsoleScreenBufferInfo(out, &info)) {
+    ud->width = info.srWindow.Right - info.srWindow.Left + 1;
+    ud->height = info.srWindow.Bottom - info.srWindow.Top + 1;
+  }
+  if (lua_istable(L, 2)) {
+    lua_pushvalue(L, 2);
+    ud->width  = GetOptIntFromTable(L, "width", ud->width);
+    ud->height = GetOptIntFromTable(L, "height", ud->height);
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, ud->width > 0 && ud->height > 0, 2, "invalid size");
+  luaL_getmetatable(L, SwapChainType);
+  lua_setmetatable(L, -2);
+
+  lua_createtable(L, n, 0);
+  for (i=0; i<n; i++) {
+    cons_ud *h;
+    HANDLE hnd = pool_take(L, &ud->stats);
+    if (hnd == INVALID_HANDLE_VALUE)
+      break;
+    h = (cons_ud*)lua_newuserdata(L, sizeof(cons_ud));
+    h->hnd = hnd;
+    h->type = POOLED_BUFFER;
+    luaL_getmetatable(L, ConsoleHandleType);
+    lua_setmetatable(L, -2);
+    lua_rawseti(L, -2, i + 1);
+    if (GetConsoleScreenBufferInfo(hnd, &info))
+      ud->size[i] = info.dwSize;
+  }
+  lua_setuservalue(L, -2);
+  if (i < n) {
+    ud->n = i;                 // for close() to give back what was taken
+    lua_pushcfunction(L, swapchain_close);
+    lua_pushvalue(L, -2);
+    lua_call(L, 1, 0);
+    return lua_pushnil(L), 1;
+  }
+  return 1;
+}
+
+// chain:back(): the handle to draw into; it is resized first if the chain
+// has been. A buffer holds what was drawn in it n-1 presents ago (or before
+// it was pooled).
+static int swapchain_back (lua_State *L)
+{
+  swapchain_ud *ud = check_swapchain(L, 1);
+  cons_ud *h = push_buffer(L, 1, ud->back);
+  COORD *size = &ud->size[ud->back];
+  if (size->X != ud->width || size->Y != ud->height) {
+    COORD wanted;
+    wanted.X = ud->width;
+    wanted.Y = ud->height;
+    if (!ResizeBuffer(h->hnd, wanted))
+      return lua_pushnil(L), 1;
+    *size = wanted;
+    ud->stats.resizes++;
+  }
+  return 1;
+}
+
+// chain:front(): the handle of the buffer on the screen, nil before present()
+static int swapchain_front (lua_State *L)
+{
+  swapchain_ud *ud = check_swapchain(L, 1);
+  if (ud->front < 0)
+    return lua_pushnil(L), 1;
+  push_buffer(L, 1, ud->front);
+  return 1;
+}
+
+// chain:present(): make the back buffer the active one; the next buffer
+// becomes the back one. Returns true, or nil if the console refused.
+static int swapchain_present (lua_State *L)
+{
+  swapchain_ud *ud = check_swapchain(L, 1);
+  cons_ud *h = push_buffer(L, 1, ud->back);
+  if (!SetConsoleActiveScreenBuffer(h->hnd))
+    return lua_pushnil(L), 1;
+  ud->front = ud->back;
+  ud->back = (ud->back + 1) % ud->n;
+  ud->stats.presents++;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+// chain:resize(width, height): the buffers take the size as they become the
+// back buffer
+static int swapchain_resize (lua_State *L)
+{
+  swapchain_ud *ud = check_swapchain(L, 1);
+  int width = luaL_checkinteger(L, 2), height = luaL_checkinteger(L, 3);
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 2, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 3, "invalid height");
+  ud->width = width;
+  ud->height = height;
+  return 0;
+}
+
+static int swapchain_size (lua_State *L)
+{
+  swapchain_ud *ud = check_swapchain(L, 1);
+  lua_pushinteger(L, ud->width);
+  lua_pushinteger(L, ud->height);
+  return 2;
+}
+
+static int swapchain_tostring (lua_State *L)
+{
+  swapchain_ud *ud = (swapchain_ud*)luaL_checkudata(L, 1, SwapChainType);
+  if (ud->closed)
+    lua_pushfstring(L, "%s (closed)", SwapChainType);
+  else
+    lua_pushfstring(L, "%s (%d x %dx%d)", SwapChainType, ud->n, ud->width, ud->height);
+  return 1;
+}
+
+static int swapchain_stats (lua_State *L)
+{
+  const swap_stats *st = &check_swapchain(L, 1)->stats;
+  lua_createtable(L, 0, 4);
+  PutNumToTable(L, "presents", st->presents);
+  PutNumToTable(L, "created", st->created);
+  PutNumToTable(L, "reused", st->reused);
+  PutNumToTable(L, "resizes", st->resizes);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Recorder: what the window of a screen buffer shows, written to a file as
+// timestamped frames (see rec.h). Output through this library to the handle
+// marks the rows it changed; at most every 'interval' ms, at the next such
+// output, the changed rows that are in the window are read back from the
+// console and encoded. Output by others is only caught by frame().
+//---------------------------------------------------------------------------
+#define MAX_RECORDERS  8
+
+typedef struct {
+  HANDLE h;
+  rec_writer w;
+  cellbuf screen;          // the window as last read (malloc'ed cells)
+  SMALL_RECT window;       // where it was
+  int top, bottom;         // rows of the buffer changed since; top > bottom: none
+  bool pending;            // output since the last capture
+  unsigned interval;       // ms from a capture to the next
+  DWORD start, last;       // GetTickCount() at the start and at the last capture
+  unsigned long captures;
+  unsigned long cells_read;
+  unsigned long errors;
+  bool closed;
+} recorder_ud;
+
+typedef struct {
+  rec_reader r;
+  bool closed;
+} player_ud;
+
+// registry: the open recorders of the state
+static const char RecordersKey = 0;
+
+typedef struct {
+  int n;
+  recorder_ud *list[MAX_RECORDERS];
+} recorder_list;
+
+static void CreateRecorderList (lua_State *L)
+{
+  lua_pushlightuserdata(L, (void*)&RecordersKey);
+  ((recorder_list*)lua_newuserdata(L, sizeof(recorder_list)))->n = 0;
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+static recorder_list* get_recorders (lua_State *L)
+{
+  recorder_list *rl;
+  lua_pushlightuserdata(L, (void*)&RecordersKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  rl = (recorder_list*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return rl;
+}
+
+// read the changed rows of the window into the screen and add a frame
+static bool Capture (recorder_ud *ud)
+{
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  CONSOLE_CURSOR_INFO ci;
+  SMALL_RECT *win = &info.srWindow;
+  rec_frame fr;
+  int width, height, top, bottom;
+  bool full;
+
+  ud->last = GetTickCount();
+  ud->captures++;
+  ud->pending = false;
+  if (!GetConsoleScreenBufferInfo(ud->h, &info))
+    return ud->errors++, false;
+  if (!GetConsoleCursorInfo(ud->h, &ci)) {
+    ci.dwSize = 25;
+    ci.bVisible = TRUE;
+  }
+  width = win->Right - win->Left + 1;
+  height = win->Bottom - win->Top + 1;
+  full = !ud->screen.cells || memcmp(win, &ud->window, sizeof(SMALL_RECT)) != 0;
+  if (width != ud->screen.width || height != ud->screen.height || !ud->screen.cells) {
+    cell_t *cells = (cell_t*)realloc(ud->screen.cells, (size_t)width * height * sizeof(cell_t));
+    if (!cells)
+      return ud->errors++, false;
+    cellbuf_init(&ud->screen, width, height, cells);
+  }
+  top = full ? 0 : ud->top - win->Top;
+  bottom = full ? height - 1 : ud->bottom - win->Top;
+  if (top < 0) top = 0;
+  if (bottom > height - 1) bottom = height - 1;
+  ud->window = *win;
+  ud->top = 1;
+  ud->bottom = 0;
+
+  if (top <= bottom) {
+    COORD dwBufferCoord;
+    SMALL_RECT region;
+    dwBufferCoord.X = 0;
+    dwBufferCoord.Y = top;
+    region.Left = win->Left;
+    region.Right = win->Right;
+    region.Top = win->Top + top;
+    region.Bottom = win->Top + bottom;
+    if (!ReadCells(NULL, ud->h, &ud->screen, dwBufferCoord, &region, true))
+      return ud->errors++, false;
+    ud->cells_read += (unsigned long)(bottom - top + 1) * width;
+  }
+  fr.time = ud->last - ud->start;
+  fr.cursor_x = info.dwCursorPosition.X - win->Left;
+  fr.cursor_y = info.dwCursorPosition.Y - win->Top;
+  fr.cursor_size = ci.dwSize;
+  fr.cursor_visible = ci.bVisible && fr.cursor_x >= 0 && fr.cursor_x < width &&
+                      fr.cursor_y >= 0 && fr.cursor_y < height;
+  if (!fr.cursor_visible)
+    fr.cursor_x = fr.cursor_y = 0;
+  if (!rec_writer_frame(&ud->w, &ud->screen, &fr, top, bottom))
+    return ud->errors++, false;
+  return true;
+}
+
+static void RecordOutput (lua_State *L, HANDLE h, int top, int bottom)
+{
+  recorder_list *rl = get_recorders(L);
+  int i;
+  for (i=0; i<rl->n; i++) {
+    recorder_ud *ud = rl->list[i];
+    if (ud->h != h)
+      continue;
+    if (top <= bottom) {
+      if (ud->top > ud->bottom) {
+        ud->top = top;
+        ud->bottom = bottom;
+      }
+      else {
+        if (top < ud->top) ud->top = top;
+        if (bottom > ud->bottom) ud->bottom = bottom;
+      }
+    }
+    ud->pending = true;
+    if (GetTickCount() - ud->last >= ud->interval)
+      Capture(ud);
+  }
+}
+
+static recorder_ud* check_recorder (lua_State *L, int pos)
+{
+  recorder_ud *ud = (recorder_ud*)luaL_checkudata(L, pos, RecorderType);
+  luaL_argcheck(L, !ud->closed, pos, "recorder is closed");
+  return ud;
+}
+
+// cons.Recorder(h, path [, {interval=, keyframe=}]): record what the window of
+// h shows into the file at path; interval is the least time between two
+// frames in ms (16 by default), keyframe the number of frames from one
+// keyframe to the next. Returns nil and a message if the file can not be
+// created.
+static int f_Recorder (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  const char *path = luaL_checkstring(L, 2);
+  int interval = 16, keyframe = 0;
+  recorder_list *rl = get_recorders(L);
+  recorder_ud *ud;
+  if (lua_istable(L, 3)) {
+    lua_pushvalue(L, 3);
+    interval = GetOptIntFromTable(L, "interval", interval);
+    keyframe = GetOptIntFromTable(L, "keyframe", keyframe);
+    lua_pop(L, 1);
+  }
+  luaL_argcheck(L, interval >= 0, 3, "invalid interval");
+  luaL_argcheck(L, keyframe >= 0, 3, "invalid keyframe");
+  if (rl->n == MAX_RECORDERS) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "too many recorders");
+    return 2;
+  }
+  ud = (recorder_ud*)lua_newuserdata(L, sizeof(recorder_ud));
+  memset(ud, 0, sizeof(recorder_ud));
+  ud->closed = true;
+  luaL_getmetatable(L, RecorderType);
+  lua_setmetatable(L, -2);
+  if (!rec_writer_open(&ud->w, path, keyframe)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "cannot create %s", path);
+    return 2;
+  }
+  ud->h = h;
+  ud->interval = interval;
+  ud->top = 0;
+  ud->bottom = 0x7FFF;
+  ud->start = GetTickCount();
+  ud->closed = false;
+  // the handle lives as long as the recorder
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, 1);
+  lua_rawseti(L, -2, 1);
+  lua_setuservalue(L, -2);
+  rl->list[rl->n++] = ud;
+  COUNT_INC(&recording);
+  Capture(ud);
+  return 1;
+}
+
+// rec:frame(): read the whole window now and add a frame if anything changed
+// (for output by others, or from a timer when there was no output);
+// returns true, or nil if the console or the file failed
+static int recorder_frame (lua_State *L)
+{
+  recorder_ud *ud = check_recorder(L, 1);
+  ud->top = 0;
+  ud->bottom = 0x7FFF;
+  if (!Capture(ud))
+    return lua_pushnil(L), 1;
+  return lua_pushboolean(L, 1), 1;
+}
+
+// rec:close(): add the last output, then the index; returns true, or nil if
+// writing the file failed at any point
+static int recorder_close (lua_State *L)
+{
+  recorder_ud *ud = (recorder_ud*)luaL_checkudata(L, 1, RecorderType);
+  recorder_list *rl = get_recorders(L);
+  int i, ok;
+  if (ud->closed)
+    return 0;
+  if (ud->pending)
+    Capture(ud);
+  for (i=0; i<rl->n; i++) {
+    if (rl->list[i] == ud) {
+      rl->list[i] = rl->list[--rl->n];
+      COUNT_DEC(&recording);
+      break;
+    }
+  }
+  ok = rec_writer_close(&ud->w);
+  free(ud->screen.cells);
+  ud->screen.cells = NULL;
+  ud->closed = true;
+  return ok ? (lua_pushboolean(L, 1), 1) : (lua_pushnil(L), 1);
+}
+
+static int recorder_tostring (lua_State *L)
+{
+  recorder_ud *ud = (recorder_ud*)luaL_checkudata(L, 1, RecorderType);
+  if (ud->closed)
+    lua_pushfstring(L, "%s (closed)", RecorderType);
+  else
+    lua_pushfstring(L, "%s (%d frames)", RecorderType, (int)ud->w.stats.frames);
+  return 1;
+}
+
+static int recorder_stats (lua_State *L)
+{
+  recorder_ud *ud = check_recorder(L, 1);
+  const rec_stats *st = &ud->w.stats;
+  lua_createtable(L, 0, 8);
+  PutNumToTable(L, "frames", st->frames);
+  PutNumToTable(L, "keyframes", st->keyframes);
+  PutNumToTable(L, "unchanged", st->unchanged);
+  PutNumToTable(L, "cells", st->cells);
+  PutNumToTable(L, "bytes", (double)st->bytes);
+  PutNumToTable(L, "captures", ud->captures);
+  PutNumToTable(L, "cells_read", ud->cells_read);
+  PutNumToTable(L, "errors", ud->errors);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Player: a recording mapped into memory, shown frame by frame
+//---------------------------------------------------------------------------
+static player_ud* check_player (lua_State *L, int pos)
+{
+  player_ud *ud = (player_ud*)luaL_checkudata(L, pos, PlayerType);
+  luaL_argcheck(L, !ud->closed, pos, "player is closed");
+  return ud;
+}
+
+// cons.Player(path): returns nil and a message if the file can not be read
+// or is not a recording
+static int f_Player (lua_State *L)
+{
+  const char *path = luaL_checkstring(L, 1);
+  player_ud *ud = (player_ud*)lua_newuserdata(L, sizeof(player_ud));
+  memset(ud, 0, sizeof(player_ud));
+  ud->closed = true;
+  luaL_getmetatable(L, PlayerType);
+  lua_setmetatable(L, -2);
+  if (!rec_reader_open(&ud->r, path)) {
+    lua_pushnil(L);
+    lua_pushfstring(L, "cannot read %s", path);
+    return 2;
+  }
+  ud->closed = false;
+  return 1;
+}
+
+static int player_close (lua_State *L)
+{
+  player_ud *ud = (player_ud*)luaL_checkudata(L, 1, PlayerType);
+  if (!ud->closed) {
+    rec_reader_close(&ud->r);
+    ud->closed = true;
+  }
+  return 0;
+}
+
+static int player_tostring (lua_State *L)
+{
+  player_ud *ud = (player_ud*)luaL_checkudata(L, 1, PlayerType);
+  if (ud->closed)
+    lua_pushfstring(L, "%s (closed)", PlayerType);
+  else
+    lua_pushfstring(L, "%s (%d frames)", PlayerType, (int)ud->r.nframes);
+  return 1;
+}
+
+// push the time of the frame shown, or nil
+static int push_frame_time (lua_State *L, const rec_reader *r, int ok)
+{
+  if (!ok || r->frame < 0)
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, r->cur.time);
+  return 1;
+}
+
+// p:next(): show the next frame; returns its time in ms, or nil at the end
+static int player_next (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  return push_frame_time(L, &ud->r, rec_reader_next(&ud->r));
+}
+
+// p:seek(ms): show the last frame at or before ms; returns its time
+static int player_seek (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  int ms = luaL_checkinteger(L, 2);
+  return push_frame_time(L, &ud->r, rec_reader_seek(&ud->r, ms < 0 ? 0 : ms));
+}
+
+// p:time(): time of the frame shown and its number (from 1), or nil
+static int player_time (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  if (!push_frame_time(L, &ud->r, 1) || ud->r.frame < 0)
+    return 1;
+  lua_pushinteger(L, ud->r.frame + 1);
+  return 2;
+}
+
+// p:size(): width and height of the frame shown (0, 0 before the first)
+static int player_size (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  bool shown = ud->r.frame >= 0;
+  lua_pushinteger(L, shown ? ud->r.screen.width : 0);
+  lua_pushinteger(L, shown ? ud->r.screen.height : 0);
+  return 2;
+}
+
+// p:cursor(): x, y, visible, size
+static int player_cursor (lua_State *L)
+{
+  const rec_frame *fr = &check_player(L, 1)->r.cur;
+  lua_pushinteger(L, fr->cursor_x);
+  lua_pushinteger(L, fr->cursor_y);
+  lua_pushboolean(L, fr->cursor_visible);
+  lua_pushinteger(L, fr->cursor_size);
+  return 4;
+}
+
+// p:draw(buf [, x, y]): copy the frame shown into a CellBuffer at x, y
+// (0, 0 by default), clipped; returns true, or nil before the first frame
+static int player_draw (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  cellbuf *dst = check_cellbuf(L, 2);
+  int x = luaL_optinteger(L, 3, 0);
+  int y = luaL_optinteger(L, 4, 0);
+  cell_rect r;
+  if (ud->r.frame < 0)
+    return lua_pushnil(L), 1;
+  r.Left = r.Top = 0;
+  r.Right = ud->r.screen.width - 1;
+  r.Bottom = ud->r.screen.height - 1;
+  cellbuf_copy_rect(dst, x, y, &ud->r.screen, r);
+  return lua_pushboolean(L, 1), 1;
+}
+
+static int player_stats (lua_State *L)
+{
+  player_ud *ud = check_player(L, 1);
+  lua_createtable(L, 0, 4);
+  PutNumToTable(L, "frames", ud->r.nframes);
+  PutNumToTable(L, "keyframes", (double)ud->r.nindex);
+  PutNumToTable(L, "duration", ud->r.duration);
+  PutNumToTable(L, "bytes", (double)ud->r.len);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Scrollback: lines beyond what a screen buffer holds (see scrollback.h),
+// appended as text and shown a window at a time
+//---------------------------------------------------------------------------
+typedef struct {
+  scrollback sb;
+  bool closed;
+} scrollback_ud;
+
+static scrollback_ud* check_scrollback (lua_State *L, int pos)
+{
+  scrollback_ud *ud = (scrollback_ud*)luaL_checkudata(L, pos, ScrollbackType);
+  luaL_argcheck(L, !ud->closed, pos, "scrollback is closed");
+  return ud;
+}
+
+// cons.Scrollback([params]): params.chunk (bytes of lines per chunk), limit
+// (the oldest chunks are dropped while this many lines are left without
+// them), spill (a file for the chunks but the 'resident' newest ones);
+// returns nil and a message if the spill file can not be created
+static int f_Scrollback (lua_State *L)
+{
+  int chunk = SCROLLBACK_CHUNK, limit = 0, resident = SCROLLBACK_RESIDENT;
+  const char *spill = NULL;
+  scrollback_ud *ud;
+  if (!lua_isnoneornil(L, 1)) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_pushvalue(L, 1);
+    chunk = GetOptIntFromTable(L, "chunk", chunk);
+    limit = GetOptIntFromTable(L, "limit", limit);
+    resident = GetOptIntFromTable(L, "resident", resident);
+    lua_getfield(L, -1, "spill");
+    spill = lua_tostring(L, -1);
+    lua_pop(L, 2);
+    luaL_argcheck(L, chunk >= 1024, 1, "invalid chunk size");
+    luaL_argcheck(L, limit >= 0, 1, "invalid limit");
+    luaL_argcheck(L, resident >= 1, 1, "invalid resident count");
+  }
+  ud = (scrollback_ud*)lua_newuserdata(L, sizeof(scrollback_ud));
+  scrollback_init(&ud->sb, chunk, limit);
+  ud->closed = false;
+  luaL_getmetatable(L, ScrollbackType);
+  lua_setmetatable(L, -2);
+  if (spill && !scrollback_spill(&ud->sb, spill, resident)) {
+    ud->closed = true;
+    lua_pushnil(L);
+    lua_pushfstring(L, "cannot create %s", spill);
+    return 2;
+  }
+  return 1;
+}
+
+static int sb_close (lua_State *L)
+{
+  scrollback_ud *ud = (scrollback_ud*)luaL_checkudata(L, 1, ScrollbackType);
+  if (!ud->closed) {
+    scrollback_free(&ud->sb);
+    ud->closed = true;
+  }
+  return 0;
+}
+
+static int sb_tostring (lua_State *L)
+{
+  scrollback_ud *ud = (scrollback_ud*)luaL_checkudata(L, 1, ScrollbackType);
+  if (ud->closed)
+    lua_pushfstring(L, "%s (closed)", ScrollbackType);
+  else
+    lua_pushfstring(L, "%s (%d lines)", ScrollbackType, (int)ud->sb.count);
+  return 1;
+}
+
+// sb:append(utf8 [, attr]): one line per line of the text ("\r\n" or "\n";
+// a final one ends the last line), one UTF-16 unit per cell; returns the
+// number of the last line, or nil if out of memory
+static int sb_append (lua_State *L)
+{
+  size_t len;
+  scrollback_ud *ud = check_scrollback(L, 1);
+  const char *s = luaL_checklstring(L, 2, &len);
+  WORD attr = opt_cell_attr(L, 3, DefaultCell.Attributes);
+  unsigned short *w = (unsigned short*)GetScratch(L, (len ? len : 1) * sizeof(unsigned short));
+  const char *end = s + len;
+  bool ok = true;
+  do {
+    const char *nl = (const char*)memchr(s, '\n', end - s);
+    size_t n = (nl ? nl : end) - s;
+    if (n && s[n-1] == '\r' && nl)
+      n--;
+    ok = scrollback_append_text(&ud->sb, w, (int)utf8_to_utf16(s, n, w, NULL), attr);
+    s = nl ? nl + 1 : end;
+  } while (ok && s < end);
+  ReleaseScratch(L, w);
+  if (!ok)
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, ud->sb.first + ud->sb.count - 1);
+  return 1;
+}
+
+// sb:append_row(buf, y [, width]): row y of a CellBuffer as a line, its first
+// 'width' cells (all by default); returns the number of the line
+static int sb_append_row (lua_State *L)
+{
+  scrollback_ud *ud = check_scrollback(L, 1);
+  cellbuf *cb = check_cellbuf(L, 2);
+  int y = luaL_checkinteger(L, 3);
+  int width = luaL_optinteger(L, 4, cb->width);
+  luaL_argcheck(L, y >= 0 && y < cb->height, 3, "row out of range");
+  if (width > cb->width)
+    width = cb->width;
+  if (!scrollback_append_cells(&ud->sb, CELLBUF_AT(cb, 0, y), width))
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, ud->sb.first + ud->sb.count - 1);
+  return 1;
+}
+
+// sb:lines(): the number of the oldest line kept (from 0) and how many are
+static int sb_lines (lua_State *L)
+{
+  scrollback_ud *ud = check_scrollback(L, 1);
+  lua_pushinteger(L, ud->sb.first);
+  lua_pushinteger(L, ud->sb.count);
+  return 2;
+}
+
+// sb:line(n): the text of line n as UTF-8, or nil if it is not kept
+static int sb_line (lua_State *L)
+{
+  scrollback_ud *ud = check_scrollback(L, 1);
+  long line = (long)luaL_checknumber(L, 2);
+  int n = scrollback_line(&ud->sb, line, NULL, 0), i;
+  cell_t *cells;
+  char *s, *p;
+  if (n < 0)
+    return lua_pushnil(L), 1;
+  // the cells, then their text: at most 3 bytes a cell
+  cells = (cell_t*)GetScratch(L, (n ? n : 1) * (sizeof(cell_t) + 3));
+  scrollback_line(&ud->sb, line, cells, n);
+  s = p = (char*)(cells + n);
+  for (i=0; i<n; i++)
+    p += utf8_encode(cells[i].Char, p);
+  lua_pushlstring(L, s, p - s);
+  ReleaseScratch(L, cells);
+  return 1;
+}
+
+// sb:render(target, first [, col [, attr]]): lines first, first+1, ... from
+// column col (0 by default) on, into a CellBuffer, or into the window of a
+// screen buffer with one WriteConsoleOutputW; what no line covers is blank in
+// 'attr'. Returns the number of rows that show a line, or nil if writing
+// to the console failed.
+static int sb_render (lua_State *L)
+{
+  scrollback_ud *ud = check_scrollback(L, 1);
+  cellbuf *target = (cellbuf*)test_udata(L, 2, CellBufferType);
+  long first = (long)luaL_checknumber(L, 3);
+  int col = luaL_optinteger(L, 4, 0);
+  cell_t blank;
+  CONSOLE_SCREEN_BUFFER_INFO info;
+  SMALL_RECT region;
+  COORD origin = { 0, 0 };
+  cellbuf cb;
+  HANDLE h;
+  int shown;
+  BOOL ok;
+  blank.Char = ' ';
+  blank.Attributes = opt_cell_attr(L, 5, DefaultCell.Attributes);
+  if (target) {
+    lua_pushinteger(L, scrollback_render(&ud->sb, first, col, target, blank));
+    return 1;
+  }
+  h = check_console_handle(L, 2);
+  if (!GetConsoleScreenBufferInfo(h, &info))
+    return lua_pushnil(L), 1;
+  region = info.srWindow;
+  cellbuf_init(&cb, region.Right - region.Left + 1, region.Bottom - region.Top + 1,
+    (cell_t*)GetScratch(L, (size_t)(region.Right - region.Left + 1) *
+                           (region.Bottom - region.Top + 1) * sizeof(cell_t)));
+  shown = scrollback_render(&ud->sb, first, col, &cb, blank);
+  ok = WriteCells(L, h, &cb, origin, &region, true);
+  ReleaseScratch(L, cb.cells);
+  if (!ok)
+    return lua_pushnil(L), 1;
+  lua_pushinteger(L, shown);
+  return 1;
+}
+
+static int sb_stats (lua_State *L)
+{
+  scrollback_ud *ud = check_scrollback(L, 1);
+  scrollback_stats st;
+  scrollback_get_stats(&ud->sb, &st);
+  lua_createtable(L, 0, 6);
+  PutNumToTable(L, "lines", st.lines);
+  PutNumToTable(L, "dropped", st.dropped);
+  PutNumToTable(L, "chunks", st.chunks);
+  PutNumToTable(L, "spilled", st.spilled);
+  PutNumToTable(L, "bytes", (double)st.bytes);
+  PutNumToTable(L, "spill_bytes", (double)st.spill_bytes);
+  return 1;
+}
+
+static int f_WriteConsole (lua_State *L)
+{
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  const TCHAR* lpBuffer = (const TCHAR*)luaL_checkstring(L, 2);
+  DWORD nNumOfCharsToWrite = lua_objlen(L, 2) / sizeof(TCHAR);
+  DWORD NumOfCharsWritten;
+  if (!WriteConsole(hConsoleOutput, lpBuffer, nNumOfCharsToWrite, &NumOfCharsWritten, 0))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfCharsWritten);
+  RECORD_ALL(L, hConsoleOutput);
+  lua_pushinteger(L, NumOfCharsWritten);
+  return 1;
+}
+
+static int f_WriteConsoleOutputAttribute (lua_State *L)
+{
+  COORD wWriteCoord;
+  DWORD NumOfAttrsWritten;
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  const WORD* lpAttribute = (const WORD*)luaL_checkstring(L, 2);
+  DWORD nLength = lua_objlen(L, 2) / sizeof(WORD);
+  wWriteCoord.X = luaL_checkinteger(L, 3);
+  wWriteCoord.Y = luaL_checkinteger(L, 4);
+  if (!WriteConsoleOutputAttribute(hConsoleOutput, lpAttribute, nLength, wWriteCoord,
+      &NumOfAttrsWritten))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfAttrsWritten);
+  RECORD_OUTPUT(L, hConsoleOutput, wWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, NumOfAttrsWritten);
+  return 1;
+}
+
+static int f_WriteConsoleOutputCharacter (lua_State *L)
+{
+  COORD wWriteCoord;
+  DWORD NumOfCharsWritten;
+  HANDLE hConsoleOutput = check_console_handle(L, 1);
+  LPCTSTR lpCharacter = (LPCTSTR)luaL_checkstring(L, 2);
+  DWORD nLength = lua_objlen(L, 2) / sizeof(TCHAR);
+  wWriteCoord.X = luaL_checkinteger(L, 3);
+  wWriteCoord.Y = luaL_checkinteger(L, 4);
+  if (!WriteConsoleOutputCharacter(hConsoleOutput, lpCharacter, nLength, wWriteCoord,
+      &NumOfCharsWritten))
+    return lua_pushnil(L), 1;
+  STATS_MOVED(L, NumOfCharsWritten);
+  RECORD_OUTPUT(L, hConsoleOutput, wWriteCoord.Y, 0x7FFF);
+  lua_pushinteger(L, NumOfCharsWritten);
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// Loop: an event loop (see loop.h) that calls back timers and handles and
+// runs Lua coroutines ("tasks") which sleep and wait on handles. When nothing
+// is ready it blocks in WaitForMultipleObjects until a handle is signalled
+// or the next timer is due.
+//---------------------------------------------------------------------------
+typedef struct {
+  event_loop lp;
+  int next_id;
+  int ntasks;
+  int nready;               // tasks in the LOOP_READY table
+  bool running;
+  bool stop;
+  bool parked;              // the task resumed last yielded through the loop
+  unsigned long resumes;    // of tasks
+  unsigned long calls;      // of callbacks
+  double latency_ms;        // total and worst of the time from an event being
+  double latency_max;       // due or seen to its code running
+} loop_ud;
+
+// the tables in the uservalue of a Loop
+enum {
+  LOOP_CODE = 1,   // [id] = the function called, or the task resumed, on id
+  LOOP_OBJECTS,    // [id] = the handle object waited on for id
+  LOOP_TASKS,      // [task] = true for the coroutines of the loop
+  LOOP_READY,      // tasks to resume on the next turn, in order
+  LOOP_SPARE       // an empty table, to be LOOP_READY on the next turn
+};
+
+#if LUA_VERSION_NUM >= 504
+static int LuaResume (lua_State *co, lua_State *from, int narg)
+{
+  int nres;
+  return lua_resume(co, from, narg, &nres);
+}
+#elif LUA_VERSION_NUM >= 502
+# define LuaResume(co, from, narg)  lua_resume(co, from, narg)
+#else
+# define LuaResume(co, from, narg)  lua_resume(co, narg)
+#endif
+
+static int loop_wait_handles (void *ctx, const intptr_t *handles, int n, int timeout_ms)
+{
+  DWORD r, timeout = timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms;
+  (void)ctx;
+  if (n == 0) {
+    Sleep(timeout);
+    return LOOP_TIMEOUT;
+  }
+  r = WaitForMultipleObjects(n, (const HANDLE*)handles, FALSE, timeout);
+  if (r < WAIT_OBJECT_0 + (DWORD)n)
+    return r - WAIT_OBJECT_0;
+  return r == WAIT_TIMEOUT ? LOOP_TIMEOUT : -1;
+}
+
+static loop_ud* check_loop (lua_State *L, int pos)
+{
+  return (loop_ud*)luaL_checkudata(L, pos, LoopType);
+}
+
+static void push_loop_table (lua_State *L, int pos, int which)
+{
+  lua_getuservalue(L, pos);
+  lua_rawgeti(L, -1, which);
+  lua_remove(L, -2);
+}
+
+// set [id] of one of the tables to the value on top of the stack (popped)
+static void set_loop_entry (lua_State *L, int pos, int which, int id)
+{
+  push_loop_table(L, pos, which);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, id);
+  lua_pop(L, 1);
+}
+
+// put the task on top of the stack (popped) on the ready list
+static void push_ready (lua_State *L, int pos, loop_ud *ud)
+{
+  push_loop_table(L, pos, LOOP_READY);
+  lua_insert(L, -2);
+  lua_rawseti(L, -2, ++ud->nready);
+  lua_pop(L, 1);
+}
+
+// a console handle or a HANDLE passed as a light userdata (a process, an
+// event...)
+static HANDLE check_wait_handle (lua_State *L, int pos)
+{
+  if (lua_islightuserdata(L, pos))
+    return (HANDLE)lua_touserdata(L, pos);
+  return check_console_handle(L, pos);
+}
+
+// the loop at index 1 in a task of it: the functions that suspend a task
+static loop_ud* check_loop_task (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  bool task;
+  push_loop_table(L, 1, LOOP_TASKS);
+  task = !lua_pushthread(L);
+  lua_rawget(L, -2);
+  task = task && lua_toboolean(L, -1);
+  lua_pop(L, 2);
+  if (!task)
+    luaL_error(L, "not called from a task of this loop");
+  return ud;
+}
+
+static int new_loop_id (loop_ud *ud)
+{
+  if (++ud->next_id <= 0)
+    ud->next_id = 1;
+  return ud->next_id;
+}
+
+// cons.loop(): a Loop
+static int f_loop (lua_State *L)
+{
+  loop_ud *ud = (loop_ud*)lua_newuserdata(L, sizeof(loop_ud));
+  int i;
+  memset(ud, 0, sizeof(*ud));
+  loop_init(&ud->lp);
+  luaL_getmetatable(L, LoopType);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, LOOP_SPARE, 0);
+  for (i=LOOP_CODE; i<=LOOP_SPARE; i++) {
+    lua_newtable(L);
+    lua_rawseti(L, -2, i);
+  }
+  lua_setuservalue(L, -2);
+  return 1;
+}
+
+static int lp_gc (lua_State *L)
+{
+  loop_free(&check_loop(L, 1)->lp);
+  return 0;
+}
+
+static int lp_tostring (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  lua_pushfstring(L, "%s (%d tasks, %d timers, %d handles)", LoopType, ud->ntasks,
+                  ud->lp.ntimers, ud->lp.nhandles);
+  return 1;
+}
+
+// loop:spawn(f, ...): a task running f(...), started on the next turn of
+// run(); returns the coroutine
+static int lp_spawn (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  int n = lua_gettop(L) - 1;
+  lua_State *co;
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+  co = lua_newthread(L);
+  lua_insert(L, 2);
+  lua_xmove(L, co, n);
+  push_loop_table(L, 1, LOOP_TASKS);
+  lua_pushvalue(L, 2);
+  lua_pushboolean(L, 1);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  lua_pushvalue(L, 2);
+  push_ready(L, 1, ud);
+  ud->ntasks++;
+  return 1;
+}
+
+// loop:sleep(ms) in a task: resumes it when ms have passed; returns how
+// many ms later than that it ran
+static int lp_sleep (lua_State *L)
+{
+  loop_ud *ud = check_loop_task(L);
+  double ms = luaL_checknumber(L, 2);
+  int id = new_loop_id(ud);
+  if (!loop_add_timer(&ud->lp, id, loop_now() + ms, 0))
+    return lua_pushnil(L), 1;
+  lua_pushthread(L);
+  set_loop_entry(L, 1, LOOP_CODE, id);
+  ud->parked = true;
+  return lua_yield(L, 0);
+}
+
+// loop:wait(h [, ms]) in a task: resumes it when handle h is signalled
+// (for console input: there are events to read) or ms have passed; returns
+// true or false (timeout)
+static int lp_wait (lua_State *L)
+{
+  loop_ud *ud = check_loop_task(L);
+  HANDLE h = check_wait_handle(L, 2);
+  int id = new_loop_id(ud);
+  if (!loop_add_handle(&ud->lp, id, (intptr_t)h))
+    return luaL_argerror(L, 2, "too many handles");
+  if (!lua_isnoneornil(L, 3) &&
+      !loop_add_timer(&ud->lp, id, loop_now() + luaL_checknumber(L, 3), 0)) {
+    loop_remove_handle(&ud->lp, id);
+    return lua_pushnil(L), 1;
+  }
+  lua_pushthread(L);
+  set_loop_entry(L, 1, LOOP_CODE, id);
+  lua_pushvalue(L, 2);
+  set_loop_entry(L, 1, LOOP_OBJECTS, id);
+  ud->parked = true;
+  return lua_yield(L, 0);
+}
+
+// loop:yield() in a task: lets the others run and resumes it on the next
+// turn (so does coroutine.yield())
+static int lp_yield (lua_State *L)
+{
+  check_loop_task(L);
+  return lua_yield(L, 0);
+}
+
+// loop:timer(ms, f [, interval]): call f(loop, id) in ms, and with an
+// interval every interval ms after that; returns the id
+static int lp_timer (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  double ms = luaL_checknumber(L, 2);
+  double interval = luaL_optnumber(L, 4, 0);
+  int id;
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  luaL_argcheck(L, interval >= 0, 4, "invalid interval");
+  id = new_loop_id(ud);
+  if (!loop_add_timer(&ud->lp, id, loop_now() + ms, interval))
+    return lua_pushnil(L), 1;
+  lua_pushvalue(L, 3);
+  set_loop_entry(L, 1, LOOP_CODE, id);
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+// loop:watch(h, f): call f(loop, id) whenever handle h is signalled (f
+// should take what signals it, e.g. read the input, or it is called again
+// at once); returns the id
+static int lp_watch (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  HANDLE h = check_wait_handle(L, 2);
+  int id;
+  luaL_checktype(L, 3, LUA_TFUNCTION);
+  id = new_loop_id(ud);
+  if (!loop_add_handle(&ud->lp, id, (intptr_t)h))
+    return luaL_argerror(L, 2, "too many handles");
+  lua_pushvalue(L, 3);
+  set_loop_entry(L, 1, LOOP_CODE, id);
+  lua_pushvalue(L, 2);
+  set_loop_entry(L, 1, LOOP_OBJECTS, id);
+  lua_pushinteger(L, id);
+  return 1;
+}
+
+// loop:cancel(id): stop a timer or a watch; returns true if there was one
+static int lp_cancel (lua_State *L)
+{
+  loop_ud *ud = check_loop(L, 1);
+  int id = luaL_checkinteger(L, 2);
+  bool found;
+  push_loop_table(L, 1, LOOP_CODE);
+  lua_rawgeti(L, -1, id);
+  found = lua_isfunction(L, -1);
+  lua_pop(L, 2);
+  if (found) {
+    loop_cancel_timer(&ud->lp, id);
+    loop_remove_handle(&ud->lp, id);
+    lua_pushnil(L);
+    set_loop_entry(L, 1, LOOP_CODE, id);
+    lua_pushnil(L);
+    set_loop_entry(L, 1, LOOP_OBJECTS, id);
+  }
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+// Resume task co, passing it the nargs values on top of the stack. A task
+// that yields by itself is resumed on the next turn; one that ends is
+// dropped. Return false if it failed, with its error pushed.
+static bool resume_task (lua_State *L, loop_ud *ud, lua_State *co, int nargs)
+{
+  int status;
+  if (lua_status(co) == LUA_YIELD) {
+    lua_settop(co, 0);
+    lua_xmove(L, co, nargs);
+  }
+  else {
+    lua_pop(L, nargs);
+    nargs = lua_gettop(co) - 1;     // a new task: its function and arguments
+  }
+  ud->parked = false;
+  ud->resumes++;
+  status = LuaResume(co, L, nargs);
+  if (status == LUA_YIELD) {
+    if (!ud->parked) {
+      lua_pushthread(co);
+      lua_xmove(co, L, 1);
+      push_ready(L, 1, ud);
+    }
+    return true;
+  }
+  push_loop_table(L, 1, LOOP_TASKS);
+  lua_pushthread(co);
+  lua_xmove(co, L, 1);
+  lua_pushnil(L);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+  ud->ntasks--;
+  if (status != 0) {
+    lua_xmove(co, L, 1);
+    return false;
+  }
+  return true;
+}
+
+static void account_latency (loop_ud *ud, double at)
+{
+  double ms = loop_now() - at;
+  if (ms < 0)
+    ms = 0;
+  ud->latency_ms += ms;
+  if (ud->latency_max < ms)
+    ud->latency_max = ms;
+}
+
+static void dispatch_event (lua_State *L, loop_ud *ud, const loop_event *ev)
 {
-  DWORD n;
-  GetNumberOfConsoleMouseButtons(&n) ? lua_pushinteger(L, n) : lua_pushnil(L);
+  push_loop_table(L, 1, LOOP_CODE);
+  lua_rawgeti(L, -1, ev->id);
+  lua_remove(L, -2);
+  if (lua_isthread(L, -1)) {
+    // a task in sleep() or wait(): it has waited for both or one of these
+    lua_State *co = lua_tothread(L, -1);
+    bool waited;
+    loop_cancel_timer(&ud->lp, ev->id);
+    loop_remove_handle(&ud->lp, ev->id);
+    lua_pushnil(L);
+    set_loop_entry(L, 1, LOOP_CODE, ev->id);
+    push_loop_table(L, 1, LOOP_OBJECTS);
+    lua_rawgeti(L, -1, ev->id);
+    waited = !lua_isnil(L, -1);
+    lua_pop(L, 2);
+    if (waited) {
+      lua_pushnil(L);
+      set_loop_entry(L, 1, LOOP_OBJECTS, ev->id);
+      lua_pushboolean(L, ev->kind == LOOP_HANDLE);
+    }
+    else
+      lua_pushnumber(L, loop_now() - ev->at);
+    account_latency(ud, ev->at);
+    if (!resume_task(L, ud, co, 1))
+      lua_error(L);
+    lua_pop(L, 1);
+  }
+  else if (lua_isfunction(L, -1)) {
+    if (ev->kind == LOOP_TIMER && !ev->again) {
+      lua_pushnil(L);
+      set_loop_entry(L, 1, LOOP_CODE, ev->id);
+    }
+    lua_pushvalue(L, 1);
+    lua_pushinteger(L, ev->id);
+    ud->calls++;
+    account_latency(ud, ev->at);
+    lua_call(L, 2, 0);
+  }
+  else
+    lua_pop(L, 1);
+}
+
+// resume the tasks that were ready at the start of the turn; those made
+// ready meanwhile go to the spare table, which takes the place of the list.
+// After a stop or a failed task the rest stay ready, ahead of those, and the
+// tables are back in order before the task's error is raised.
+static void run_ready (lua_State *L, loop_ud *ud)
+{
+  int i, j, left, n = ud->nready;
+  bool failed = false;
+  if (n == 0)
+    return;
+  lua_getuservalue(L, 1);
+  lua_rawgeti(L, -1, LOOP_READY);
+  lua_rawgeti(L, -2, LOOP_SPARE);
+  lua_rawseti(L, -3, LOOP_READY);
+  ud->nready = 0;
+  for (i=1; i<=n && !ud->stop && !failed; i++) {
+    lua_State *co;
+    lua_rawgeti(L, -1, i);
+    lua_pushnil(L);
+    lua_rawseti(L, -3, i);
+    co = lua_tothread(L, -1);
+    if (!co || resume_task(L, ud, co, 0))
+      lua_pop(L, 1);
+    else {
+      lua_replace(L, -2);          // the error, below the tables
+      lua_insert(L, -3);
+      failed = true;
+    }
+  }
+  left = n - i + 1;
+  if (left > 0) {
+    lua_rawgeti(L, -2, LOOP_READY);
+    for (j=ud->nready; j>=1; j--) {
+      lua_rawgeti(L, -1, j);
+      lua_rawseti(L, -2, j + left);
+    }
+    for (j=1; j<=left; j++) {
+      lua_rawgeti(L, -2, i + j - 1);
+      lua_rawseti(L, -2, j);
+      lua_pushnil(L);
+      lua_rawseti(L, -3, i + j - 1);
+    }
+    ud->nready += left;
+    lua_pop(L, 1);
+  }
+  lua_rawseti(L, -2, LOOP_SPARE);
+  lua_pop(L, 1);
+  if (failed)
+    lua_error(L);
+}
+
+// the body of run(), called protected: 1 = loop, 2 = until
+static int run_loop (lua_State *L)
+{
+  loop_ud *ud = (loop_ud*)lua_touserdata(L, 1);
+  double until = lua_tonumber(L, 2);
+  loop_backend be;
+  loop_event ev;
+  be.wait = loop_wait_handles;
+  be.ctx = NULL;
+  while (!ud->stop) {
+    bool ready;
+    int r;
+    run_ready(L, ud);
+    if (ud->stop)
+      break;
+    ready = ud->nready > 0;
+    if (!ready)
+      FlushWriters(L);
+    r = loop_next(&ud->lp, &be, ready ? loop_now() : until, &ev);
+    if (r < 0)
+      return lua_pushnil(L), 1;
+    if (r > 0)
+      dispatch_event(L, ud, &ev);
+    else if (!ready || (until >= 0 && loop_now() >= until))
+      break;
+  }
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int f_GenerateConsoleCtrlEvent (lua_State *L)
+// loop:run([ms]): run until loop:stop() is called, nothing is left to wait
+// for, or ms have passed. An error in a callback or a task is raised from
+// here; the loop can be run again after it. Returns true, or nil if waiting
+// failed.
+static int lp_run (lua_State *L)
 {
-  DWORD dwCtrlEvent = check_env_flag(L, 1);
-  DWORD dwProcessGroupId = luaL_checkinteger(L, 2);
-  lua_pushboolean(L, GenerateConsoleCtrlEvent(dwCtrlEvent, dwProcessGroupId));
+  loop_ud *ud = check_loop(L, 1);
+  double until = lua_isnoneornil(L, 2) ? -1 : loop_now() + luaL_checknumber(L, 2);
+  int status;
+  luaL_argcheck(L, !ud->running, 1, "loop is running");
+  lua_settop(L, 1);
+  lua_pushcfunction(L, run_loop);
+  lua_pushvalue(L, 1);
+  lua_pushnumber(L, until);
+  ud->running = true;
+  ud->stop = false;
+  status = lua_pcall(L, 2, 1, 0);
+  ud->running = false;
+  if (status != 0)
+    return lua_error(L);
   return 1;
 }
 
-static int f_SetConsoleCtrlHandler (lua_State *L)
+static int lp_stop (lua_State *L)
 {
-  BOOL Add = lua_toboolean(L, 1);
-  return lua_pushboolean(L, SetConsoleCtrlHandler(NULL, Add)), 1;
+  check_loop(L, 1)->stop = true;
+  return 0;
 }
 
-static int f_FillConsoleOutputAttribute (lua_State *L)
+// loop:now(): ms on the loop's clock
+static int lp_now (lua_State *L)
 {
-  COORD dwWriteCoord;
-  DWORD NumOfAttrsWritten;
-  HANDLE h = check_console_handle(L, 1);
-  WORD wAttribute = CheckFlags(L, 2);
-  DWORD nLength = luaL_checkinteger(L, 3);
-  dwWriteCoord.X = luaL_checkinteger(L, 4);
-  dwWriteCoord.Y = luaL_checkinteger(L, 5);
-  FillConsoleOutputAttribute(h, wAttribute, nLength, dwWriteCoord, &NumOfAttrsWritten)
-    ? lua_pushinteger(L, NumOfAttrsWritten): lua_pushnil(L);
+  check_loop(L, 1);
+  lua_pushnumber(L, loop_now());
   return 1;
 }
 
-static int f_FillConsoleOutputCharacter (lua_State *L)
+static int lp_stats (lua_State *L)
 {
-  COORD dwWriteCoord;
-  DWORD NumOfAttrsWritten;
-  HANDLE h = check_console_handle(L, 1);
-  TCHAR cCharacter = *(const TCHAR*)luaL_checkstring(L, 2);
-  DWORD nLength = luaL_checkinteger(L, 3);
-  dwWriteCoord.X = luaL_checkinteger(L, 4);
-  dwWriteCoord.Y = luaL_checkinteger(L, 5);
-  FillConsoleOutputCharacter(h, cCharacter, nLength, dwWriteCoord, &NumOfAttrsWritten)
-    ? lua_pushinteger(L, NumOfAttrsWritten): lua_pushnil(L);
+  loop_ud *ud = check_loop(L, 1);
+  const loop_stats *st = &ud->lp.stats;
+  unsigned long events = st->timers + st->handles;
+  lua_createtable(L, 0, 10);
+  PutNumToTable(L, "tasks",   ud->ntasks);
+  PutNumToTable(L, "timers",  st->timers);
+  PutNumToTable(L, "handles", st->handles);
+  PutNumToTable(L, "waits",   st->waits);
+  PutNumToTable(L, "skipped", st->skipped);
+  PutNumToTable(L, "idle_ms", st->idle_ms);
+  PutNumToTable(L, "resumes", ud->resumes);
+  PutNumToTable(L, "calls",   ud->calls);
+  PutNumToTable(L, "latency_avg", events ? ud->latency_ms / events : 0);
+  PutNumToTable(L, "latency_max", ud->latency_max);
   return 1;
 }
 
-static int f_ReadConsole (lua_State *L)
+//---------------------------------------------------------------------------
+// Headless console (built with CONS_HEADLESS and linked with winshim.c): the
+// module runs over an in-memory console, where there is none, and these
+// functions play the user at it: a fresh console, scripted input, window
+// resizes, and the text on a screen buffer.
+//---------------------------------------------------------------------------
+#ifdef CONS_HEADLESS
+
+#include "winshim.h"
+
+// cons.headless_reset([width, height]): blank screen buffers of width x height
+// (80x25 by default), an empty input queue and the stats cleared; the screen
+// buffers created before are closed
+static int f_headless_reset (lua_State *L)
 {
-  HANDLE hConsoleInput = check_console_handle(L, 1);
-  DWORD NumOfCharsToRead = luaL_checkinteger(L, 2);
-  DWORD NumOfCharsRead;
-  LPVOID lpBuffer = lua_newuserdata(L, NumOfCharsToRead * sizeof(TCHAR));
-  ReadConsole(hConsoleInput, lpBuffer, NumOfCharsToRead, &NumOfCharsRead, NULL)
-    ? lua_pushinteger(L, NumOfCharsRead): lua_pushnil(L);
+  int width = luaL_optinteger(L, 1, 80);
+  int height = luaL_optinteger(L, 2, 25);
+  luaL_argcheck(L, width > 0 && width <= 0x7FFF, 1, "invalid width");
+  luaL_argcheck(L, height > 0 && height <= 0x7FFF, 2, "invalid height");
+  lua_pushboolean(L, winshim_reset(width, height));
   return 1;
 }
 
-static int f_ReadConsoleOutputAttribute (lua_State *L)
+// cons.headless_feed(records [, endless]): queue input records, in the form
+// WriteConsoleInput takes; with 'endless' the records read are queued again
+static int f_headless_feed (lua_State *L)
 {
-  COORD dwReadCoord;
-  DWORD NumOfAttrsRead, i;
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  DWORD nLength = luaL_checkinteger(L, 2);
-  dwReadCoord.X = luaL_checkinteger(L, 3);
-  dwReadCoord.Y = luaL_checkinteger(L, 4);
-  LPWORD lpAttribute = (LPWORD)lua_newuserdata(L, nLength * sizeof(WORD));
-  if (!ReadConsoleOutputAttribute(hConsoleOutput, lpAttribute, nLength,
-                                  dwReadCoord, &NumOfAttrsRead))
-  {
-    return lua_pushnil(L), 1;
-  }
-  lua_createtable(L, NumOfAttrsRead, 0);
-  for (i=0; i < NumOfAttrsRead; i++) {
-    lua_pushinteger(L, i+1);
-    lua_pushinteger(L, lpAttribute[i]);
-    lua_rawset(L, -3);
+  DWORD n, i;
+  INPUT_RECORD *records;
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = lua_objlen(L, 1);
+  luaL_argcheck(L, n, 1, "empty array");
+  CheckInputRecords(L, 1, n);
+  records = (INPUT_RECORD*)GetScratch(L, n * sizeof(INPUT_RECORD));
+  for (i=0; i < n; i++) {
+    lua_rawgeti(L, 1, i+1);
+    FillInputRecord(L, -1, records + i);
+    lua_pop(L, 1);
   }
+  winshim_feed(records, n, lua_toboolean(L, 2));
+  ReleaseScratch(L, records);
+  return 0;
+}
+
+// cons.headless_resize(h, width, height): the user resized the console window
+// of screen buffer h; a WINDOW_BUFFER_SIZE_EVENT is queued if h is shown and
+// the input mode has ENABLE_WINDOW_INPUT
+static int f_headless_resize (lua_State *L)
+{
+  HANDLE h = check_console_handle(L, 1);
+  int width = luaL_checkinteger(L, 2);
+  int height = luaL_checkinteger(L, 3);
+  if (!winshim_resize(h, width, height))
+    return lua_pushnil(L), 1;
+  RECORD_ALL(L, h);
+  lua_pushboolean(L, 1);
   return 1;
 }
 
-static int f_ReadConsoleOutputCharacter (lua_State *L)
+// cons.headless_text(h [, top [, bottom]]): rows top to bottom (all of them
+// by default) of screen buffer h as UTF-8 lines, trailing spaces cut, joined
+// with "\n"
+static int f_headless_text (lua_State *L)
 {
-  COORD dwReadCoord;
-  DWORD NumOfCharsRead;
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  DWORD nLength = luaL_checkinteger(L, 2);
-  dwReadCoord.X = luaL_checkinteger(L, 3);
-  dwReadCoord.Y = luaL_checkinteger(L, 4);
-  LPTSTR lpCharacter = (LPTSTR)lua_newuserdata(L, nLength * sizeof(TCHAR));
-  if (!ReadConsoleOutputCharacter(hConsoleOutput, lpCharacter, nLength,
-                                  dwReadCoord, &NumOfCharsRead))
-  {
+  HANDLE h = check_console_handle(L, 1);
+  int width, height, top, bottom, x, y, end;
+  const CHAR_INFO *cells = winshim_screen(h, &width, &height);
+  luaL_Buffer b;
+  char s[4];
+  if (!cells)
     return lua_pushnil(L), 1;
+  top = luaL_optinteger(L, 2, 0);
+  bottom = luaL_optinteger(L, 3, height - 1);
+  if (top < 0) top = 0;
+  if (bottom > height - 1) bottom = height - 1;
+  luaL_buffinit(L, &b);
+  for (y=top; y<=bottom; y++) {
+    const CHAR_INFO *row = cells + (size_t)y * width;
+    for (end=width; end>0 && row[end-1].Char.UnicodeChar == ' '; end--) {}
+    for (x=0; x<end; x++)
+      luaL_addlstring(&b, s, utf8_encode(row[x].Char.UnicodeChar, s));
+    if (y < bottom)
+      luaL_addchar(&b, '\n');
   }
-  lua_pushlstring(L, lpCharacter, NumOfCharsRead * sizeof(TCHAR));
+  luaL_pushresult(&b);
   return 1;
 }
 
-static int f_SetConsoleWindowInfo (lua_State *L)
+// cons.headless_stats(): cells written and read, and input records read, since
+// the last reset
+static int f_headless_stats (lua_State *L)
 {
-  SMALL_RECT rect;
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  BOOL bAbsolute = lua_toboolean(L, 2);
-  rect.Left = luaL_checkinteger(L, 3);
-  rect.Top = luaL_checkinteger(L, 4);
-  rect.Right = luaL_checkinteger(L, 5);
-  rect.Bottom = luaL_checkinteger(L, 6);
-  lua_pushboolean(L, SetConsoleWindowInfo(hConsoleOutput, bAbsolute, &rect));
+  const winshim_stats *st = winshim_get_stats();
+  lua_createtable(L, 0, 3);
+  PutNumToTable(L, "cells_written", st->cells_written);
+  PutNumToTable(L, "cells_read", st->cells_read);
+  PutNumToTable(L, "events_read", st->events_read);
   return 1;
 }
 
-static int f_WriteConsole (lua_State *L)
+#endif // CONS_HEADLESS
+
+//---------------------------------------------------------------------------
+// Statistics (built with CONS_STATS): the functions of cons_functions and
+// cons_methods (the ConsoleHandle methods) are registered as closures of
+// stats_call, which counts the calls, the failures (a first result of nil or
+// false, or an error raised) and the units moved, and times each call into a
+// histogram of log2(timer ticks). The methods of the other types (CellBuffer,
+// Renderer, Writer, ...) are not counted. The timer is the CPU's time-stamp
+// counter where there is one, otherwise a nanosecond clock. Switched on and
+// off per Lua state by cons.stats_enable().
+//---------------------------------------------------------------------------
+#ifdef CONS_STATS
+
+#define STATS_BUCKETS 32
+
+typedef struct {
+  bool on;
+  unsigned long moved;         // by all calls (STATS_MOVED)
+  unsigned long claimed;       // of that, by the counted calls that returned
+  unsigned long long ticks0;   // timer and clock when switched on or reset,
+  double ns0;                  // to tell ticks per microsecond
+} stats_control;
+
+typedef struct {
+  lua_CFunction func;
+  stats_control *ctl;
+  unsigned long calls;
+  unsigned long failures;
+  unsigned long moved;
+  unsigned long long ticks;
+  unsigned long hist[STATS_BUCKETS];   // hist[b]: calls of [2^b, 2^(b+1)) ticks
+} api_stats;
+
+// registry: [1] = stats_control, [name] = api_stats of every counted function
+static const char StatsKey = 0;
+
+#if LUA_VERSION_NUM < 502
+# define STATS_UPVALUE 1
+#else
+# define STATS_UPVALUE 2     // after the flags table
+#endif
+
+static double stats_clock_ns (void)
 {
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  const TCHAR* lpBuffer = (const TCHAR*)luaL_checkstring(L, 2);
-  DWORD nNumOfCharsToWrite = lua_objlen(L, 2) / sizeof(TCHAR);
-  DWORD NumOfCharsWritten;
-  WriteConsole(hConsoleOutput, lpBuffer, nNumOfCharsToWrite, &NumOfCharsWritten, 0)
-    ? lua_pushinteger(L, NumOfCharsWritten) : lua_pushnil(L);
-  return 1;
+#ifdef _WIN32
+  LARGE_INTEGER t, freq;
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&freq);
+  return (double)t.QuadPart * 1e9 / (double)freq.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+#endif
 }
 
-static int f_WriteConsoleOutputAttribute (lua_State *L)
+#ifdef STATS_TSC
+# define stats_ticks()  ((unsigned long long)__rdtsc())
+#else
+# define stats_ticks()  ((unsigned long long)stats_clock_ns())
+#endif
+
+static int stats_bucket (unsigned long long t)
 {
-  COORD wWriteCoord;
-  DWORD NumOfAttrsWritten;
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  const WORD* lpAttribute = (const WORD*)luaL_checkstring(L, 2);
-  DWORD nLength = lua_objlen(L, 2) / sizeof(WORD);
-  wWriteCoord.X = luaL_checkinteger(L, 3);
-  wWriteCoord.Y = luaL_checkinteger(L, 4);
-  WriteConsoleOutputAttribute(hConsoleOutput, lpAttribute, nLength, wWriteCoord,
-    &NumOfAttrsWritten) ? lua_pushinteger(L, NumOfAttrsWritten) : lua_pushnil(L);
+  int b = 0;
+#ifdef __GNUC__
+  if (t)
+    b = 63 - __builtin_clzll(t);
+#else
+  while (t >>= 1)
+    b++;
+#endif
+  return b < STATS_BUCKETS ? b : STATS_BUCKETS - 1;
+}
+
+static int stats_call (lua_State *L)
+{
+  api_stats *st = (api_stats*)lua_touserdata(L, lua_upvalueindex(STATS_UPVALUE));
+  stats_control *ctl = st->ctl;
+  unsigned long long t;
+  unsigned long moved0, claimed0, own;
+  int n;
+  if (!ctl->on)
+    return st->func(L);
+  // A call that raises an error does not come back here: it stays counted
+  // as a failure, and the units it moved go to the counted call it was made
+  // from (through Lua code), if any. Nothing in ctl is left to restore.
+  st->calls++;
+  st->failures++;
+  moved0 = ctl->moved;
+  claimed0 = ctl->claimed;
+  t = stats_ticks();
+  n = st->func(L);
+  t = stats_ticks() - t;
+  st->ticks += t;
+  st->hist[stats_bucket(t)]++;
+  own = (ctl->moved - moved0) - (ctl->claimed - claimed0);  // less the calls it made
+  st->moved += own;
+  ctl->claimed += own;
+  if ((n == 0 || lua_toboolean(L, -n)) && st->failures > 0)  // 0: reset meanwhile
+    st->failures--;
+  return n;
+}
+
+// push the statistics table of the state and return its control block
+static stats_control* get_stats (lua_State *L)
+{
+  stats_control *ctl;
+  lua_pushlightuserdata(L, (void*)&StatsKey);
+  lua_rawget(L, LUA_REGISTRYINDEX);
+  lua_rawgeti(L, -1, 1);
+  ctl = (stats_control*)lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  return ctl;
+}
+
+static void StatsMoved (lua_State *L, unsigned long n)
+{
+  stats_control *ctl;
+  if (!L)
+    return;
+  ctl = get_stats(L);
+  lua_pop(L, 1);
+  if (ctl && ctl->on)
+    ctl->moved += n;
+}
+
+static void CreateStats (lua_State *L)
+{
+  stats_control *ctl;
+  lua_pushlightuserdata(L, (void*)&StatsKey);
+  lua_createtable(L, 1, 64);
+  ctl = (stats_control*)lua_newuserdata(L, sizeof(stats_control));
+  memset(ctl, 0, sizeof(*ctl));
+  lua_rawseti(L, -2, 1);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// cons.stats(): a table of the functions called since the last reset, each
+// {calls, failures, moved, ticks, hist} where hist[i] is the number of calls
+// that took [2^(i-1), 2^i) timer ticks; and the timer ticks per microsecond,
+// when known. Only the cons functions and the ConsoleHandle methods are
+// there; calls that raised an error count as failures but are not timed.
+static int f_stats (lua_State *L)
+{
+  stats_control *ctl = get_stats(L);
+  double ns = stats_clock_ns() - ctl->ns0;
+  lua_newtable(L);
+  lua_pushnil(L);
+  while (lua_next(L, -3)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      api_stats *st = (api_stats*)lua_touserdata(L, -1);
+      if (st->calls) {
+        int i, n = STATS_BUCKETS;
+        lua_pushvalue(L, -2);
+        lua_createtable(L, 0, 5);
+        PutNumToTable(L, "calls", st->calls);
+        PutNumToTable(L, "failures", st->failures);
+        PutNumToTable(L, "moved", st->moved);
+        PutNumToTable(L, "ticks", (double)st->ticks);
+        while (n > 0 && st->hist[n-1] == 0)
+          n--;
+        lua_createtable(L, n, 0);
+        for (i=0; i<n; i++) {
+          lua_pushnumber(L, st->hist[i]);
+          lua_rawseti(L, -2, i + 1);
+        }
+        lua_setfield(L, -2, "hist");
+        lua_rawset(L, -5);
+      }
+    }
+    lua_pop(L, 1);
+  }
+  if (ns >= 1e6)
+    lua_pushnumber(L, (stats_ticks() - ctl->ticks0) / (ns / 1000));
+  else
+    lua_pushnil(L);
+  return 2;
+}
+
+// cons.stats_enable(on): switch counting on or off; returns the previous state
+static int f_stats_enable (lua_State *L)
+{
+  stats_control *ctl = get_stats(L);
+  bool on = lua_toboolean(L, 1);
+  lua_pushboolean(L, ctl->on);
+  if (on && !ctl->on) {
+    ctl->ticks0 = stats_ticks();
+    ctl->ns0 = stats_clock_ns();
+  }
+  ctl->on = on;
   return 1;
 }
 
-static int f_WriteConsoleOutputCharacter (lua_State *L)
+// cons.stats_reset(): clear all counts
+static int f_stats_reset (lua_State *L)
 {
-  COORD wWriteCoord;
-  DWORD NumOfCharsWritten;
-  HANDLE hConsoleOutput = check_console_handle(L, 1);
-  LPCTSTR lpCharacter = (LPCTSTR)luaL_checkstring(L, 2);
-  DWORD nLength = lua_objlen(L, 2) / sizeof(TCHAR);
-  wWriteCoord.X = luaL_checkinteger(L, 3);
-  wWriteCoord.Y = luaL_checkinteger(L, 4);
-  WriteConsoleOutputCharacter(hConsoleOutput, lpCharacter, nLength, wWriteCoord,
-    &NumOfCharsWritten) ? lua_pushinteger(L, NumOfCharsWritten) : lua_pushnil(L);
+  stats_control *ctl = get_stats(L);
+  lua_pushnil(L);
+  while (lua_next(L, -2)) {
+    if (lua_type(L, -2) == LUA_TSTRING) {
+      api_stats *st = (api_stats*)lua_touserdata(L, -1);
+      lua_CFunction func = st->func;
+      memset(st, 0, sizeof(*st));
+      st->func = func;
+      st->ctl = ctl;
+    }
+    lua_pop(L, 1);
+  }
+  ctl->ticks0 = stats_ticks();
+  ctl->ns0 = stats_clock_ns();
+  return 0;
+}
+
+// Replace the functions of 'l' in the table at the top of the stack with
+// closures of stats_call (with Lua 5.2+, the flags table below it is their
+// shared upvalue, as in luaL_setfuncs).
+static void CountCalls (lua_State *L, const luaL_Reg *l)
+{
+  int t = lua_gettop(L), reg;
+  stats_control *ctl = get_stats(L);
+  reg = lua_gettop(L);
+  for (; l->name; l++) {
+    api_stats *st;
+    if (l->func == f_stats || l->func == f_stats_enable || l->func == f_stats_reset)
+      continue;
+#if LUA_VERSION_NUM >= 502
+    lua_pushvalue(L, t - 1);
+#endif
+    st = (api_stats*)lua_newuserdata(L, sizeof(api_stats));
+    memset(st, 0, sizeof(*st));
+    st->func = l->func;
+    st->ctl = ctl;
+    lua_pushvalue(L, -1);
+    lua_setfield(L, reg, l->name);
+    lua_pushcclosure(L, stats_call, STATS_UPVALUE);
+    lua_setfield(L, t, l->name);
+  }
+  lua_pop(L, 1);
+}
+
+#else
+
+static int f_stats (lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "not built with CONS_STATS");
+  return 2;
+}
+
+static int f_stats_enable (lua_State *L)
+{
+  lua_pushboolean(L, false);
   return 1;
 }
 
+static int f_stats_reset (lua_State *L)
+{
+  (void)L;
+  return 0;
+}
+
+#endif // CONS_STATS
+
 static const luaL_Reg cons_methods [] = {
   {"__tostring",                     consolehandle_tostring},
   {"__gc",                           consolehandle_gc},
@@ -788,6 +5505,7 @@ static const luaL_Reg cons_methods [] = {
   //--------------------------------------------------------------------------
   {"FillConsoleOutputAttribute",     f_FillConsoleOutputAttribute},
   {"FillConsoleOutputCharacter",     f_FillConsoleOutputCharacter},
+  {"FillConsoleOutputCharacterW",    f_FillConsoleOutputCharacterW},
   {"FlushConsoleInputBuffer",        f_FlushConsoleInputBuffer},
   {"GetConsoleCursorInfo",           f_GetConsoleCursorInfo},
   {"GetConsoleMode",                 f_GetConsoleMode},
@@ -797,10 +5515,11 @@ static const luaL_Reg cons_methods [] = {
   {"PeekConsoleInput",               f_PeekConsoleInput},
   {"ReadConsole",                    f_ReadConsole},
   {"ReadConsoleInput",               f_ReadConsoleInput},
-//{"ReadConsoleOutput",              f_ReadConsoleOutput},
+  {"ReadConsoleOutput",              f_ReadConsoleOutput},
   {"ReadConsoleOutputAttribute",     f_ReadConsoleOutputAttribute},
   {"ReadConsoleOutputCharacter",     f_ReadConsoleOutputCharacter},
-//{"ScrollConsoleScreenBuffer",      f_ScrollConsoleScreenBuffer},
+  {"ReadConsoleOutputW",             f_ReadConsoleOutputW},
+  {"ScrollConsoleScreenBuffer",      f_ScrollConsoleScreenBuffer},
   {"SetConsoleActiveScreenBuffer",   f_SetConsoleActiveScreenBuffer},
   {"SetConsoleCursorInfo",           f_SetConsoleCursorInfo},
   {"SetConsoleCursorPosition",       f_SetConsoleCursorPosition},
@@ -813,11 +5532,231 @@ static const luaL_Reg cons_methods [] = {
   {"WriteConsoleOutput",             f_WriteConsoleOutput},
   {"WriteConsoleOutputAttribute",    f_WriteConsoleOutputAttribute},
   {"WriteConsoleOutputCharacter",    f_WriteConsoleOutputCharacter},
+  {"WriteConsoleOutputCharacterW",   f_WriteConsoleOutputCharacterW},
+  {"WriteConsoleOutputW",            f_WriteConsoleOutputW},
+  {"WriteConsoleW",                  f_WriteConsoleW},
+  {"execute",                        f_execute},
+  {NULL, NULL}
+};
+
+static const luaL_Reg cellbuffer_methods [] = {
+  {"__tostring",                     cellbuffer_tostring},
+  {"attrs",                          cellbuffer_attrs},
+  {"blit",                           cellbuffer_blit},
+  {"compare_row",                    cellbuffer_compare_row},
+  {"fill_rect",                      cellbuffer_fill_rect},
+  {"get",                            cellbuffer_get},
+  {"get_utf8",                       cellbuffer_get_utf8},
+  {"layout",                         cellbuffer_layout},
+  {"origin",                         cellbuffer_origin},
+  {"put_string",                     cellbuffer_put_string},
+  {"put_utf8",                       cellbuffer_put_utf8},
+  {"recolor",                        cellbuffer_recolor},
+  {"row",                            cellbuffer_row},
+  {"set",                            cellbuffer_set},
+  {"size",                           cellbuffer_size},
+  {NULL, NULL}
+};
+
+static const luaL_Reg terminal_methods [] = {
+  {"__tostring",                     terminal_tostring},
+  {"buffer",                         terminal_buffer},
+  {"cursor",                         terminal_cursor},
+  {"dirty",                          terminal_dirty},
+  {"feed",                           terminal_feed},
+  {"reset",                          terminal_reset},
+  {"stats",                          terminal_stats},
+  {"title",                          terminal_title},
+  {NULL, NULL}
+};
+
+static const luaL_Reg swapchain_methods [] = {
+  {"__gc",                           swapchain_close},
+  {"__tostring",                     swapchain_tostring},
+  {"back",                           swapchain_back},
+  {"close",                          swapchain_close},
+  {"front",                          swapchain_front},
+  {"present",                        swapchain_present},
+  {"resize",                         swapchain_resize},
+  {"size",                           swapchain_size},
+  {"stats",                          swapchain_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg recorder_methods [] = {
+  {"__gc",                           recorder_close},
+  {"__tostring",                     recorder_tostring},
+  {"close",                          recorder_close},
+  {"frame",                          recorder_frame},
+  {"stats",                          recorder_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg player_methods [] = {
+  {"__gc",                           player_close},
+  {"__tostring",                     player_tostring},
+  {"close",                          player_close},
+  {"cursor",                         player_cursor},
+  {"draw",                           player_draw},
+  {"next",                           player_next},
+  {"seek",                           player_seek},
+  {"size",                           player_size},
+  {"stats",                          player_stats},
+  {"time",                           player_time},
+  {NULL, NULL}
+};
+
+static const luaL_Reg scrollback_methods [] = {
+  {"__gc",                           sb_close},
+  {"__tostring",                     sb_tostring},
+  {"append",                         sb_append},
+  {"append_row",                     sb_append_row},
+  {"close",                          sb_close},
+  {"line",                           sb_line},
+  {"lines",                          sb_lines},
+  {"render",                         sb_render},
+  {"stats",                          sb_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg vtencoder_methods [] = {
+  {"__gc",                           vtencoder_gc},
+  {"__tostring",                     vtencoder_tostring},
+  {"encode",                         vtencoder_encode},
+  {"reset",                          vtencoder_reset},
+  {"stats",                          vtencoder_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg writer_methods [] = {
+  {"__gc",                           writer_gc},
+  {"__tostring",                     writer_tostring},
+  {"flush",                          writer_flush},
+  {"pending",                        writer_pending},
+  {"stats",                          writer_stats},
+  {"tick",                           writer_tick},
+  {"write",                          writer_write},
+  {NULL, NULL}
+};
+
+static const luaL_Reg renderer_methods [] = {
+  {"__gc",                           renderer_gc},
+  {"__tostring",                     renderer_tostring},
+  {"buffer",                         renderer_buffer},
+  {"invalidate",                     renderer_invalidate},
+  {"present",                        renderer_present},
+  {"scroll_region",                  renderer_scroll_region},
+  {"stats",                          renderer_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg compositor_methods [] = {
+  {"__gc",                           compositor_gc},
+  {"__tostring",                     compositor_tostring},
+  {"add",                            compositor_add},
+  {"background",                     compositor_background},
+  {"buffer",                         compositor_buffer},
+  {"damage",                         compositor_damage},
+  {"invalidate",                     compositor_invalidate},
+  {"move",                           compositor_move},
+  {"plane",                          compositor_plane},
+  {"present",                        compositor_present},
+  {"remove",                         compositor_remove},
+  {"set_key",                        compositor_set_key},
+  {"set_z",                          compositor_set_z},
+  {"show",                           compositor_show},
+  {"stats",                          compositor_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg inputring_methods [] = {
+  {"__len",                          inputring_count},
+  {"__tostring",                     inputring_tostring},
+  {"clear",                          inputring_clear},
+  {"count",                          inputring_count},
+  {"events",                         inputring_events},
+  {"get",                            inputring_get},
+  {"pop",                            inputring_pop},
+  {"read",                           inputring_read},
+  {NULL, NULL}
+};
+
+static const luaL_Reg commandlist_methods [] = {
+  {"__gc",                           commandlist_gc},
+  {"__len",                          commandlist_count},
+  {"__tostring",                     commandlist_tostring},
+  {"FillConsoleOutputAttribute",     commandlist_FillConsoleOutputAttribute},
+  {"FillConsoleOutputCharacter",     commandlist_FillConsoleOutputCharacter},
+  {"SetConsoleCursorInfo",           commandlist_SetConsoleCursorInfo},
+  {"SetConsoleCursorPosition",       commandlist_SetConsoleCursorPosition},
+  {"SetConsoleTextAttribute",        commandlist_SetConsoleTextAttribute},
+  {"WriteConsole",                   commandlist_WriteConsole},
+  {"clear",                          commandlist_clear},
+  {"count",                          commandlist_count},
+  {"patch",                          commandlist_patch},
+  {NULL, NULL}
+};
+
+static const luaL_Reg coalescer_methods [] = {
+  {"__tostring",                     coalescer_tostring},
+  {"apply",                          coalescer_apply},
+  {"reset",                          coalescer_reset},
+  {"stats",                          coalescer_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg renderservice_methods [] = {
+  {"__gc",                           renderservice_close},
+  {"__tostring",                     renderservice_tostring},
+  {"close",                          renderservice_close},
+  {"handle",                         renderservice_handle},
+  {"stats",                          renderservice_stats},
+  {NULL, NULL}
+};
+
+static const luaL_Reg renderproducer_methods [] = {
+  {"__gc",                           renderproducer_close},
+  {"__tostring",                     renderproducer_tostring},
+  {"close",                          renderproducer_close},
+  {"stats",                          renderproducer_stats},
+  {"submit",                         renderproducer_submit},
+  {"sync",                           renderproducer_sync},
+  {NULL, NULL}
+};
+
+static const luaL_Reg inputpump_methods [] = {
+  {"__gc",                           inputpump_close},
+  {"__tostring",                     inputpump_tostring},
+  {"close",                          inputpump_close},
+  {"poll",                           inputpump_poll},
+  {"stats",                          inputpump_stats},
+  {"wait",                           inputpump_wait},
+  {NULL, NULL}
+};
+
+static const luaL_Reg loop_methods [] = {
+  {"__gc",                           lp_gc},
+  {"__tostring",                     lp_tostring},
+  {"cancel",                         lp_cancel},
+  {"now",                            lp_now},
+  {"run",                            lp_run},
+  {"sleep",                          lp_sleep},
+  {"spawn",                          lp_spawn},
+  {"stats",                          lp_stats},
+  {"stop",                           lp_stop},
+  {"timer",                          lp_timer},
+  {"wait",                           lp_wait},
+  {"watch",                          lp_watch},
+  {"yield",                          lp_yield},
   {NULL, NULL}
 };
 
 static const luaL_Reg cons_functions[] = {
   {"AllocConsole",                   f_AllocConsole},
+  {"CellBuffer",                     f_CellBuffer},
+  {"Coalescer",                      f_Coalescer},
+  {"CommandList",                    f_CommandList},
+  {"Compositor",                     f_Compositor},
   {"CreateConsoleScreenBuffer",      f_CreateConsoleScreenBuffer},
   {"FreeConsole",                    f_FreeConsole},
   {"GenerateConsoleCtrlEvent",       f_GenerateConsoleCtrlEvent},
@@ -827,11 +5766,40 @@ static const luaL_Reg cons_functions[] = {
   {"GetFlags",                       f_GetFlags},
   {"GetNumberOfConsoleMouseButtons", f_GetNumberOfConsoleMouseButtons},
   {"GetStdHandle",                   f_GetStdHandle},
+  {"InputPump",                      f_InputPump},
+  {"InputRing",                      f_InputRing},
+  {"Player",                         f_Player},
+  {"Recorder",                       f_Recorder},
+  {"RenderProducer",                 f_RenderProducer},
+  {"RenderService",                  f_RenderService},
+  {"Renderer",                       f_Renderer},
+  {"Scrollback",                     f_Scrollback},
   {"SetConsoleCP",                   f_SetConsoleCP},
   {"SetConsoleCtrlHandler",          f_SetConsoleCtrlHandler},
   {"SetConsoleOutputCP",             f_SetConsoleOutputCP},
   {"SetConsoleTitle",                f_SetConsoleTitle},
   {"SetStdHandle",                   f_SetStdHandle},
+  {"SwapChain",                      f_SwapChain},
+  {"Terminal",                       f_Terminal},
+  {"VTEncoder",                      f_VTEncoder},
+  {"Writer",                         f_Writer},
+  {"cellops",                        f_cellops},
+  {"detect_scroll",                  f_detect_scroll},
+  {"flagnames",                      f_flagnames},
+  {"flags",                          f_flags},
+#ifdef CONS_HEADLESS
+  {"headless_feed",                  f_headless_feed},
+  {"headless_reset",                 f_headless_reset},
+  {"headless_resize",                f_headless_resize},
+  {"headless_stats",                 f_headless_stats},
+  {"headless_text",                  f_headless_text},
+#endif
+  {"loop",                           f_loop},
+  {"measure",                        f_measure},
+  {"scratch_stats",                  f_scratch_stats},
+  {"stats",                          f_stats},
+  {"stats_enable",                   f_stats_enable},
+  {"stats_reset",                    f_stats_reset},
   {NULL, NULL}
 };
 
@@ -851,16 +5819,68 @@ static void CreateType (lua_State *L, const char *name, const luaL_Reg *methods)
 
 int luaopen_cons (lua_State *L)
 {
+  cellops_init();
+  utf8_init();
+  term_init_tables();
+  lua_pushlightuserdata(L, (void*)&FlagCacheKey);
+  lua_createtable(L, 1, 0);
+  lua_pushinteger(L, 0);
+  lua_rawseti(L, -2, 1);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  lua_pushlightuserdata(L, (void*)&WritersKey);
+  lua_createtable(L, 0, 0);
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "k");
+  lua_setfield(L, -2, "__mode");
+  lua_setmetatable(L, -2);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+  CreateScratch(L);
+  CreateBufferPool(L);
+  CreateRecorderList(L);
+#ifdef CONS_STATS
+  CreateStats(L);
+#endif
   push_flags_table (L);
 #if LUA_VERSION_NUM == 501
   lua_replace (L, LUA_ENVIRONINDEX);
+#endif
   CreateType(L, ConsoleHandleType, cons_methods);
+  CreateType(L, CellBufferType, cellbuffer_methods);
+  CreateType(L, RendererType, renderer_methods);
+  CreateType(L, CompositorType, compositor_methods);
+  CreateType(L, InputRingType, inputring_methods);
+  CreateType(L, InputPumpType, inputpump_methods);
+  CreateType(L, CoalescerType, coalescer_methods);
+  CreateType(L, CommandListType, commandlist_methods);
+  CreateType(L, WriterType, writer_methods);
+  CreateType(L, VTEncoderType, vtencoder_methods);
+  CreateType(L, TerminalType, terminal_methods);
+  CreateType(L, SwapChainType, swapchain_methods);
+  CreateType(L, RecorderType, recorder_methods);
+  CreateType(L, PlayerType, player_methods);
+  CreateType(L, ScrollbackType, scrollback_methods);
+  CreateType(L, LoopType, loop_methods);
+  CreateType(L, RenderServiceType, renderservice_methods);
+  CreateType(L, RenderProducerType, renderproducer_methods);
+#if LUA_VERSION_NUM == 501
   luaL_register(L, "cons", cons_functions);
+#ifdef CONS_STATS
+  CountCalls(L, cons_functions);
+  luaL_getmetatable(L, ConsoleHandleType);
+  CountCalls(L, cons_methods);
+  lua_pop(L, 1);
+#endif
 #else
-  CreateType(L, ConsoleHandleType, cons_methods);
   lua_createtable(L, 0, sizeof(cons_functions)/sizeof(luaL_Reg) - 1);
   lua_pushvalue(L, -2);
   luaL_setfuncs(L, cons_functions, 1);
+#ifdef CONS_STATS
+  CountCalls(L, cons_functions);
+  lua_pushvalue(L, -2);
+  luaL_getmetatable(L, ConsoleHandleType);
+  CountCalls(L, cons_methods);
+  lua_pop(L, 2);
+#endif
 #endif
   return 1;
 }
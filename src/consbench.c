@@ -0,0 +1,263 @@
+// consbench.c
+// Benchmarks for the binding layer: cons.c called from Lua as a script would,
+// linked against winshim.c instead of the console, so that what is measured
+// is the library's own cost per call (argument checks, marshalling, the
+// tables it builds) and not conhost's.
+// Build with "make consbench"; run as "consbench [name-prefix]".
+// Output is one JSON object per line, for tracking from release to release:
+//   {"name":..., "ops":..., "ns_per_op":..., "allocs_per_op":..., "bytes_per_op":...}
+// Allocations are those made through the Lua allocator: userdata, tables and
+// strings, which is all the library allocates per call.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+#include "winshim.h"
+
+int luaopen_cons (lua_State *L);
+
+static double now_ns (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+//---------------------------------------------------------------------------
+// counting allocator
+//---------------------------------------------------------------------------
+typedef struct {
+  unsigned long allocs;   // new blocks, and blocks grown
+  unsigned long bytes;    // bytes added by them
+} alloc_count;
+
+static alloc_count counted;
+
+static void* counting_alloc (void *ud, void *ptr, size_t osize, size_t nsize)
+{
+  (void)ud;
+  if (nsize == 0) {
+    free(ptr);
+    return NULL;
+  }
+  // with ptr NULL, osize is not a size (a type tag since Lua 5.2)
+  if (ptr == NULL) {
+    counted.allocs++;
+    counted.bytes += nsize;
+  }
+  else if (nsize > osize) {
+    counted.allocs++;
+    counted.bytes += nsize - osize;
+  }
+  return realloc(ptr, nsize);
+}
+
+//---------------------------------------------------------------------------
+// cases
+//---------------------------------------------------------------------------
+// Each case is a chunk returning function(n) that does the operation n
+// times; what it needs is made once, outside the timing. The globals
+// 'cons', 'IN' (console input) and 'OUT' (screen buffer) are set.
+typedef struct {
+  const char *name;
+  long ops;
+  int events;          // key events queued before the case (read endlessly)
+  const char *code;
+} bench_case;
+
+#define TABLES_OUTPUT(w, h) \
+  "local chars, attrs = {}, {}\n" \
+  "for i = 1, " #w "*" #h " do chars[i] = string.char(65 + i % 26); attrs[i] = 7 + i % 8 end\n" \
+  "local params = { dwBufferSizeX=" #w ", dwBufferSizeY=" #h ", WriteRegionRight=" #w "-1, WriteRegionBottom=" #h "-1 }\n" \
+  "return function(n) for i = 1, n do OUT:WriteConsoleOutput(chars, attrs, params) end end"
+
+#define CELLBUFFER_OUTPUT(w, h) \
+  "local buf = cons.CellBuffer(" #w ", " #h ")\n" \
+  "for y = 0, " #h "-1 do buf:put_string(0, y, string.rep('0123456789', 20):sub(1, " #w "), 0x1F) end\n" \
+  "return function(n) for i = 1, n do OUT:WriteConsoleOutput(buf) end end"
+
+#define READ_INPUT(k) \
+  "return function(n) for i = 1, n do IN:ReadConsoleInput(" #k ") end end"
+
+static const bench_case cases[] = {
+  { "call/GetConsoleCP", 2000000, 0,
+    "local f = cons.GetConsoleCP\n"
+    "return function(n) for i = 1, n do f() end end" },
+  // the same with cons.stats() counting (as without it, unless built with CONS_STATS)
+  { "call/GetConsoleCP/counted", 2000000, 0,
+    "local f = cons.GetConsoleCP\n"
+    "return function(n)\n"
+    "  cons.stats_enable(true)\n"
+    "  for i = 1, n do f() end\n"
+    "  cons.stats_enable(false)\n"
+    "end" },
+  { "flags/array", 500000, 0,
+    "local t = { 'FOREGROUND_RED', 'FOREGROUND_INTENSITY', 'BACKGROUND_BLUE' }\n"
+    "return function(n) for i = 1, n do cons.flags(t) end end" },
+  { "flags/combination", 500000, 0,
+    "return function(n) for i = 1, n do\n"
+    "  cons.flags('FOREGROUND_RED|FOREGROUND_INTENSITY|BACKGROUND_BLUE') end end" },
+  { "flags/name", 2000000, 0,
+    "return function(n) for i = 1, n do cons.flags('FOREGROUND_RED') end end" },
+  { "flags/number", 2000000, 0,
+    "return function(n) for i = 1, n do cons.flags(0x1F) end end" },
+  // one step of a test run against the headless console: a key read, a frame
+  // drawn and written, the screen text read back
+  { "frame/headless/80x25", 20000, 64,
+    "local buf = cons.CellBuffer(80, 25)\n"
+    "return function(n) for i = 1, n do\n"
+    "  IN:ReadConsoleInput(1)\n"
+    "  buf:layout(0, 0, 'frame ' .. i .. ': ' .. string.rep('lorem ipsum ', 100), { attr=0x1F })\n"
+    "  OUT:WriteConsoleOutput(buf)\n"
+    "  cons.headless_text(OUT)\n"
+    "end end" },
+  { "info/GetConsoleScreenBufferInfo", 500000, 0,
+    "return function(n) for i = 1, n do OUT:GetConsoleScreenBufferInfo() end end" },
+  { "input/InputRing/16", 200000, 64,
+    "local ring = cons.InputRing(64)\n"
+    "return function(n) for i = 1, n do\n"
+    "  ring:read(IN, 16)\n"
+    "  while ring:pop() do end\n"
+    "end end" },
+  { "input/ReadConsoleInput/1", 500000, 64, READ_INPUT(1) },
+  { "input/ReadConsoleInput/16", 100000, 64, READ_INPUT(16) },
+  { "input/ReadConsoleInput/256", 5000, 1024, READ_INPUT(256) },
+  // a task switch: resuming a task that yields at once
+  { "loop/yield", 500000, 0,
+    "local loop = cons.loop()\n"
+    "return function(n)\n"
+    "  loop:spawn(function() for i = 1, n do loop:yield() end end)\n"
+    "  loop:run()\n"
+    "end" },
+  // input waited on and read by a watch callback, one event per call
+  { "loop/watch/input", 200000, 64,
+    "local loop = cons.loop()\n"
+    "return function(n)\n"
+    "  local k = 0\n"
+    "  local id = loop:watch(IN, function(l)\n"
+    "    IN:ReadConsoleInput(1)\n"
+    "    k = k + 1\n"
+    "    if k == n then l:stop() end\n"
+    "  end)\n"
+    "  loop:run()\n"
+    "  loop:cancel(id)\n"
+    "end" },
+  { "output/WriteConsoleOutput/cellbuffer/200x60", 20000, 0, CELLBUFFER_OUTPUT(200, 60) },
+  { "output/WriteConsoleOutput/cellbuffer/80x25", 100000, 0, CELLBUFFER_OUTPUT(80, 25) },
+  { "output/WriteConsoleOutput/tables/200x60", 200, 0, TABLES_OUTPUT(200, 60) },
+  { "output/WriteConsoleOutput/tables/80x25", 2000, 0, TABLES_OUTPUT(80, 25) },
+  // the same, recorded with a capture after every call (the worst case)
+  { "output/WriteConsoleOutput/cellbuffer/80x25/recorded", 20000, 0,
+    "local rec = cons.Recorder(OUT, os.tmpname(), { interval=0 })\n"
+    "local buf = cons.CellBuffer(80, 25)\n"
+    "return function(n) for i = 1, n do\n"
+    "  buf:put_string(0, i % 25, tostring(i), 0x1F)\n"
+    "  OUT:WriteConsoleOutput(buf)\n"
+    "end end" },
+  { "present/SwapChain", 500000, 0,
+    "local chain = cons.SwapChain(2, { width=80, height=25 })\n"
+    "return function(n) for i = 1, n do\n"
+    "  chain:back()\n"
+    "  chain:present()\n"
+    "end end" },
+  // a status field submitted from Lua; the owner thread writes it out
+  { "present/RenderService/submit", 500000, 0,
+    "local svc = cons.RenderService(OUT)\n"
+    "local p = cons.RenderProducer(svc)\n"
+    "local buf = cons.CellBuffer(10, 1)\n"
+    "return function(n)\n"
+    "  for i = 1, n do p:submit(buf, 0, i % 25) end\n"
+    "  p:sync()\n"
+    "end" },
+  { "text/GetConsoleTitle", 500000, 0,
+    "return function(n) for i = 1, n do cons.GetConsoleTitle() end end" },
+  { "text/ReadConsoleOutputAttribute/80", 200000, 0,
+    "return function(n) for i = 1, n do OUT:ReadConsoleOutputAttribute(80, 0, 0) end end" },
+  { "text/ReadConsoleOutputCharacter/80", 500000, 0,
+    "return function(n) for i = 1, n do OUT:ReadConsoleOutputCharacter(80, 0, 0) end end" },
+  { "text/WriteConsoleW/80", 500000, 0,
+    "local s = string.rep('0123456789', 8)\n"
+    "return function(n) for i = 1, n do OUT:WriteConsoleW(s) end end" },
+};
+
+static void check (lua_State *L, int status)
+{
+  if (status) {
+    fprintf(stderr, "consbench: %s\n", lua_tostring(L, -1));
+    exit(1);
+  }
+}
+
+// key presses of printable characters, as typing produces
+static void queue_events (int n)
+{
+  INPUT_RECORD ir;
+  int i;
+  memset(&ir, 0, sizeof(ir));
+  ir.EventType = KEY_EVENT;
+  ir.Event.KeyEvent.wRepeatCount = 1;
+  for (i=0; i<n; i++) {
+    ir.Event.KeyEvent.bKeyDown = i % 2 == 0;
+    ir.Event.KeyEvent.wVirtualKeyCode = (WORD)('A' + i / 2 % 26);
+    ir.Event.KeyEvent.uChar.UnicodeChar = (WCHAR)('a' + i / 2 % 26);
+    winshim_feed(&ir, 1, 1);
+  }
+}
+
+static void run_case (lua_State *L, const bench_case *c)
+{
+  double t0, t1;
+  alloc_count before;
+  winshim_reset(200, 60);
+  queue_events(c->events);
+  check(L, luaL_loadstring(L, c->code));
+  check(L, lua_pcall(L, 0, 1, 0));
+  // warm up
+  lua_pushvalue(L, -1);
+  lua_pushnumber(L, (lua_Number)(c->ops / 10 + 1));
+  check(L, lua_pcall(L, 1, 0, 0));
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
+  before = counted;
+  lua_pushnumber(L, (lua_Number)c->ops);
+  t0 = now_ns();
+  check(L, lua_pcall(L, 1, 0, 0));
+  t1 = now_ns();
+  printf("{\"name\":\"%s\", \"ops\":%ld, \"ns_per_op\":%.1f, \"allocs_per_op\":%.2f, "
+         "\"bytes_per_op\":%.1f}\n", c->name, c->ops, (t1 - t0) / c->ops,
+         (double)(counted.allocs - before.allocs) / c->ops,
+         (double)(counted.bytes - before.bytes) / c->ops);
+  fflush(stdout);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+}
+
+int main (int argc, char **argv)
+{
+  const char *prefix = argc > 1 ? argv[1] : "";
+  size_t i;
+  lua_State *L = lua_newstate(counting_alloc, NULL);
+  if (!L) {
+    fprintf(stderr, "out of memory\n");
+    return 1;
+  }
+  luaL_openlibs(L);
+  lua_pushcfunction(L, luaopen_cons);
+  lua_pushstring(L, "cons");
+  check(L, lua_pcall(L, 1, 1, 0));
+  lua_setglobal(L, "cons");
+  check(L, luaL_loadstring(L,
+    "IN = cons.GetStdHandle('STD_INPUT_HANDLE')\n"
+    "OUT = cons.GetStdHandle('STD_OUTPUT_HANDLE')"));
+  check(L, lua_pcall(L, 0, 0, 0));
+
+  for (i=0; i<sizeof(cases)/sizeof(cases[0]); i++) {
+    if (!strncmp(cases[i].name, prefix, strlen(prefix)))
+      run_case(L, &cases[i]);
+  }
+  lua_close(L);
+  return 0;
+}
@@ -0,0 +1,16 @@
+// flags.h
+// Named Win32 constants; the definitions are generated into flags.c by
+// makeflags.lua.
+
+#ifndef FLAGS_H
+#define FLAGS_H
+
+#include <stddef.h>
+#include <lua.h>
+
+void        push_flags_table (lua_State *L);
+int         flag_lookup      (const char *name, size_t len, int *val);
+int         flag_slots       (void);
+const char* flag_at          (int i, int *val);   // NULL: an empty slot
+
+#endif
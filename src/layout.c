@@ -0,0 +1,279 @@
+// layout.c
+// Text layout into cells. Each line is scanned first, to find where it ends
+// and how wide it is, then written at the offset its alignment asks for.
+
+#include <string.h>
+#include "layout.h"
+#include "utf8.h"
+#include "width.h"
+
+#define FLAGS         (LAYOUT_LEADING | LAYOUT_TRAILING)
+#define IS_GRAPHIC(c) ((unsigned char)((c) - 0x21) < 0x5E)   // printable ASCII but space
+#define IS_PRINT(c)   ((unsigned char)((c) - 0x20) < 0x5F)   // printable ASCII
+#define IS_BLANK(c)   ((c) == ' ' || (c) == '\t')
+
+typedef struct {
+  size_t end;         // the line shows the text up to here
+  size_t next;        // where the next line starts
+  int cols;           // cells of the text shown
+  int cut;            // text of the line was left out
+} line_t;
+
+void layout_init_params (layout_params *prm, int width)
+{
+  prm->width = width > 0 ? width : 1;
+  prm->height = 0;
+  prm->align = LAYOUT_LEFT;
+  prm->wrap = LAYOUT_WRAP_WORD;
+  prm->ellipsis = 0;
+  prm->tab = 8;
+  prm->attr = -1;
+}
+
+// The character of s at i (not a tab or a line feed): return its length, and
+// the code point shown and its width. ASCII controls take no cell.
+static size_t next_char (const char *s, size_t i, size_t len, unsigned *cp, int *w)
+{
+  unsigned char c = (unsigned char)s[i];
+  size_t n;
+  if (c < 0x80) {
+    *cp = c;
+    *w = IS_PRINT(c);
+    return 1;
+  }
+  n = utf8_decode(s + i, len - i, cp);
+  if (*cp > 0xFFFF) {
+    *cp = UTF8_REPLACEMENT;
+    *w = 1;
+  }
+  else
+    *w = UNICODE_WIDTH(*cp);
+  return n;
+}
+
+// A tab reaches the next tab stop, or the end of the line if that is nearer.
+static int tab_width (const layout_params *prm, int col)
+{
+  int w = prm->tab > 0 ? prm->tab - col % prm->tab : 1;
+  return w < prm->width - col ? w : prm->width - col;
+}
+
+static void scan_line (const char *s, size_t i, size_t len, const layout_params *prm,
+                       line_t *ln)
+{
+  const int width = prm->width;
+  const int word = prm->wrap == LAYOUT_WRAP_WORD;
+  size_t brk_end = 0, brk_next = 0;   // the last place where a word wrap may go
+  int col = 0, brk_cols = 0, w;
+  unsigned cp;
+  size_t n;
+
+  ln->cut = 0;
+  while (i < len) {
+    unsigned char c = (unsigned char)s[i];
+    if (IS_GRAPHIC(c)) {
+      // as many as the line has room for in one go
+      size_t lim = i + (size_t)(width - col), j = i;
+      if (lim > len)
+        lim = len;
+      while (j < lim && IS_GRAPHIC(s[j]))
+        j++;
+      if (j > i) {
+        col += (int)(j - i);
+        i = j;
+        continue;
+      }
+      n = w = 1;
+    }
+    else if (c == '\n') {
+      ln->end = i;
+      ln->next = i + 1;
+      ln->cols = col;
+      return;
+    }
+    else if (c == '\t') {
+      n = 1;
+      w = tab_width(prm, col);
+    }
+    else
+      n = next_char(s, i, len, &cp, &w);
+
+    if (col + w > width) {
+      if (prm->wrap == LAYOUT_CLIP) {
+        const char *nl = (const char*)memchr(s + i, '\n', len - i);
+        ln->end = i;
+        ln->next = nl ? (size_t)(nl - s) + 1 : len;
+        ln->cols = col;
+        ln->cut = 1;
+      }
+      else if (word && IS_BLANK(c)) {
+        ln->end = i;
+        while (i < len && IS_BLANK(s[i]))
+          i++;
+        ln->next = i;
+        ln->cols = col;
+      }
+      else if (word && brk_cols > 0) {
+        ln->end = brk_end;
+        ln->next = brk_next;
+        ln->cols = brk_cols;
+      }
+      else if (col > 0) {     // a break inside the word
+        ln->end = ln->next = i;
+        ln->cols = col;
+      }
+      else {                  // a double-width character in a line of one cell
+        ln->end = i;
+        ln->next = i + n;
+        ln->cols = 0;
+        ln->cut = 1;
+      }
+      return;
+    }
+    if (word && IS_BLANK(c) && col > 0 && !IS_BLANK(s[i-1])) {
+      size_t j = i + 1;
+      while (j < len && IS_BLANK(s[j]))
+        j++;
+      brk_end = i;
+      brk_next = j;
+      brk_cols = col;
+    }
+    col += w;
+    i += n;
+  }
+  ln->end = ln->next = len;
+  ln->cols = col;
+}
+
+// Shorten a line so that an ellipsis fits after it.
+static void fit_ellipsis (const char *s, size_t i, const layout_params *prm, line_t *ln)
+{
+  int col = 0, w;
+  unsigned cp;
+  size_t n;
+  while (i < ln->end) {
+    if (s[i] == '\t') {
+      n = 1;
+      w = tab_width(prm, col);
+    }
+    else
+      n = next_char(s, i, ln->end, &cp, &w);
+    if (col + w > prm->width - 1)
+      break;
+    col += w;
+    i += n;
+  }
+  ln->end = i;
+  ln->cols = col;
+}
+
+static void put_cell (cellbuf *cb, int x, int y, unsigned ch, int attr, int flags)
+{
+  if (x >= 0 && x < cb->width) {
+    cell_t *p = CELLBUF_AT(cb, x, y);
+    p->Char = (unsigned short)ch;
+    p->Attributes = (unsigned short)(((attr >= 0 ? attr : p->Attributes) & ~FLAGS) | flags);
+  }
+}
+
+static void put_line (cellbuf *cb, int x, int y, const char *s, size_t i, size_t end,
+                      const layout_params *prm, int dots)
+{
+  int col = 0, w, k;
+  unsigned cp;
+  size_t n;
+  if (y < 0 || y >= cb->height)
+    return;
+  while (i < end) {
+    unsigned char c = (unsigned char)s[i];
+    if (IS_PRINT(c)) {
+      // a run of printable ASCII, clipped to the buffer
+      size_t j = i;
+      int a, b;
+      while (j < end && IS_PRINT(s[j]))
+        j++;
+      a = x + col;
+      b = a + (int)(j - i);
+      col = b - x;
+      if (a < 0) {
+        i += -a;
+        a = 0;
+      }
+      if (b > cb->width)
+        b = cb->width;
+      if (a < b) {
+        cell_t *p = CELLBUF_AT(cb, a, y);
+        if (prm->attr >= 0)
+          for (k = a; k < b; k++, p++) {
+            p->Char = (unsigned char)s[i++];
+            p->Attributes = (unsigned short)(prm->attr & ~FLAGS);
+          }
+        else
+          for (k = a; k < b; k++, p++) {
+            p->Char = (unsigned char)s[i++];
+            p->Attributes &= ~FLAGS;
+          }
+      }
+      i = j;
+      continue;
+    }
+    if (c == '\t') {
+      n = 1;
+      w = tab_width(prm, col);
+      for (k = 0; k < w; k++)
+        put_cell(cb, x + col + k, y, ' ', prm->attr, 0);
+    }
+    else {
+      n = next_char(s, i, end, &cp, &w);
+      if (w == 1)
+        put_cell(cb, x + col, y, cp, prm->attr, 0);
+      else if (w == 2) {
+        put_cell(cb, x + col, y, cp, prm->attr, LAYOUT_LEADING);
+        put_cell(cb, x + col + 1, y, cp, prm->attr, LAYOUT_TRAILING);
+      }
+    }
+    col += w;
+    i += n;
+  }
+  if (dots)
+    put_cell(cb, x + col, y, LAYOUT_ELLIPSIS, prm->attr, 0);
+}
+
+int layout_text (cellbuf *cb, int x, int y, const char *s, size_t len,
+                 const layout_params *prm, layout_extent *ext)
+{
+  size_t i = 0;
+  int lines = 0, widest = 0, truncated = 0;
+  line_t ln;
+
+  while (i < len) {
+    int dots, cols, off = 0;
+    scan_line(s, i, len, prm, &ln);
+    if (prm->height > 0 && lines + 1 == prm->height && ln.next < len)
+      ln.cut = 1;             // the last line there is room for
+    dots = ln.cut && prm->ellipsis;
+    if (dots && ln.cols >= prm->width)
+      fit_ellipsis(s, i, prm, &ln);
+    truncated |= ln.cut;
+    cols = ln.cols + dots;
+    if (cols > widest)
+      widest = cols;
+    if (prm->align == LAYOUT_CENTER)
+      off = (prm->width - cols) / 2;
+    else if (prm->align == LAYOUT_RIGHT)
+      off = prm->width - cols;
+    if (cb)
+      put_line(cb, x + off, y + lines, s, i, ln.end, prm, dots);
+    lines++;
+    i = ln.next;
+    if (lines == prm->height)
+      break;
+  }
+  if (ext) {
+    ext->lines = lines;
+    ext->width = widest;
+    ext->used = i;
+    ext->truncated = truncated || i < len;
+  }
+  return lines;
+}
@@ -0,0 +1,49 @@
+// layout.h
+// Text layout into cells: UTF-8 text wrapped at words or anywhere, or
+// clipped, optionally marked with an ellipsis where it is cut, aligned in a
+// box, with tabs expanded. Double-width characters take two cells. The
+// layout is written into a cellbuf or only measured.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+#include "cells.h"
+
+enum { LAYOUT_LEFT, LAYOUT_CENTER, LAYOUT_RIGHT };
+enum { LAYOUT_CLIP, LAYOUT_WRAP_CHAR, LAYOUT_WRAP_WORD };
+
+// Attributes of the two cells of a double-width character: the same bits as
+// COMMON_LVB_LEADING_BYTE and COMMON_LVB_TRAILING_BYTE.
+#define LAYOUT_LEADING   0x0100
+#define LAYOUT_TRAILING  0x0200
+
+#define LAYOUT_ELLIPSIS  0x2026
+
+typedef struct {
+  int width;          // cells per line, at least 1
+  int height;         // lines at most; 0 for no limit
+  int align;          // LAYOUT_LEFT, LAYOUT_CENTER, LAYOUT_RIGHT
+  int wrap;           // LAYOUT_CLIP, LAYOUT_WRAP_CHAR, LAYOUT_WRAP_WORD
+  int ellipsis;       // end text that is cut off with an ellipsis
+  int tab;            // distance of tab stops; 0 shows a tab as one space
+  int attr;           // attributes of the text; -1 keeps those of the cells
+} layout_params;
+
+typedef struct {
+  int lines;          // lines laid out
+  int width;          // cells of the widest one
+  size_t used;        // bytes laid out: the rest did not fit in the height
+  int truncated;      // some text was clipped or did not fit
+} layout_extent;
+
+void layout_init_params (layout_params *prm, int width);
+
+// Lay out 'len' bytes of s with its top left corner at (x,y) of cb, clipped
+// to cb; with a NULL cb only measure it. Invalid UTF-8 is shown as U+FFFD,
+// and so are characters beyond the BMP, which a cell cannot hold. Return the
+// number of lines.
+int layout_text (cellbuf *cb, int x, int y, const char *s, size_t len,
+                 const layout_params *prm, layout_extent *ext);
+
+#endif
@@ -0,0 +1,235 @@
+// loop.c
+// The event loop core of loop.h. Timers are a binary heap ordered by due
+// time; cancelling one searches the heap, which is short next to what the
+// timers themselves cost to serve.
+
+#include <stdlib.h>
+#include <string.h>
+#include "loop.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <time.h>
+#endif
+
+double loop_now (void)
+{
+#ifdef _WIN32
+  static double ms_per_tick;
+  LARGE_INTEGER t;
+  if (ms_per_tick == 0) {
+    LARGE_INTEGER freq;
+    QueryPerformanceFrequency(&freq);
+    ms_per_tick = 1e3 / (double)freq.QuadPart;
+  }
+  QueryPerformanceCounter(&t);
+  return (double)t.QuadPart * ms_per_tick;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+#endif
+}
+
+void loop_init (event_loop *lp)
+{
+  memset(lp, 0, sizeof(*lp));
+}
+
+void loop_free (event_loop *lp)
+{
+  free(lp->heap);
+  memset(lp, 0, sizeof(*lp));
+}
+
+//---------------------------------------------------------------------------
+// timers
+//---------------------------------------------------------------------------
+static int before (const loop_timer *a, const loop_timer *b)
+{
+  return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void sift_up (loop_timer *heap, int i)
+{
+  loop_timer t = heap[i];
+  while (i > 0 && before(&t, &heap[(i-1)/2])) {
+    heap[i] = heap[(i-1)/2];
+    i = (i-1)/2;
+  }
+  heap[i] = t;
+}
+
+static void sift_down (loop_timer *heap, int n, int i)
+{
+  loop_timer t = heap[i];
+  for (;;) {
+    int c = 2*i + 1;
+    if (c >= n)
+      break;
+    if (c + 1 < n && before(&heap[c+1], &heap[c]))
+      c++;
+    if (!before(&heap[c], &t))
+      break;
+    heap[i] = heap[c];
+    i = c;
+  }
+  heap[i] = t;
+}
+
+static void push_timer (event_loop *lp, loop_timer *t)
+{
+  t->seq = lp->seq++;
+  lp->heap[lp->ntimers] = *t;
+  sift_up(lp->heap, lp->ntimers++);
+}
+
+int loop_add_timer (event_loop *lp, int id, double due, double interval)
+{
+  loop_timer t;
+  if (lp->ntimers == lp->cap) {
+    int cap = lp->cap ? 2 * lp->cap : 16;
+    loop_timer *heap = (loop_timer*)realloc(lp->heap, cap * sizeof(loop_timer));
+    if (!heap)
+      return 0;
+    lp->heap = heap;
+    lp->cap = cap;
+  }
+  t.due = due;
+  t.interval = interval > 0 ? interval : 0;
+  t.id = id;
+  push_timer(lp, &t);
+  return 1;
+}
+
+int loop_cancel_timer (event_loop *lp, int id)
+{
+  int i;
+  for (i=0; i<lp->ntimers; i++) {
+    if (lp->heap[i].id == id) {
+      lp->heap[i] = lp->heap[--lp->ntimers];
+      if (i < lp->ntimers) {
+        sift_up(lp->heap, i);
+        sift_down(lp->heap, lp->ntimers, i);
+      }
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// handles
+//---------------------------------------------------------------------------
+int loop_add_handle (event_loop *lp, int id, intptr_t h)
+{
+  if (lp->nhandles == LOOP_MAX_HANDLES)
+    return 0;
+  lp->handles[lp->nhandles] = h;
+  lp->ids[lp->nhandles++] = id;
+  return 1;
+}
+
+static void remove_at (event_loop *lp, int i)
+{
+  int n = lp->nhandles - i - 1;
+  memmove(lp->handles + i, lp->handles + i + 1, n * sizeof(intptr_t));
+  memmove(lp->ids + i, lp->ids + i + 1, n * sizeof(int));
+  lp->nhandles--;
+}
+
+int loop_remove_handle (event_loop *lp, int id)
+{
+  int i;
+  for (i=0; i<lp->nhandles; i++) {
+    if (lp->ids[i] == id) {
+      remove_at(lp, i);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// events
+//---------------------------------------------------------------------------
+static void fire_timer (event_loop *lp, double now, loop_event *ev)
+{
+  loop_timer t = lp->heap[0];
+  lp->heap[0] = lp->heap[--lp->ntimers];
+  if (lp->ntimers > 0)
+    sift_down(lp->heap, lp->ntimers, 0);
+  ev->kind = LOOP_TIMER;
+  ev->id = t.id;
+  ev->again = t.interval > 0;
+  ev->at = t.due;
+  lp->stats.timers++;
+  if (ev->again) {
+    // keep to the original ticks; those that were missed are skipped
+    t.due += t.interval;
+    if (t.due <= now) {
+      unsigned long missed = (unsigned long)((now - t.due) / t.interval) + 1;
+      lp->stats.skipped += missed;
+      t.due += missed * t.interval;
+    }
+    push_timer(lp, &t);     // the room it had is still there
+  }
+}
+
+static int timer_due (const event_loop *lp, double now)
+{
+  return lp->ntimers > 0 && lp->heap[0].due <= now;
+}
+
+int loop_next (event_loop *lp, const loop_backend *be, double until, loop_event *ev)
+{
+  for (;;) {
+    double now = loop_now(), end;
+    int timeout, r;
+    if (timer_due(lp, now)) {
+      fire_timer(lp, now, ev);
+      return 1;
+    }
+    if (lp->ntimers == 0 && lp->nhandles == 0)
+      return 0;
+    // block until the next timer (rounded up, not to wake too early) or
+    // 'until', whichever comes first
+    end = lp->ntimers > 0 ? lp->heap[0].due : -1;
+    if (until >= 0 && (end < 0 || until < end))
+      end = until;
+    if (end < 0)
+      timeout = -1;
+    else if (end - now >= 0x7FFFFFFF)
+      timeout = 0x7FFFFFFF;
+    else
+      timeout = end > now ? (int)(end - now + 0.999) : 0;
+    if (timeout == 0 && lp->nhandles == 0)
+      return 0;               // 'until' has come
+    r = be->wait(be->ctx, lp->handles, lp->nhandles, timeout);
+    lp->stats.waits++;
+    lp->stats.idle_ms += loop_now() - now;
+    if (r >= 0 && r < lp->nhandles) {
+      intptr_t h = lp->handles[r];
+      int id = lp->ids[r];
+      // to the end of the list, as the backend reports the first one
+      // signalled of those it is given
+      remove_at(lp, r);
+      loop_add_handle(lp, id, h);
+      ev->kind = LOOP_HANDLE;
+      ev->id = id;
+      ev->again = 0;
+      ev->at = loop_now();
+      lp->stats.handles++;
+      return 1;
+    }
+    if (r != LOOP_TIMEOUT)
+      return -1;
+    if (until >= 0 && (now = loop_now()) >= until) {
+      if (!timer_due(lp, now))
+        return 0;
+      fire_timer(lp, now, ev);
+      return 1;
+    }
+  }
+}
@@ -0,0 +1,83 @@
+// loop.h
+// Event loop core: a min-heap of timers and a set of handles, waited on
+// together through a backend (WaitForMultipleObjects on Windows) that blocks
+// until the next timer is due, so that an idle loop takes no CPU. Events come
+// out one at a time, tagged with the id they were registered with; what runs
+// for them is up to the caller.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef LOOP_H
+#define LOOP_H
+
+#include <stdint.h>
+
+#define LOOP_MAX_HANDLES  64      // MAXIMUM_WAIT_OBJECTS
+#define LOOP_TIMEOUT      (-2)
+
+typedef struct {
+  // Wait at most 'timeout_ms' (-1: no limit) for one of the n handles to be
+  // signalled; return its index, LOOP_TIMEOUT, or -1 on failure. With n 0
+  // only sleep.
+  int (*wait) (void *ctx, const intptr_t *handles, int n, int timeout_ms);
+  void *ctx;
+} loop_backend;
+
+enum { LOOP_TIMER = 1, LOOP_HANDLE };
+
+typedef struct {
+  int kind;           // LOOP_TIMER or LOOP_HANDLE
+  int id;
+  int again;          // a timer that was set to fire again
+  double at;          // when it was due (a timer) or seen (a handle), as a
+                      // loop_now() time: its latency is measured from there
+} loop_event;
+
+typedef struct {
+  double due;         // loop_now() time
+  double interval;    // 0: once
+  unsigned long seq;  // timers due at the same time fire in the order set
+  int id;
+} loop_timer;
+
+typedef struct {
+  unsigned long timers;     // timer events
+  unsigned long handles;    // handle events
+  unsigned long waits;      // backend calls
+  unsigned long skipped;    // ticks of interval timers missed as being late
+  double idle_ms;           // spent in backend calls
+} loop_stats;
+
+typedef struct {
+  loop_timer *heap;
+  int ntimers, cap;
+  intptr_t handles[LOOP_MAX_HANDLES];
+  int ids[LOOP_MAX_HANDLES];
+  int nhandles;
+  unsigned long seq;
+  loop_stats stats;
+} event_loop;
+
+// Milliseconds on a monotonic clock.
+double loop_now (void);
+
+void loop_init (event_loop *lp);
+void loop_free (event_loop *lp);
+
+// A timer firing at 'due' and, with an interval, every 'interval' ms after
+// that; return 0 if out of memory.
+int  loop_add_timer    (event_loop *lp, int id, double due, double interval);
+int  loop_cancel_timer (event_loop *lp, int id);       // 0 if there is none
+
+// Wait for handle h, until removed; return 0 if LOOP_MAX_HANDLES are
+// waited on already.
+int  loop_add_handle    (event_loop *lp, int id, intptr_t h);
+int  loop_remove_handle (event_loop *lp, int id);      // 0 if there is none
+
+// The next event: a timer that is due, or else a handle that is signalled,
+// waiting for one until 'until' (a loop_now() time; negative: no limit). A
+// handle that stays signalled comes out again only after the others have
+// had their turn. Return 1 for an event, 0 if there is none by 'until' or
+// nothing to wait for (no timers, no handles), -1 if the backend failed.
+int  loop_next (event_loop *lp, const loop_backend *be, double until, loop_event *ev);
+
+#endif
@@ -22,16 +22,109 @@ local function add_ids (src, trg)
   end
 end
 
+-- Hashes of a name; must match flag_slot() in the C code below.
+-- Arithmetic is mod 2^32 and stays exact in a double (no bit ops needed).
+local M1, M2, M3 = 31, 37, 131
+
+local function hash (s, m)
+  local h = 0
+  for i = 1, #s do
+    h = (h * m + s:byte(i)) % 4294967296
+  end
+  return h
+end
+
+local function is_prime (n)
+  if n < 2 then return false end
+  for d = 2, math.floor(math.sqrt(n)) do
+    if n % d == 0 then return false end
+  end
+  return true
+end
+
+local function next_prime (n)
+  while not is_prime(n) do n = n + 1 end
+  return n
+end
+
+-- Build a perfect hash ("hash and displace"): names are spread over buckets
+-- by their 3rd hash; each bucket gets a displacement d = d0*n + d1 such that
+-- slot = (h1 + d0*(h2 % (n-1) + 1) + d1) % n is distinct for all names.
+-- Return the number of slots, the slot->name map and the displacements.
+local function build_hash (names)
+  local n = next_prime(#names)
+  while true do
+    local nb = math.max(1, math.ceil(#names / 2))
+    local buckets, slots, disp = {}, {}, {}
+    for b = 1, nb do buckets[b] = {} end
+    for _, name in ipairs(names) do
+      table_insert(buckets[hash(name, M3) % nb + 1], {
+        name = name, h1 = hash(name, M1) % n, h2 = hash(name, M2) % (n - 1) + 1 })
+    end
+    local order = {}
+    for b = 1, nb do order[b] = b end
+    table.sort(order, function(a, b)
+      if #buckets[a] ~= #buckets[b] then return #buckets[a] > #buckets[b] end
+      return a < b
+    end)
+    local ok = true
+    for _, b in ipairs(order) do
+      local keys = buckets[b]
+      disp[b] = 0
+      if #keys > 0 then
+        local found
+        for d0 = 0, n - 1 do
+          for d1 = 0, n - 1 do
+            local used = {}
+            for _, k in ipairs(keys) do
+              local slot = (k.h1 + d0 * k.h2 + d1) % n
+              if slots[slot] or used[slot] then used = nil; break end
+              used[slot] = k.name
+            end
+            if used then
+              for slot, name in pairs(used) do slots[slot] = name end
+              disp[b] = d0 * n + d1
+              found = true
+              break
+            end
+          end
+          if found then break end
+        end
+        if not found then ok = false; break end
+      end
+    end
+    if ok then return n, slots, disp end
+    n = next_prime(n + 1)
+  end
+end
+
 local function write_target (trg)
-  io_write [[
-// this array must be sorted by 'key' to allow for binary search
-static const flag_pair flags[] = {
-]]
-  table.sort(trg) -- sort the table: this will allow for binary search
-  for k,v in ipairs(trg) do
-    io_write(string.format('  {"%s", %s},\n', v, v))
+  -- the same constant may be collected more than once
+  local names, seen = {}, {}
+  for _, v in ipairs(trg) do
+    if not seen[v] then seen[v] = true; table_insert(names, v) end
+  end
+  table.sort(names)
+  local n, slots, disp = build_hash(names)
+
+  io_write(string.format("#define FLAG_SLOTS   %d\n", n))
+  io_write(string.format("#define FLAG_BUCKETS %d\n\n", #disp))
+  io_write("// the names placed by a perfect hash: see flag_slot()\n")
+  io_write("static const flag_pair flags[FLAG_SLOTS] = {\n")
+  for slot = 0, n - 1 do
+    local v = slots[slot]
+    if v then
+      io_write(string.format('  {"%s", %s},\n', v, v))
+    else
+      io_write("  {NULL, 0},\n")
+    end
   end
   io_write("};\n\n")
+  io_write("static const unsigned flag_disp[FLAG_BUCKETS] = {")
+  for b, d in ipairs(disp) do
+    io_write((b - 1) % 12 == 0 and "\n  " or " ", d, ",")
+  end
+  io_write("\n};\n\n")
 end
 
 -- file "wincon.h"
@@ -51,9 +144,11 @@ local file_top = [[
 #define _WIN32_WINNT 0x0601
 #define WINVER       0x0601
 
+#include <string.h>
 #include <lua.h>
 #include <windows.h>
 #include <wincon.h>
+#include "flags.h"
 
 typedef struct {
   const char* key;
@@ -63,20 +158,60 @@ typedef struct {
 ]]
 
 
-local file_bottom = [[
+local file_bottom = [==[
+static unsigned flag_slot (const char *s, size_t len)
+{
+  unsigned h1 = 0, h2 = 0, h3 = 0, d;
+  size_t i;
+  for (i=0; i<len; i++) {
+    unsigned char c = (unsigned char)s[i];
+    h1 = h1 * 31 + c;
+    h2 = h2 * 37 + c;
+    h3 = h3 * 131 + c;
+  }
+  d = flag_disp[h3 % FLAG_BUCKETS];
+  return (h1 % FLAG_SLOTS + d / FLAG_SLOTS * (h2 % (FLAG_SLOTS - 1) + 1) + d % FLAG_SLOTS)
+         % FLAG_SLOTS;
+}
+
+// find a flag by name with one hash probe; return 0 if there is none
+int flag_lookup (const char *name, size_t len, int *val)
+{
+  const flag_pair *f = &flags[flag_slot(name, len)];
+  if (f->key && !strncmp(f->key, name, len) && f->key[len] == 0) {
+    *val = f->val;
+    return 1;
+  }
+  return 0;
+}
+
+int flag_slots (void)
+{
+  return FLAG_SLOTS;
+}
+
+// the flag in slot i (0-based) of the hash, for scanning them all
+const char* flag_at (int i, int *val)
+{
+  const flag_pair *f = &flags[i];
+  *val = f->val;
+  return f->key;
+}
+
 // create a table; fill with flags; leave on stack
 void push_flags_table (lua_State *L)
 {
-  int i = 0;
-  const int nelem = sizeof(flags) / sizeof(flags[0]);
-  lua_createtable (L, 0, nelem);
-  for (i=0; i<nelem; ++i) {
-    lua_pushinteger(L, flags[i].val);
-    lua_setfield(L, -2, flags[i].key);
+  int i;
+  lua_createtable (L, 0, FLAG_SLOTS);
+  for (i=0; i<FLAG_SLOTS; ++i) {
+    if (flags[i].key) {
+      lua_pushinteger(L, flags[i].val);
+      lua_setfield(L, -2, flags[i].key);
+    }
   }
 }
 
-]]
+]==]
 
 local function write_common_flags_file (fname)
   assert (fname, "input file not specified")
@@ -0,0 +1,94 @@
+-- This script is intended to generate the "widthtab.c" file: the display
+-- width of every code point in console cells, as the two-level table that
+-- width.h reads.
+-- Usage: lua makewidth.lua <directory> > widthtab.c
+-- where the directory holds EastAsianWidth.txt and UnicodeData.txt of one
+-- version of the Unicode Character Database.
+local io_write     = io.write
+local table_concat = table.concat
+
+local dir = assert(arg and arg[1], "usage: lua makewidth.lua <UCD directory>")
+
+local MAXCP = 0x110000
+local BLOCK = 256
+local width = {}          -- code point -> 0 or 2 (1 is not stored)
+
+-- UAX #11: code points of these ranges not listed are Wide
+local wide_ranges = {
+  { 0x3400, 0x4DBF }, { 0x4E00, 0x9FFF }, { 0xF900, 0xFAFF },
+  { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD },
+}
+for _, r in ipairs(wide_ranges) do
+  for cp = r[1], r[2] do width[cp] = 2 end
+end
+
+local version
+for line in io.lines(dir .. "/EastAsianWidth.txt") do
+  version = version or line:match("^#%s*EastAsianWidth%-([%d%.]+)%.txt")
+  local a, b, w = line:match("^(%x+)%.%.(%x+)%s*;%s*(%a+)")
+  if not a then
+    a, w = line:match("^(%x+)%s*;%s*(%a+)")
+    b = a
+  end
+  if a then
+    local v = (w == "W" or w == "F") and 2 or nil
+    for cp = tonumber(a, 16), tonumber(b, 16) do width[cp] = v end
+  end
+end
+
+-- Nonspacing and enclosing marks, format and control characters take no
+-- cell; the ranges of UnicodeData.txt (<..., First> / <..., Last>) have
+-- none of these categories
+local zero_categories = { Mn = true, Me = true, Cf = true, Cc = true }
+for line in io.lines(dir .. "/UnicodeData.txt") do
+  local cp, cat = line:match("^(%x+);[^;]*;(%a%a);")
+  if cp and zero_categories[cat] then
+    width[tonumber(cp, 16)] = 0
+  end
+end
+width[0x00AD] = nil                          -- SOFT HYPHEN is shown
+for cp = 0x1160, 0x11FF do width[cp] = 0 end -- Hangul medial vowels and final consonants
+
+-- stage 2: distinct blocks of 256 widths, 2 bits each; stage 1: the block
+-- of each 256 code points
+local stage1, stage2, seen = {}, {}, {}
+for base = 0, MAXCP - 1, BLOCK do
+  local bytes = {}
+  for k = 0, BLOCK / 4 - 1 do
+    local v = 0
+    for j = 3, 0, -1 do
+      v = v * 4 + (width[base + k * 4 + j] or 1)
+    end
+    bytes[#bytes + 1] = v
+  end
+  local key = table_concat(bytes, ",")
+  if not seen[key] then
+    stage2[#stage2 + 1] = bytes
+    seen[key] = #stage2 - 1
+  end
+  stage1[#stage1 + 1] = seen[key]
+end
+assert(#stage2 <= 256, "too many distinct blocks for an 8-bit stage 1")
+
+local function write_array (t, indent)
+  for i = 1, #t, 16 do
+    local row = {}
+    for j = i, math.min(i + 15, #t) do row[#row + 1] = t[j] end
+    io_write(indent, table_concat(row, ","), ",\n")
+  end
+end
+
+io_write("// widthtab.c\n")
+io_write("// Generated by makewidth.lua from EastAsianWidth.txt and UnicodeData.txt\n")
+io_write("// of Unicode ", version or "(unknown version)", "; do not edit.\n\n")
+io_write('#include "width.h"\n\n')
+io_write("const unsigned char width_stage1[WIDTH_BLOCKS] = {\n")
+write_array(stage1, "  ")
+io_write("};\n\n")
+io_write("const unsigned char width_stage2[][64] = {\n")
+for _, bytes in ipairs(stage2) do
+  io_write("  {\n")
+  write_array(bytes, "    ")
+  io_write("  },\n")
+end
+io_write("};\n")
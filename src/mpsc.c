@@ -0,0 +1,93 @@
+// mpsc.c
+// Lock-free multi-producer/single-consumer ring of pointers. Each slot has a
+// sequence number: producers claim an index by advancing 'tail' with a
+// compare-and-swap, fill the slot and publish it by setting its sequence to
+// index + 1 (release); the consumer frees it for the next round by setting
+// it to index + capacity. A producer that has claimed a slot but not yet
+// filled it holds up the consumer at that slot only.
+
+#include <stdlib.h>
+#include <string.h>
+#include "mpsc.h"
+
+#define LOAD_ACQUIRE(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define LOAD_RELAXED(p)      __atomic_load_n(p, __ATOMIC_RELAXED)
+#define STORE_RELEASE(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// the capacity is rounded up to a power of two; return 0 if out of memory
+int mpsc_init (mpsc_queue *q, unsigned capacity)
+{
+  unsigned cap = 2, i;
+  while (cap < capacity && cap < 0x40000000u)
+    cap <<= 1;
+  memset(q, 0, sizeof(*q));
+  q->slots = (mpsc_slot*)malloc((size_t)cap * sizeof(mpsc_slot));
+  if (!q->slots)
+    return 0;
+  for (i=0; i<cap; i++) {
+    q->slots[i].seq = i;
+    q->slots[i].item = NULL;
+  }
+  q->mask = cap - 1;
+  return 1;
+}
+
+void mpsc_free (mpsc_queue *q)
+{
+  free(q->slots);
+  q->slots = NULL;
+}
+
+unsigned mpsc_capacity (const mpsc_queue *q)
+{
+  return q->mask + 1;
+}
+
+// approximate: counts the slots claimed, filled or not. 'head' is read
+// first: it never passes 'tail', so the difference can not wrap below zero
+// however the two move in between, but it may then be past the capacity.
+unsigned mpsc_count (mpsc_queue *q)
+{
+  unsigned head = LOAD_ACQUIRE(&q->head);
+  unsigned n = LOAD_ACQUIRE(&q->tail) - head;
+  return n <= q->mask ? n : q->mask + 1;
+}
+
+// any thread: return 0 if the queue is full
+int mpsc_push (mpsc_queue *q, void *item)
+{
+  unsigned pos = LOAD_RELAXED(&q->tail);
+  mpsc_slot *slot;
+  for (;;) {
+    int diff;
+    slot = &q->slots[pos & q->mask];
+    diff = (int)(LOAD_ACQUIRE(&slot->seq) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+      // 'pos' was reloaded by the failed exchange
+    }
+    else if (diff < 0)
+      return 0;                  // the slot still holds an item of the last round
+    else
+      pos = LOAD_RELAXED(&q->tail);
+  }
+  slot->item = item;
+  STORE_RELEASE(&slot->seq, pos + 1);
+  return 1;
+}
+
+// consumer: the next item, or NULL if there is none (yet)
+void* mpsc_pop (mpsc_queue *q)
+{
+  unsigned pos = q->head;
+  mpsc_slot *slot = &q->slots[pos & q->mask];
+  void *item;
+  if (LOAD_ACQUIRE(&slot->seq) != pos + 1)
+    return NULL;
+  item = slot->item;
+  STORE_RELEASE(&slot->seq, pos + q->mask + 1);
+  STORE_RELEASE(&q->head, pos + 1);
+  return item;
+}
@@ -0,0 +1,35 @@
+// mpsc.h
+// Lock-free multi-producer/single-consumer ring of pointers.
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#define MPSC_CACHE_LINE 64
+
+typedef struct {
+  unsigned seq;            // the index the slot is free for (== index) or
+                           // full for (== index + 1)
+  void *item;
+} mpsc_slot;
+
+typedef struct {
+  // read-only after mpsc_init
+  mpsc_slot *slots;
+  unsigned mask;           // capacity - 1; the capacity is a power of two
+  char pad0[MPSC_CACHE_LINE];
+  // producer side
+  unsigned tail;           // next slot to claim (by compare-and-swap)
+  char pad1[MPSC_CACHE_LINE];
+  // consumer side
+  unsigned head;           // next slot to pop (written by the consumer only)
+  char pad2[MPSC_CACHE_LINE];
+} mpsc_queue;
+
+int      mpsc_init     (mpsc_queue *q, unsigned capacity);
+void     mpsc_free     (mpsc_queue *q);
+unsigned mpsc_capacity (const mpsc_queue *q);
+unsigned mpsc_count    (mpsc_queue *q);
+int      mpsc_push     (mpsc_queue *q, void *item);
+void*    mpsc_pop      (mpsc_queue *q);
+
+#endif
@@ -0,0 +1,73 @@
+// outbuf.c
+// Buffered output: writes are gathered in a fixed buffer and handed to the
+// sink in one call when the buffer fills, when the oldest pending byte gets
+// older than a deadline, or on request.
+
+#include <string.h>
+#include "outbuf.h"
+
+void outbuf_init (outbuf *w, char *storage, size_t cap, unsigned flush_ms,
+                  const outbuf_sink *sink)
+{
+  memset(w, 0, sizeof(*w));
+  w->buf = storage;
+  w->cap = cap;
+  w->flush_ms = flush_ms;
+  w->sink = *sink;
+}
+
+static int send (outbuf *w, const char *s, size_t len)
+{
+  if (!w->sink.write(w->sink.ctx, s, len)) {
+    w->stats.errors++;
+    return 0;
+  }
+  w->stats.flushes++;
+  w->stats.bytes += len;
+  return 1;
+}
+
+// Hand the pending bytes to the sink. Return 0 if it failed; the bytes are
+// dropped either way, so a broken sink cannot wedge the outbuf.
+int outbuf_flush (outbuf *w)
+{
+  size_t len = w->len;
+  if (len == 0)
+    return 1;
+  w->len = 0;
+  return send(w, w->buf, len);
+}
+
+// true if pending bytes have waited for 'flush_ms' or longer
+int outbuf_due (const outbuf *w, unsigned now)
+{
+  return w->len && w->flush_ms && now - w->since >= w->flush_ms;
+}
+
+int outbuf_tick (outbuf *w, unsigned now)
+{
+  return outbuf_due(w, now) ? outbuf_flush(w) : 1;
+}
+
+// Add s to the buffer. What does not fit goes out with the pending bytes
+// first; a string at least as large as the buffer is passed straight to the
+// sink. Return 0 if a sink call failed.
+int outbuf_write (outbuf *w, const char *s, size_t len, unsigned now)
+{
+  int ok = 1;
+  w->stats.writes++;
+  if (w->len + len > w->cap) {
+    ok = outbuf_flush(w);
+    if (len >= w->cap)
+      return send(w, s, len) && ok;
+  }
+  if (len) {
+    if (w->len == 0)
+      w->since = now;
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+  }
+  if (w->len == w->cap || outbuf_due(w, now))
+    ok = outbuf_flush(w) && ok;
+  return ok;
+}
@@ -0,0 +1,47 @@
+// outbuf.h
+// Buffered output: writes are gathered in a fixed buffer and handed to the
+// sink in one call when the buffer fills, when the oldest pending byte gets
+// older than a deadline, or on request.
+
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stddef.h>
+
+// Output stand-in: write all of s; return 0 on failure.
+typedef int (*outbuf_write_fn) (void *ctx, const char *s, size_t len);
+
+typedef struct {
+  outbuf_write_fn write;
+  void *ctx;
+} outbuf_sink;
+
+typedef struct {
+  unsigned long writes;   // outbuf_write() calls
+  unsigned long flushes;  // sink calls
+  unsigned long bytes;    // bytes handed to the sink
+  unsigned long errors;   // failed sink calls
+} outbuf_stats;
+
+// Times are in milliseconds from any wrapping clock (GetTickCount will do);
+// only differences are used.
+typedef struct {
+  char *buf;
+  size_t len, cap;
+  unsigned flush_ms;    // 0: no deadline
+  unsigned since;       // time of the first pending byte
+  outbuf_sink sink;
+  outbuf_stats stats;
+} outbuf;
+
+#define OUTBUF_DEFAULT_BUFFER    65536
+#define OUTBUF_DEFAULT_FLUSH_MS  16
+
+void outbuf_init  (outbuf *w, char *storage, size_t cap, unsigned flush_ms,
+                   const outbuf_sink *sink);
+int  outbuf_write (outbuf *w, const char *s, size_t len, unsigned now);
+int  outbuf_flush (outbuf *w);
+int  outbuf_due   (const outbuf *w, unsigned now);
+int  outbuf_tick  (outbuf *w, unsigned now);
+
+#endif
@@ -0,0 +1,144 @@
+// pump.c
+// Input pump: a thread that blocks on an event source and moves the records
+// it delivers into a lock-free queue, so that the reading side never blocks
+// or spins.
+
+#include <stdlib.h>
+#include "pump.h"
+#include "loop.h"
+#include "spsc.h"
+#include "thread.h"
+
+#define LOAD(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+struct input_pump {
+  spsc_queue q;
+  pump_source src;
+  sys_thread thread;
+  sys_event ready;         // set whenever records were queued
+  int stop;                // set by the owner
+  int waiting;             // set by the owner while in pump_wait
+  int alive;               // cleared by the pump thread on exit
+  // written by the pump thread only
+  unsigned long received, dropped, overflows, errors;
+  char *batch;
+};
+
+static THREAD_PROC(pump_thread, arg)
+{
+  input_pump *p = (input_pump*)arg;
+  int full = 0;
+  while (!LOAD(&p->stop)) {
+    int i, n, queued = 0;
+    n = p->src.wait(p->src.ctx, PUMP_POLL_MS);
+    if (n > 0)
+      n = p->src.read(p->src.ctx, p->batch, PUMP_BATCH);
+    if (n < 0) {
+      STORE(&p->errors, p->errors + 1);
+      break;
+    }
+    for (i=0; i<n; i++) {
+      if (spsc_push(&p->q, p->batch + i * p->q.elem_size)) {
+        queued++;
+        full = 0;
+      }
+      else {
+        // count each run of lost records as one overflow
+        if (!full)
+          STORE(&p->overflows, p->overflows + 1);
+        STORE(&p->dropped, p->dropped + 1);
+        full = 1;
+      }
+    }
+    if (n > 0)
+      STORE(&p->received, p->received + n);
+    // signal only a reader that is (about to be) asleep: pairs with the
+    // store to 'waiting' and the count check in pump_wait
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (queued && LOAD(&p->waiting))
+      sys_event_set(&p->ready);
+  }
+  STORE(&p->alive, 0);
+  sys_event_set(&p->ready);    // wake a waiter so it sees the pump is gone
+  THREAD_RETURN;
+}
+
+// Start a pump thread over 'src'; records are 'elem_size' bytes and the queue
+// holds at least 'capacity' of them. Return NULL on failure.
+input_pump* pump_start (const pump_source *src, unsigned capacity, size_t elem_size)
+{
+  input_pump *p = (input_pump*)calloc(1, sizeof(input_pump));
+  if (!p)
+    return NULL;
+  p->src = *src;
+  p->alive = 1;
+  p->batch = (char*)malloc(PUMP_BATCH * elem_size);
+  if (p->batch && spsc_init(&p->q, capacity, elem_size)) {
+    if (sys_event_init(&p->ready)) {
+      if (sys_thread_start(&p->thread, pump_thread, p))
+        return p;
+      sys_event_free(&p->ready);
+    }
+    spsc_free(&p->q);
+  }
+  free(p->batch);
+  free(p);
+  return NULL;
+}
+
+// Ask the thread to finish, wait for it and free everything. This takes up
+// to PUMP_POLL_MS if the thread is blocked in the source's wait().
+void pump_stop (input_pump *p)
+{
+  STORE(&p->stop, 1);
+  sys_thread_join(&p->thread);
+  sys_event_free(&p->ready);
+  spsc_free(&p->q);
+  free(p->batch);
+  free(p);
+}
+
+// Move up to 'max' queued records into 'out'; never blocks.
+int pump_poll (input_pump *p, void *out, int max)
+{
+  return max > 0 ? (int)spsc_pop(&p->q, out, (unsigned)max) : 0;
+}
+
+// Wait until records are queued or 'timeout_ms' passes (a negative timeout
+// waits forever). Return 1 if records are queued, 0 otherwise. Returns at
+// once if the pump thread has stopped.
+int pump_wait (input_pump *p, int timeout_ms)
+{
+  double end = timeout_ms >= 0 ? loop_now() + timeout_ms : 0;
+  int i;
+  if (spsc_count(&p->q) != 0)
+    return 1;
+  __atomic_store_n(&p->waiting, 1, __ATOMIC_SEQ_CST);
+  // the event may still be set from records that were polled since; then
+  // the second wait is the real one, for what is left of the timeout
+  for (i=0; i<2 && spsc_count(&p->q) == 0 && LOAD(&p->alive); i++) {
+    if (i > 0 && timeout_ms >= 0) {
+      double left = end - loop_now();
+      timeout_ms = left > 0 ? (int)(left + 0.999) : 0;
+    }
+    if (!sys_event_wait(&p->ready, timeout_ms))
+      break;
+  }
+  STORE(&p->waiting, 0);
+  return spsc_count(&p->q) != 0;
+}
+
+int pump_alive (input_pump *p)
+{
+  return LOAD(&p->alive);
+}
+
+void pump_get_stats (input_pump *p, pump_stats *st)
+{
+  st->received  = LOAD(&p->received);
+  st->dropped   = LOAD(&p->dropped);
+  st->overflows = LOAD(&p->overflows);
+  st->errors    = LOAD(&p->errors);
+  st->pending   = spsc_count(&p->q);
+}
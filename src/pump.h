@@ -0,0 +1,43 @@
+// pump.h
+// Input pump: a thread that blocks on an event source and moves the records
+// it delivers into a lock-free queue, so that the reading side never blocks
+// or spins.
+
+#ifndef PUMP_H
+#define PUMP_H
+
+#include <stddef.h>
+
+// Event source, called on the pump thread only.
+typedef struct {
+  // Wait at most 'timeout_ms' for records; return 1 if there may be some,
+  // 0 on timeout and -1 on failure.
+  int (*wait) (void *ctx, int timeout_ms);
+  // Read up to 'max' records into 'buf' without blocking; return how many,
+  // or -1 on failure.
+  int (*read) (void *ctx, void *buf, int max);
+  void *ctx;
+} pump_source;
+
+typedef struct {
+  unsigned long received;   // records read from the source
+  unsigned long dropped;    // records lost because the queue was full
+  unsigned long overflows;  // times the queue ran full
+  unsigned long errors;     // source failures (the pump stops on the first)
+  unsigned long pending;    // records in the queue
+} pump_stats;
+
+#define PUMP_DEFAULT_CAPACITY  1024
+#define PUMP_BATCH             64     // records per read() call
+#define PUMP_POLL_MS           100    // how often a stop request is noticed
+
+typedef struct input_pump input_pump;
+
+input_pump* pump_start (const pump_source *src, unsigned capacity, size_t elem_size);
+void        pump_stop  (input_pump *p);
+int         pump_poll  (input_pump *p, void *out, int max);
+int         pump_wait  (input_pump *p, int timeout_ms);
+int         pump_alive (input_pump *p);
+void        pump_get_stats (input_pump *p, pump_stats *st);
+
+#endif
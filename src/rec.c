@@ -0,0 +1,604 @@
+// rec.c
+// Screen recordings: the file format of rec.h, its encoder and its player.
+
+#include <stdlib.h>
+#include <string.h>
+#include "rec.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+enum { OP_SKIP, OP_LITERAL, OP_REPEAT };
+
+static const char magic[8] = { 'C','O','N','S','R','E','C','1' };
+static const char index_magic[4] = { 'R','I','D','X' };
+
+#define CELL_WORD(c)  ((unsigned)(c).Char | (unsigned)(c).Attributes << 16)
+
+static void put16 (unsigned char *p, unsigned v)
+{
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+}
+
+static void put32 (unsigned char *p, unsigned long v)
+{
+  put16(p, (unsigned)(v & 0xFFFF));
+  put16(p + 2, (unsigned)(v >> 16 & 0xFFFF));
+}
+
+static void put64 (unsigned char *p, unsigned long long v)
+{
+  put32(p, (unsigned long)(v & 0xFFFFFFFF));
+  put32(p + 4, (unsigned long)(v >> 32));
+}
+
+static unsigned get16 (const unsigned char *p)
+{
+  return p[0] | (unsigned)p[1] << 8;
+}
+
+static unsigned long get32 (const unsigned char *p)
+{
+  return get16(p) | (unsigned long)get16(p + 2) << 16;
+}
+
+static unsigned long long get64 (const unsigned char *p)
+{
+  return get32(p) | (unsigned long long)get32(p + 4) << 32;
+}
+
+//---------------------------------------------------------------------------
+// writer
+//---------------------------------------------------------------------------
+static int reserve (rec_writer *w, size_t n)
+{
+  if (w->outlen + n > w->outcap) {
+    size_t cap = w->outcap ? w->outcap : 4096;
+    unsigned char *p;
+    while (cap < w->outlen + n) cap *= 2;
+    if (!(p = (unsigned char*)realloc(w->out, cap)))
+      return 0;
+    w->out = p;
+    w->outcap = cap;
+  }
+  return 1;
+}
+
+static void emit_varint (rec_writer *w, unsigned long long v)
+{
+  while (v >= 0x80) {
+    w->out[w->outlen++] = (unsigned char)(v | 0x80);
+    v >>= 7;
+  }
+  w->out[w->outlen++] = (unsigned char)v;
+}
+
+static int emit_op (rec_writer *w, int op, size_t n)
+{
+  if (!reserve(w, 10))
+    return 0;
+  emit_varint(w, (unsigned long long)n << 2 | op);
+  return 1;
+}
+
+static int emit_word (rec_writer *w, unsigned long x)
+{
+  if (!reserve(w, 4))
+    return 0;
+  put32(w->out + w->outlen, x);
+  w->outlen += 4;
+  return 1;
+}
+
+static unsigned xor_at (const cell_t *cur, const cell_t *prev, size_t i)
+{
+  return CELL_WORD(cur[i]) ^ (prev ? CELL_WORD(prev[i]) : 0);
+}
+
+// Encode cells [from, to) against 'prev' (a blank screen if NULL); cells
+// before 'from' are skipped. Return the number of cells changed, or -1 if
+// out of memory.
+static long encode (rec_writer *w, const cell_t *cur, const cell_t *prev,
+                    size_t from, size_t to)
+{
+  size_t i = from, skip = from, j;
+  long changed = 0;
+  while (i < to) {
+    unsigned x = xor_at(cur, prev, i);
+    if (x == 0) {
+      skip++, i++;
+      // most of a delta is unchanged: step over it a block at a time
+      while (prev && i + 16 <= to && !memcmp(cur + i, prev + i, 16 * sizeof(cell_t)))
+        skip += 16, i += 16;
+      continue;
+    }
+    if (skip) {
+      if (!emit_op(w, OP_SKIP, skip))
+        return -1;
+      skip = 0;
+    }
+    for (j = i + 1; j < to && xor_at(cur, prev, j) == x; j++) {}
+    if (j - i >= 3) {
+      if (!emit_op(w, OP_REPEAT, j - i) || !emit_word(w, x))
+        return -1;
+    }
+    else {
+      // literals up to an unchanged cell or a run of three
+      for (j = i; j < to; j++) {
+        unsigned y = xor_at(cur, prev, j);
+        if (y == 0 || (j + 2 < to && xor_at(cur, prev, j + 1) == y &&
+                       xor_at(cur, prev, j + 2) == y))
+          break;
+      }
+      if (!emit_op(w, OP_LITERAL, j - i) || !reserve(w, (j - i) * 4))
+        return -1;
+      changed += (long)(j - i);
+      for (; i < j; i++)
+        emit_word(w, xor_at(cur, prev, i));
+      continue;
+    }
+    changed += (long)(j - i);
+    i = j;
+  }
+  return changed;
+}
+
+static int add_index (rec_writer *w, unsigned time, unsigned long frame,
+                      unsigned long long offset)
+{
+  unsigned char *e;
+  if (w->nindex == w->indexcap) {
+    size_t cap = w->indexcap ? w->indexcap * 2 : 64;
+    unsigned char *p = (unsigned char*)realloc(w->index, cap * REC_INDEX_ENTRY);
+    if (!p)
+      return 0;
+    w->index = p;
+    w->indexcap = cap;
+  }
+  e = w->index + w->nindex++ * REC_INDEX_ENTRY;
+  put32(e, time);
+  put32(e + 4, frame);
+  put64(e + 8, offset);
+  return 1;
+}
+
+static int write_out (rec_writer *w, const void *p, size_t n)
+{
+  if (w->failed || fwrite(p, 1, n, w->f) != n) {
+    w->failed = 1;
+    return 0;
+  }
+  w->stats.bytes += n;
+  return 1;
+}
+
+// Create the file; return 0 on failure. 'keyframe' is the number of frames
+// from a keyframe to the next (0: the default).
+int rec_writer_open (rec_writer *w, const char *path, int keyframe)
+{
+  unsigned char header[REC_HEADER_SIZE];
+  memset(w, 0, sizeof(rec_writer));
+  w->keyframe = keyframe > 0 ? keyframe : REC_DEFAULT_KEYFRAME;
+  if (!(w->f = fopen(path, "wb")))
+    return 0;
+  memcpy(header, magic, 8);
+  put32(header + 8, REC_VERSION);
+  put32(header + 12, 0);
+  if (!write_out(w, header, sizeof(header)) || fflush(w->f)) {
+    fclose(w->f);
+    w->f = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static int same_cursor (const rec_frame *a, const rec_frame *b)
+{
+  return a->cursor_x == b->cursor_x && a->cursor_y == b->cursor_y &&
+         a->cursor_visible == b->cursor_visible && a->cursor_size == b->cursor_size;
+}
+
+// Add a frame. Only rows top..bottom of 'screen' may differ from the last
+// frame; nothing is written if they do not and the cursor has not changed.
+// A keyframe is written instead of a delta for the first frame, after a
+// change of size and every w->keyframe frames. The frame is flushed to the
+// file, so that a recording cut short keeps what came before. Return 0 on
+// failure.
+int rec_writer_frame (rec_writer *w, const cellbuf *screen, const rec_frame *fr,
+                      int top, int bottom)
+{
+  size_t n = (size_t)screen->width * screen->height, row;
+  unsigned char *h;
+  long changed;
+  int key = !w->prev.cells || screen->width != w->prev.width ||
+            screen->height != w->prev.height || w->since_key >= w->keyframe;
+  if (!w->f || w->failed)
+    return 0;
+  if (key) {
+    cell_t *cells = w->prev.cells;
+    if (screen->width != w->prev.width || screen->height != w->prev.height) {
+      if (!(cells = (cell_t*)realloc(w->prev.cells, (n ? n : 1) * sizeof(cell_t))))
+        return 0;
+    }
+    cellbuf_init(&w->prev, screen->width, screen->height, cells);
+    top = 0;
+    bottom = screen->height - 1;
+  }
+  else {
+    if (top < 0) top = 0;
+    if (bottom > screen->height - 1) bottom = screen->height - 1;
+  }
+
+  w->outlen = 0;
+  if (!reserve(w, REC_FRAME_HEADER))
+    return 0;
+  w->outlen = REC_FRAME_HEADER;
+  changed = 0;
+  if (top <= bottom) {
+    row = (size_t)top * screen->width;
+    changed = encode(w, screen->cells, key ? NULL : w->prev.cells, row,
+                     (size_t)(bottom + 1) * screen->width);
+    if (changed < 0)
+      return 0;
+  }
+  if (!key && changed == 0 && same_cursor(fr, &w->last)) {
+    w->stats.unchanged++;
+    return 1;
+  }
+
+  h = w->out;
+  put32(h, (unsigned long)w->outlen);
+  put32(h + 4, fr->time);
+  h[8] = key ? 'K' : 'D';
+  h[9] = (unsigned char)(fr->cursor_visible != 0);
+  h[10] = (unsigned char)fr->cursor_size;
+  h[11] = 0;
+  put16(h + 12, (unsigned)screen->width);
+  put16(h + 14, (unsigned)screen->height);
+  put16(h + 16, (unsigned)fr->cursor_x);
+  put16(h + 18, (unsigned)fr->cursor_y);
+  if (key && !add_index(w, fr->time, w->stats.frames, w->stats.bytes))
+    return 0;
+  if (!write_out(w, w->out, w->outlen) || fflush(w->f)) {
+    w->failed = 1;
+    return 0;
+  }
+
+  if (top <= bottom)
+    memcpy(CELLBUF_AT(&w->prev, 0, top), CELLBUF_AT(screen, 0, top),
+           (size_t)(bottom - top + 1) * screen->width * sizeof(cell_t));
+  w->last = *fr;
+  w->since_key = key ? 1 : w->since_key + 1;
+  w->stats.frames++;
+  if (key)
+    w->stats.keyframes++;
+  else
+    w->stats.cells += (unsigned long)changed;
+  return 1;
+}
+
+// Write the index and close the file; return 0 if anything failed since
+// rec_writer_open(). The writer may be closed more than once.
+int rec_writer_close (rec_writer *w)
+{
+  int ok = 1;
+  if (w->f) {
+    unsigned char trailer[REC_TRAILER_SIZE];
+    unsigned long long offset = w->stats.bytes;
+    put64(trailer, offset);
+    put32(trailer + 8, (unsigned long)w->nindex);
+    put32(trailer + 12, w->stats.frames);
+    put32(trailer + 16, w->last.time);
+    memcpy(trailer + 20, index_magic, 4);
+    if (w->nindex)
+      write_out(w, w->index, w->nindex * REC_INDEX_ENTRY);
+    write_out(w, trailer, sizeof(trailer));
+    ok = !w->failed;
+    if (fclose(w->f))
+      ok = 0;
+    w->f = NULL;
+  }
+  else
+    ok = !w->failed;
+  free(w->prev.cells);
+  free(w->out);
+  free(w->index);
+  w->prev.cells = NULL;
+  w->out = w->index = NULL;
+  w->outlen = w->outcap = w->nindex = w->indexcap = 0;
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+// reader
+//---------------------------------------------------------------------------
+// find the frames of a recording without a trailer, and index its keyframes
+static int scan (rec_reader *r)
+{
+  size_t pos = REC_HEADER_SIZE, cap = 0;
+  while (pos + REC_FRAME_HEADER <= r->len) {
+    const unsigned char *p = r->data + pos;
+    unsigned long size = get32(p);
+    if (size < REC_FRAME_HEADER || size > r->len - pos || (p[8] != 'K' && p[8] != 'D'))
+      break;
+    if (p[8] == 'K') {
+      unsigned char *e;
+      if (r->nindex == cap) {
+        unsigned char *q;
+        cap = cap ? cap * 2 : 64;
+        if (!(q = (unsigned char*)realloc(r->scanned, cap * REC_INDEX_ENTRY)))
+          return 0;
+        r->scanned = q;
+      }
+      e = r->scanned + r->nindex++ * REC_INDEX_ENTRY;
+      memcpy(e, p + 4, 4);
+      put32(e + 4, r->nframes);
+      put64(e + 8, pos);
+    }
+    r->duration = (unsigned)get32(p + 4);
+    r->nframes++;
+    pos += size;
+  }
+  r->end = pos;
+  r->index = r->scanned;
+  return 1;
+}
+
+// the index of the trailer is used only if each entry is a keyframe header
+// within the frames, in the order of the file
+static int check_index (const rec_reader *r)
+{
+  unsigned long long prev = 0;
+  unsigned long prev_time = 0;
+  size_t i;
+  if (r->end < REC_HEADER_SIZE + REC_FRAME_HEADER)
+    return r->nindex == 0;
+  for (i=0; i<r->nindex; i++) {
+    const unsigned char *e = r->index + i * REC_INDEX_ENTRY;
+    unsigned long long offset = get64(e + 8);
+    if (offset < REC_HEADER_SIZE || offset > r->end - REC_FRAME_HEADER ||
+        (i && offset <= prev) || (i && get32(e) < prev_time) ||
+        get32(e + 4) >= r->nframes || r->data[offset + 8] != 'K')
+      return 0;
+    prev = offset;
+    prev_time = get32(e);
+  }
+  return 1;
+}
+
+// Read a recording held in memory, which must stay there until
+// rec_reader_close(). Return 0 if it is not one.
+int rec_reader_memory (rec_reader *r, const void *data, size_t len)
+{
+  const unsigned char *p = (const unsigned char*)data;
+  memset(r, 0, sizeof(rec_reader));
+  r->data = p;
+  r->len = len;
+  r->frame = -1;
+  r->next = REC_HEADER_SIZE;
+  if (len < REC_HEADER_SIZE || memcmp(p, magic, 8) || get32(p + 8) != REC_VERSION)
+    return 0;
+  if (len >= REC_HEADER_SIZE + REC_TRAILER_SIZE &&
+      !memcmp(p + len - 4, index_magic, 4)) {
+    const unsigned char *t = p + len - REC_TRAILER_SIZE;
+    unsigned long long offset = get64(t);
+    unsigned long count = get32(t + 8);
+    if (offset >= REC_HEADER_SIZE && offset <= len - REC_TRAILER_SIZE &&
+        (len - REC_TRAILER_SIZE - offset) / REC_INDEX_ENTRY == count &&
+        (len - REC_TRAILER_SIZE - offset) % REC_INDEX_ENTRY == 0) {
+      r->end = (size_t)offset;
+      r->index = p + offset;
+      r->nindex = count;
+      r->nframes = get32(t + 12);
+      r->duration = (unsigned)get32(t + 16);
+      if (check_index(r))
+        return 1;
+      // a damaged index: as if there were none
+      r->index = NULL;
+      r->nindex = r->nframes = 0;
+      r->duration = 0;
+    }
+  }
+  if (!scan(r)) {
+    rec_reader_close(r);
+    return 0;
+  }
+  return 1;
+}
+
+static void unmap (void *base, size_t len)
+{
+#ifdef _WIN32
+  (void)len;
+  UnmapViewOfFile(base);
+#else
+  munmap(base, len);
+#endif
+}
+
+// Map the file; return 0 if it can not be read or is not a recording.
+int rec_reader_open (rec_reader *r, const char *path)
+{
+  void *base = NULL;
+  size_t len = 0;
+#ifdef _WIN32
+  HANDLE mapping;
+  LARGE_INTEGER size;
+  HANDLE f = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                         NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (f == INVALID_HANDLE_VALUE)
+    return 0;
+  if (GetFileSizeEx(f, &size) && size.QuadPart > 0 &&
+      (ULONGLONG)(size_t)size.QuadPart == (ULONGLONG)size.QuadPart) {
+    len = (size_t)size.QuadPart;
+    if ((mapping = CreateFileMapping(f, NULL, PAGE_READONLY, 0, 0, NULL)) != NULL) {
+      base = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);   // the view keeps it
+    }
+  }
+  CloseHandle(f);
+#else
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    len = (size_t)st.st_size;
+    base = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+  }
+  close(fd);
+#endif
+  if (!base)
+    return 0;
+  if (!rec_reader_memory(r, base, len)) {
+    unmap(base, len);
+    return 0;
+  }
+  r->mapping = base;
+  return 1;
+}
+
+void rec_reader_close (rec_reader *r)
+{
+  if (r->mapping) {
+    unmap(r->mapping, r->len);
+    r->mapping = NULL;
+  }
+  free(r->scanned);
+  free(r->screen.cells);
+  r->scanned = NULL;
+  r->screen.cells = NULL;
+  r->data = r->index = NULL;
+  r->len = r->end = r->nindex = 0;
+}
+
+static void xor_cell (cell_t *c, unsigned long x)
+{
+  c->Char ^= (unsigned short)(x & 0xFFFF);
+  c->Attributes ^= (unsigned short)(x >> 16);
+}
+
+static int decode (cell_t *cells, size_t n, const unsigned char *p, const unsigned char *end)
+{
+  size_t pos = 0;
+  while (p < end) {
+    unsigned long long v = 0, count;
+    unsigned long x;
+    int shift = 0;
+    do {
+      if (p == end || shift > 63)
+        return 0;
+      v |= (unsigned long long)(*p & 0x7F) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    count = v >> 2;
+    if (count > n - pos)
+      return 0;
+    switch (v & 3) {
+      case OP_SKIP:
+        pos += (size_t)count;
+        break;
+      case OP_LITERAL:
+        if ((size_t)(end - p) / 4 < count)
+          return 0;
+        for (; count; count--, p += 4)
+          xor_cell(cells + pos++, get32(p));
+        break;
+      case OP_REPEAT:
+        if (end - p < 4)
+          return 0;
+        x = get32(p);
+        p += 4;
+        for (; count; count--)
+          xor_cell(cells + pos++, x);
+        break;
+      default:
+        return 0;
+    }
+  }
+  return 1;
+}
+
+// Show the next frame; return 0 at the end, or if it is damaged.
+int rec_reader_next (rec_reader *r)
+{
+  const unsigned char *p;
+  unsigned long size;
+  int width, height;
+  size_t n;
+  if (!r->data || r->next > r->end || r->end - r->next < REC_FRAME_HEADER)
+    return 0;
+  p = r->data + r->next;
+  size = get32(p);
+  if (size < REC_FRAME_HEADER || size > r->end - r->next)
+    return 0;
+  width = (int)get16(p + 12);
+  height = (int)get16(p + 14);
+  n = (size_t)width * height;
+  if (p[8] == 'K') {
+    if (!r->screen.cells || width != r->screen.width || height != r->screen.height) {
+      cell_t *cells = (cell_t*)realloc(r->screen.cells, (n ? n : 1) * sizeof(cell_t));
+      if (!cells)
+        return 0;
+      cellbuf_init(&r->screen, width, height, cells);
+    }
+    memset(r->screen.cells, 0, n * sizeof(cell_t));
+  }
+  else if (p[8] != 'D' || !r->screen.cells || width != r->screen.width ||
+           height != r->screen.height)
+    return 0;
+  if (!decode(r->screen.cells, n, p + REC_FRAME_HEADER, p + size))
+    return 0;
+  r->cur.time = (unsigned)get32(p + 4);
+  r->cur.cursor_visible = p[9];
+  r->cur.cursor_size = p[10];
+  r->cur.cursor_x = (int)get16(p + 16);
+  r->cur.cursor_y = (int)get16(p + 18);
+  r->frame++;
+  r->next += size;
+  return 1;
+}
+
+// Show the last frame at or before 'time' (the first frame if there is
+// none): from the keyframe before it, found by binary search in the index,
+// then the deltas. Return 0 if there is no frame or it is damaged (the reader
+// is then left at the frame it was at).
+int rec_reader_seek (rec_reader *r, unsigned time)
+{
+  size_t lo = 0, hi = r->nindex, next = r->next;
+  long frame = r->frame;
+  const unsigned char *e;
+  if (!r->nindex)
+    return 0;
+  // the last entry whose time is <= time, if any
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (get32(r->index + mid * REC_INDEX_ENTRY) <= time)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  e = r->index + lo * REC_INDEX_ENTRY;
+  r->next = (size_t)get64(e + 8);
+  r->frame = (long)get32(e + 4) - 1;
+  if (!rec_reader_next(r)) {
+    r->next = next;     // where it was, as after a failed rec_reader_next
+    r->frame = frame;
+    return 0;
+  }
+  while (r->end - r->next >= REC_FRAME_HEADER &&
+         get32(r->data + r->next + 4) <= time) {
+    if (!rec_reader_next(r))
+      break;
+  }
+  return 1;
+}
@@ -0,0 +1,91 @@
+// rec.h
+// Screen recordings: timestamped frames of a cell grid written to a file as
+// keyframes and XOR deltas, with an index of the keyframes at the end, and
+// read back from a mapping of the file with seeking by time.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef REC_H
+#define REC_H
+
+#include <stdio.h>
+#include "cells.h"
+
+// File layout (all numbers little-endian):
+//   header   "CONSREC1", u32 version, u32 reserved
+//   frames   u32 size (of the whole frame), u32 time (ms), u8 kind ('K' or
+//            'D'), u8 cursor visible, u8 cursor size, u8 reserved,
+//            u16 width, u16 height, u16 cursor x, u16 cursor y, then the ops
+//   index    per keyframe: u32 time, u32 frame number, u64 offset
+//   trailer  u64 index offset, u32 keyframes, u32 frames, u32 end time,
+//            "RIDX"
+// A cell is the word Char | Attributes << 16. The ops of a frame XOR the
+// cells of the previous frame (of a blank screen for a keyframe), in order:
+// a varint n << 2 | op, where op is skip n cells, n literal words follow,
+// or repeat the following word n times. Cells past the last op are skipped.
+// Without a trailer (a recording cut short) the frames are scanned instead.
+#define REC_VERSION       1
+#define REC_HEADER_SIZE   16
+#define REC_FRAME_HEADER  20
+#define REC_INDEX_ENTRY   16
+#define REC_TRAILER_SIZE  24
+
+#define REC_DEFAULT_KEYFRAME  100   // frames from one keyframe to the next
+
+typedef struct {
+  unsigned time;              // ms from the start of the recording
+  int cursor_x, cursor_y;     // in the grid
+  int cursor_visible;
+  int cursor_size;            // 1 to 100
+} rec_frame;
+
+typedef struct {
+  unsigned long frames;       // frames written
+  unsigned long keyframes;
+  unsigned long unchanged;    // rec_writer_frame() calls with nothing new
+  unsigned long cells;        // cells changed, over all deltas
+  unsigned long long bytes;   // file size so far
+} rec_stats;
+
+typedef struct {
+  FILE *f;
+  int keyframe;               // frames from one keyframe to the next
+  int since_key;              // frames since the last keyframe
+  cellbuf prev;               // last frame written (malloc'ed cells)
+  rec_frame last;
+  unsigned char *out;         // encoding of one frame
+  size_t outlen, outcap;
+  unsigned char *index;       // index entries, as written at the end
+  size_t nindex, indexcap;    // in entries
+  int failed;                 // a write failed: the rest is dropped
+  rec_stats stats;
+} rec_writer;
+
+int  rec_writer_open  (rec_writer *w, const char *path, int keyframe);
+int  rec_writer_frame (rec_writer *w, const cellbuf *screen, const rec_frame *fr,
+                       int top, int bottom);
+int  rec_writer_close (rec_writer *w);
+
+typedef struct {
+  const unsigned char *data;  // the whole file
+  size_t len;
+  size_t end;                 // where the frames end
+  const unsigned char *index; // keyframe entries (in the file, or built by a scan)
+  unsigned char *scanned;     // the index built by a scan, if any
+  size_t nindex;
+  unsigned long nframes;
+  unsigned duration;          // time of the last frame
+  void *mapping;              // platform mapping of 'data', if any
+  // playback
+  cellbuf screen;             // the frame shown (malloc'ed cells)
+  rec_frame cur;
+  long frame;                 // its number; -1 before the first
+  size_t next;                // offset of the next frame
+} rec_reader;
+
+int  rec_reader_open   (rec_reader *r, const char *path);
+int  rec_reader_memory (rec_reader *r, const void *data, size_t len);
+void rec_reader_close  (rec_reader *r);
+int  rec_reader_next   (rec_reader *r);
+int  rec_reader_seek   (rec_reader *r, unsigned time);
+
+#endif
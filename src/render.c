@@ -0,0 +1,252 @@
+// render.c
+// Damage tracking: diff two cell arrays and cover the changes with a small
+// set of rectangles, each of which is then sent with one output call.
+
+#include "render.h"
+#include "cellops.h"
+#include "scroll.h"
+
+#define CELL_EQ(a, b)  ((a).Char == (b).Char && (a).Attributes == (b).Attributes)
+
+void render_init_params (render_params *prm)
+{
+  prm->call_cost = RENDER_DEFAULT_CALL_COST;
+  prm->max_rects = RENDER_DEFAULT_MAX_RECTS;
+  prm->scroll = 0;
+  prm->scroll_top = 0;
+  prm->scroll_bottom = 0x7FFF;
+  prm->max_shift = 0;
+}
+
+static long rect_area (const cell_rect *r)
+{
+  return (long)(r->Right - r->Left + 1) * (r->Bottom - r->Top + 1);
+}
+
+static void rect_union (cell_rect *u, const cell_rect *a, const cell_rect *b)
+{
+  u->Left   = a->Left   < b->Left   ? a->Left   : b->Left;
+  u->Top    = a->Top    < b->Top    ? a->Top    : b->Top;
+  u->Right  = a->Right  > b->Right  ? a->Right  : b->Right;
+  u->Bottom = a->Bottom > b->Bottom ? a->Bottom : b->Bottom;
+}
+
+// Extra cost of sending the bounding box of a and b instead of both of them;
+// zero or less means the merge pays off.
+static long merge_penalty (const cell_rect *a, const cell_rect *b, int call_cost)
+{
+  cell_rect u;
+  rect_union(&u, a, b);
+  return rect_area(&u) - rect_area(a) - rect_area(b) - call_cost;
+}
+
+// Find the changed spans of one row between its first and last changed cells
+// (first <= x < end). Runs of unchanged cells not longer than 'gap' are
+// swallowed: sending them is cheaper than another output call.
+static int row_spans (const cell_t *f, const cell_t *b, int first, int end, int gap,
+                      int *spans, int maxspans)
+{
+  int x, n = 0, start = -1, last = -1;
+  for (x=first; x<end; x++) {
+    if (CELL_EQ(f[x], b[x]))
+      continue;
+    if (start >= 0 && x - last - 1 > gap) {
+      spans[2*n] = start; spans[2*n+1] = last;
+      if (++n == maxspans - 1) {
+        // out of room: the rest of the row becomes one span
+        for (last=end-1; CELL_EQ(f[last], b[last]); last--) {}
+        start = x;
+        break;
+      }
+      start = x;
+    }
+    else if (start < 0)
+      start = x;
+    last = x;
+  }
+  if (start >= 0) {
+    spans[2*n] = start; spans[2*n+1] = last;
+    n++;
+  }
+  return n;
+}
+
+// Merge the pair with the lowest penalty; return 0 if that penalty is
+// positive and 'force' is not set.
+static int merge_best_pair (cell_rect *rects, int *n, int call_cost, int force)
+{
+  int i, j, bi = -1, bj = -1;
+  long best = 0;
+  for (i=0; i<*n; i++) {
+    for (j=i+1; j<*n; j++) {
+      long p = merge_penalty(&rects[i], &rects[j], call_cost);
+      if (bi < 0 || p < best) {
+        best = p; bi = i; bj = j;
+      }
+    }
+  }
+  if (bi < 0 || (best > 0 && !force))
+    return 0;
+  rect_union(&rects[bi], &rects[bi], &rects[bj]);
+  rects[bj] = rects[--(*n)];
+  return 1;
+}
+
+// Compute the rectangles needed to turn 'front' into 'back' (both must have
+// the same size). Return their number; 'rects' must hold RENDER_MAX_RECTS.
+int render_diff (const cellbuf *front, const cellbuf *back, const render_params *prm,
+                 cell_rect *rects)
+{
+  int spans[2*RENDER_MAX_RECTS];
+  int y, n = 0;
+  int call_cost = prm->call_cost > 0 ? prm->call_cost : 0;
+  int max_rects = prm->max_rects > 0 ? prm->max_rects : 1;
+  int cap = max_rects * 4;
+
+  if (max_rects > RENDER_MAX_RECTS) max_rects = RENDER_MAX_RECTS;
+  if (cap > RENDER_MAX_RECTS) cap = RENDER_MAX_RECTS;
+
+  for (y=0; y<front->height; y++) {
+    const cell_t *f = CELLBUF_AT(front, 0, y);
+    const cell_t *b = CELLBUF_AT(back, 0, y);
+    size_t first, last;
+    int i, ns;
+    if (!cellops_compare(f, b, front->width, &first, &last))
+      continue;
+    ns = row_spans(f, b, (int)first, (int)last + 1, call_cost, spans, RENDER_MAX_RECTS);
+    for (i=0; i<ns; i++) {
+      cell_rect span;
+      int k, bk = -1;
+      long best = 0;
+      span.Left = spans[2*i]; span.Right = spans[2*i+1];
+      span.Top = span.Bottom = y;
+      // only rectangles reaching the previous row (or this one) can grow
+      for (k=0; k<n; k++) {
+        if (rects[k].Bottom >= y - 1) {
+          long p = merge_penalty(&rects[k], &span, call_cost);
+          if (bk < 0 || p < best) {
+            best = p; bk = k;
+          }
+        }
+      }
+      if (bk >= 0 && best <= 0)
+        rect_union(&rects[bk], &rects[bk], &span);
+      else if (n < cap)
+        rects[n++] = span;
+      else {
+        // full: fold the span into whatever rectangle it costs least to grow
+        for (k=0, bk=0; k<n; k++) {
+          long p = merge_penalty(&rects[k], &span, call_cost);
+          if (k == 0 || p < best) {
+            best = p; bk = k;
+          }
+        }
+        rect_union(&rects[bk], &rects[bk], &span);
+      }
+    }
+  }
+
+  while (merge_best_pair(rects, &n, call_cost, n > max_rects)) {}
+  return n;
+}
+
+// Scroll the target if rows of 'back' are found shifted in 'front' and the
+// scroll saves more than it costs. Return 0 if the scroll call failed.
+static int present_scroll (cellbuf *front, const cellbuf *back, const render_params *prm,
+                           const render_sink *sink, render_stats *stats)
+{
+  static const cell_t fill = { ' ', 0x07 };
+  int matched, shift, top = prm->scroll_top, bottom = prm->scroll_bottom;
+  if (bottom >= back->height)
+    bottom = back->height - 1;
+  shift = scroll_detect(front, back, top, bottom, prm->max_shift, &matched);
+  if (shift == 0 || (long)matched * back->width <= prm->call_cost)
+    return 1;
+  if (!sink->scroll(sink->ctx, top, bottom, shift, fill))
+    return 0;
+  scroll_apply(front, top, bottom, shift, fill);
+  stats->scrolls++;
+  return 1;
+}
+
+// Send the difference between 'front' (what the target shows) and 'back'
+// (what it should show), updating 'front' as rectangles go out. With 'full'
+// set the whole buffer is sent. Return the number of rectangles or -1 if
+// an output call failed.
+int render_present (cellbuf *front, const cellbuf *back, const render_params *prm,
+                    int full, const render_sink *sink, render_stats *stats)
+{
+  cell_rect rects[RENDER_MAX_RECTS];
+  int i, n;
+
+  if (!full && prm->scroll && sink->scroll) {
+    if (!present_scroll(front, back, prm, sink, stats))
+      return -1;
+  }
+  if (full) {
+    rects[0].Left = rects[0].Top = 0;
+    rects[0].Right = back->width - 1;
+    rects[0].Bottom = back->height - 1;
+    n = 1;
+  }
+  else
+    n = render_diff(front, back, prm, rects);
+
+  stats->frames++;
+  for (i=0; i<n; i++) {
+    if (!sink->write(sink->ctx, back, &rects[i]))
+      return -1;
+    cellbuf_copy_rect(front, rects[i].Left, rects[i].Top, back, rects[i]);
+    stats->rects++;
+    stats->cells += rect_area(&rects[i]);
+  }
+  return n;
+}
+
+// Send columns lo[y]..hi[y] of the rows y in top..bottom of 'src' (none of
+// a row where lo[y] > hi[y]); adjacent rows go out as one rectangle while
+// its extra cells cost less than another call would. Return the number of
+// rectangles or -1 if an output call failed.
+int render_spans (const cellbuf *src, const int *lo, const int *hi, int top, int bottom,
+                  int call_cost, const render_sink *sink, render_stats *stats)
+{
+  cell_rect cur;
+  long area = 0;
+  int y, have = 0, n = 0;
+  for (y=top; y<=bottom; y++) {
+    int a = lo[y], b = hi[y];
+    if (a > b)
+      continue;
+    if (have && y == cur.Bottom + 1) {
+      int l = a < cur.Left ? a : cur.Left;
+      int r = b > cur.Right ? b : cur.Right;
+      long merged = (long)(r - l + 1) * (y - cur.Top + 1);
+      if (merged <= area + call_cost + (b - a + 1)) {
+        cur.Left = l;
+        cur.Right = r;
+        cur.Bottom = y;
+        area = merged;
+        continue;
+      }
+    }
+    if (have) {
+      if (!sink->write(sink->ctx, src, &cur))
+        return -1;
+      stats->rects++;
+      stats->cells += area;
+    }
+    cur.Left = a;
+    cur.Right = b;
+    cur.Top = cur.Bottom = y;
+    area = b - a + 1;
+    have = 1;
+    n++;
+  }
+  if (have) {
+    if (!sink->write(sink->ctx, src, &cur))
+      return -1;
+    stats->rects++;
+    stats->cells += area;
+  }
+  return n;
+}
@@ -0,0 +1,59 @@
+// render.h
+// Damage tracking: diff two cell arrays and cover the changes with a small
+// set of rectangles, each of which is then sent with one output call.
+
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "cells.h"
+
+// Cost model: sending a rectangle costs 'call_cost' plus one per cell in it.
+// Two rectangles are merged whenever their bounding box is not more expensive
+// than sending them separately; no more than 'max_rects' are ever produced.
+//
+// With 'scroll' set, rows [scroll_top, scroll_bottom] are first checked for
+// a vertical shift (see scroll.h); if one pays off it is done with a single
+// scroll call and only the rows that still differ are sent.
+typedef struct {
+  int call_cost;
+  int max_rects;
+  int scroll;
+  int scroll_top;
+  int scroll_bottom;
+  int max_shift;
+} render_params;
+
+#define RENDER_DEFAULT_CALL_COST  64
+#define RENDER_DEFAULT_MAX_RECTS  32
+#define RENDER_MAX_RECTS          256
+
+// Output stand-in: write rectangle r of src to the same place on the target.
+// Return 0 on failure.
+typedef int (*render_write_fn) (void *ctx, const cellbuf *src, const cell_rect *r);
+
+// Optional: scroll rows [top, bottom] of the target by 'shift' (as
+// scroll_apply does) and fill the exposed rows. Return 0 on failure.
+typedef int (*render_scroll_fn) (void *ctx, int top, int bottom, int shift, cell_t fill);
+
+typedef struct {
+  render_write_fn write;
+  render_scroll_fn scroll;
+  void *ctx;
+} render_sink;
+
+typedef struct {
+  unsigned long frames;   // present() calls
+  unsigned long rects;    // rectangles sent
+  unsigned long cells;    // cells sent
+  unsigned long scrolls;  // scroll calls
+} render_stats;
+
+void render_init_params (render_params *prm);
+int  render_diff (const cellbuf *front, const cellbuf *back, const render_params *prm,
+                  cell_rect *rects);
+int  render_present (cellbuf *front, const cellbuf *back, const render_params *prm,
+                     int full, const render_sink *sink, render_stats *stats);
+int  render_spans (const cellbuf *src, const int *lo, const int *hi, int top, int bottom,
+                   int call_cost, const render_sink *sink, render_stats *stats);
+
+#endif
@@ -0,0 +1,106 @@
+// scroll.c
+// Detection of vertically shifted rows between two frames, so that a scroll
+// can be done with one ScrollConsoleScreenBuffer call instead of a repaint.
+
+#include <stdlib.h>
+#include <string.h>
+#include "scroll.h"
+#include "cellops.h"
+
+#define HASH_PRIME 0x100000001B3ULL
+
+// FNV-style hash of a row, two cells per step in two independent lanes
+static unsigned long long row_hash (const cell_t *p, int width)
+{
+  unsigned long long h1 = 0xCBF29CE484222325ULL, h2 = 0x84222325CBF29CE4ULL, v1, v2;
+  int x;
+  for (x=0; x+4<=width; x+=4) {
+    memcpy(&v1, p + x, sizeof(v1));
+    memcpy(&v2, p + x + 2, sizeof(v2));
+    h1 = (h1 ^ v1) * HASH_PRIME;
+    h2 = (h2 ^ v2) * HASH_PRIME;
+  }
+  for (; x<width; x++)
+    h1 = (h1 ^ ((unsigned)p[x].Char | (unsigned)p[x].Attributes << 16)) * HASH_PRIME;
+  return (h1 ^ (h2 >> 29)) * HASH_PRIME ^ h2;
+}
+
+// Find the shift of rows [top, bottom] (|shift| <= max_shift) that turns the
+// largest number of changed rows of 'cur' into rows already present in 'old'.
+// Both buffers must have the same size. Return the shift (0 if none helps)
+// and store the number of rows it fixes in *matched.
+int scroll_detect (const cellbuf *old, const cellbuf *cur, int top, int bottom,
+                   int max_shift, int *matched)
+{
+  unsigned long long *ho, *hc;
+  int rows, y, s, best = 0, best_count = 0;
+
+  *matched = 0;
+  if (top < 0) top = 0;
+  if (bottom >= cur->height) bottom = cur->height - 1;
+  rows = bottom - top + 1;
+  if (rows < 2)
+    return 0;
+  if (max_shift <= 0 || max_shift >= rows)
+    max_shift = rows - 1;
+
+  ho = (unsigned long long*)malloc(2 * rows * sizeof(unsigned long long));
+  if (!ho)
+    return 0;
+  hc = ho + rows;
+  for (y=0; y<rows; y++) {
+    ho[y] = row_hash(CELLBUF_AT(old, 0, top + y), old->width);
+    hc[y] = row_hash(CELLBUF_AT(cur, 0, top + y), cur->width);
+  }
+
+  // vote: rows that differ in place but match the old row 's' rows away
+  for (s=-max_shift; s<=max_shift; s++) {
+    int count = 0, lo, hi;
+    if (s == 0)
+      continue;
+    lo = s < 0 ? -s : 0;
+    hi = s > 0 ? rows - s : rows;
+    for (y=lo; y<hi; y++) {
+      if (hc[y] == ho[y + s] && hc[y] != ho[y])
+        count++;
+    }
+    if (count > best_count || (count == best_count && count && abs(s) < abs(best))) {
+      best_count = count;
+      best = s;
+    }
+  }
+  free(ho);
+
+  *matched = best_count;
+  return best;
+}
+
+// Do to a cell array what ScrollConsoleScreenBuffer does to the screen: move
+// rows [top, bottom] by 'shift' within that band and fill the exposed rows.
+void scroll_apply (cellbuf *cb, int top, int bottom, int shift, cell_t fill)
+{
+  cell_rect r;
+  int y;
+  if (top < 0) top = 0;
+  if (bottom >= cb->height) bottom = cb->height - 1;
+  if (shift == 0 || top > bottom)
+    return;
+  r.Left = 0;
+  r.Right = cb->width - 1;
+  if (shift > 0) {
+    r.Top = top + shift;
+    r.Bottom = bottom;
+    cellbuf_copy_rect(cb, 0, top, cb, r);
+    y = bottom - shift + 1;
+    if (y < top) y = top;
+    for (; y<=bottom; y++)
+      cellops_fill(CELLBUF_AT(cb, 0, y), cb->width, fill);
+  }
+  else {
+    r.Top = top;
+    r.Bottom = bottom + shift;
+    cellbuf_copy_rect(cb, 0, top - shift, cb, r);
+    for (y=top; y<=bottom && y<top-shift; y++)
+      cellops_fill(CELLBUF_AT(cb, 0, y), cb->width, fill);
+  }
+}
@@ -0,0 +1,17 @@
+// scroll.h
+// Detection of vertically shifted rows between two frames, so that a scroll
+// can be done with one ScrollConsoleScreenBuffer call instead of a repaint.
+
+#ifndef SCROLL_H
+#define SCROLL_H
+
+#include "cells.h"
+
+// Row shift convention: a shift of s means new row y shows old row y + s,
+// i.e. s > 0 scrolls the content up by s rows and s < 0 scrolls it down.
+
+int  scroll_detect (const cellbuf *old, const cellbuf *cur, int top, int bottom,
+                    int max_shift, int *matched);
+void scroll_apply  (cellbuf *cb, int top, int bottom, int shift, cell_t fill);
+
+#endif
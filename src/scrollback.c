@@ -0,0 +1,431 @@
+// scrollback.c
+// The scrollback store of scrollback.h: chunks of line records, an index of
+// the chunks searched by line number, and the spill file.
+
+#include <stdlib.h>
+#include <string.h>
+#include "scrollback.h"
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
+#define ALIGN8(n)  (((n) + 7) & ~(unsigned long long)7)
+#define MAP_MIN    (1 << 20)
+#define NARROW     0x8000     // in the count of runs: the characters are bytes
+
+int scrollback_init (scrollback *sb, size_t chunk_bytes, long limit)
+{
+  memset(sb, 0, sizeof(*sb));
+  sb->chunk_bytes = chunk_bytes ? chunk_bytes : SCROLLBACK_CHUNK;
+  sb->limit = limit > 0 ? limit : 0;
+  sb->resident = SCROLLBACK_RESIDENT;
+  sb->file = -1;
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// spill file
+//---------------------------------------------------------------------------
+static void unmap (void *base, unsigned long long len)
+{
+#ifdef _WIN32
+  (void)len;
+  UnmapViewOfFile(base);
+#else
+  munmap(base, (size_t)len);
+#endif
+}
+
+// Map at least 'need' bytes of the file, growing it. The new mapping is made
+// before the old one goes, so that a failure leaves the chunks readable.
+static int map_grow (scrollback *sb, unsigned long long need)
+{
+  unsigned long long len = sb->map_len ? sb->map_len : MAP_MIN;
+  void *base = NULL;
+  while (len < need)
+    len *= 2;
+  if ((unsigned long long)(size_t)len != len)
+    return 0;
+#ifdef _WIN32
+  {
+    HANDLE mapping = CreateFileMapping((HANDLE)sb->file, NULL, PAGE_READWRITE,
+                                       (DWORD)(len >> 32), (DWORD)len, NULL);
+    if (mapping) {
+      base = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)len);
+      CloseHandle(mapping);   // the view keeps it
+    }
+  }
+#else
+  if (ftruncate((int)sb->file, (off_t)len) == 0) {
+    base = mmap(NULL, (size_t)len, PROT_READ | PROT_WRITE, MAP_SHARED, (int)sb->file, 0);
+    if (base == MAP_FAILED)
+      base = NULL;
+  }
+#endif
+  if (!base)
+    return 0;
+  if (sb->map)
+    unmap(sb->map, sb->map_len);
+  sb->map = (unsigned char*)base;
+  sb->map_len = len;
+  return 1;
+}
+
+// Copy a chunk's lines and offsets to the end of the file and free them.
+static int spill_chunk (scrollback *sb, scrollback_chunk *c)
+{
+  unsigned long long at = sb->spill_end;
+  unsigned long long size = ALIGN8(c->used) + (unsigned long long)c->nlines * sizeof(unsigned);
+  if (at + size > sb->map_len && !map_grow(sb, at + size))
+    return 0;
+  memcpy(sb->map + at, c->data, c->used);
+  memcpy(sb->map + at + ALIGN8(c->used), c->offsets, c->nlines * sizeof(unsigned));
+  free(c->data);
+  free(c->offsets);
+  c->data = NULL;
+  c->offsets = NULL;
+  c->spilled = 1;
+  c->spill_at = at;
+  sb->spill_end = at + ALIGN8(size);
+  sb->nspilled++;
+  return 1;
+}
+
+// Spill the chunks older than the 'resident' newest ones; they are spilled
+// oldest first, so the walk back stops at the first one already out.
+static void spill_cold (scrollback *sb)
+{
+  int i = sb->nchunks - sb->resident - 1;
+  while (i >= 0 && !sb->chunks[i].spilled)
+    i--;
+  for (i++; i < sb->nchunks - sb->resident && !sb->failed; i++)
+    sb->failed = !spill_chunk(sb, sb->chunks + i);
+}
+
+int scrollback_spill (scrollback *sb, const char *path, int resident)
+{
+  if (sb->file != -1)
+    return 0;
+#ifdef _WIN32
+  {
+    HANDLE f = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                           FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (f == INVALID_HANDLE_VALUE)
+      return 0;
+    sb->file = (intptr_t)f;
+  }
+#else
+  {
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+      return 0;
+    unlink(path);             // gone once closed
+    sb->file = fd;
+  }
+#endif
+  sb->resident = resident > 0 ? resident : 1;   // the newest is being written
+  spill_cold(sb);
+  return 1;
+}
+
+void scrollback_free (scrollback *sb)
+{
+  int i;
+  for (i=0; i<sb->nchunks; i++) {
+    free(sb->chunks[i].data);
+    free(sb->chunks[i].offsets);
+  }
+  free(sb->chunks);
+  if (sb->map)
+    unmap(sb->map, sb->map_len);
+  if (sb->file != -1) {
+#ifdef _WIN32
+    CloseHandle((HANDLE)sb->file);
+#else
+    close((int)sb->file);
+#endif
+  }
+  scrollback_init(sb, sb->chunk_bytes, sb->limit);
+}
+
+//---------------------------------------------------------------------------
+// appending
+//---------------------------------------------------------------------------
+// A full chunk gives back the room it does not use.
+static void seal (scrollback_chunk *c)
+{
+  unsigned char *data = (unsigned char*)realloc(c->data, c->used);
+  unsigned *offsets = (unsigned*)realloc(c->offsets, c->nlines * sizeof(unsigned));
+  if (data) {
+    c->data = data;
+    c->cap = c->used;
+  }
+  if (offsets) {
+    c->offsets = offsets;
+    c->maxlines = c->nlines;
+  }
+}
+
+// Drop the oldest chunks while the lines left are still over the limit.
+static void drop_old (scrollback *sb)
+{
+  int n = 0;
+  while (sb->limit && n < sb->nchunks && sb->count - sb->chunks[n].nlines >= sb->limit) {
+    scrollback_chunk *c = sb->chunks + n++;
+    free(c->data);
+    free(c->offsets);
+    sb->first += c->nlines;
+    sb->count -= c->nlines;
+    sb->nspilled -= c->spilled;
+  }
+  if (n) {
+    sb->nchunks -= n;
+    memmove(sb->chunks, sb->chunks + n, sb->nchunks * sizeof(scrollback_chunk));
+  }
+}
+
+static scrollback_chunk* new_chunk (scrollback *sb, size_t need)
+{
+  scrollback_chunk *c;
+  if (sb->nchunks == sb->chunkcap) {
+    int cap = sb->chunkcap ? sb->chunkcap * 2 : 16;
+    c = (scrollback_chunk*)realloc(sb->chunks, cap * sizeof(scrollback_chunk));
+    if (!c)
+      return NULL;
+    sb->chunks = c;
+    sb->chunkcap = cap;
+  }
+  c = sb->chunks + sb->nchunks;
+  memset(c, 0, sizeof(*c));
+  c->cap = need > sb->chunk_bytes ? need : sb->chunk_bytes;
+  c->maxlines = 64;
+  c->data = (unsigned char*)malloc(c->cap);
+  c->offsets = (unsigned*)malloc(c->maxlines * sizeof(unsigned));
+  if (!c->data || !c->offsets) {
+    free(c->data);
+    free(c->offsets);
+    return NULL;
+  }
+  c->first = sb->first + sb->count;
+  sb->nchunks++;
+  return c;
+}
+
+// Room for a line record of 'size' bytes, in the newest chunk or a new one.
+static unsigned short* reserve (scrollback *sb, size_t size)
+{
+  scrollback_chunk *c = sb->nchunks ? sb->chunks + sb->nchunks - 1 : NULL;
+  unsigned char *p;
+  if (!c || c->used + size > c->cap) {
+    if (c)
+      seal(c);
+    drop_old(sb);
+    if (!(c = new_chunk(sb, size)))
+      return NULL;
+    if (sb->file != -1 && !sb->failed) {
+      spill_cold(sb);
+      c = sb->chunks + sb->nchunks - 1;
+    }
+  }
+  if (c->nlines == c->maxlines) {
+    unsigned *offsets = (unsigned*)realloc(c->offsets, 2 * c->maxlines * sizeof(unsigned));
+    if (!offsets)
+      return NULL;
+    c->offsets = offsets;
+    c->maxlines *= 2;
+  }
+  c->offsets[c->nlines++] = (unsigned)c->used;
+  p = c->data + c->used;
+  c->used += size;
+  sb->count++;
+  return (unsigned short*)p;
+}
+
+// Bytes of n characters, kept even for the next record.
+static size_t chars_size (int n, int narrow)
+{
+  return narrow ? ((size_t)n + 1) & ~(size_t)1 : 2 * (size_t)n;
+}
+
+// Whether all n characters fit in a byte.
+static int is_narrow (const unsigned short *chars, int n)
+{
+  unsigned short any = 0;
+  int i;
+  for (i=0; i<n; i++)
+    any |= chars[i];
+  return any < 0x100;
+}
+
+int scrollback_append_text (scrollback *sb, const unsigned short *chars, int n,
+                            unsigned short attr)
+{
+  unsigned short *p;
+  int i, narrow;
+  if (n < 0)
+    n = 0;
+  if (n > SCROLLBACK_MAX_CELLS)
+    n = SCROLLBACK_MAX_CELLS;
+  narrow = is_narrow(chars, n);
+  if (!(p = reserve(sb, 4 + (n ? 4 : 0) + chars_size(n, narrow))))
+    return 0;
+  p[0] = (unsigned short)n;
+  p[1] = (n ? 1 : 0) | (narrow ? NARROW : 0);
+  if (n) {
+    p[2] = (unsigned short)n;
+    p[3] = attr;
+    if (narrow) {
+      unsigned char *ch = (unsigned char*)(p + 4);
+      for (i=0; i<n; i++)
+        ch[i] = (unsigned char)chars[i];
+    }
+    else
+      memcpy(p + 4, chars, 2 * (size_t)n);
+  }
+  return 1;
+}
+
+int scrollback_append_cells (scrollback *sb, const cell_t *cells, int n)
+{
+  unsigned short *p, *run, any = 0;
+  int i, nruns = 0;
+  if (n < 0)
+    n = 0;
+  if (n > SCROLLBACK_MAX_CELLS)
+    n = SCROLLBACK_MAX_CELLS;
+  for (i=0; i<n; i++) {
+    nruns += i == 0 || cells[i].Attributes != cells[i-1].Attributes;
+    any |= cells[i].Char;
+  }
+  if (!(p = reserve(sb, 4 + 4 * (size_t)nruns + chars_size(n, any < 0x100))))
+    return 0;
+  p[0] = (unsigned short)n;
+  p[1] = (unsigned short)nruns | (any < 0x100 ? NARROW : 0);
+  run = p + 2;
+  if (any < 0x100) {
+    unsigned char *ch = (unsigned char*)(p + 2 + 2 * nruns);
+    for (i=0; i<n; run+=2) {
+      unsigned short attr = cells[i].Attributes;
+      int start = i;
+      for (; i < n && cells[i].Attributes == attr; i++)
+        ch[i] = (unsigned char)cells[i].Char;
+      run[0] = (unsigned short)(i - start);
+      run[1] = attr;
+    }
+  }
+  else {
+    unsigned short *ch = p + 2 + 2 * nruns;
+    for (i=0; i<n; run+=2) {
+      unsigned short attr = cells[i].Attributes;
+      int start = i;
+      for (; i < n && cells[i].Attributes == attr; i++)
+        ch[i] = cells[i].Char;
+      run[0] = (unsigned short)(i - start);
+      run[1] = attr;
+    }
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// reading
+//---------------------------------------------------------------------------
+static const unsigned short* find_line (const scrollback *sb, long line)
+{
+  const scrollback_chunk *c;
+  const unsigned char *data;
+  const unsigned *offsets;
+  int lo = 0, hi = sb->nchunks - 1;
+  if (line < sb->first || line >= sb->first + sb->count)
+    return NULL;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (sb->chunks[mid].first <= line)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  c = sb->chunks + lo;
+  if (c->spilled) {
+    data = sb->map + c->spill_at;
+    offsets = (const unsigned*)(data + ALIGN8(c->used));
+  }
+  else {
+    data = c->data;
+    offsets = c->offsets;
+  }
+  return (const unsigned short*)(data + offsets[line - c->first]);
+}
+
+// Cells col, col+1, ... of a line record into out; return how many.
+static int decode (const unsigned short *p, int col, cell_t *out, int max)
+{
+  const int nruns = p[1] & ~NARROW;
+  const unsigned short *run = p + 2, *wide = p + 2 + 2 * nruns;
+  const unsigned char *narrow = (const unsigned char*)wide;
+  int r, pos = 0, k = 0, i;
+  for (r = 0; r < nruns && k < max; r++, run += 2) {
+    int end = pos + run[0];
+    i = pos > col ? pos : col;
+    if (p[1] & NARROW)
+      for (; i < end && k < max; i++, k++) {
+        out[k].Char = narrow[i];
+        out[k].Attributes = run[1];
+      }
+    else
+      for (; i < end && k < max; i++, k++) {
+        out[k].Char = wide[i];
+        out[k].Attributes = run[1];
+      }
+    pos = end;
+  }
+  return k;
+}
+
+int scrollback_line (const scrollback *sb, long line, cell_t *out, int max)
+{
+  const unsigned short *p = find_line(sb, line);
+  if (!p)
+    return -1;
+  decode(p, 0, out, max);
+  return p[0];
+}
+
+int scrollback_render (const scrollback *sb, long first, int col, cellbuf *cb,
+                       cell_t blank)
+{
+  int x, y, k, shown = 0;
+  if (col < 0)
+    col = 0;
+  for (y=0; y<cb->height; y++) {
+    cell_t *row = CELLBUF_AT(cb, 0, y);
+    const unsigned short *p = find_line(sb, first + y);
+    k = p ? decode(p, col, row, cb->width) : 0;
+    shown += p != NULL;
+    for (x=k; x<cb->width; x++)
+      row[x] = blank;
+  }
+  return shown;
+}
+
+void scrollback_get_stats (const scrollback *sb, scrollback_stats *st)
+{
+  int i;
+  memset(st, 0, sizeof(*st));
+  st->lines = sb->count;
+  st->dropped = sb->first;
+  st->chunks = sb->nchunks;
+  st->spilled = sb->nspilled;
+  st->bytes = (unsigned long long)sb->chunkcap * sizeof(scrollback_chunk);
+  for (i=0; i<sb->nchunks; i++) {
+    const scrollback_chunk *c = sb->chunks + i;
+    if (!c->spilled)
+      st->bytes += c->cap + (unsigned long long)c->maxlines * sizeof(unsigned);
+  }
+  st->spill_bytes = sb->spill_end;
+}
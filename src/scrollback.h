@@ -0,0 +1,84 @@
+// scrollback.h
+// A scrollback store: lines of cells, far more of them than a screen buffer
+// holds, kept in chunks as text with runs of attributes, appended at the end
+// and read back from anywhere. Chunks other than the newest ones can spill to
+// a mapped file.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <stdint.h>
+#include "cells.h"
+
+// A line is stored as u16 cells, u16 runs, the runs (u16 count, u16
+// attributes), then the characters: a line of one colour costs 8 bytes over
+// its text, and 4 more for its offset in the table of the chunk. The
+// characters take a byte each when none is beyond U+00FF.
+#define SCROLLBACK_CHUNK      65536   // bytes of lines per chunk, by default
+#define SCROLLBACK_RESIDENT   16      // chunks kept in memory when spilling
+#define SCROLLBACK_MAX_CELLS  0x7FFF  // longer lines are cut
+
+typedef struct {
+  unsigned char *data;        // the lines; NULL once spilled
+  unsigned *offsets;          // of each line in data; NULL once spilled
+  long first;                 // number of the first line
+  int nlines, maxlines;
+  size_t used, cap;           // bytes of data
+  int spilled;
+  unsigned long long spill_at;  // where data and offsets are in the spill file
+} scrollback_chunk;
+
+typedef struct {
+  long lines;                 // kept
+  long dropped;               // over the limit, oldest first
+  int chunks;
+  int spilled;                // chunks in the spill file
+  unsigned long long bytes;   // in memory, chunks and index
+  unsigned long long spill_bytes;
+} scrollback_stats;
+
+typedef struct {
+  scrollback_chunk *chunks;   // oldest first
+  int nchunks, chunkcap;
+  size_t chunk_bytes;
+  long first;                 // number of the oldest line kept
+  long count;                 // lines kept
+  long limit;                 // the oldest chunks are dropped while this many
+                              // lines are left without them; 0: none are
+  int resident;               // chunks kept in memory once spilling
+  // spill file, mapped: chunks are copied to the end of it; the space of
+  // chunks dropped later is not reused
+  intptr_t file;              // descriptor or HANDLE; -1 if not spilling
+  unsigned char *map;
+  unsigned long long map_len, spill_end;
+  int nspilled;
+  int failed;                 // spilling failed: chunks stay in memory
+} scrollback;
+
+int  scrollback_init  (scrollback *sb, size_t chunk_bytes, long limit);
+void scrollback_free  (scrollback *sb);
+
+// Spill all chunks but the 'resident' newest ones to the file at 'path',
+// which is created (and removed on scrollback_free).
+int  scrollback_spill (scrollback *sb, const char *path, int resident);
+
+// Append a line of n characters of one attribute, or of n cells; return 0 if
+// out of memory.
+int  scrollback_append_text  (scrollback *sb, const unsigned short *chars, int n,
+                              unsigned short attr);
+int  scrollback_append_cells (scrollback *sb, const cell_t *cells, int n);
+
+// The cells of line 'line' (at most 'max' of them) copied to out; return how
+// many the line has, or -1 if it is not kept.
+int  scrollback_line   (const scrollback *sb, long line, cell_t *out, int max);
+
+// Lines first, first+1, ... into the rows of cb, from column 'col' of them on;
+// the rest of each row, and rows past the lines kept, are 'blank'. Return the
+// number of rows that show a line.
+int  scrollback_render (const scrollback *sb, long first, int col, cellbuf *cb,
+                        cell_t blank);
+
+void scrollback_get_stats (const scrollback *sb, scrollback_stats *st);
+
+#endif
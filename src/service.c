@@ -0,0 +1,599 @@
+// service.c
+// The render service of service.h. Updates are allocated by the producers
+// and freed by the owner once merged; a producer's 'inflight' count goes up
+// as it queues an update and down as the owner flushes it, and the owner
+// sets the producer's event after a flush if it is waiting for room. The
+// service is freed by whoever drops the last reference: service_stop or the
+// last service_close after it. Running services are also listed by id for
+// service_open_id; the list has a spin lock of its own, held only to look a
+// service up and take a reference.
+
+#include <stdlib.h>
+#include <string.h>
+#include "service.h"
+#include "loop.h"
+#include "mpsc.h"
+#include "thread.h"
+
+#define LOAD(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ADD(p, v)    __atomic_add_fetch(p, v, __ATOMIC_ACQ_REL)
+#define SUB(p, v)    __atomic_sub_fetch(p, v, __ATOMIC_ACQ_REL)
+// between setting a flag and checking what the other side publishes (and
+// the reverse on the other side), so that one of the two sees the other
+#define FENCE()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef struct {
+  service_producer *from;
+  int x, y;                   // screen position of the upper-left corner
+  int width, height;
+  cell_t cells[1];
+} service_update;
+
+struct service_producer {
+  render_service *s;
+  service_producer *next;     // in the list of the service
+  int credit;
+  int timeout_ms;
+  int inflight;               // queued or merged, not flushed
+  int waiting;                // set by the producer while it waits for room
+  int closed;
+  sys_event room;             // set by the owner after a flush
+  int pending;                // owner: merged since the last flush
+  unsigned long flushed;      // written by the owner
+  // written by the producer only
+  unsigned long submitted, cells, waits, timeouts;
+  double wait_ms;
+};
+
+struct render_service {
+  mpsc_queue q;
+  cellbuf screen;             // what was sent, with the merged updates
+  int *spans;                 // SERVICE_ROW_SPANS pairs of dirty columns a..b
+                              // a row, apart and in order
+  int *nspans;                // of each row
+  int top, bottom;            // no row outside top..bottom is dirty
+  render_sink sink;
+  int frame_ms;
+  sys_thread thread;
+  sys_event work;             // set when updates were queued while idle
+  int idle;                   // set by the owner while it waits for work
+  int stop;
+  int refs;
+  unsigned id;                // in the list of running services
+  render_service *next;       // in that list
+  sys_mutex lock;             // for the list of producers
+  service_producer *producers;
+  unsigned long nproducers;   // open ones
+  // written by the owner only
+  unsigned long frames, updates, cells, dirty, rects, sent, errors;
+  unsigned long drains, depth_max, depth_sum;
+};
+
+void service_init_params (service_params *prm)
+{
+  prm->width = 80;
+  prm->height = 25;
+  prm->capacity = SERVICE_DEFAULT_CAPACITY;
+  prm->frame_ms = 0;
+}
+
+//---------------------------------------------------------------------------
+// owner thread
+//---------------------------------------------------------------------------
+static void clear_dirty (render_service *s)
+{
+  int y;
+  for (y=s->top; y<=s->bottom; y++)
+    s->nspans[y] = 0;
+  s->top = s->screen.height;
+  s->bottom = -1;
+}
+
+// mark columns a..b of row y dirty; spans that overlap or touch it are
+// merged with it, others stay apart so that the cells between them do not
+// go out again. A row out of room has its two closest spans merged.
+static void add_span (render_service *s, int y, int a, int b)
+{
+  int *sp = s->spans + (size_t)y * 2 * SERVICE_ROW_SPANS;
+  int n = s->nspans[y], i = 0, j, k;
+  while (i < n && sp[2*i+1] < a - 1)
+    i++;
+  for (j=i; j < n && sp[2*j] <= b + 1; j++) {
+    if (a > sp[2*j])   a = sp[2*j];
+    if (b < sp[2*j+1]) b = sp[2*j+1];
+  }
+  if (j == i && n == SERVICE_ROW_SPANS) {
+    int best = -1, gap = 0;
+    for (k=0; k < n-1; k++)
+      if (best < 0 || sp[2*k+2] - sp[2*k+1] < gap) {
+        best = k;
+        gap = sp[2*k+2] - sp[2*k+1];
+      }
+    sp[2*best+1] = sp[2*best+3];
+    memmove(sp + 2*best+2, sp + 2*best+4, (n - best - 2) * 2 * sizeof(int));
+    s->nspans[y] = --n;
+    if (i == best + 1)              // a..b was in the gap just closed
+      return;
+    if (i > best)
+      i--;
+    j = i;
+  }
+  // spans i..j-1 become a..b
+  memmove(sp + 2*i+2, sp + 2*j, (n - j) * 2 * sizeof(int));
+  sp[2*i] = a;
+  sp[2*i+1] = b;
+  s->nspans[y] = n - (j - i) + 1;
+}
+
+// send the dirty spans: the same columns in adjacent rows go out as one
+// rectangle. Return the number of rectangles or -1 if a write failed.
+static int send_spans (render_service *s, render_stats *rs)
+{
+  cell_rect open[SERVICE_ROW_SPANS], next[SERVICE_ROW_SPANS];
+  int nopen = 0, nnext, n = 0, y, i, k;
+  for (y=s->top; y<=s->bottom+1; y++) {
+    const int *sp = s->spans + (size_t)y * 2 * SERVICE_ROW_SPANS;
+    int ns = y <= s->bottom ? s->nspans[y] : 0;
+    nnext = 0;
+    for (i=0; i < ns; i++) {
+      for (k=0; k < nopen; k++)
+        if (open[k].Left == sp[2*i] && open[k].Right == sp[2*i+1])
+          break;
+      if (k < nopen) {
+        next[nnext] = open[k];
+        open[k].Left = -1;          // taken on
+      }
+      else {
+        next[nnext].Left = sp[2*i];
+        next[nnext].Right = sp[2*i+1];
+        next[nnext].Top = y;
+        n++;
+      }
+      next[nnext++].Bottom = y;
+    }
+    for (k=0; k < nopen; k++) {
+      if (open[k].Left < 0)
+        continue;
+      if (!s->sink.write(s->sink.ctx, &s->screen, &open[k]))
+        return -1;
+      rs->rects++;
+      rs->cells += (unsigned long)(open[k].Right - open[k].Left + 1) *
+                   (open[k].Bottom - open[k].Top + 1);
+    }
+    memcpy(open, next, nnext * sizeof(cell_rect));
+    nopen = nnext;
+  }
+  return n;
+}
+
+static void merge (render_service *s, service_update *u)
+{
+  cell_rect r;
+  int y;
+  r.Left = u->x;
+  r.Top = u->y;
+  r.Right = u->x + u->width - 1;
+  r.Bottom = u->y + u->height - 1;
+  if (cellbuf_clip(&s->screen, &r)) {
+    int n = r.Right - r.Left + 1;
+    for (y=r.Top; y<=r.Bottom; y++) {
+      const cell_t *src = u->cells + (size_t)(y - u->y) * u->width + (r.Left - u->x);
+      memcpy(CELLBUF_AT(&s->screen, r.Left, y), src, n * sizeof(cell_t));
+      add_span(s, y, r.Left, r.Right);
+    }
+    if (s->top > r.Top)       s->top = r.Top;
+    if (s->bottom < r.Bottom) s->bottom = r.Bottom;
+    STORE(&s->cells, s->cells + (unsigned long)n * (r.Bottom - r.Top + 1));
+  }
+  STORE(&s->updates, s->updates + 1);
+  u->from->pending++;
+  free(u);
+}
+
+// merge what is queued, but no more than a queue's worth so that a flood
+// does not hold up the flush; return the number of updates
+static unsigned drain (render_service *s)
+{
+  unsigned depth = mpsc_count(&s->q), max = mpsc_capacity(&s->q), n = 0;
+  service_update *u;
+  if (depth == 0)
+    return 0;
+  STORE(&s->drains, s->drains + 1);
+  STORE(&s->depth_sum, s->depth_sum + depth);
+  if (depth > s->depth_max)
+    STORE(&s->depth_max, depth);
+  while (n < max && (u = (service_update*)mpsc_pop(&s->q)) != NULL) {
+    merge(s, u);
+    n++;
+  }
+  return n;
+}
+
+// wait at most 'timeout_ms' (-1: no limit) for an update or the stop
+static void wait_work (render_service *s, int timeout_ms)
+{
+  __atomic_store_n(&s->idle, 1, __ATOMIC_SEQ_CST);
+  FENCE();
+  if (mpsc_count(&s->q) == 0 && !LOAD(&s->stop))
+    sys_event_wait(&s->work, timeout_ms);
+  STORE(&s->idle, 0);
+}
+
+static void free_producer (service_producer *p)
+{
+  sys_event_free(&p->room);
+  free(p);
+}
+
+// send the dirty cells, then give the producers their credit back
+static void flush (render_service *s)
+{
+  render_stats rs;
+  service_producer **pp;
+  unsigned long dirty = 0;
+  int y, i;
+  for (y=s->top; y<=s->bottom; y++) {
+    const int *sp = s->spans + (size_t)y * 2 * SERVICE_ROW_SPANS;
+    for (i=0; i < s->nspans[y]; i++)
+      dirty += sp[2*i+1] - sp[2*i] + 1;
+  }
+  memset(&rs, 0, sizeof(rs));
+  if (dirty && send_spans(s, &rs) < 0)
+    STORE(&s->errors, s->errors + 1);
+  clear_dirty(s);
+  STORE(&s->frames, s->frames + 1);
+  STORE(&s->dirty, s->dirty + dirty);
+  STORE(&s->rects, s->rects + rs.rects);
+  STORE(&s->sent, s->sent + rs.cells);
+
+  sys_mutex_lock(&s->lock);
+  pp = &s->producers;
+  while (*pp) {
+    service_producer *p = *pp;
+    if (p->pending) {
+      STORE(&p->flushed, p->flushed + p->pending);
+      SUB(&p->inflight, p->pending);
+      p->pending = 0;
+    }
+    FENCE();
+    if (LOAD(&p->closed) && LOAD(&p->inflight) == 0) {
+      *pp = p->next;
+      free_producer(p);
+      continue;
+    }
+    if (LOAD(&p->waiting))
+      sys_event_set(&p->room);
+    pp = &p->next;
+  }
+  sys_mutex_unlock(&s->lock);
+}
+
+static THREAD_PROC(owner_thread, arg)
+{
+  render_service *s = (render_service*)arg;
+  double last = 0;
+  for (;;) {
+    // what was queued before the stop still goes out
+    int stop = LOAD(&s->stop);
+    if (drain(s) == 0) {
+      if (stop && mpsc_count(&s->q) == 0)
+        break;
+      wait_work(s, stop ? 1 : -1);
+      continue;
+    }
+    if (s->frame_ms > 0) {
+      double left;
+      while (!LOAD(&s->stop) && (left = last + s->frame_ms - loop_now()) > 0) {
+        wait_work(s, (int)left + 1);
+        drain(s);
+      }
+    }
+    flush(s);
+    last = loop_now();
+  }
+  THREAD_RETURN;
+}
+
+//---------------------------------------------------------------------------
+// service
+//---------------------------------------------------------------------------
+static render_service *running;   // the list of services by id
+static unsigned last_id;
+static int running_lock;
+
+static void lock_running (void)
+{
+  while (__atomic_exchange_n(&running_lock, 1, __ATOMIC_ACQUIRE))
+    sys_yield();
+}
+
+static void unlock_running (void)
+{
+  __atomic_store_n(&running_lock, 0, __ATOMIC_RELEASE);
+}
+
+static void destroy (render_service *s)
+{
+  service_update *u;
+  while (s->producers) {
+    service_producer *p = s->producers;
+    s->producers = p->next;
+    free_producer(p);
+  }
+  if (s->q.slots) {
+    while ((u = (service_update*)mpsc_pop(&s->q)) != NULL)
+      free(u);
+    mpsc_free(&s->q);
+  }
+  free(s->screen.cells);
+  free(s->spans);
+  free(s->nspans);
+  free(s);
+}
+
+static void release (render_service *s)
+{
+  if (SUB(&s->refs, 1) == 0) {
+    sys_event_free(&s->work);
+    sys_mutex_free(&s->lock);
+    destroy(s);
+  }
+}
+
+render_service* service_start (const service_params *prm, const render_sink *sink,
+                               const cellbuf *shown)
+{
+  render_service *s = (render_service*)calloc(1, sizeof(render_service));
+  size_t ncells = (size_t)prm->width * prm->height;
+  cell_t *cells;
+  if (!s)
+    return NULL;
+  cells = (cell_t*)calloc(ncells, sizeof(cell_t));
+  cellbuf_init(&s->screen, prm->width, prm->height, cells);
+  s->spans = (int*)malloc((size_t)prm->height * 2 * SERVICE_ROW_SPANS * sizeof(int));
+  s->nspans = (int*)malloc(prm->height * sizeof(int));
+  if (!cells || !s->spans || !s->nspans || !mpsc_init(&s->q, prm->capacity)) {
+    destroy(s);
+    return NULL;
+  }
+  if (shown) {
+    cell_rect all;
+    all.Left = all.Top = 0;
+    all.Right = shown->width - 1;
+    all.Bottom = shown->height - 1;
+    cellbuf_copy_rect(&s->screen, 0, 0, shown, all);
+  }
+  s->top = 0;
+  s->bottom = prm->height - 1;
+  clear_dirty(s);
+  s->sink = *sink;
+  s->frame_ms = prm->frame_ms;
+  s->refs = 1;
+  if (sys_event_init(&s->work)) {
+    sys_mutex_init(&s->lock);
+    if (sys_thread_start(&s->thread, owner_thread, s)) {
+      lock_running();
+      if (++last_id == 0)
+        ++last_id;
+      s->id = last_id;
+      s->next = running;
+      running = s;
+      unlock_running();
+      return s;
+    }
+    sys_mutex_free(&s->lock);
+    sys_event_free(&s->work);
+  }
+  destroy(s);
+  return NULL;
+}
+
+void service_stop (render_service *s)
+{
+  service_producer *p;
+  render_service **ps;
+  // no new producer by id from now on
+  lock_running();
+  for (ps=&running; *ps != s; ps=&(*ps)->next) {}
+  *ps = s->next;
+  unlock_running();
+  STORE(&s->stop, 1);
+  sys_event_set(&s->work);
+  sys_thread_join(&s->thread);
+  // producers waiting for room see the stop
+  sys_mutex_lock(&s->lock);
+  for (p=s->producers; p; p=p->next)
+    sys_event_set(&p->room);
+  sys_mutex_unlock(&s->lock);
+  release(s);
+}
+
+void service_get_stats (render_service *s, service_stats *st)
+{
+  unsigned long drains = LOAD(&s->drains);
+  st->frames    = LOAD(&s->frames);
+  st->updates   = LOAD(&s->updates);
+  st->cells     = LOAD(&s->cells);
+  st->dirty     = LOAD(&s->dirty);
+  st->rects     = LOAD(&s->rects);
+  st->sent      = LOAD(&s->sent);
+  st->errors    = LOAD(&s->errors);
+  st->depth     = mpsc_count(&s->q);
+  st->depth_max = LOAD(&s->depth_max);
+  st->depth_avg = drains ? (double)LOAD(&s->depth_sum) / drains : 0;
+  sys_mutex_lock(&s->lock);
+  st->producers = s->nproducers;
+  sys_mutex_unlock(&s->lock);
+}
+
+unsigned service_id (render_service *s)
+{
+  return s->id;
+}
+
+//---------------------------------------------------------------------------
+// producers
+//---------------------------------------------------------------------------
+service_producer* service_open_id (unsigned id, int credit, int timeout_ms)
+{
+  service_producer *p = NULL;
+  render_service *s;
+  lock_running();
+  for (s=running; s && s->id != id; s=s->next) {}
+  if (s)
+    ADD(&s->refs, 1);          // it stays until the open is done
+  unlock_running();
+  if (s) {
+    p = service_open(s, credit, timeout_ms);
+    release(s);
+  }
+  return p;
+}
+
+service_producer* service_open (render_service *s, int credit, int timeout_ms)
+{
+  service_producer *p = (service_producer*)calloc(1, sizeof(service_producer));
+  if (!p)
+    return NULL;
+  if (!sys_event_init(&p->room)) {
+    free(p);
+    return NULL;
+  }
+  p->s = s;
+  p->credit = credit > 0 ? credit : SERVICE_DEFAULT_CREDIT;
+  p->timeout_ms = timeout_ms;
+  ADD(&s->refs, 1);
+  sys_mutex_lock(&s->lock);
+  p->next = s->producers;
+  s->producers = p;
+  s->nproducers++;
+  sys_mutex_unlock(&s->lock);
+  return p;
+}
+
+// what is still queued goes out; p is freed by the owner after that
+void service_close (service_producer *p)
+{
+  render_service *s = p->s;
+  sys_mutex_lock(&s->lock);
+  s->nproducers--;
+  STORE(&p->closed, 1);
+  sys_mutex_unlock(&s->lock);
+  release(s);
+}
+
+static int has_room (service_producer *p, int drained)
+{
+  int n = LOAD(&p->inflight);
+  if (drained)
+    return n == 0;
+  return n < p->credit && mpsc_count(&p->s->q) < mpsc_capacity(&p->s->q);
+}
+
+// wait until p has room for an update (with 'drained': nothing in flight)
+// or 'deadline' (a loop_now() time; negative: no limit) passes; return 1
+// if it has, 0 otherwise or if the service stopped
+static int wait_room (service_producer *p, int drained, double deadline)
+{
+  int ok;
+  for (;;) {
+    int ms = -1;
+    __atomic_store_n(&p->waiting, 1, __ATOMIC_SEQ_CST);
+    FENCE();
+    if (has_room(p, drained)) {
+      ok = 1;
+      break;
+    }
+    if (LOAD(&p->s->stop)) {
+      ok = 0;
+      break;
+    }
+    if (deadline >= 0) {
+      double left = deadline - loop_now();
+      if (left <= 0) {
+        ok = 0;
+        break;
+      }
+      ms = (int)left + 1;
+    }
+    sys_event_wait(&p->room, ms);
+  }
+  STORE(&p->waiting, 0);
+  return ok;
+}
+
+int service_submit (service_producer *p, const cellbuf *src, cell_rect r, int x, int y)
+{
+  render_service *s = p->s;
+  service_update *u;
+  double t0 = 0;
+  int w, h, row;
+  if (LOAD(&s->stop))
+    return -1;
+  x -= r.Left;
+  y -= r.Top;
+  if (!cellbuf_clip(src, &r))
+    return 1;
+  w = r.Right - r.Left + 1;
+  h = r.Bottom - r.Top + 1;
+  u = (service_update*)malloc(offsetof(service_update, cells) + (size_t)w * h * sizeof(cell_t));
+  if (!u)
+    return -1;
+  u->from = p;
+  u->x = x + r.Left;
+  u->y = y + r.Top;
+  u->width = w;
+  u->height = h;
+  for (row=0; row<h; row++)
+    memcpy(u->cells + (size_t)row * w, CELLBUF_AT(src, r.Left, r.Top + row), w * sizeof(cell_t));
+
+  for (;;) {
+    int ok;
+    if (LOAD(&p->inflight) < p->credit) {
+      ADD(&p->inflight, 1);
+      if (mpsc_push(&s->q, u))
+        break;
+      SUB(&p->inflight, 1);
+    }
+    if (t0 == 0) {
+      t0 = loop_now();
+      p->waits++;
+    }
+    ok = wait_room(p, 0, p->timeout_ms < 0 ? -1 : t0 + p->timeout_ms);
+    if (!ok || LOAD(&s->stop)) {
+      p->wait_ms += loop_now() - t0;
+      free(u);
+      if (LOAD(&s->stop))
+        return -1;
+      p->timeouts++;
+      return 0;
+    }
+  }
+  if (t0 != 0)
+    p->wait_ms += loop_now() - t0;
+  p->submitted++;
+  p->cells += (unsigned long)w * h;
+  FENCE();
+  if (LOAD(&s->idle))
+    sys_event_set(&s->work);
+  return 1;
+}
+
+int service_sync (service_producer *p, int timeout_ms)
+{
+  if (LOAD(&p->inflight) == 0)
+    return 1;
+  return wait_room(p, 1, timeout_ms < 0 ? -1 : loop_now() + timeout_ms);
+}
+
+void service_producer_stats (service_producer *p, producer_stats *st)
+{
+  st->submitted = p->submitted;
+  st->cells     = p->cells;
+  st->flushed   = LOAD(&p->flushed);
+  st->inflight  = LOAD(&p->inflight);
+  st->waits     = p->waits;
+  st->timeouts  = p->timeouts;
+  st->wait_ms   = p->wait_ms;
+}
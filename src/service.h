@@ -0,0 +1,90 @@
+// service.h
+// Render service: producers on any number of threads submit blocks of cells
+// for rectangles of the screen; one owner thread takes them from a lock-free
+// MPSC queue, merges those of a frame into a screen-sized cellbuf (a later
+// update overwrites what an earlier one put in the same cells) and sends the
+// cells they touched to a sink: each row keeps its dirty spans apart unless
+// they overlap or touch, and the same span in adjacent rows goes out as one
+// rectangle. A producer may have at
+// most 'credit' updates submitted and not yet sent; past that, or while the
+// queue is full, it waits: that is the backpressure.
+// Nothing in here depends on Lua or on the console API.
+
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include "cells.h"
+#include "render.h"
+
+#define SERVICE_DEFAULT_CAPACITY  1024
+#define SERVICE_DEFAULT_CREDIT    64
+#define SERVICE_ROW_SPANS         8     // dirty spans kept apart in a row
+
+typedef struct {
+  int width, height;        // of the screen
+  unsigned capacity;        // queue slots (rounded up to a power of two)
+  int frame_ms;             // at least this long from one flush to the next
+                            // (0: flush as soon as the queue is drained)
+} service_params;
+
+typedef struct {
+  unsigned long frames;     // flushes
+  unsigned long updates;    // updates merged
+  unsigned long cells;      // cells they brought (within the screen)
+  unsigned long dirty;      // distinct cells they changed
+  unsigned long rects;      // rectangles sent
+  unsigned long sent;       // cells sent
+  unsigned long errors;     // failed flushes (their cells are lost)
+  unsigned long depth;      // updates in the queue now
+  unsigned long depth_max;  // most found in the queue when draining it
+  double depth_avg;         // on average, when draining it
+  unsigned long producers;  // open ones
+} service_stats;
+
+typedef struct {
+  unsigned long submitted;  // updates
+  unsigned long cells;
+  unsigned long flushed;    // of them sent (or lost to a failed flush)
+  unsigned long inflight;   // submitted, not yet flushed
+  unsigned long waits;      // submits that had to wait
+  unsigned long timeouts;   // of them given up
+  double wait_ms;           // spent waiting
+} producer_stats;
+
+typedef struct render_service render_service;
+typedef struct service_producer service_producer;
+
+void service_init_params (service_params *prm);
+
+// Start the owner thread; the sink is called on that thread only. 'shown'
+// is what the screen shows to begin with (NULL: zeroed cells): a row with
+// more than SERVICE_ROW_SPANS spans apart has its two closest merged, and the
+// cells between them go out again as the service last knew them. Return NULL
+// on failure.
+render_service* service_start (const service_params *prm, const render_sink *sink,
+                               const cellbuf *shown);
+// Flush what is queued, stop the owner thread and drop the reference that
+// service_start made; the service is freed with the last producer.
+void service_stop (render_service *s);
+void service_get_stats (render_service *s, service_stats *st);
+// An id for the service (never 0), unique in the process, by which any
+// thread may open a producer for as long as it has not been stopped.
+unsigned service_id (render_service *s);
+
+// A producer is for one thread at a time. Submits wait at most 'timeout_ms'
+// for room (a negative timeout waits for as long as it takes). Return NULL
+// on failure.
+service_producer* service_open (render_service *s, int credit, int timeout_ms);
+// As service_open, for the service of that id; NULL if it was stopped too.
+service_producer* service_open_id (unsigned id, int credit, int timeout_ms);
+void service_close (service_producer *p);
+
+// Queue rectangle r of src for the screen at (x, y). Return 1 if queued, 0
+// if there was no room in time, -1 if the service is stopped or out of
+// memory.
+int  service_submit (service_producer *p, const cellbuf *src, cell_rect r, int x, int y);
+// Wait until what p submitted is flushed; return 1 if it is.
+int  service_sync (service_producer *p, int timeout_ms);
+void service_producer_stats (service_producer *p, producer_stats *st);
+
+#endif
@@ -0,0 +1,152 @@
+// wincon.h
+// Stand-in for <wincon.h>: the console constants, structures and functions,
+// implemented by winshim.c. It is also what makeflags.lua reads for the
+// flags of a shim build, so the constants are plain numeric #defines.
+
+#ifndef WINSHIM_WINCON_H
+#define WINSHIM_WINCON_H
+
+#define FOREGROUND_BLUE                0x0001
+#define FOREGROUND_GREEN               0x0002
+#define FOREGROUND_RED                 0x0004
+#define FOREGROUND_INTENSITY           0x0008
+#define BACKGROUND_BLUE                0x0010
+#define BACKGROUND_GREEN               0x0020
+#define BACKGROUND_RED                 0x0040
+#define BACKGROUND_INTENSITY           0x0080
+#define COMMON_LVB_LEADING_BYTE        0x0100
+#define COMMON_LVB_TRAILING_BYTE       0x0200
+#define COMMON_LVB_GRID_HORIZONTAL     0x0400
+#define COMMON_LVB_GRID_LVERTICAL      0x0800
+#define COMMON_LVB_GRID_RVERTICAL      0x1000
+#define COMMON_LVB_REVERSE_VIDEO       0x4000
+#define COMMON_LVB_UNDERSCORE          0x8000
+
+#define CTRL_C_EVENT                   0
+#define CTRL_BREAK_EVENT               1
+#define CTRL_CLOSE_EVENT               2
+#define CTRL_LOGOFF_EVENT              5
+#define CTRL_SHUTDOWN_EVENT            6
+
+#define ENABLE_PROCESSED_INPUT         0x0001
+#define ENABLE_LINE_INPUT              0x0002
+#define ENABLE_ECHO_INPUT              0x0004
+#define ENABLE_WINDOW_INPUT            0x0008
+#define ENABLE_MOUSE_INPUT             0x0010
+#define ENABLE_INSERT_MODE             0x0020
+#define ENABLE_QUICK_EDIT_MODE         0x0040
+#define ENABLE_EXTENDED_FLAGS          0x0080
+#define ENABLE_AUTO_POSITION           0x0100
+#define ENABLE_PROCESSED_OUTPUT        0x0001
+#define ENABLE_WRAP_AT_EOL_OUTPUT      0x0002
+#define ENABLE_VIRTUAL_TERMINAL_PROCESSING 0x0004
+
+// the same as in winport.h, repeated here for makeflags.lua
+#define KEY_EVENT                 0x0001
+#define MOUSE_EVENT               0x0002
+#define WINDOW_BUFFER_SIZE_EVENT  0x0004
+#define MENU_EVENT                0x0008
+#define FOCUS_EVENT               0x0010
+
+#define MOUSE_MOVED               0x0001
+#define DOUBLE_CLICK              0x0002
+#define MOUSE_WHEELED             0x0004
+#define MOUSE_HWHEELED            0x0008
+
+#define FROM_LEFT_1ST_BUTTON_PRESSED   0x0001
+#define RIGHTMOST_BUTTON_PRESSED       0x0002
+#define FROM_LEFT_2ND_BUTTON_PRESSED   0x0004
+#define FROM_LEFT_3RD_BUTTON_PRESSED   0x0008
+#define FROM_LEFT_4TH_BUTTON_PRESSED   0x0010
+
+#define RIGHT_ALT_PRESSED              0x0001
+#define LEFT_ALT_PRESSED               0x0002
+#define RIGHT_CTRL_PRESSED             0x0004
+#define LEFT_CTRL_PRESSED              0x0008
+#define SHIFT_PRESSED                  0x0010
+#define NUMLOCK_ON                     0x0020
+#define SCROLLLOCK_ON                  0x0040
+#define CAPSLOCK_ON                    0x0080
+#define ENHANCED_KEY                   0x0100
+
+#define CONSOLE_TEXTMODE_BUFFER        1
+
+typedef struct {
+  union {
+    WCHAR UnicodeChar;
+    CHAR  AsciiChar;
+  } Char;
+  WORD Attributes;
+} CHAR_INFO;
+
+typedef struct {
+  COORD      dwSize;
+  COORD      dwCursorPosition;
+  WORD       wAttributes;
+  SMALL_RECT srWindow;
+  COORD      dwMaximumWindowSize;
+} CONSOLE_SCREEN_BUFFER_INFO;
+
+typedef struct {
+  DWORD dwSize;
+  BOOL  bVisible;
+} CONSOLE_CURSOR_INFO;
+
+typedef BOOL (WINAPI *PHANDLER_ROUTINE) (DWORD dwCtrlType);
+
+BOOL   AllocConsole (void);
+BOOL   FreeConsole (void);
+HANDLE CreateConsoleScreenBuffer (DWORD access, DWORD share,
+         const SECURITY_ATTRIBUTES *sa, DWORD flags, LPVOID data);
+BOOL   SetConsoleActiveScreenBuffer (HANDLE h);
+UINT   GetConsoleCP (void);
+BOOL   SetConsoleCP (UINT cp);
+UINT   GetConsoleOutputCP (void);
+BOOL   SetConsoleOutputCP (UINT cp);
+DWORD  GetConsoleTitle (LPSTR title, DWORD size);
+BOOL   SetConsoleTitle (LPCSTR title);
+BOOL   GetConsoleMode (HANDLE h, LPDWORD mode);
+BOOL   SetConsoleMode (HANDLE h, DWORD mode);
+BOOL   SetConsoleCtrlHandler (PHANDLER_ROUTINE handler, BOOL add);
+BOOL   GenerateConsoleCtrlEvent (DWORD event, DWORD group);
+BOOL   GetNumberOfConsoleMouseButtons (LPDWORD n);
+
+BOOL   GetConsoleScreenBufferInfo (HANDLE h, CONSOLE_SCREEN_BUFFER_INFO *info);
+BOOL   SetConsoleScreenBufferSize (HANDLE h, COORD size);
+BOOL   SetConsoleWindowInfo (HANDLE h, BOOL absolute, const SMALL_RECT *window);
+COORD  GetLargestConsoleWindowSize (HANDLE h);
+BOOL   GetConsoleCursorInfo (HANDLE h, CONSOLE_CURSOR_INFO *info);
+BOOL   SetConsoleCursorInfo (HANDLE h, const CONSOLE_CURSOR_INFO *info);
+BOOL   SetConsoleCursorPosition (HANDLE h, COORD pos);
+BOOL   SetConsoleTextAttribute (HANDLE h, WORD attr);
+
+BOOL   ReadConsoleInput (HANDLE h, INPUT_RECORD *buf, DWORD n, LPDWORD read);
+BOOL   PeekConsoleInput (HANDLE h, INPUT_RECORD *buf, DWORD n, LPDWORD read);
+BOOL   WriteConsoleInput (HANDLE h, const INPUT_RECORD *buf, DWORD n, LPDWORD written);
+BOOL   GetNumberOfConsoleInputEvents (HANDLE h, LPDWORD n);
+BOOL   FlushConsoleInputBuffer (HANDLE h);
+BOOL   ReadConsole (HANDLE h, LPVOID buf, DWORD n, LPDWORD read, LPVOID control);
+
+BOOL   WriteConsole (HANDLE h, LPCVOID buf, DWORD n, LPDWORD written, LPVOID reserved);
+BOOL   WriteConsoleW (HANDLE h, LPCVOID buf, DWORD n, LPDWORD written, LPVOID reserved);
+BOOL   WriteConsoleOutput (HANDLE h, const CHAR_INFO *buf, COORD size, COORD from,
+         SMALL_RECT *region);
+BOOL   WriteConsoleOutputW (HANDLE h, const CHAR_INFO *buf, COORD size, COORD from,
+         SMALL_RECT *region);
+BOOL   ReadConsoleOutput (HANDLE h, CHAR_INFO *buf, COORD size, COORD from,
+         SMALL_RECT *region);
+BOOL   ReadConsoleOutputW (HANDLE h, CHAR_INFO *buf, COORD size, COORD from,
+         SMALL_RECT *region);
+BOOL   WriteConsoleOutputCharacter (HANDLE h, LPCSTR s, DWORD n, COORD pos, LPDWORD written);
+BOOL   WriteConsoleOutputCharacterW (HANDLE h, LPCWSTR s, DWORD n, COORD pos, LPDWORD written);
+BOOL   WriteConsoleOutputAttribute (HANDLE h, const WORD *attr, DWORD n, COORD pos,
+         LPDWORD written);
+BOOL   ReadConsoleOutputCharacter (HANDLE h, LPSTR s, DWORD n, COORD pos, LPDWORD read);
+BOOL   ReadConsoleOutputAttribute (HANDLE h, LPWORD attr, DWORD n, COORD pos, LPDWORD read);
+BOOL   FillConsoleOutputCharacter (HANDLE h, CHAR ch, DWORD n, COORD pos, LPDWORD written);
+BOOL   FillConsoleOutputCharacterW (HANDLE h, WCHAR ch, DWORD n, COORD pos, LPDWORD written);
+BOOL   FillConsoleOutputAttribute (HANDLE h, WORD attr, DWORD n, COORD pos, LPDWORD written);
+BOOL   ScrollConsoleScreenBuffer (HANDLE h, const SMALL_RECT *scroll, const SMALL_RECT *clip,
+         COORD dest, const CHAR_INFO *fill);
+
+#endif
@@ -0,0 +1,72 @@
+// windows.h
+// Stand-in for <windows.h> where there is none: the types, constants and
+// kernel32 functions the library uses, implemented by winshim.c. The console
+// part is in wincon.h, which this includes as the real header does.
+
+#ifndef WINSHIM_WINDOWS_H
+#define WINSHIM_WINDOWS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "../winport.h"
+
+typedef void*           HANDLE;
+typedef void*           LPVOID;
+typedef const void*     LPCVOID;
+typedef unsigned char   BYTE;
+typedef long            LONG;
+typedef char            TCHAR;   // the ANSI functions only
+typedef char*           LPSTR;
+typedef const char*     LPCSTR;
+typedef char*           LPTSTR;
+typedef const char*     LPCTSTR;
+typedef WCHAR*          LPWSTR;
+typedef const WCHAR*    LPCWSTR;
+typedef WORD*           LPWORD;
+typedef DWORD*          LPDWORD;
+
+#define WINAPI
+#define TRUE   1
+#define FALSE  0
+
+#define INVALID_HANDLE_VALUE  ((HANDLE)(intptr_t)-1)
+#define STD_INPUT_HANDLE      ((DWORD)-10)
+#define STD_OUTPUT_HANDLE     ((DWORD)-11)
+#define STD_ERROR_HANDLE      ((DWORD)-12)
+
+#define GENERIC_READ          0x80000000
+#define GENERIC_WRITE         0x40000000
+#define FILE_SHARE_READ       0x00000001
+#define FILE_SHARE_WRITE      0x00000002
+
+#define INFINITE              0xFFFFFFFF
+#define WAIT_OBJECT_0         0x00000000
+#define WAIT_TIMEOUT          0x00000102
+#define WAIT_FAILED           0xFFFFFFFF
+#define MAXIMUM_WAIT_OBJECTS  64
+
+typedef struct {
+  SHORT Left;
+  SHORT Top;
+  SHORT Right;
+  SHORT Bottom;
+} SMALL_RECT;
+
+typedef struct {
+  DWORD  nLength;
+  LPVOID lpSecurityDescriptor;
+  BOOL   bInheritHandle;
+} SECURITY_ATTRIBUTES;
+
+HANDLE GetStdHandle        (DWORD nStdHandle);
+BOOL   SetStdHandle        (DWORD nStdHandle, HANDLE h);
+BOOL   CloseHandle         (HANDLE h);
+DWORD  WaitForSingleObject (HANDLE h, DWORD timeout_ms);
+DWORD  WaitForMultipleObjects (DWORD n, const HANDLE *handles, BOOL wait_all,
+                               DWORD timeout_ms);
+void   Sleep               (DWORD ms);
+DWORD  GetTickCount        (void);
+
+#include <wincon.h>
+
+#endif
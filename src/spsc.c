@@ -0,0 +1,80 @@
+// spsc.c
+// Lock-free single-producer/single-consumer ring of fixed-size elements.
+// The indices run freely and are masked on access; the producer publishes
+// 'tail' with release semantics after filling a slot, the consumer
+// publishes 'head' with release semantics after emptying one.
+
+#include <stdlib.h>
+#include <string.h>
+#include "spsc.h"
+
+#define LOAD_ACQUIRE(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(p, v)  __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+// the capacity is rounded up to a power of two; return 0 if out of memory
+int spsc_init (spsc_queue *q, unsigned capacity, size_t elem_size)
+{
+  unsigned cap = 2;
+  while (cap < capacity && cap < 0x40000000u)
+    cap <<= 1;
+  memset(q, 0, sizeof(*q));
+  q->slots = (char*)malloc((size_t)cap * elem_size);
+  if (!q->slots)
+    return 0;
+  q->elem_size = elem_size;
+  q->mask = cap - 1;
+  return 1;
+}
+
+void spsc_free (spsc_queue *q)
+{
+  free(q->slots);
+  q->slots = NULL;
+}
+
+unsigned spsc_capacity (const spsc_queue *q)
+{
+  return q->mask + 1;
+}
+
+// approximate when called by neither side
+unsigned spsc_count (spsc_queue *q)
+{
+  return LOAD_ACQUIRE(&q->tail) - LOAD_ACQUIRE(&q->head);
+}
+
+// producer: return 0 if the queue is full
+int spsc_push (spsc_queue *q, const void *elem)
+{
+  unsigned tail = q->tail;
+  if (tail - q->head_cache > q->mask) {
+    q->head_cache = LOAD_ACQUIRE(&q->head);
+    if (tail - q->head_cache > q->mask)
+      return 0;
+  }
+  memcpy(q->slots + (size_t)(tail & q->mask) * q->elem_size, elem, q->elem_size);
+  STORE_RELEASE(&q->tail, tail + 1);
+  return 1;
+}
+
+// consumer: pop up to 'max' elements into 'out'; return how many
+unsigned spsc_pop (spsc_queue *q, void *out, unsigned max)
+{
+  unsigned head = q->head, n = 0;
+  char *dst = (char*)out;
+  if (q->tail_cache == head)
+    q->tail_cache = LOAD_ACQUIRE(&q->tail);
+  while (n < max && head != q->tail_cache) {
+    unsigned slot = head & q->mask;
+    unsigned run = q->tail_cache - head;       // contiguous part of the ring
+    if (run > q->mask + 1 - slot) run = q->mask + 1 - slot;
+    if (run > max - n) run = max - n;
+    memcpy(dst, q->slots + (size_t)slot * q->elem_size, (size_t)run * q->elem_size);
+    dst += (size_t)run * q->elem_size;
+    head += run;
+    n += run;
+  }
+  if (n)
+    STORE_RELEASE(&q->head, head);
+  return n;
+}
@@ -0,0 +1,34 @@
+// spsc.h
+// Lock-free single-producer/single-consumer ring of fixed-size elements.
+
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stddef.h>
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct {
+  // read-only after spsc_init
+  char *slots;
+  size_t elem_size;
+  unsigned mask;           // capacity - 1; the capacity is a power of two
+  char pad0[SPSC_CACHE_LINE];
+  // consumer side
+  unsigned head;           // next slot to pop (written by the consumer only)
+  unsigned tail_cache;     // consumer's last view of 'tail'
+  char pad1[SPSC_CACHE_LINE];
+  // producer side
+  unsigned tail;           // next slot to fill (written by the producer only)
+  unsigned head_cache;     // producer's last view of 'head'
+  char pad2[SPSC_CACHE_LINE];
+} spsc_queue;
+
+int      spsc_init     (spsc_queue *q, unsigned capacity, size_t elem_size);
+void     spsc_free     (spsc_queue *q);
+unsigned spsc_capacity (const spsc_queue *q);
+unsigned spsc_count    (spsc_queue *q);
+int      spsc_push     (spsc_queue *q, const void *elem);
+unsigned spsc_pop      (spsc_queue *q, void *out, unsigned max);
+
+#endif
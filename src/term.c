@@ -0,0 +1,726 @@
+// term.c
+// Terminal emulation into a cell grid: a table-driven DEC/ANSI parser that
+// applies what it reads to a cellbuf.
+
+#include <string.h>
+#include "term.h"
+#include "utf8.h"
+
+//---------------------------------------------------------------------------
+// state machine
+//---------------------------------------------------------------------------
+enum {
+  S_GROUND, S_ESCAPE, S_ESC_INTER, S_CSI_ENTRY, S_CSI_PARAM, S_CSI_INTER,
+  S_CSI_IGNORE, S_DCS, S_OSC, S_SOS, NSTATES
+};
+
+enum {
+  A_NONE, A_PRINT, A_EXECUTE, A_CLEAR, A_COLLECT, A_PARAM, A_ESC_DISPATCH,
+  A_CSI_DISPATCH, A_OSC_START, A_OSC_PUT, A_OSC_END
+};
+
+// transition: action in the high nibble, next state in the low one
+static unsigned char table[NSTATES][256];
+
+#define T(action, state)  (unsigned char)((action) << 4 | (state))
+
+static void set_range (int s, int from, int to, int action, int next)
+{
+  int b;
+  for (b=from; b<=to; b++)
+    table[s][b] = T(action, next);
+}
+
+// C0 controls are executed in place everywhere but in the strings
+static void set_execute (int s)
+{
+  set_range(s, 0x00, 0x17, A_EXECUTE, s);
+  set_range(s, 0x19, 0x19, A_EXECUTE, s);
+  set_range(s, 0x1C, 0x1F, A_EXECUTE, s);
+}
+
+// Bytes 0x80-0x9F are UTF-8 continuation bytes here, not C1 controls.
+void term_init_tables (void)
+{
+  int s;
+  for (s=0; s<NSTATES; s++) {
+    set_range(s, 0x00, 0xFF, A_NONE, s);
+    if (s != S_OSC && s != S_DCS && s != S_SOS)
+      set_execute(s);
+    // anywhere
+    set_range(s, 0x18, 0x18, A_EXECUTE, S_GROUND);
+    set_range(s, 0x1A, 0x1A, A_EXECUTE, S_GROUND);
+    set_range(s, 0x1B, 0x1B, A_CLEAR, S_ESCAPE);
+  }
+  set_range(S_GROUND, 0x20, 0x7E, A_PRINT, S_GROUND);
+  set_range(S_GROUND, 0x80, 0xFF, A_PRINT, S_GROUND);
+
+  set_range(S_ESCAPE, 0x20, 0x2F, A_COLLECT, S_ESC_INTER);
+  set_range(S_ESCAPE, 0x30, 0x7E, A_ESC_DISPATCH, S_GROUND);
+  set_range(S_ESCAPE, 0x5B, 0x5B, A_CLEAR, S_CSI_ENTRY);
+  set_range(S_ESCAPE, 0x5D, 0x5D, A_OSC_START, S_OSC);
+  set_range(S_ESCAPE, 0x50, 0x50, A_NONE, S_DCS);
+  set_range(S_ESCAPE, 0x58, 0x58, A_NONE, S_SOS);
+  set_range(S_ESCAPE, 0x5E, 0x5F, A_NONE, S_SOS);
+
+  set_range(S_ESC_INTER, 0x20, 0x2F, A_COLLECT, S_ESC_INTER);
+  set_range(S_ESC_INTER, 0x30, 0x7E, A_ESC_DISPATCH, S_GROUND);
+
+  set_range(S_CSI_ENTRY, 0x20, 0x2F, A_COLLECT, S_CSI_INTER);
+  set_range(S_CSI_ENTRY, 0x30, 0x3B, A_PARAM, S_CSI_PARAM);
+  set_range(S_CSI_ENTRY, 0x3C, 0x3F, A_COLLECT, S_CSI_PARAM);
+  set_range(S_CSI_ENTRY, 0x40, 0x7E, A_CSI_DISPATCH, S_GROUND);
+
+  set_range(S_CSI_PARAM, 0x20, 0x2F, A_COLLECT, S_CSI_INTER);
+  set_range(S_CSI_PARAM, 0x30, 0x3B, A_PARAM, S_CSI_PARAM);
+  set_range(S_CSI_PARAM, 0x3C, 0x3F, A_NONE, S_CSI_IGNORE);
+  set_range(S_CSI_PARAM, 0x40, 0x7E, A_CSI_DISPATCH, S_GROUND);
+
+  set_range(S_CSI_INTER, 0x20, 0x2F, A_COLLECT, S_CSI_INTER);
+  set_range(S_CSI_INTER, 0x30, 0x3F, A_NONE, S_CSI_IGNORE);
+  set_range(S_CSI_INTER, 0x40, 0x7E, A_CSI_DISPATCH, S_GROUND);
+
+  set_range(S_CSI_IGNORE, 0x40, 0x7E, A_NONE, S_GROUND);
+
+  set_range(S_OSC, 0x07, 0x07, A_OSC_END, S_GROUND);
+  set_range(S_OSC, 0x20, 0xFF, A_OSC_PUT, S_OSC);
+}
+
+//---------------------------------------------------------------------------
+// grid operations
+//---------------------------------------------------------------------------
+#define BLANK_ATTR(t)  ((t)->attr & 0x00FF)
+
+// While a feed runs, the grid's rows are a ring starting at row0, so that
+// scrolling the whole screen costs nothing; term_feed() puts them back in
+// order before it returns.
+static cell_t* row_at (const term *t, int y)
+{
+  int r = t->row0 + y;
+  if (r >= t->grid->height)
+    r -= t->grid->height;
+  return t->grid->cells + (size_t)r * t->grid->width;
+}
+
+static void swap_rows (cellbuf *g, int a, int b)
+{
+  cell_t *p = CELLBUF_AT(g, 0, a), *q = CELLBUF_AT(g, 0, b), c;
+  int i;
+  for (i=0; i<g->width; i++) {
+    c = p[i]; p[i] = q[i]; q[i] = c;
+  }
+}
+
+static void reverse_rows (cellbuf *g, int from, int to)
+{
+  for (to--; from < to; from++, to--)
+    swap_rows(g, from, to);
+}
+
+// rotate the rows back into order
+static void unroll (term *t)
+{
+  if (t->row0) {
+    reverse_rows(t->grid, 0, t->row0);
+    reverse_rows(t->grid, t->row0, t->grid->height);
+    reverse_rows(t->grid, 0, t->grid->height);
+    t->row0 = 0;
+  }
+}
+
+static void mark (term *t, int top, int bottom)
+{
+  if (top < t->dirty_top) t->dirty_top = top;
+  if (bottom > t->dirty_bottom) t->dirty_bottom = bottom;
+}
+
+static void blank (term *t, cell_t *p, size_t n)
+{
+  cell_t c;
+  size_t i;
+  c.Char = ' ';
+  c.Attributes = (unsigned short)BLANK_ATTR(t);
+  for (i=0; i<n; i++)
+    p[i] = c;
+}
+
+// erase cells [x1, x2] of row y
+static void erase_cells (term *t, int y, int x1, int x2)
+{
+  if (x1 < 0) x1 = 0;
+  if (x2 >= t->grid->width) x2 = t->grid->width - 1;
+  if (x1 > x2)
+    return;
+  blank(t, row_at(t, y) + x1, x2 - x1 + 1);
+  mark(t, y, y);
+}
+
+static void erase_rows (term *t, int y1, int y2)
+{
+  int y;
+  for (y=y1; y<=y2; y++)
+    blank(t, row_at(t, y), t->grid->width);
+  if (y1 <= y2)
+    mark(t, y1, y2);
+}
+
+// Move rows [top, bottom] up by n (down if n < 0), blanking what is exposed.
+static void scroll_rows (term *t, int top, int bottom, int n)
+{
+  int h = t->grid->height, rows = bottom - top + 1, y;
+  size_t size = t->grid->width * sizeof(cell_t);
+  if (n == 0 || rows <= 0)
+    return;
+  t->stats.scrolls += n > 0 ? n : -n;
+  if (n >= rows || -n >= rows)
+    erase_rows(t, top, bottom);
+  else if (top == 0 && bottom == h - 1) {
+    t->row0 = (t->row0 + n + h) % h;
+    if (n > 0)
+      erase_rows(t, h - n, h - 1);
+    else
+      erase_rows(t, 0, -n - 1);
+  }
+  else if (n > 0) {
+    for (y=top; y<=bottom-n; y++)
+      memcpy(row_at(t, y), row_at(t, y + n), size);
+    erase_rows(t, bottom - n + 1, bottom);
+  }
+  else {
+    for (y=bottom; y>=top-n; y--)
+      memcpy(row_at(t, y), row_at(t, y + n), size);
+    erase_rows(t, top, top - n - 1);
+  }
+  mark(t, top, bottom);
+}
+
+static void line_feed (term *t)
+{
+  if (t->y == t->bottom)
+    scroll_rows(t, t->top, t->bottom, 1);
+  else if (t->y < t->grid->height - 1)
+    t->y++;
+}
+
+static void reverse_feed (term *t)
+{
+  if (t->y == t->top)
+    scroll_rows(t, t->top, t->bottom, -1);
+  else if (t->y > 0)
+    t->y--;
+}
+
+static void clamp_cursor (term *t)
+{
+  if (t->x < 0) t->x = 0;
+  if (t->x >= t->grid->width) t->x = t->grid->width - 1;
+  if (t->y < 0) t->y = 0;
+  if (t->y >= t->grid->height) t->y = t->grid->height - 1;
+  t->wrap = 0;
+}
+
+static void store (cell_t *p, const void *src, size_t from, size_t n, int bytes,
+                   unsigned short attr)
+{
+  size_t i;
+  if (bytes) {
+    const unsigned char *b = (const unsigned char*)src + from;
+    for (i=0; i<n; i++) {
+      p[i].Char = b[i];
+      p[i].Attributes = attr;
+    }
+  }
+  else {
+    const unsigned short *u = (const unsigned short*)src + from;
+    for (i=0; i<n; i++) {
+      p[i].Char = u[i];
+      p[i].Attributes = attr;
+    }
+  }
+}
+
+// Put n UTF-16 units (or bytes, if 'bytes' is set) at the cursor, a row at
+// a time.
+static void put_text (term *t, const void *src, size_t n, int bytes)
+{
+  int w = t->grid->width;
+  unsigned short attr = (unsigned short)t->attr;
+  size_t done = 0, k;
+  while (done < n) {
+    if (t->wrap) {
+      t->x = 0;
+      line_feed(t);
+      t->wrap = 0;
+    }
+    mark(t, t->y, t->y);
+    k = (size_t)(w - t->x);
+    if (k >= n - done)
+      k = n - done;
+    else if (!t->autowrap) {
+      // no wrapping: the last character ends up in the last column
+      store(row_at(t, t->y) + t->x, src, done, k - 1, bytes, attr);
+      store(row_at(t, t->y) + w - 1, src, n - 1, 1, bytes, attr);
+      t->x = w - 1;
+      return;
+    }
+    store(row_at(t, t->y) + t->x, src, done, k, bytes, attr);
+    done += k;
+    t->x += (int)k;
+    if (t->x == w) {
+      t->x = w - 1;
+      t->wrap = t->autowrap;
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// SGR
+//---------------------------------------------------------------------------
+// ANSI colour number to console bits and back (red and blue swap places)
+static int console_color (int c)
+{
+  return (c & 1 ? 4 : 0) | (c & 2) | (c & 4 ? 1 : 0);
+}
+
+static int rgb_color (int r, int g, int b)
+{
+  int mx = r > g ? (r > b ? r : b) : (g > b ? g : b);
+  int c = (r >= 0x60 ? 4 : 0) | (g >= 0x60 ? 2 : 0) | (b >= 0x60 ? 1 : 0);
+  if (mx > 0xC0 || (c == 0 && mx >= 0x40))
+    c |= 8;
+  return c;
+}
+
+static int color256 (int n)
+{
+  static const int levels[6] = { 0, 0x5F, 0x87, 0xAF, 0xD7, 0xFF };
+  if (n < 8)
+    return console_color(n);
+  if (n < 16)
+    return console_color(n - 8) | 8;
+  if (n < 232) {
+    n -= 16;
+    return rgb_color(levels[n / 36], levels[n / 6 % 6], levels[n % 6]);
+  }
+  n = 8 + (n - 232) * 10;
+  return n < 0x40 ? 0 : n < 0x80 ? 8 : n < 0xC0 ? 7 : 15;
+}
+
+// 38/48 ;5;n or ;2;r;g;b starting at params[i]; return the colour (or -1)
+// and advance *i past what was used
+static int extended_color (term *t, int *i)
+{
+  int *p = t->params, n = t->nparams, k = *i;
+  if (k + 1 < n && p[k+1] == 5 && k + 2 < n) {
+    *i = k + 2;
+    return color256(p[k+2] & 0xFF);
+  }
+  if (k + 1 < n && p[k+1] == 2 && k + 4 < n) {
+    *i = k + 4;
+    return rgb_color(p[k+2], p[k+3], p[k+4]);
+  }
+  *i = n;
+  return -1;
+}
+
+static void sgr (term *t)
+{
+  int i, a = t->attr, c;
+  if (t->nparams == 0)
+    t->params[t->nparams++] = 0;
+  for (i=0; i<t->nparams; i++) {
+    int p = t->params[i];
+    if (p == 0)                  { a = 0x07; t->fg = 0x07; t->bold = 0; }
+    else if (p == 1)             t->bold = 1;
+    else if (p == 22)            t->bold = 0;
+    else if (p == 4)             a |= 0x8000;
+    else if (p == 24)            a &= ~0x8000;
+    else if (p == 7)             a |= 0x4000;
+    else if (p == 27)            a &= ~0x4000;
+    else if (p >= 30 && p <= 37) t->fg = console_color(p - 30);
+    else if (p == 39)            t->fg = 0x07;
+    else if (p >= 90 && p <= 97) t->fg = console_color(p - 90) | 0x08;
+    else if (p >= 40 && p <= 47) a = (a & ~0xF0) | console_color(p - 40) << 4;
+    else if (p == 49)            a &= ~0xF0;
+    else if (p >= 100 && p <= 107) a = (a & ~0xF0) | (console_color(p - 100) | 0x08) << 4;
+    else if (p == 38) {
+      if ((c = extended_color(t, &i)) >= 0) t->fg = c;
+    }
+    else if (p == 48) {
+      if ((c = extended_color(t, &i)) >= 0) a = (a & ~0xF0) | c << 4;
+    }
+  }
+  // bold is shown as intensity, as the console does
+  t->attr = (a & ~0x0F) | t->fg | (t->bold ? 0x08 : 0);
+}
+
+//---------------------------------------------------------------------------
+// dispatch
+//---------------------------------------------------------------------------
+// parameter i, with 'def' for a missing or zero one
+static int param (const term *t, int i, int def)
+{
+  return i < t->nparams && t->params[i] > 0 ? t->params[i] : def;
+}
+
+static void save_cursor (term *t)
+{
+  t->save_x = t->x;
+  t->save_y = t->y;
+  t->save_attr = t->attr;
+  t->save_fg = t->fg;
+  t->save_bold = t->bold;
+}
+
+static void restore_cursor (term *t)
+{
+  t->x = t->save_x;
+  t->y = t->save_y;
+  t->attr = t->save_attr;
+  t->fg = t->save_fg;
+  t->bold = t->save_bold;
+  clamp_cursor(t);
+}
+
+static void execute (term *t, int b)
+{
+  t->stats.controls++;
+  switch (b) {
+    case '\b':
+      if (t->x > 0 && !t->wrap) t->x--;
+      t->wrap = 0;
+      break;
+    case '\t':
+      t->x = (t->x / 8 + 1) * 8;
+      if (t->x >= t->grid->width) t->x = t->grid->width - 1;
+      t->wrap = 0;
+      break;
+    case '\n': case '\v': case '\f':
+      if (t->newline) t->x = 0;
+      line_feed(t);
+      t->wrap = 0;
+      break;
+    case '\r':
+      t->x = 0;
+      t->wrap = 0;
+      break;
+  }
+}
+
+static void esc_dispatch (term *t, int b)
+{
+  t->stats.sequences++;
+  if (t->ninter)
+    return;                      // charset designations and the like
+  switch (b) {
+    case '7': save_cursor(t); break;
+    case '8': restore_cursor(t); break;
+    case 'D': line_feed(t); t->wrap = 0; break;
+    case 'E': t->x = 0; line_feed(t); t->wrap = 0; break;
+    case 'M': reverse_feed(t); t->wrap = 0; break;
+    case 'c': term_reset(t); break;
+  }
+}
+
+static void private_mode (term *t, int on)
+{
+  int i;
+  for (i=0; i<t->nparams; i++) {
+    if (t->params[i] == 7)  t->autowrap = on;
+    if (t->params[i] == 25) t->cursor_visible = on;
+  }
+}
+
+static void csi_dispatch (term *t, int b)
+{
+  int w = t->grid->width, h = t->grid->height, n;
+  t->stats.sequences++;
+  if (t->ninter) {
+    if (t->ninter == 1 && t->inter[0] == '?' && (b == 'h' || b == 'l'))
+      private_mode(t, b == 'h');
+    return;
+  }
+  switch (b) {
+    case 'A':                    // stops at the top margin if below it
+      n = t->y >= t->top ? t->top : 0;
+      t->y -= param(t, 0, 1);
+      if (t->y < n) t->y = n;
+      break;
+    case 'B':
+      n = t->y <= t->bottom ? t->bottom : h - 1;
+      t->y += param(t, 0, 1);
+      if (t->y > n) t->y = n;
+      break;
+    case 'C': t->x += param(t, 0, 1); break;
+    case 'D': t->x -= param(t, 0, 1); break;
+    case 'E': t->y += param(t, 0, 1); t->x = 0; break;
+    case 'F': t->y -= param(t, 0, 1); t->x = 0; break;
+    case 'G': case '`': t->x = param(t, 0, 1) - 1; break;
+    case 'd': t->y = param(t, 0, 1) - 1; break;
+    case 'H': case 'f':
+      t->y = param(t, 0, 1) - 1;
+      t->x = param(t, 1, 1) - 1;
+      break;
+    case 'J':
+      n = t->nparams ? t->params[0] : 0;
+      if (n == 0) {
+        erase_cells(t, t->y, t->x, w - 1);
+        erase_rows(t, t->y + 1, h - 1);
+      }
+      else if (n == 1) {
+        erase_rows(t, 0, t->y - 1);
+        erase_cells(t, t->y, 0, t->x);
+      }
+      else
+        erase_rows(t, 0, h - 1);
+      return;                    // the cursor stays, wrap state included
+    case 'K':
+      n = t->nparams ? t->params[0] : 0;
+      erase_cells(t, t->y, n == 0 ? t->x : 0, n == 1 ? t->x : w - 1);
+      return;
+    case 'L': case 'M':
+      if (t->y >= t->top && t->y <= t->bottom) {
+        n = param(t, 0, 1);
+        scroll_rows(t, t->y, t->bottom, b == 'L' ? -n : n);
+        t->x = 0;
+      }
+      break;
+    case '@': case 'P': {
+      cell_t *row = row_at(t, t->y);
+      n = param(t, 0, 1);
+      if (n > w - t->x) n = w - t->x;
+      if (b == '@') {
+        memmove(row + t->x + n, row + t->x, (size_t)(w - t->x - n) * sizeof(cell_t));
+        blank(t, row + t->x, n);
+      }
+      else {
+        memmove(row + t->x, row + t->x + n, (size_t)(w - t->x - n) * sizeof(cell_t));
+        blank(t, row + w - n, n);
+      }
+      mark(t, t->y, t->y);
+      break;
+    }
+    case 'X':
+      erase_cells(t, t->y, t->x, t->x + param(t, 0, 1) - 1);
+      break;
+    case 'S': scroll_rows(t, t->top, t->bottom, param(t, 0, 1)); break;
+    case 'T': scroll_rows(t, t->top, t->bottom, -param(t, 0, 1)); break;
+    case 'r': {
+      int top = param(t, 0, 1) - 1, bottom = param(t, 1, h) - 1;
+      if (bottom >= h) bottom = h - 1;
+      if (top < bottom) {
+        t->top = top;
+        t->bottom = bottom;
+        t->x = t->y = 0;
+      }
+      break;
+    }
+    case 's': save_cursor(t); break;
+    case 'u': restore_cursor(t); break;
+    case 'm': sgr(t); return;
+    default: return;
+  }
+  clamp_cursor(t);
+}
+
+static void osc_end (term *t)
+{
+  t->stats.sequences++;
+  if (t->nosc >= 2 && (t->osc[0] == '0' || t->osc[0] == '2') && t->osc[1] == ';') {
+    memcpy(t->title, t->osc + 2, t->nosc - 2);
+    t->title[t->nosc - 2] = 0;
+  }
+}
+
+static void clear (term *t)
+{
+  t->nparams = 0;
+  t->ninter = 0;
+}
+
+static void add_param (term *t, int b)
+{
+  if (t->nparams == 0)
+    t->params[t->nparams++] = 0;
+  if (b == ';' || b == ':') {
+    if (t->nparams < TERM_MAX_PARAMS)
+      t->params[t->nparams++] = 0;
+  }
+  else {
+    int *p = &t->params[t->nparams - 1];
+    if (*p < 10000)
+      *p = *p * 10 + (b - '0');
+  }
+}
+
+static void action (term *t, int a, int b)
+{
+  switch (a) {
+    case A_EXECUTE:      execute(t, b); break;
+    case A_CLEAR:        clear(t); break;
+    case A_COLLECT:      if (t->ninter < 2) t->inter[t->ninter++] = (char)b; break;
+    case A_PARAM:        add_param(t, b); break;
+    case A_ESC_DISPATCH: esc_dispatch(t, b); break;
+    case A_CSI_DISPATCH: csi_dispatch(t, b); break;
+    case A_OSC_START:    t->nosc = 0; break;
+    case A_OSC_PUT:      if (t->nosc < TERM_MAX_OSC - 1) t->osc[t->nosc++] = (char)b; break;
+    case A_OSC_END:      osc_end(t); break;
+  }
+}
+
+//---------------------------------------------------------------------------
+// text runs
+//---------------------------------------------------------------------------
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+// Length of the run of text bytes (neither C0 controls nor DEL) at s,
+// looked for 8 bytes at a time; *ascii tells if it is all ASCII.
+static size_t text_run (const unsigned char *s, size_t len, int *ascii)
+{
+  unsigned long long acc = 0;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    unsigned long long v, d;
+    memcpy(&v, s + i, 8);
+    d = v ^ (ONES * 0x7F);
+    // a byte below 0x20, or a zero byte in d
+    if ((((v - ONES * 0x20) & ~v) | ((d - ONES) & ~d)) & HIGHS)
+      break;
+    acc |= v;
+  }
+  for (; i < len && s[i] >= 0x20 && s[i] != 0x7F; i++)
+    acc |= s[i];
+  *ascii = !(acc & HIGHS);
+  return i;
+}
+
+// bytes at the end of s that start a UTF-8 sequence not complete yet
+static size_t incomplete_tail (const unsigned char *s, size_t len)
+{
+  size_t i, k;
+  for (k=1; k<=3 && k<=len; k++) {
+    unsigned c = s[len - k];
+    if (c >= 0x80 && c < 0xC0)
+      continue;                          // continuation: look further back
+    i = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return i > k ? k : 0;
+  }
+  return 0;
+}
+
+static void put_utf8 (term *t, const unsigned char *s, size_t len)
+{
+  unsigned short buf[512];
+  while (len) {
+    size_t n = len < sizeof(buf)/sizeof(buf[0]) ? len : sizeof(buf)/sizeof(buf[0]);
+    // never cut a sequence in two
+    if (n < len)
+      n -= incomplete_tail(s, n);
+    if (n == 0)
+      n = len < 4 ? len : 4;
+    put_text(t, buf, utf8_to_utf16((const char*)s, n, buf, NULL), 0);
+    s += n;
+    len -= n;
+  }
+}
+
+
+// Finish a sequence left incomplete by the last feed; return the bytes used.
+static size_t finish_utf8 (term *t, const unsigned char *s, size_t len)
+{
+  unsigned c = (unsigned char)t->utf8[0];
+  int need = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : 2;
+  size_t used = 0;
+  while (t->nutf8 < need && used < len && s[used] >= 0x80 && s[used] < 0xC0)
+    t->utf8[t->nutf8++] = (char)s[used++];
+  if (t->nutf8 < need && used == len)
+    return used;                         // still not complete
+  t->stats.text += t->nutf8;
+  put_utf8(t, (const unsigned char*)t->utf8, t->nutf8);
+  t->nutf8 = 0;
+  return used;
+}
+
+//---------------------------------------------------------------------------
+// interface
+//---------------------------------------------------------------------------
+void term_init (term *t, cellbuf *grid)
+{
+  memset(t, 0, sizeof(*t));
+  t->grid = grid;
+  term_reset(t);
+}
+
+// RIS: everything back to the initial state, screen cleared
+void term_reset (term *t)
+{
+  t->x = t->y = t->wrap = 0;
+  t->attr = t->fg = 0x07;
+  t->bold = 0;
+  t->top = 0;
+  t->bottom = t->grid->height - 1;
+  t->autowrap = 1;
+  t->cursor_visible = 1;
+  t->save_x = t->save_y = 0;
+  t->save_attr = t->attr;
+  t->save_fg = t->fg;
+  t->save_bold = 0;
+  t->state = S_GROUND;
+  t->nutf8 = 0;
+  t->title[0] = 0;
+  clear(t);
+  erase_rows(t, 0, t->grid->height - 1);
+}
+
+void term_feed (term *t, const char *str, size_t len)
+{
+  const unsigned char *s = (const unsigned char*)str;
+  size_t i = 0;
+  t->stats.bytes += len;
+  if (t->nutf8)
+    i = finish_utf8(t, s, len);
+  while (i < len) {
+    if (t->state == S_GROUND && s[i] >= 0x20 && s[i] != 0x7F) {
+      int ascii;
+      size_t n = text_run(s + i, len - i, &ascii), tail = 0;
+      if (i + n == len) {
+        // keep a sequence cut by the end of the input for the next feed
+        tail = incomplete_tail(s + i, n);
+        memcpy(t->utf8, s + len - tail, tail);
+        t->nutf8 = (int)tail;
+      }
+      t->stats.text += n - tail;
+      if (ascii)
+        put_text(t, s + i, n, 1);
+      else
+        put_utf8(t, s + i, n - tail);
+      i += n;
+    }
+    else {
+      int tr = table[t->state][s[i]];
+      int next = tr & 15;
+      if (t->state == S_OSC && next != S_OSC && (tr >> 4) != A_OSC_END)
+        osc_end(t);                    // ended by ST or an abort
+      action(t, tr >> 4, s[i]);
+      t->state = next;
+      i++;
+    }
+  }
+  if (t->row0) {
+    unroll(t);
+    mark(t, 0, t->grid->height - 1);
+  }
+}
+
+// Rows changed since the last call: return 0 if none.
+int term_take_dirty (term *t, int *top, int *bottom)
+{
+  if (t->dirty_top > t->dirty_bottom)
+    return 0;
+  *top = t->dirty_top;
+  *bottom = t->dirty_bottom;
+  t->dirty_top = t->grid->height;
+  t->dirty_bottom = -1;
+  return 1;
+}
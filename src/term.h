@@ -0,0 +1,62 @@
+// term.h
+// Terminal emulation into a cell grid: a table-driven DEC/ANSI parser (after
+// Paul Williams' VT500 state machine) that applies what it reads to a
+// cellbuf, with its own cursor, scroll region and attributes.
+
+#ifndef TERM_H
+#define TERM_H
+
+#include "cells.h"
+
+// Text is UTF-8, one UTF-16 unit per cell; runs of it go into the grid in
+// bulk. Controls: BS, HT, LF/VT/FF, CR. Escapes: DECSC, DECRC, IND, NEL, RI,
+// RIS. CSI: CUU CUD CUF CUB CNL CPL CHA HPA VPA CUP HVP ED EL IL DL ICH DCH
+// ECH SU SD DECSTBM SCOSC SCORC SGR, and DECSET/DECRST of autowrap (7) and
+// cursor visibility (25). SGR colours (16, 256 and RGB) are mapped to the 16
+// console colours; bold sets FOREGROUND_INTENSITY. OSC 0 and 2 set the
+// title; the rest, DCS, SOS, PM and APC are read and ignored.
+#define TERM_MAX_PARAMS  16
+#define TERM_MAX_OSC     256
+
+typedef struct {
+  unsigned long bytes;      // bytes fed
+  unsigned long text;       // bytes taken as text
+  unsigned long controls;   // C0 controls executed
+  unsigned long sequences;  // escape, CSI and OSC sequences dispatched
+  unsigned long scrolls;    // lines scrolled
+} term_stats;
+
+typedef struct {
+  cellbuf *grid;
+  int row0;                 // grid row where the screen starts, during a feed
+  int x, y;                 // cursor
+  int wrap;                 // the next character goes to a new line
+  int attr;                 // attributes of new text
+  int fg, bold;             // what makes up the foreground in 'attr'
+  int top, bottom;          // scroll region (inclusive)
+  int save_x, save_y, save_attr, save_fg, save_bold;
+  int autowrap;
+  int cursor_visible;
+  int newline;              // LF also does CR
+  int dirty_top, dirty_bottom;   // rows changed since term_take_dirty()
+  // parser
+  int state;
+  int params[TERM_MAX_PARAMS];
+  int nparams;
+  char inter[2];            // private marker / intermediates
+  int ninter;
+  char osc[TERM_MAX_OSC];
+  int nosc;
+  char utf8[4];             // an incomplete UTF-8 sequence left by the last feed
+  int nutf8;
+  char title[TERM_MAX_OSC];
+  term_stats stats;
+} term;
+
+void term_init_tables (void);
+void term_init  (term *t, cellbuf *grid);
+void term_reset (term *t);
+void term_feed  (term *t, const char *s, size_t len);
+int  term_take_dirty (term *t, int *top, int *bottom);
+
+#endif
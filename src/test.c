@@ -0,0 +1,1265 @@
+// test.c
+// Tests of the portable parts of the library (no Lua, no console).
+// Build and run with "make check"; run as "tests [name-prefix]". The exit
+// status is the number of failed checks (at most 255).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cells.h"
+#include "cellops.h"
+#include "cmdlist.h"
+#include "loop.h"
+#include "mpsc.h"
+#include "outbuf.h"
+#include "pump.h"
+#include "rec.h"
+#include "render.h"
+#include "scroll.h"
+#include "service.h"
+#include "spsc.h"
+#include "term.h"
+#include "thread.h"
+#include "utf8.h"
+
+#ifdef _WIN32
+# define yield_cpu()  Sleep(0)
+#else
+# include <sched.h>
+# define yield_cpu()  sched_yield()
+#endif
+
+static int checks, failures;
+
+#define CHECK(cond)  check((cond) != 0, #cond, __FILE__, __LINE__)
+
+static void check (int ok, const char *what, const char *file, int line)
+{
+  checks++;
+  if (!ok) {
+    failures++;
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  }
+}
+
+static cell_t* alloc_cells (int width, int height)
+{
+  cell_t *p = (cell_t*)calloc((size_t)width * height, sizeof(cell_t));
+  if (!p) {
+    fprintf(stderr, "out of memory\n");
+    exit(255);
+  }
+  return p;
+}
+
+static int cell_is (const cellbuf *cb, int x, int y, int ch, int attr)
+{
+  const cell_t *c = CELLBUF_AT(cb, x, y);
+  return c->Char == ch && c->Attributes == attr;
+}
+
+//---------------------------------------------------------------------------
+// cells: the storage behind CellBuffer
+//---------------------------------------------------------------------------
+static void test_cells (void)
+{
+  cellbuf a, b;
+  cell_t blank = { ' ', 0x07 };
+  cell_rect r;
+  int x, y, n;
+
+  cellbuf_init(&a, 10, 4, alloc_cells(10, 4));
+  cellbuf_init(&b, 10, 4, alloc_cells(10, 4));
+  cellbuf_clear(&a, blank);
+  CHECK(cell_is(&a, 0, 0, ' ', 0x07) && cell_is(&a, 9, 3, ' ', 0x07));
+
+  // clipped on both sides; a negative attr keeps the attributes
+  n = cellbuf_put_string(&a, -2, 1, "abcdefghijklmn", 14, 0x1F);
+  CHECK(n == 10);
+  CHECK(cell_is(&a, 0, 1, 'c', 0x1F) && cell_is(&a, 9, 1, 'l', 0x1F));
+  CHECK(cellbuf_put_string(&a, 3, 4, "x", 1, 0x1F) == 0);
+  CHECK(cellbuf_put_string(&a, -5, 0, "abc", 3, 0x1F) == 0);
+  cellbuf_put_string(&a, 0, 1, "Z", 1, -1);
+  CHECK(cell_is(&a, 0, 1, 'Z', 0x1F));
+
+  // fill: clipped, and either half may be left alone
+  r.Left = 8; r.Top = 2; r.Right = 20; r.Bottom = 20;
+  cellbuf_fill_rect(&a, r, '#', 0x4F);
+  CHECK(cell_is(&a, 8, 2, '#', 0x4F) && cell_is(&a, 9, 3, '#', 0x4F));
+  CHECK(cell_is(&a, 7, 2, ' ', 0x07));
+  r.Left = 0; r.Top = 0; r.Right = 9; r.Bottom = 3;
+  cellbuf_fill_rect(&a, r, -1, 0x70);
+  CHECK(cell_is(&a, 0, 1, 'Z', 0x70) && cell_is(&a, 8, 2, '#', 0x70));
+  cellbuf_fill_rect(&a, r, '.', -1);
+  CHECK(cell_is(&a, 5, 3, '.', 0x70));
+
+  // copy within one buffer, overlapping downwards
+  for (y=0; y<4; y++)
+    for (x=0; x<10; x++) {
+      CELLBUF_AT(&a, x, y)->Char = (unsigned short)('0' + y);
+      CELLBUF_AT(&a, x, y)->Attributes = (unsigned short)x;
+    }
+  r.Left = 0; r.Top = 0; r.Right = 9; r.Bottom = 2;
+  cellbuf_copy_rect(&a, 0, 1, &a, r);
+  CHECK(cell_is(&a, 4, 0, '0', 4) && cell_is(&a, 4, 1, '0', 4) &&
+        cell_is(&a, 4, 2, '1', 4) && cell_is(&a, 4, 3, '2', 4));
+
+  // blit: cells matching the key are transparent
+  cellbuf_clear(&b, blank);
+  cellbuf_put_string(&b, 0, 0, "a b", 3, 0x07);
+  r.Left = 0; r.Top = 0; r.Right = 2; r.Bottom = 0;
+  cellbuf_blit(&a, 5, 3, &b, r, CELL32(' ', 0), CELL32_CHAR);
+  CHECK(cell_is(&a, 5, 3, 'a', 0x07) && cell_is(&a, 6, 3, '2', 6) &&
+        cell_is(&a, 7, 3, 'b', 0x07));
+  // a copy hanging off the destination is cut, not wrapped
+  r.Bottom = 1;
+  cellbuf_copy_rect(&a, 8, -1, &b, r);
+  CHECK(cell_is(&a, 8, 0, ' ', 0x07) && cell_is(&a, 9, 0, ' ', 0x07) &&
+        cell_is(&a, 7, 0, '0', 7) && cell_is(&a, 8, 1, '0', 8));
+
+  free(a.cells);
+  free(b.cells);
+}
+
+//---------------------------------------------------------------------------
+// render: the diff, its cost model, and what reaches the output
+//---------------------------------------------------------------------------
+// a sink that applies the output to a target buffer, as the console would
+typedef struct {
+  cellbuf *target;
+  long calls, cells, scrolls;
+  int last_shift;
+} screen;
+
+static int screen_write (void *ctx, const cellbuf *src, const cell_rect *r)
+{
+  screen *sc = (screen*)ctx;
+  sc->calls++;
+  sc->cells += (long)(r->Right - r->Left + 1) * (r->Bottom - r->Top + 1);
+  cellbuf_copy_rect(sc->target, r->Left, r->Top, src, *r);
+  return 1;
+}
+
+static int screen_scroll (void *ctx, int top, int bottom, int shift, cell_t fill)
+{
+  screen *sc = (screen*)ctx;
+  sc->calls++;
+  sc->scrolls++;
+  sc->last_shift = shift;
+  scroll_apply(sc->target, top, bottom, shift, fill);
+  return 1;
+}
+
+static int same_cells (const cellbuf *a, const cellbuf *b)
+{
+  return !memcmp(a->cells, b->cells, (size_t)a->width * a->height * sizeof(cell_t));
+}
+
+static void test_render (void)
+{
+  const int W = 80, H = 25;
+  cellbuf front, back, target;
+  cell_t blank = { ' ', 0x07 };
+  cell_rect rects[RENDER_MAX_RECTS];
+  render_params prm;
+  render_stats stats;
+  render_sink sink;
+  screen sc;
+  int lo[25], hi[25];
+  int i, n, y, frame, bad = 0;
+
+  cellbuf_init(&front, W, H, alloc_cells(W, H));
+  cellbuf_init(&back, W, H, alloc_cells(W, H));
+  cellbuf_init(&target, W, H, alloc_cells(W, H));
+  cellbuf_clear(&front, blank);
+  cellbuf_clear(&back, blank);
+  render_init_params(&prm);
+
+  CHECK(render_diff(&front, &back, &prm, rects) == 0);
+
+  // two changes in one row: one call if the gap costs less than a call,
+  // two if it costs more
+  CELLBUF_AT(&back, 2, 3)->Char = 'a';
+  CELLBUF_AT(&back, 70, 3)->Char = 'b';
+  prm.call_cost = 100;
+  n = render_diff(&front, &back, &prm, rects);
+  CHECK(n == 1 && rects[0].Left == 2 && rects[0].Right == 70 &&
+        rects[0].Top == 3 && rects[0].Bottom == 3);
+  prm.call_cost = 10;
+  n = render_diff(&front, &back, &prm, rects);
+  CHECK(n == 2 && rects[0].Right - rects[0].Left + rects[1].Right - rects[1].Left == 0);
+
+  // the same column in rows far apart: merged only if the rows between
+  // cost less than a call
+  cellbuf_clear(&back, blank);
+  CELLBUF_AT(&back, 5, 0)->Char = 'a';
+  CELLBUF_AT(&back, 5, 20)->Char = 'b';
+  prm.call_cost = 64;
+  n = render_diff(&front, &back, &prm, rects);
+  CHECK(n == 1 && rects[0].Top == 0 && rects[0].Bottom == 20);
+  prm.call_cost = 8;
+  CHECK(render_diff(&front, &back, &prm, rects) == 2);
+
+  // random damage: the target ends up as 'back', never more than
+  // max_rects calls, and no dearer than sending each changed cell alone
+  sc.target = &target;
+  sink.write = screen_write;
+  sink.scroll = screen_scroll;
+  sink.ctx = &sc;
+  render_init_params(&prm);
+  prm.max_rects = 6;
+  cellbuf_clear(&front, blank);
+  cellbuf_clear(&target, blank);
+  memset(&stats, 0, sizeof(stats));
+  srand(7);
+  for (frame=0; frame<500; frame++) {
+    long changed = 0;
+    int k = rand() % 40;
+    sc.calls = sc.cells = 0;
+    for (i=0; i<k; i++) {
+      cell_t *c = CELLBUF_AT(&back, rand() % W, rand() % H);
+      c->Char = (unsigned short)('a' + rand() % 26);
+    }
+    for (i=0; i<W*H; i++)
+      changed += front.cells[i].Char != back.cells[i].Char;
+    n = render_present(&front, &back, &prm, 0, &sink, &stats);
+    bad += n < 0 || n > prm.max_rects || n != sc.calls ||
+           !same_cells(&target, &back) || !same_cells(&front, &back) ||
+           sc.calls * prm.call_cost + sc.cells > changed * (prm.call_cost + 1);
+  }
+  CHECK(bad == 0);
+  CHECK(stats.frames == 500 && stats.scrolls == 0);
+
+  // a log tail: one scroll call, then only the new bottom row
+  cellbuf_clear(&front, blank);
+  cellbuf_clear(&back, blank);
+  for (y=0; y<H; y++) {
+    char text[32];
+    sprintf(text, "line %d", y);
+    cellbuf_put_string(&front, 0, y, text, strlen(text), 0x07);
+    sprintf(text, "line %d", y + 1);
+    cellbuf_put_string(&back, 0, y, text, strlen(text), 0x07);
+  }
+  memcpy(target.cells, front.cells, (size_t)W * H * sizeof(cell_t));
+  prm.scroll = 1;
+  prm.scroll_top = 0;
+  prm.scroll_bottom = H - 1;
+  sc.calls = sc.cells = sc.scrolls = 0;
+  n = render_present(&front, &back, &prm, 0, &sink, &stats);
+  CHECK(sc.scrolls == 1 && sc.last_shift == 1);
+  CHECK(n == 1 && sc.cells <= W);
+  CHECK(same_cells(&target, &back));
+
+  // spans: adjacent rows go out together while that is cheaper
+  for (y=0; y<H; y++) {
+    lo[y] = 1;
+    hi[y] = 0;
+  }
+  lo[2] = 10; hi[2] = 19;
+  lo[3] = 12; hi[3] = 21;
+  lo[8] = 0;  hi[8] = 79;
+  sc.calls = sc.cells = 0;
+  memset(&stats, 0, sizeof(stats));
+  n = render_spans(&back, lo, hi, 0, H - 1, 64, &sink, &stats);
+  CHECK(n == 2 && sc.calls == 2 && stats.cells == 2 * 12 + 80);
+  sc.calls = sc.cells = 0;
+  n = render_spans(&back, lo, hi, 0, H - 1, 0, &sink, &stats);
+  CHECK(n == 3 && sc.cells == 10 + 10 + 80);
+
+  free(front.cells);
+  free(back.cells);
+  free(target.cells);
+}
+
+//---------------------------------------------------------------------------
+// scroll: the shift detector on synthetic frames
+//---------------------------------------------------------------------------
+// rows top..bottom show log lines first, first+1, ...; the others blank
+static void log_frame (cellbuf *cb, int top, int bottom, int first)
+{
+  cell_t blank = { ' ', 0x07 };
+  char text[32];
+  int y;
+  cellbuf_clear(cb, blank);
+  for (y=top; y<=bottom; y++) {
+    sprintf(text, "%05d log line", first + y - top);
+    cellbuf_put_string(cb, 0, y, text, strlen(text), 0x07);
+  }
+}
+
+static int rows_equal (const cellbuf *a, const cellbuf *b, int top, int bottom)
+{
+  return !memcmp(CELLBUF_AT(a, 0, top), CELLBUF_AT(b, 0, top),
+                 (size_t)(bottom - top + 1) * a->width * sizeof(cell_t));
+}
+
+static void test_scroll (void)
+{
+  const int W = 60, H = 20;
+  cellbuf old, cur;
+  cell_t blank = { ' ', 0x07 };
+  int shift, matched, k, bad = 0;
+
+  cellbuf_init(&old, W, H, alloc_cells(W, H));
+  cellbuf_init(&cur, W, H, alloc_cells(W, H));
+
+  // nothing changed: no shift
+  log_frame(&old, 0, H - 1, 100);
+  log_frame(&cur, 0, H - 1, 100);
+  CHECK(scroll_detect(&old, &cur, 0, H - 1, 0, &matched) == 0 && matched == 0);
+
+  // up and down by k; applying the shift to the old frame gives the rows
+  // of the new one that were there before
+  for (k=1; k<H/2; k++) {
+    log_frame(&old, 0, H - 1, 100);
+    log_frame(&cur, 0, H - 1, 100 + k);
+    shift = scroll_detect(&old, &cur, 0, H - 1, 0, &matched);
+    bad += shift != k || matched != H - k;
+    scroll_apply(&old, 0, H - 1, shift, blank);
+    bad += !rows_equal(&old, &cur, 0, H - 1 - k);
+
+    log_frame(&old, 0, H - 1, 100 + k);
+    log_frame(&cur, 0, H - 1, 100);
+    shift = scroll_detect(&old, &cur, 0, H - 1, 0, &matched);
+    bad += shift != -k || matched != H - k;
+    scroll_apply(&old, 0, H - 1, shift, blank);
+    bad += !rows_equal(&old, &cur, k, H - 1);
+  }
+  CHECK(bad == 0);
+
+  // a shift past max_shift is not looked for
+  log_frame(&old, 0, H - 1, 100);
+  log_frame(&cur, 0, H - 1, 105);
+  CHECK(scroll_detect(&old, &cur, 0, H - 1, 4, &matched) == 0 && matched == 0);
+  CHECK(scroll_detect(&old, &cur, 0, H - 1, 5, &matched) == 5 && matched == H - 5);
+
+  // a pane between a fixed header and footer: found both within the pane
+  // and over the whole screen, where the fixed rows do not vote
+  log_frame(&old, 3, H - 4, 100);
+  log_frame(&cur, 3, H - 4, 101);
+  cellbuf_put_string(&old, 0, 0, "header", 6, 0x70);
+  cellbuf_put_string(&cur, 0, 0, "header", 6, 0x70);
+  cellbuf_put_string(&old, 0, H - 1, "status 1", 8, 0x70);
+  cellbuf_put_string(&cur, 0, H - 1, "status 2", 8, 0x70);
+  CHECK(scroll_detect(&old, &cur, 3, H - 4, 0, &matched) == 1 && matched == H - 7);
+  CHECK(scroll_detect(&old, &cur, 0, H - 1, 0, &matched) == 1 && matched == H - 7);
+  scroll_apply(&old, 3, H - 4, 1, blank);
+  CHECK(rows_equal(&old, &cur, 0, H - 5));
+
+  // unrelated frames: no shift
+  log_frame(&old, 0, H - 1, 100);
+  log_frame(&cur, 0, H - 1, 500);
+  CHECK(scroll_detect(&old, &cur, 0, H - 1, 0, &matched) == 0 && matched == 0);
+
+  free(old.cells);
+  free(cur.cells);
+}
+
+//---------------------------------------------------------------------------
+// pump: the SPSC ring across two threads, and the pump over a synthetic
+// source
+//---------------------------------------------------------------------------
+#define SPSC_ITEMS  1000000
+
+static THREAD_PROC(spsc_producer, arg)
+{
+  spsc_queue *q = (spsc_queue*)arg;
+  unsigned i;
+  for (i=0; i<SPSC_ITEMS; i++) {
+    while (!spsc_push(q, &i))
+      yield_cpu();
+  }
+  THREAD_RETURN;
+}
+
+typedef struct {
+  unsigned next, limit;      // sequence numbers still to deliver
+  unsigned window;           // if set, stay at most this far ahead of 'seen'
+  unsigned seen;             // advanced by the reader
+  int fail;                  // read() fails instead
+} seq_source;
+
+static int seq_wait (void *ctx, int timeout_ms)
+{
+  seq_source *ss = (seq_source*)ctx;
+  (void)timeout_ms;
+  if (ss->fail)
+    return 1;
+  if (ss->next >= ss->limit ||
+      (ss->window && ss->next - __atomic_load_n(&ss->seen, __ATOMIC_ACQUIRE) > ss->window)) {
+    yield_cpu();
+    return 0;
+  }
+  return 1;
+}
+
+static int seq_read (void *ctx, void *buf, int max)
+{
+  seq_source *ss = (seq_source*)ctx;
+  unsigned *out = (unsigned*)buf;
+  int n;
+  if (ss->fail)
+    return -1;
+  for (n=0; n<max && ss->next < ss->limit; n++)
+    out[n] = ss->next++;
+  return n;
+}
+
+static void test_pump (void)
+{
+  unsigned out[64], next = 0, got = 0;
+  spsc_queue q;
+  sys_thread t;
+  seq_source ss;
+  pump_source src;
+  pump_stats st;
+  input_pump *p;
+  double t0;
+  int n, k, bad = 0;
+
+  // the ring alone: everything arrives, once and in order
+  CHECK(spsc_init(&q, 256, sizeof(unsigned)));
+  CHECK(spsc_capacity(&q) == 256);
+  CHECK(sys_thread_start(&t, spsc_producer, &q));
+  while (next < SPSC_ITEMS) {
+    n = (int)spsc_pop(&q, out, 64);
+    if (!n)
+      yield_cpu();
+    for (k=0; k<n; k++)
+      bad += out[k] != next++;
+  }
+  sys_thread_join(&t);
+  CHECK(bad == 0);
+  CHECK(spsc_count(&q) == 0 && spsc_pop(&q, out, 1) == 0);
+  spsc_free(&q);
+
+  // a reader that keeps up: no drops, no reordering
+  src.wait = seq_wait;
+  src.read = seq_read;
+  src.ctx = &ss;
+  memset(&ss, 0, sizeof(ss));
+  ss.limit = 200000;
+  ss.window = 2048;
+  p = pump_start(&src, 4096, sizeof(unsigned));
+  CHECK(p != NULL);
+  next = 0;
+  while (next < ss.limit) {
+    pump_wait(p, 100);
+    while ((n = pump_poll(p, out, 64)) > 0) {
+      for (k=0; k<n; k++)
+        bad += out[k] != next++;
+      __atomic_store_n(&ss.seen, next, __ATOMIC_RELEASE);
+    }
+  }
+  pump_get_stats(p, &st);
+  CHECK(bad == 0);
+  CHECK(st.received == ss.limit && st.dropped == 0 && st.pending == 0);
+  // drained, with the event maybe still set: a wait keeps to its timeout
+  t0 = loop_now();
+  CHECK(pump_wait(p, 40) == 0);
+  t0 = loop_now() - t0;
+  CHECK(t0 >= 30 && t0 < 70);
+  pump_stop(p);
+
+  // a reader that does not read: the queue fills once, the rest is
+  // dropped and counted, and what was kept is the start of the sequence
+  memset(&ss, 0, sizeof(ss));
+  ss.limit = 5000;
+  p = pump_start(&src, 64, sizeof(unsigned));
+  CHECK(p != NULL);
+  do {
+    yield_cpu();
+    pump_get_stats(p, &st);
+  } while (st.received < ss.limit);
+  CHECK(st.pending == 64 && st.dropped == ss.limit - 64 && st.overflows == 1);
+  next = 0;
+  while ((n = pump_poll(p, out, 64)) > 0) {
+    for (k=0; k<n; k++)
+      bad += out[k] != next++;
+    got += n;
+  }
+  CHECK(bad == 0 && got == 64);
+  pump_stop(p);
+
+  // a failing source stops the pump, and a waiting reader notices
+  memset(&ss, 0, sizeof(ss));
+  ss.fail = 1;
+  p = pump_start(&src, 64, sizeof(unsigned));
+  CHECK(p != NULL);
+  CHECK(pump_wait(p, 5000) == 0);
+  pump_get_stats(p, &st);
+  CHECK(!pump_alive(p) && st.errors == 1);
+  pump_stop(p);
+}
+
+//---------------------------------------------------------------------------
+// cmdlist: recording, patching and replaying
+//---------------------------------------------------------------------------
+// a backend that logs the calls as text; call number 'fail_at' fails
+typedef struct {
+  char log[512];
+  int calls, fail_at;
+} call_log;
+
+static int log_call (call_log *cl, const char *text)
+{
+  size_t n = strlen(cl->log);
+  snprintf(cl->log + n, sizeof(cl->log) - n, "%s;", text);
+  return ++cl->calls != cl->fail_at;
+}
+
+static int log_cursor_pos (void *ctx, int x, int y)
+{
+  char s[32];
+  sprintf(s, "pos %d %d", x, y);
+  return log_call((call_log*)ctx, s);
+}
+
+static int log_text_attr (void *ctx, int attr)
+{
+  char s[32];
+  sprintf(s, "attr %d", attr);
+  return log_call((call_log*)ctx, s);
+}
+
+static int log_write (void *ctx, const char *text, size_t len)
+{
+  char s[64];
+  sprintf(s, "write %.*s", (int)len, text);
+  return log_call((call_log*)ctx, s);
+}
+
+static int log_fill_char (void *ctx, int ch, int n, int x, int y)
+{
+  char s[48];
+  sprintf(s, "fillc %c %d %d %d", ch, n, x, y);
+  return log_call((call_log*)ctx, s);
+}
+
+static int log_fill_attr (void *ctx, int attr, int n, int x, int y)
+{
+  char s[48];
+  sprintf(s, "filla %d %d %d %d", attr, n, x, y);
+  return log_call((call_log*)ctx, s);
+}
+
+static int log_cursor_info (void *ctx, int size, int visible)
+{
+  char s[32];
+  sprintf(s, "cursor %d %d", size, visible);
+  return log_call((call_log*)ctx, s);
+}
+
+static void run_logged (const cmdlist *cl, call_log *lg, int fail_at, int *failed)
+{
+  cmd_backend be;
+  be.cursor_pos = log_cursor_pos;
+  be.text_attr = log_text_attr;
+  be.write = log_write;
+  be.fill_char = log_fill_char;
+  be.fill_attr = log_fill_attr;
+  be.cursor_info = log_cursor_info;
+  be.ctx = lg;
+  memset(lg, 0, sizeof(*lg));
+  lg->fail_at = fail_at;
+  *failed = cmdlist_run(cl, &be);
+}
+
+static void test_cmdlist (void)
+{
+  int pos[2] = { 3, 4 }, attr[1] = { 0x1F }, fill[4] = { '-', 10, 0, 5 };
+  int cur[2] = { 25, 1 }, other[4] = { 0x70, 80, 0, 24 };
+  int idpos, idtext, failed, i;
+  call_log lg;
+  cmdlist cl;
+
+  cmdlist_init(&cl);
+  idpos = cmdlist_add(&cl, CMD_CURSOR_POS, pos);
+  CHECK(idpos == 0);
+  CHECK(cmdlist_add(&cl, CMD_TEXT_ATTR, attr) == 1);
+  idtext = cmdlist_add_text(&cl, "hello", 5, 16);
+  CHECK(idtext == 2);
+  CHECK(cmdlist_add(&cl, CMD_FILL_CHAR, fill) == 3);
+  CHECK(cmdlist_add(&cl, CMD_FILL_ATTR, other) == 4);
+  CHECK(cmdlist_add(&cl, CMD_CURSOR_INFO, cur) == 5);
+  // no such opcode, and text goes through cmdlist_add_text only
+  CHECK(cmdlist_add(&cl, 0, pos) == -1 && cmdlist_add(&cl, CMD_LAST + 1, pos) == -1);
+  CHECK(cmdlist_add(&cl, CMD_WRITE, pos) == -1);
+  CHECK(cmdlist_op(&cl, idtext) == CMD_WRITE && cmdlist_op(&cl, 6) == 0 &&
+        cmdlist_op(&cl, -1) == 0);
+
+  run_logged(&cl, &lg, 0, &failed);
+  CHECK(failed == -1);
+  CHECK(!strcmp(lg.log, "pos 3 4;attr 31;write hello;fillc - 10 0 5;"
+                        "filla 112 80 0 24;cursor 25 1;"));
+
+  // patched in place: arguments, then text within the room recorded
+  pos[0] = 7;
+  CHECK(cmdlist_patch(&cl, idpos, pos));
+  CHECK(cmdlist_patch_text(&cl, idtext, "0123456789abcdef", 16));
+  CHECK(!cmdlist_patch_text(&cl, idtext, "0123456789abcdefg", 17));
+  CHECK(!cmdlist_patch_text(&cl, idpos, "x", 1));
+  CHECK(!cmdlist_patch(&cl, idtext, pos) && !cmdlist_patch(&cl, 99, pos));
+  run_logged(&cl, &lg, 0, &failed);
+  CHECK(failed == -1);
+  CHECK(!strncmp(lg.log, "pos 7 4;attr 31;write 0123456789abcdef;", 39));
+
+  // a failed call stops the replay and names the command
+  run_logged(&cl, &lg, 3, &failed);
+  CHECK(failed == 2 && lg.calls == 3);
+
+  // cleared, the memory is reused
+  cmdlist_clear(&cl);
+  run_logged(&cl, &lg, 0, &failed);
+  CHECK(failed == -1 && lg.calls == 0);
+  for (i=0; i<1000; i++)
+    cmdlist_add(&cl, CMD_TEXT_ATTR, &i);
+  run_logged(&cl, &lg, 1000, &failed);
+  CHECK(failed == 999 && cmdlist_op(&cl, 999) == CMD_TEXT_ATTR);
+  cmdlist_free(&cl);
+}
+
+//---------------------------------------------------------------------------
+// outbuf: when the buffered writer hands its bytes on
+//---------------------------------------------------------------------------
+typedef struct {
+  char out[256];
+  size_t len;
+  int calls, fail;
+} byte_sink;
+
+static int sink_write (void *ctx, const char *s, size_t len)
+{
+  byte_sink *bs = (byte_sink*)ctx;
+  bs->calls++;
+  if (bs->fail)
+    return 0;
+  memcpy(bs->out + bs->len, s, len);
+  bs->len += len;
+  return 1;
+}
+
+static void test_outbuf (void)
+{
+  char storage[16];
+  outbuf_sink sink;
+  byte_sink bs;
+  outbuf w;
+  unsigned t0 = 0xFFFFFFF0u;   // the clock wraps during the test
+
+  memset(&bs, 0, sizeof(bs));
+  sink.write = sink_write;
+  sink.ctx = &bs;
+  outbuf_init(&w, storage, sizeof(storage), 10, &sink);
+
+  // gathered until the buffer fills
+  CHECK(outbuf_write(&w, "abcde", 5, t0));
+  CHECK(outbuf_write(&w, "fghij", 5, t0 + 1));
+  CHECK(bs.calls == 0 && w.len == 10);
+  CHECK(outbuf_write(&w, "klmnop", 6, t0 + 2));
+  CHECK(bs.calls == 1 && bs.len == 16 && w.len == 0);
+  // what does not fit pushes the pending bytes out first
+  CHECK(outbuf_write(&w, "0123456789", 10, t0 + 3));
+  CHECK(outbuf_write(&w, "ABCDEFGHIJ", 10, t0 + 4));
+  CHECK(bs.calls == 2 && bs.len == 26 && w.len == 10);
+  // a string as large as the buffer goes straight to the sink, after them
+  CHECK(outbuf_write(&w, "<----------------->", 19, t0 + 5));
+  CHECK(bs.calls == 4 && w.len == 0);
+  CHECK(bs.len == 55 && !memcmp(bs.out, "abcdefghijklmnop0123456789ABCDEFGHIJ"
+                                        "<----------------->", 55));
+
+  // the deadline counts from the first pending byte, across the wrap
+  CHECK(outbuf_write(&w, "x", 1, t0 + 10));
+  CHECK(!outbuf_due(&w, t0 + 19) && outbuf_tick(&w, t0 + 19) && w.len == 1);
+  CHECK(outbuf_write(&w, "y", 1, t0 + 19) && w.len == 2);
+  CHECK(outbuf_due(&w, t0 + 20) && outbuf_tick(&w, t0 + 20) && w.len == 0);
+  CHECK(bs.calls == 5 && !memcmp(bs.out + 55, "xy", 2));
+  // a write past the deadline takes itself along
+  CHECK(outbuf_write(&w, "z", 1, t0 + 30) && outbuf_write(&w, "!", 1, t0 + 45));
+  CHECK(bs.calls == 6 && w.len == 0 && !memcmp(bs.out + 57, "z!", 2));
+
+  // a failing sink drops the bytes and counts the error
+  bs.fail = 1;
+  CHECK(outbuf_write(&w, "lost", 4, t0 + 50));
+  CHECK(!outbuf_flush(&w) && w.len == 0);
+  CHECK(outbuf_flush(&w));
+  CHECK(w.stats.errors == 1 && w.stats.flushes == 6 && w.stats.bytes == 59);
+  CHECK(w.stats.writes == 11);
+}
+
+//---------------------------------------------------------------------------
+// rec: recordings written and read back
+//---------------------------------------------------------------------------
+#define REC_FRAMES  60
+
+// the reader shows frame i as it was written
+static int shows_frame (const rec_reader *r, const cellbuf *frames, const rec_frame *fr, int i)
+{
+  const cellbuf *f = &frames[i];
+  return r->frame == i && r->screen.width == f->width && r->screen.height == f->height &&
+         !memcmp(r->screen.cells, f->cells, (size_t)f->width * f->height * sizeof(cell_t)) &&
+         r->cur.time == fr[i].time && r->cur.cursor_x == fr[i].cursor_x &&
+         r->cur.cursor_y == fr[i].cursor_y && r->cur.cursor_size == fr[i].cursor_size &&
+         r->cur.cursor_visible == fr[i].cursor_visible;
+}
+
+static void test_rec (void)
+{
+  const char *path = "test.rec";
+  cellbuf frames[REC_FRAMES], screen;
+  rec_frame fr[REC_FRAMES];
+  cell_t blank = { ' ', 0x07 };
+  unsigned char *data, *copy;
+  rec_writer w;
+  rec_reader r;
+  size_t len;
+  int i, k, bad = 0;
+
+  // random edits to a 40x12 screen, which grows to 50x14 halfway; each
+  // frame reports the rows it changed
+  cellbuf_init(&screen, 50, 14, alloc_cells(50, 14));
+  screen.width = 40;
+  screen.height = 12;
+  cellbuf_clear(&screen, blank);
+  CHECK(rec_writer_open(&w, path, 7));
+  srand(3);
+  for (i=0; i<REC_FRAMES; i++) {
+    int top = screen.height, bottom = -1;
+    if (i == REC_FRAMES / 2) {
+      cellbuf_init(&screen, 50, 14, screen.cells);
+      cellbuf_clear(&screen, blank);
+    }
+    for (k=rand()%20 + 1; k; k--) {
+      int y = rand() % screen.height;
+      cell_t *c = CELLBUF_AT(&screen, rand() % screen.width, y);
+      c->Char = (unsigned short)('A' + rand() % 26);
+      c->Attributes = (unsigned short)(rand() % 256);
+      if (y < top) top = y;
+      if (y > bottom) bottom = y;
+    }
+    memset(&fr[i], 0, sizeof(rec_frame));
+    fr[i].time = 16 * i + rand() % 16;
+    fr[i].cursor_x = rand() % screen.width;
+    fr[i].cursor_y = rand() % screen.height;
+    fr[i].cursor_size = 1 + rand() % 100;
+    fr[i].cursor_visible = rand() % 2;
+    cellbuf_init(&frames[i], screen.width, screen.height, alloc_cells(screen.width, screen.height));
+    memcpy(frames[i].cells, screen.cells, (size_t)screen.width * screen.height * sizeof(cell_t));
+    bad += !rec_writer_frame(&w, &screen, &fr[i], top, bottom);
+  }
+  // nothing new: no frame
+  bad += !rec_writer_frame(&w, &screen, &fr[REC_FRAMES-1], 0, screen.height - 1);
+  CHECK(bad == 0 && w.stats.frames == REC_FRAMES && w.stats.unchanged == 1);
+  CHECK(w.stats.keyframes == 10);   // 0, 7, ..., 28, 30 (resize), 37, ..., 58
+  CHECK(rec_writer_close(&w));
+
+  // played through, then sought to each frame and around it
+  CHECK(rec_reader_open(&r, path));
+  CHECK(r.nframes == REC_FRAMES && r.nindex == 10 && r.duration == fr[REC_FRAMES-1].time);
+  for (i=0; rec_reader_next(&r); i++)
+    bad += !shows_frame(&r, frames, fr, i);
+  CHECK(bad == 0 && i == REC_FRAMES);
+  for (i=REC_FRAMES-1; i>=0; i--) {
+    bad += !rec_reader_seek(&r, fr[i].time) || !shows_frame(&r, frames, fr, i);
+    if (i)
+      bad += !rec_reader_seek(&r, fr[i].time - 1) || !shows_frame(&r, frames, fr, i - 1);
+  }
+  CHECK(bad == 0);
+  CHECK(rec_reader_seek(&r, 0) && r.frame == 0);
+  len = r.len;
+  data = (unsigned char*)malloc(len);
+  memcpy(data, r.data, len);
+  rec_reader_close(&r);
+
+  // cut short before the index: the frames are scanned instead
+  copy = (unsigned char*)malloc(len);
+  memcpy(copy, data, len);
+  CHECK(rec_reader_memory(&r, copy, len - 10 * REC_INDEX_ENTRY - REC_TRAILER_SIZE));
+  CHECK(r.nframes == REC_FRAMES && r.nindex == 10);
+  CHECK(rec_reader_seek(&r, fr[45].time) && shows_frame(&r, frames, fr, 45));
+  rec_reader_close(&r);
+
+  // cut in the middle of a frame: what came before plays
+  CHECK(rec_reader_memory(&r, copy, len / 2));
+  for (i=0; rec_reader_next(&r); i++)
+    bad += !shows_frame(&r, frames, fr, i);
+  CHECK(bad == 0 && i > 0 && i < REC_FRAMES && (unsigned long)i == r.nframes);
+  rec_reader_close(&r);
+
+  // an index entry pointing anywhere: the index is not used
+  for (k=0; k<4; k++) {
+    static const unsigned long long offsets[4] = {
+      0, 5, 0xFFFFFFFFFFFFFFF0ULL, 17
+    };
+    size_t at = len - REC_TRAILER_SIZE - 10 * REC_INDEX_ENTRY + 3 * REC_INDEX_ENTRY + 8;
+    memcpy(copy, data, len);
+    for (i=0; i<8; i++)
+      copy[at + i] = (unsigned char)(offsets[k] >> (8 * i));
+    if (k == 3)   // inside the file, but not where a keyframe starts
+      copy[at] = (unsigned char)(copy[at] + 17);
+    CHECK(rec_reader_memory(&r, copy, len));
+    CHECK(r.nframes == REC_FRAMES && r.nindex == 10);
+    CHECK(rec_reader_seek(&r, fr[25].time) && shows_frame(&r, frames, fr, 25));
+    rec_reader_close(&r);
+  }
+
+  // a keyframe damaged after opening: seeking from it fails, and the reader
+  // goes on from the frame it was at
+  memcpy(copy, data, len);
+  CHECK(rec_reader_memory(&r, copy, len));
+  for (i=0; i<5; i++)
+    rec_reader_next(&r);
+  {
+    size_t at = len - REC_TRAILER_SIZE - 10 * REC_INDEX_ENTRY + 3 * REC_INDEX_ENTRY + 8;
+    size_t offset = 0;
+    for (i=7; i>=0; i--)
+      offset = offset << 8 | copy[at + i];
+    copy[offset + 8] = 'X';     // the frame type
+  }
+  CHECK(!rec_reader_seek(&r, fr[25].time) && shows_frame(&r, frames, fr, 4));
+  CHECK(rec_reader_next(&r) && shows_frame(&r, frames, fr, 5));
+  rec_reader_close(&r);
+
+  // not a recording
+  memcpy(copy, data, len);
+  copy[0] = 'X';
+  CHECK(!rec_reader_memory(&r, copy, len));
+  CHECK(!rec_reader_memory(&r, copy, 4));
+
+  free(copy);
+  free(data);
+  for (i=0; i<REC_FRAMES; i++)
+    free(frames[i].cells);
+  free(screen.cells);
+  remove(path);
+}
+
+//---------------------------------------------------------------------------
+// loop: the order events come out in, over a backend that reports the
+// handles set in 'signalled' at once instead of waiting
+//---------------------------------------------------------------------------
+typedef struct {
+  intptr_t signalled[4];
+  int nsignalled;
+  int fail;
+  int calls, last_timeout;
+} fake_backend;
+
+static int fake_wait (void *ctx, const intptr_t *handles, int n, int timeout_ms)
+{
+  fake_backend *fb = (fake_backend*)ctx;
+  int i, j;
+  fb->calls++;
+  fb->last_timeout = timeout_ms;
+  if (fb->fail)
+    return -1;
+  for (i=0; i<n; i++)
+    for (j=0; j<fb->nsignalled; j++)
+      if (handles[i] == fb->signalled[j])
+        return i;
+  return LOOP_TIMEOUT;
+}
+
+// the ids of the next events, as a string of digits ("" if none came)
+static const char* next_ids (event_loop *lp, const loop_backend *be, int n)
+{
+  static char ids[16];
+  loop_event ev;
+  int i;
+  for (i=0; i<n && loop_next(lp, be, 0, &ev) == 1; i++)
+    ids[i] = (char)('0' + ev.id);
+  ids[i] = 0;
+  return ids;
+}
+
+static void test_loop (void)
+{
+  event_loop lp;
+  loop_backend be;
+  fake_backend fb;
+  loop_event ev;
+  double now;
+  int i;
+
+  memset(&fb, 0, sizeof(fb));
+  be.wait = fake_wait;
+  be.ctx = &fb;
+  loop_init(&lp);
+  CHECK(loop_next(&lp, &be, -1, &ev) == 0);      // nothing to wait for
+
+  // timers that are due come out by due time, those due together in the
+  // order set; a cancelled one never does
+  now = loop_now();
+  CHECK(loop_add_timer(&lp, 1, now - 50, 0));
+  CHECK(loop_add_timer(&lp, 2, now - 10, 0));
+  CHECK(loop_add_timer(&lp, 3, now - 30, 0));
+  CHECK(loop_add_timer(&lp, 4, now - 20, 0));
+  CHECK(loop_add_timer(&lp, 5, now - 20, 0));
+  CHECK(loop_add_timer(&lp, 6, now - 40, 0));
+  CHECK(loop_cancel_timer(&lp, 6));
+  CHECK(!loop_cancel_timer(&lp, 6));
+  CHECK(!strcmp(next_ids(&lp, &be, 9), "13452"));
+  CHECK(lp.ntimers == 0 && lp.stats.timers == 5 && fb.calls == 0);
+
+  // more timers than the heap starts with, set in reverse
+  for (i=0; i<40; i++)
+    CHECK(loop_add_timer(&lp, i % 10, now - 100 + (40 - i), 0));
+  CHECK(!strcmp(next_ids(&lp, &be, 10), "9876543210"));
+  for (i=0; i<30; i++)
+    loop_next(&lp, &be, 0, &ev);
+  CHECK(lp.ntimers == 0);
+
+  // an interval timer keeps to its ticks and skips those it is late for
+  CHECK(loop_add_timer(&lp, 7, now - 35, 10));
+  CHECK(loop_next(&lp, &be, 0, &ev) == 1);
+  CHECK(ev.kind == LOOP_TIMER && ev.id == 7 && ev.again && ev.at == now - 35);
+  CHECK(lp.stats.skipped >= 3 && lp.ntimers == 1 && lp.heap[0].due > now);
+  CHECK(loop_cancel_timer(&lp, 7));
+
+  // handles that stay signalled take turns; a due timer goes first
+  CHECK(loop_add_handle(&lp, 1, 101));
+  CHECK(loop_add_handle(&lp, 2, 102));
+  CHECK(loop_add_handle(&lp, 3, 103));
+  fb.signalled[0] = 103;
+  fb.signalled[1] = 101;
+  fb.signalled[2] = 102;
+  fb.nsignalled = 3;
+  CHECK(!strcmp(next_ids(&lp, &be, 6), "123123"));
+  CHECK(loop_add_timer(&lp, 9, loop_now() - 1, 0));
+  CHECK(!strcmp(next_ids(&lp, &be, 3), "912"));
+  CHECK(loop_next(&lp, &be, 0, &ev) == 1 && ev.kind == LOOP_HANDLE && ev.id == 3);
+  CHECK(loop_remove_handle(&lp, 2));
+  CHECK(!loop_remove_handle(&lp, 2));
+  CHECK(!strcmp(next_ids(&lp, &be, 4), "1313"));
+
+  // none signalled: the wait is bounded by 'until' or the next timer,
+  // whichever comes first
+  fb.nsignalled = 0;
+  CHECK(loop_next(&lp, &be, loop_now() - 1, &ev) == 0);
+  CHECK(fb.last_timeout == 0);
+  CHECK(loop_add_timer(&lp, 8, loop_now() + 5000, 0));
+  CHECK(loop_next(&lp, &be, loop_now() + 20, &ev) == 0);
+  CHECK(fb.last_timeout >= 0 && fb.last_timeout <= 21);
+  CHECK(loop_next(&lp, &be, loop_now() - 1, &ev) == 0);
+  fb.fail = 1;
+  CHECK(loop_next(&lp, &be, -1, &ev) == -1);
+  CHECK(fb.last_timeout > 4000);
+  CHECK(loop_remove_handle(&lp, 1) && loop_remove_handle(&lp, 3));
+  fb.calls = 0;
+  CHECK(loop_next(&lp, &be, loop_now() - 1, &ev) == 0);
+  CHECK(fb.calls == 0);                          // a timer alone: no wait
+
+  // no more handles than a wait takes
+  for (i=0; i<LOOP_MAX_HANDLES; i++)
+    loop_add_handle(&lp, i, 200 + i);
+  CHECK(!loop_add_handle(&lp, 99, 99));
+  loop_free(&lp);
+}
+
+//---------------------------------------------------------------------------
+// mpsc: the MPSC ring, alone and with producers racing for its slots
+//---------------------------------------------------------------------------
+#define MPSC_PRODUCERS  4
+#define MPSC_ITEMS      200000
+
+typedef struct {
+  mpsc_queue *q;
+  unsigned id;
+} mpsc_worker;
+
+// items are id << 24 | sequence number, plus one so that none is NULL
+static THREAD_PROC(mpsc_producer, arg)
+{
+  mpsc_worker *w = (mpsc_worker*)arg;
+  unsigned i;
+  for (i=0; i<MPSC_ITEMS; i++) {
+    while (!mpsc_push(w->q, (void*)(size_t)((w->id << 24 | i) + 1)))
+      yield_cpu();
+  }
+  THREAD_RETURN;
+}
+
+static void test_mpsc (void)
+{
+  mpsc_queue q;
+  mpsc_worker workers[MPSC_PRODUCERS];
+  sys_thread threads[MPSC_PRODUCERS];
+  unsigned next[MPSC_PRODUCERS], got = 0, i;
+  int bad = 0;
+
+  // one thread: rounded capacity, full, empty, first in first out
+  CHECK(mpsc_init(&q, 100));
+  CHECK(mpsc_capacity(&q) == 128);
+  CHECK(mpsc_count(&q) == 0 && mpsc_pop(&q) == NULL);
+  for (i=0; i<128; i++)
+    bad += !mpsc_push(&q, (void*)(size_t)(i + 1));
+  CHECK(bad == 0);
+  CHECK(!mpsc_push(&q, (void*)1));
+  CHECK(mpsc_count(&q) == 128);
+  for (i=0; i<128; i++)
+    bad += mpsc_pop(&q) != (void*)(size_t)(i + 1);
+  CHECK(bad == 0);
+  CHECK(mpsc_count(&q) == 0 && mpsc_pop(&q) == NULL);
+  mpsc_free(&q);
+
+  // several producers through a small ring: each one's items arrive once
+  // and in its order, and the count stays within the capacity meanwhile
+  CHECK(mpsc_init(&q, 64));
+  for (i=0; i<MPSC_PRODUCERS; i++) {
+    workers[i].q = &q;
+    workers[i].id = i;
+    next[i] = 0;
+    CHECK(sys_thread_start(&threads[i], mpsc_producer, &workers[i]));
+  }
+  while (got < MPSC_PRODUCERS * MPSC_ITEMS) {
+    void *item = mpsc_pop(&q);
+    unsigned v, id;
+    bad += mpsc_count(&q) > 64;
+    if (!item) {
+      yield_cpu();
+      continue;
+    }
+    v = (unsigned)(size_t)item - 1;
+    id = v >> 24;
+    if (id >= MPSC_PRODUCERS || (v & 0xFFFFFF) != next[id]) {
+      bad++;
+      break;
+    }
+    next[id]++;
+    got++;
+  }
+  for (i=0; i<MPSC_PRODUCERS; i++)
+    sys_thread_join(&threads[i]);
+  CHECK(bad == 0);
+  CHECK(got == MPSC_PRODUCERS * MPSC_ITEMS);
+  CHECK(mpsc_pop(&q) == NULL);
+  mpsc_free(&q);
+}
+
+//---------------------------------------------------------------------------
+// service: what reaches the sink, and producers on several threads each
+// keeping to a band of rows, so that the screen must end up as each of them
+// expects
+//---------------------------------------------------------------------------
+#define SVC_WIDTH      120
+#define SVC_PRODUCERS  4
+#define SVC_BAND       6
+#define SVC_UPDATES    20000
+
+typedef struct {
+  render_service *s;
+  int id, credit;
+  cell_t expect[SVC_BAND * SVC_WIDTH];
+  producer_stats st;
+  int failed;
+} svc_worker;
+
+static THREAD_PROC(svc_worker_proc, arg)
+{
+  svc_worker *w = (svc_worker*)arg;
+  service_producer *p = service_open(w->s, w->credit, -1);
+  cell_t cells[SVC_BAND * 16];
+  cellbuf block, expect;
+  unsigned seed = 4321u * (w->id + 1);
+  int i, j;
+  cellbuf_init(&expect, SVC_WIDTH, SVC_BAND, w->expect);
+  for (i=0; i<SVC_UPDATES && p; i++) {
+    cell_rect r;
+    int x, y, bw, bh;
+    seed = seed * 1103515245u + 12345u;
+    bw = 1 + (seed >> 8) % 16;
+    bh = 1 + (seed >> 16) % SVC_BAND;
+    x = (seed >> 4) % (SVC_WIDTH - bw + 1);
+    y = (seed >> 20) % (SVC_BAND - bh + 1);
+    cellbuf_init(&block, bw, bh, cells);
+    for (j=0; j<bw*bh; j++) {
+      cells[j].Char = (unsigned short)('A' + w->id);
+      cells[j].Attributes = (unsigned short)(i + j);
+    }
+    r.Left = r.Top = 0;
+    r.Right = bw - 1;
+    r.Bottom = bh - 1;
+    if (service_submit(p, &block, r, x, w->id * SVC_BAND + y) != 1) {
+      w->failed = 1;
+      break;
+    }
+    cellbuf_copy_rect(&expect, x, y, &block, r);
+  }
+  if (p) {
+    w->failed |= service_sync(p, -1) != 1;
+    service_producer_stats(p, &w->st);
+    service_close(p);
+  }
+  else
+    w->failed = 1;
+  THREAD_RETURN;
+}
+
+static void test_service (void)
+{
+  static svc_worker workers[SVC_PRODUCERS];
+  sys_thread threads[SVC_PRODUCERS];
+  service_params prm;
+  service_stats st;
+  render_sink sink;
+  render_service *s;
+  service_producer *p;
+  cellbuf target, shown, expect, block;
+  cell_t cells[15];
+  cell_rect r, all;
+  screen sc;
+  unsigned id;
+  int i, bad = 0;
+
+  cellbuf_init(&target, SVC_WIDTH, SVC_PRODUCERS * SVC_BAND,
+               alloc_cells(SVC_WIDTH, SVC_PRODUCERS * SVC_BAND));
+  cellbuf_init(&shown, target.width, target.height, alloc_cells(target.width, target.height));
+  cellbuf_init(&expect, target.width, target.height, alloc_cells(target.width, target.height));
+  memset(&sc, 0, sizeof(sc));
+  sc.target = &target;
+  sink.write = screen_write;
+  sink.scroll = screen_scroll;
+  sink.ctx = &sc;
+  service_init_params(&prm);
+  prm.width = target.width;
+  prm.height = target.height;
+  all.Left = all.Top = 0;
+  all.Right = target.width - 1;
+  all.Bottom = target.height - 1;
+
+  // what the screen shows to begin with; the service must not change it
+  // where nothing was updated
+  for (i=0; i<target.height; i++)
+    cellbuf_put_string(&shown, 0, i, "the quick brown fox jumps over the lazy dog", 43, 0x07 + i);
+  cellbuf_copy_rect(&target, 0, 0, &shown, all);
+  cellbuf_copy_rect(&expect, 0, 0, &shown, all);
+  s = service_start(&prm, &sink, &shown);
+  CHECK(s != NULL);
+  if (!s)
+    return;
+  p = service_open(s, 4, -1);
+  CHECK(p != NULL);
+
+  // a block goes out as one rectangle
+  for (i=0; i<15; i++) {
+    cells[i].Char = (unsigned short)('a' + i);
+    cells[i].Attributes = 0x1F;
+  }
+  cellbuf_init(&block, 5, 3, cells);
+  r.Left = r.Top = 0;
+  r.Right = 4;
+  r.Bottom = 2;
+  CHECK(service_submit(p, &block, r, 2, 1) == 1);
+  CHECK(service_sync(p, -1) == 1);
+  cellbuf_copy_rect(&expect, 2, 1, &block, r);
+  CHECK(sc.calls == 1 && sc.cells == 15);
+  CHECK(same_cells(&target, &expect));
+
+  // updates apart in a row: only their cells go out, whether or not they
+  // made the same frame
+  sc.calls = sc.cells = 0;
+  r.Right = 1;
+  r.Bottom = 0;
+  CHECK(service_submit(p, &block, r, 0, 10) == 1);
+  CHECK(service_submit(p, &block, r, 60, 10) == 1);
+  CHECK(service_sync(p, -1) == 1);
+  cellbuf_copy_rect(&expect, 0, 10, &block, r);
+  cellbuf_copy_rect(&expect, 60, 10, &block, r);
+  CHECK(sc.calls == 2 && sc.cells == 4);
+  CHECK(same_cells(&target, &expect));
+
+  // more spans apart in a row than the service keeps: the cells between
+  // those merged go out as they were shown
+  r.Right = 0;
+  for (i=0; i<=SERVICE_ROW_SPANS; i++) {
+    CHECK(service_submit(p, &block, r, 5 * i, 12) == 1);
+    cellbuf_copy_rect(&expect, 5 * i, 12, &block, r);
+  }
+  CHECK(service_sync(p, -1) == 1);
+  CHECK(same_cells(&target, &expect));
+  service_close(p);
+  service_get_stats(s, &st);
+  CHECK(st.updates == 4 + SERVICE_ROW_SPANS && st.producers == 0 && st.errors == 0);
+  CHECK(st.sent >= st.dirty && st.dirty <= st.cells);
+
+  // by id, producers open only until the service is stopped
+  id = service_id(s);
+  CHECK(id != 0);
+  p = service_open_id(id, 1, 0);
+  CHECK(p != NULL);
+  service_stop(s);
+  CHECK(service_submit(p, &block, r, 0, 0) == -1);
+  service_close(p);                  // frees the service
+  CHECK(service_open_id(id, 1, 0) == NULL);
+
+  // several producers through a tight queue: each band ends up as its
+  // producer expects, and every update is flushed
+  memset(target.cells, 0, (size_t)target.width * target.height * sizeof(cell_t));
+  prm.capacity = 16;
+  s = service_start(&prm, &sink, NULL);
+  CHECK(s != NULL);
+  if (!s)
+    return;
+  for (i=0; i<SVC_PRODUCERS; i++) {
+    svc_worker *w = &workers[i];
+    memset(w, 0, sizeof(*w));
+    w->s = s;
+    w->id = i;
+    w->credit = 4;
+    CHECK(sys_thread_start(&threads[i], svc_worker_proc, w));
+  }
+  for (i=0; i<SVC_PRODUCERS; i++)
+    sys_thread_join(&threads[i]);
+  service_get_stats(s, &st);
+  service_stop(s);
+  for (i=0; i<SVC_PRODUCERS; i++) {
+    svc_worker *w = &workers[i];
+    bad += w->failed || w->st.submitted != SVC_UPDATES ||
+           w->st.flushed != SVC_UPDATES || w->st.inflight != 0 ||
+           memcmp(CELLBUF_AT(&target, 0, i * SVC_BAND), w->expect, sizeof(w->expect)) != 0;
+  }
+  CHECK(bad == 0);
+  CHECK(st.updates == SVC_PRODUCERS * SVC_UPDATES && st.errors == 0);
+  CHECK(st.depth_max <= 16);
+  CHECK(st.sent >= st.dirty && st.dirty <= st.cells);
+
+  free(target.cells);
+  free(shown.cells);
+  free(expect.cells);
+}
+
+typedef struct {
+  const char *name;
+  void (*run) (void);
+} test_case;
+
+static const test_case cases[] = {
+  {"cells", test_cells},
+  {"cmdlist", test_cmdlist},
+  {"loop", test_loop},
+  {"mpsc", test_mpsc},
+  {"outbuf", test_outbuf},
+  {"pump", test_pump},
+  {"rec", test_rec},
+  {"render", test_render},
+  {"scroll", test_scroll},
+  {"service", test_service},
+  {NULL, NULL}
+};
+
+int main (int argc, char **argv)
+{
+  const test_case *c;
+  cellops_init();
+  utf8_init();
+  term_init_tables();
+  for (c=cases; c->name; c++) {
+    if (argc < 2 || !strncmp(c->name, argv[1], strlen(argv[1]))) {
+      int before = failures;
+      c->run();
+      printf("%-16s %s\n", c->name, failures == before ? "ok" : "FAILED");
+    }
+  }
+  printf("%d checks, %d failed\n", checks, failures);
+  return failures > 255 ? 255 : failures;
+}
@@ -0,0 +1,128 @@
+// thread.c
+// Just enough threading for the library: threads, auto-reset events and a
+// mutex, on top of the Win32 API or pthreads.
+
+#include "thread.h"
+
+#ifdef _WIN32
+
+int sys_thread_start (sys_thread *t, sys_thread_proc proc, void *arg)
+{
+  *t = CreateThread(NULL, 0, proc, arg, 0, NULL);
+  return *t != NULL;
+}
+
+void sys_thread_join (sys_thread *t)
+{
+  WaitForSingleObject(*t, INFINITE);
+  CloseHandle(*t);
+}
+
+int sys_event_init (sys_event *e)
+{
+  *e = CreateEvent(NULL, FALSE, FALSE, NULL);
+  return *e != NULL;
+}
+
+void sys_event_free (sys_event *e)
+{
+  CloseHandle(*e);
+}
+
+void sys_event_set (sys_event *e)
+{
+  SetEvent(*e);
+}
+
+// wait for the event (a negative timeout waits forever); return 1 if it was
+// signaled, 0 on timeout; the event is reset by a successful wait
+int sys_event_wait (sys_event *e, int timeout_ms)
+{
+  return WaitForSingleObject(*e, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms) == WAIT_OBJECT_0;
+}
+
+void sys_mutex_init (sys_mutex *m)   { InitializeCriticalSection(m); }
+void sys_mutex_free (sys_mutex *m)   { DeleteCriticalSection(m); }
+void sys_mutex_lock (sys_mutex *m)   { EnterCriticalSection(m); }
+void sys_mutex_unlock (sys_mutex *m) { LeaveCriticalSection(m); }
+
+void sys_yield (void)                { Sleep(0); }
+
+#else
+
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+
+int sys_thread_start (sys_thread *t, sys_thread_proc proc, void *arg)
+{
+  return pthread_create(t, NULL, proc, arg) == 0;
+}
+
+void sys_thread_join (sys_thread *t)
+{
+  pthread_join(*t, NULL);
+}
+
+int sys_event_init (sys_event *e)
+{
+  e->set = 0;
+  if (pthread_mutex_init(&e->mtx, NULL))
+    return 0;
+  if (pthread_cond_init(&e->cond, NULL)) {
+    pthread_mutex_destroy(&e->mtx);
+    return 0;
+  }
+  return 1;
+}
+
+void sys_event_free (sys_event *e)
+{
+  pthread_cond_destroy(&e->cond);
+  pthread_mutex_destroy(&e->mtx);
+}
+
+void sys_event_set (sys_event *e)
+{
+  pthread_mutex_lock(&e->mtx);
+  e->set = 1;
+  pthread_cond_signal(&e->cond);
+  pthread_mutex_unlock(&e->mtx);
+}
+
+// wait for the event (a negative timeout waits forever); return 1 if it was
+// signaled, 0 on timeout; the event is reset by a successful wait
+int sys_event_wait (sys_event *e, int timeout_ms)
+{
+  int r = 0;
+  pthread_mutex_lock(&e->mtx);
+  if (timeout_ms < 0) {
+    while (!e->set)
+      pthread_cond_wait(&e->cond, &e->mtx);
+  }
+  else {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    while (!e->set && r != ETIMEDOUT)
+      r = pthread_cond_timedwait(&e->cond, &e->mtx, &ts);
+  }
+  r = e->set;
+  e->set = 0;
+  pthread_mutex_unlock(&e->mtx);
+  return r;
+}
+
+void sys_mutex_init (sys_mutex *m)   { pthread_mutex_init(m, NULL); }
+void sys_mutex_free (sys_mutex *m)   { pthread_mutex_destroy(m); }
+void sys_mutex_lock (sys_mutex *m)   { pthread_mutex_lock(m); }
+void sys_mutex_unlock (sys_mutex *m) { pthread_mutex_unlock(m); }
+
+void sys_yield (void)                { sched_yield(); }
+
+#endif
@@ -0,0 +1,45 @@
+// thread.h
+// Just enough threading for the library: threads, auto-reset events and a
+// mutex, on top of the Win32 API or pthreads.
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#ifdef _WIN32
+# include <windows.h>
+# define THREAD_PROC(name, arg)  DWORD WINAPI name (LPVOID arg)
+# define THREAD_RETURN           return 0
+typedef LPTHREAD_START_ROUTINE sys_thread_proc;
+typedef HANDLE sys_thread;
+typedef HANDLE sys_event;
+typedef CRITICAL_SECTION sys_mutex;
+#else
+# include <pthread.h>
+# define THREAD_PROC(name, arg)  void* name (void *arg)
+# define THREAD_RETURN           return NULL
+typedef void* (*sys_thread_proc) (void*);
+typedef pthread_t sys_thread;
+typedef struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  int set;
+} sys_event;
+typedef pthread_mutex_t sys_mutex;
+#endif
+
+int  sys_thread_start (sys_thread *t, sys_thread_proc proc, void *arg);
+void sys_thread_join  (sys_thread *t);
+
+int  sys_event_init   (sys_event *e);
+void sys_event_free   (sys_event *e);
+void sys_event_set    (sys_event *e);
+int  sys_event_wait   (sys_event *e, int timeout_ms);
+
+void sys_mutex_init   (sys_mutex *m);
+void sys_mutex_free   (sys_mutex *m);
+void sys_mutex_lock   (sys_mutex *m);
+void sys_mutex_unlock (sys_mutex *m);
+
+void sys_yield        (void);       // give up the rest of the time slice
+
+#endif
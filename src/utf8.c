@@ -0,0 +1,252 @@
+// utf8.c
+// UTF-8 to UTF-16 conversion for the wide console API, with SSE2/AVX2 fast
+// paths for runs of ASCII picked at run time.
+
+#include <string.h>
+#include "utf8.h"
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+# define UTF8_X86 1
+# include <immintrin.h>
+#endif
+
+#define INVALID 0xFFFFFFFFu
+
+// Decode one sequence; return the bytes it takes. An invalid sequence yields
+// INVALID and takes the bytes of its longest valid prefix (at least one), as
+// Unicode recommends.
+static size_t decode (const char *str, size_t len, unsigned *cp)
+{
+  const unsigned char *s = (const unsigned char*)str;
+  unsigned c, lo = 0x80, hi = 0xBF;
+  size_t need, i;
+
+  if (len == 0)
+    return 0;
+  c = s[0];
+  if (c < 0x80) {
+    *cp = c;
+    return 1;
+  }
+  if (c >= 0xC2 && c <= 0xDF) {
+    need = 1; c &= 0x1F;
+  }
+  else if (c >= 0xE0 && c <= 0xEF) {
+    need = 2; c &= 0x0F;
+    if (s[0] == 0xE0) lo = 0xA0;       // overlong
+    else if (s[0] == 0xED) hi = 0x9F;  // surrogates
+  }
+  else if (c >= 0xF0 && c <= 0xF4) {
+    need = 3; c &= 0x07;
+    if (s[0] == 0xF0) lo = 0x90;       // overlong
+    else if (s[0] == 0xF4) hi = 0x8F;  // above U+10FFFF
+  }
+  else {
+    *cp = INVALID;
+    return 1;
+  }
+  for (i=1; i<=need; i++) {
+    if (i >= len || s[i] < lo || s[i] > hi) {
+      *cp = INVALID;
+      return i;
+    }
+    c = c << 6 | (s[i] & 0x3F);
+    lo = 0x80; hi = 0xBF;
+  }
+  *cp = c;
+  return i;
+}
+
+size_t utf8_decode (const char *s, size_t len, unsigned *cp)
+{
+  size_t n = decode(s, len, cp);
+  if (*cp == INVALID)
+    *cp = UTF8_REPLACEMENT;
+  return n;
+}
+
+size_t utf8_encode (unsigned cp, char *out)
+{
+  unsigned char *o = (unsigned char*)out;
+  if ((cp >= 0xD800 && cp < 0xE000) || cp > 0x10FFFF)
+    cp = UTF8_REPLACEMENT;
+  if (cp < 0x80) {
+    o[0] = (unsigned char)cp;
+    return 1;
+  }
+  if (cp < 0x800) {
+    o[0] = (unsigned char)(0xC0 | cp >> 6);
+    o[1] = (unsigned char)(0x80 | (cp & 0x3F));
+    return 2;
+  }
+  if (cp < 0x10000) {
+    o[0] = (unsigned char)(0xE0 | cp >> 12);
+    o[1] = (unsigned char)(0x80 | (cp >> 6 & 0x3F));
+    o[2] = (unsigned char)(0x80 | (cp & 0x3F));
+    return 3;
+  }
+  o[0] = (unsigned char)(0xF0 | cp >> 18);
+  o[1] = (unsigned char)(0x80 | (cp >> 12 & 0x3F));
+  o[2] = (unsigned char)(0x80 | (cp >> 6 & 0x3F));
+  o[3] = (unsigned char)(0x80 | (cp & 0x3F));
+  return 4;
+}
+
+// convert one non-ASCII sequence; return bytes consumed, advance *o
+static size_t convert_one (const char *s, size_t len, unsigned short **o, size_t *bad)
+{
+  unsigned cp;
+  size_t n = decode(s, len, &cp);
+  if (cp == INVALID) {
+    cp = UTF8_REPLACEMENT;
+    (*bad)++;
+  }
+  if (cp >= 0x10000) {
+    cp -= 0x10000;
+    *(*o)++ = (unsigned short)(0xD800 | cp >> 10);
+    *(*o)++ = (unsigned short)(0xDC00 | (cp & 0x3FF));
+  }
+  else
+    *(*o)++ = (unsigned short)cp;
+  return n;
+}
+
+//---------------------------------------------------------------------------
+// scalar: the reference, and the tails of the vector loops
+//---------------------------------------------------------------------------
+static size_t convert_scalar (const char *s, size_t len, unsigned short *out, size_t *bad)
+{
+  unsigned short *o = out;
+  size_t i = 0;
+  while (i < len) {
+    if ((unsigned char)s[i] < 0x80)
+      *o++ = (unsigned char)s[i++];
+    else
+      i += convert_one(s + i, len - i, &o, bad);
+  }
+  return o - out;
+}
+
+#ifdef UTF8_X86
+//---------------------------------------------------------------------------
+// SSE2: 16 bytes per step. A block is widened and stored whole, then only its
+// leading ASCII part is kept; there is always room, as units never outrun
+// bytes. A run of non-ASCII text is decoded whole before going back to
+// blocks.
+//---------------------------------------------------------------------------
+__attribute__((target("sse2")))
+static size_t convert_sse2 (const char *s, size_t len, unsigned short *out, size_t *bad)
+{
+  const __m128i zero = _mm_setzero_si128();
+  unsigned short *o = out;
+  size_t i = 0;
+  while (i + 16 <= len) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(const void*)(s + i));
+    unsigned mask = _mm_movemask_epi8(v);
+    _mm_storeu_si128((__m128i*)(void*)o, _mm_unpacklo_epi8(v, zero));
+    _mm_storeu_si128((__m128i*)(void*)(o + 8), _mm_unpackhi_epi8(v, zero));
+    if (mask == 0) {
+      i += 16; o += 16;
+    }
+    else {
+      unsigned n = __builtin_ctz(mask);
+      i += n; o += n;
+      do
+        i += convert_one(s + i, len - i, &o, bad);
+      while (i < len && (unsigned char)s[i] >= 0x80);
+    }
+  }
+  return (o - out) + convert_scalar(s + i, len - i, o, bad);
+}
+
+//---------------------------------------------------------------------------
+// AVX2: 32 bytes per step, same scheme
+//---------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static size_t convert_avx2 (const char *s, size_t len, unsigned short *out, size_t *bad)
+{
+  unsigned short *o = out;
+  size_t i = 0;
+  while (i + 32 <= len) {
+    __m256i v = _mm256_loadu_si256((const __m256i*)(const void*)(s + i));
+    unsigned mask = (unsigned)_mm256_movemask_epi8(v);
+    __m128i lo = _mm256_castsi256_si128(v), hi = _mm256_extracti128_si256(v, 1);
+    _mm256_storeu_si256((__m256i*)(void*)o, _mm256_cvtepu8_epi16(lo));
+    _mm256_storeu_si256((__m256i*)(void*)(o + 16), _mm256_cvtepu8_epi16(hi));
+    if (mask == 0) {
+      i += 32; o += 32;
+    }
+    else {
+      unsigned n = __builtin_ctz(mask);
+      i += n; o += n;
+      do
+        i += convert_one(s + i, len - i, &o, bad);
+      while (i < len && (unsigned char)s[i] >= 0x80);
+    }
+  }
+  return (o - out) + convert_scalar(s + i, len - i, o, bad);
+}
+#endif // UTF8_X86
+
+//---------------------------------------------------------------------------
+// dispatch
+//---------------------------------------------------------------------------
+typedef struct {
+  const char *name;
+  size_t (*convert) (const char*, size_t, unsigned short*, size_t*);
+} utf8_impl;
+
+static const utf8_impl impls[] = {
+#ifdef UTF8_X86
+  { "avx2",   convert_avx2   },
+  { "sse2",   convert_sse2   },
+#endif
+  { "scalar", convert_scalar },
+};
+
+#define NIMPLS (int)(sizeof(impls) / sizeof(impls[0]))
+
+static const utf8_impl *impl = &impls[NIMPLS - 1];
+
+static int supported (const utf8_impl *p)
+{
+#ifdef UTF8_X86
+  __builtin_cpu_init();
+  if (!strcmp(p->name, "avx2")) return __builtin_cpu_supports("avx2");
+  if (!strcmp(p->name, "sse2")) return __builtin_cpu_supports("sse2");
+#endif
+  (void)p;
+  return 1;
+}
+
+// pick the fastest implementation this CPU can run
+void utf8_init (void)
+{
+  int i;
+  for (i=0; i<NIMPLS && !supported(&impls[i]); i++) {}
+  impl = &impls[i < NIMPLS ? i : NIMPLS - 1];
+}
+
+// force an implementation by name; return 0 if unknown or not supported
+int utf8_select (const char *name)
+{
+  int i;
+  for (i=0; i<NIMPLS; i++) {
+    if (!strcmp(impls[i].name, name) && supported(&impls[i])) {
+      impl = &impls[i];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char* utf8_backend (void)
+{
+  return impl->name;
+}
+
+size_t utf8_to_utf16 (const char *s, size_t len, unsigned short *out, size_t *bad)
+{
+  size_t dummy = 0;
+  return impl->convert(s, len, out, bad ? bad : &dummy);
+}
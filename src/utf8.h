@@ -0,0 +1,29 @@
+// utf8.h
+// UTF-8 to UTF-16 conversion for the wide console API, with SSE2/AVX2 fast
+// paths for runs of ASCII picked at run time.
+
+#ifndef UTF8_H
+#define UTF8_H
+
+#include <stddef.h>
+
+#define UTF8_REPLACEMENT  0xFFFD
+
+void        utf8_init    (void);
+int         utf8_select  (const char *name);
+const char* utf8_backend (void);
+
+// Convert 'len' bytes of UTF-8; 'out' must have room for 'len' units (never
+// more are produced). Each maximal invalid subsequence becomes U+FFFD and is
+// counted in *bad (if not NULL). Return the number of units written.
+size_t utf8_to_utf16 (const char *s, size_t len, unsigned short *out, size_t *bad);
+
+// Decode the first character of s; return its length in bytes (0 if len is
+// 0), with U+FFFD for an invalid sequence.
+size_t utf8_decode (const char *s, size_t len, unsigned *cp);
+
+// Encode code point cp (a lone surrogate becomes U+FFFD) into out, which
+// needs room for 4 bytes; return the number of bytes.
+size_t utf8_encode (unsigned cp, char *out);
+
+#endif
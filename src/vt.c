@@ -0,0 +1,298 @@
+// vt.c
+// VT/ANSI output: a frame of cells (or its difference from the previous
+// frame) encoded as one escape-sequence stream.
+
+#include <stdlib.h>
+#include <string.h>
+#include "vt.h"
+#include "cellops.h"
+#include "utf8.h"
+
+#define CELL_EQ(a, b)  ((a).Char == (b).Char && (a).Attributes == (b).Attributes)
+
+#define LEADING_BYTE    0x0100   // COMMON_LVB_LEADING_BYTE
+#define TRAILING_BYTE   0x0200   // COMMON_LVB_TRAILING_BYTE
+#define UNDERSCORE      0x8000   // COMMON_LVB_UNDERSCORE
+#define REVERSE_VIDEO   0x4000   // COMMON_LVB_REVERSE_VIDEO
+#define SGR_BITS        (0x00FF | UNDERSCORE | REVERSE_VIDEO)
+
+// room a single cell may take: a move, an SGR and a character
+#define CELL_ROOM  48
+
+void vt_init (vt_encoder *e)
+{
+  memset(e, 0, sizeof(*e));
+  vt_reset(e);
+}
+
+void vt_free (vt_encoder *e)
+{
+  free(e->data);
+  e->data = NULL;
+  e->len = e->cap = 0;
+}
+
+// forget the cursor and attributes, e.g. after output done past the encoder
+void vt_reset (vt_encoder *e)
+{
+  e->x = e->y = -1;
+  e->attr = -1;
+}
+
+static int reserve (vt_encoder *e, size_t n)
+{
+  if (e->len + n > e->cap) {
+    size_t cap = e->cap ? e->cap : 4096;
+    char *p;
+    while (cap < e->len + n)
+      cap *= 2;
+    if (!(p = (char*)realloc(e->data, cap)))
+      return 0;
+    e->data = p;
+    e->cap = cap;
+  }
+  return 1;
+}
+
+static char* put_uint (char *p, unsigned n)
+{
+  char tmp[12];
+  int i = 0;
+  do tmp[i++] = (char)('0' + n % 10); while (n /= 10);
+  while (i) *p++ = tmp[--i];
+  return p;
+}
+
+// CSI n final, with n left out when it is 1
+static char* put_csi (char *p, unsigned n, char final)
+{
+  *p++ = '\x1b'; *p++ = '[';
+  if (n != 1)
+    p = put_uint(p, n);
+  *p++ = final;
+  return p;
+}
+
+//---------------------------------------------------------------------------
+// cursor movement
+//---------------------------------------------------------------------------
+// Best way from column c (-1: not known) to column x on the same row.
+static char* put_horiz (char *p, int c, int x)
+{
+  char best[16], tmp[16], *b, *q;
+  if (c == x)
+    return p;
+  b = put_csi(best, x + 1, 'G');               // CHA
+  q = tmp; *q++ = '\r';                        // CR, CR+CUF
+  if (x > 0)
+    q = put_csi(q, x, 'C');
+  if (q - tmp < b - best) {
+    memcpy(best, tmp, q - tmp); b = best + (q - tmp);
+  }
+  if (c >= 0) {
+    if (x > c)
+      q = put_csi(tmp, x - c, 'C');            // CUF
+    else if (c - x <= 3) {
+      for (q=tmp; q - tmp < c - x; ) *q++ = '\b';
+    }
+    else
+      q = put_csi(tmp, c - x, 'D');            // CUB
+    if (q - tmp < b - best) {
+      memcpy(best, tmp, q - tmp); b = best + (q - tmp);
+    }
+  }
+  memcpy(p, best, b - best);
+  return p + (b - best);
+}
+
+// Write into p the shortest sequence taking the cursor to (x, y); return
+// its end.
+static char* put_move (const vt_encoder *e, char *p, int x, int y)
+{
+  char best[32], tmp[32], *b = best, *q;
+
+  // CUP always works
+  *b++ = '\x1b'; *b++ = '[';
+  if (y > 0 || x > 0)
+    b = put_uint(b, y + 1);
+  if (x > 0) {
+    *b++ = ';';
+    b = put_uint(b, x + 1);
+  }
+  *b++ = 'H';
+
+  if (e->y >= 0) {
+    int dy = y - e->y;
+    if (dy == 0)
+      q = put_horiz(tmp, e->x, x);
+    else if (dy > 0) {
+      q = put_horiz(put_csi(tmp, dy, 'B'), e->x, x);    // CUD
+      if (q - tmp < b - best) {
+        memcpy(best, tmp, q - tmp); b = best + (q - tmp);
+      }
+      if (dy <= 4) {                                    // CR LF ...
+        int i;
+        for (q=tmp, i=0; i<dy; i++) { *q++ = '\r'; *q++ = '\n'; }
+        q = put_horiz(q, 0, x);
+      }
+    }
+    else
+      q = put_horiz(put_csi(tmp, -dy, 'A'), e->x, x);   // CUU
+    if (q - tmp < b - best) {
+      memcpy(best, tmp, q - tmp); b = best + (q - tmp);
+    }
+  }
+  memcpy(p, best, b - best);
+  return p + (b - best);
+}
+
+//---------------------------------------------------------------------------
+// attributes
+//---------------------------------------------------------------------------
+// console colour bits (blue, green, red) to an ANSI colour number
+static unsigned ansi_color (unsigned c)
+{
+  return (c & 1 ? 4 : 0) | (c & 2) | (c & 4 ? 1 : 0);
+}
+
+static char* put_param (char *p, unsigned n, int *first)
+{
+  if (!*first)
+    *p++ = ';';
+  *first = 0;
+  return put_uint(p, n);
+}
+
+// SGR for a change from 'prev' (-1: not known) to 'next'
+static char* put_sgr (char *p, int prev, int next)
+{
+  int first = 1, diff;
+  *p++ = '\x1b'; *p++ = '[';
+  if (prev < 0) {
+    // after SGR 0 the colours are the terminal's defaults: set both
+    p = put_param(p, 0, &first);
+    diff = (0x07 ^ next) | 0xFF;
+  }
+  else
+    diff = prev ^ next;
+  if (diff & 0x0F)
+    p = put_param(p, (next & 0x08 ? 90 : 30) + ansi_color(next), &first);
+  if (diff & 0xF0)
+    p = put_param(p, (next & 0x80 ? 100 : 40) + ansi_color(next >> 4), &first);
+  if (diff & UNDERSCORE)
+    p = put_param(p, next & UNDERSCORE ? 4 : 24, &first);
+  if (diff & REVERSE_VIDEO)
+    p = put_param(p, next & REVERSE_VIDEO ? 7 : 27, &first);
+  *p++ = 'm';
+  return p;
+}
+
+//---------------------------------------------------------------------------
+// cells
+//---------------------------------------------------------------------------
+// Code point of the cell at row[x] and the number of cells it covers.
+static unsigned cell_char (const cell_t *row, int x, int width, int *adv)
+{
+  unsigned c = row[x].Char;
+  *adv = 1;
+  if ((row[x].Attributes & LEADING_BYTE) && x + 1 < width)
+    *adv = 2;
+  if (c >= 0xD800 && c < 0xDC00 && x + 1 < width &&
+      row[x+1].Char >= 0xDC00 && row[x+1].Char < 0xE000) {
+    c = 0x10000 + ((c - 0xD800) << 10) + (row[x+1].Char - 0xDC00);
+    *adv = 2;
+  }
+  else if (c < 0x20 || c == 0x7F)
+    c = ' ';
+  return c;
+}
+
+// Emit the cell at row[x]; return the next column.
+static int put_cell (vt_encoder *e, const cell_t *row, int x, int width, int x0)
+{
+  int adv, attr = row[x].Attributes & SGR_BITS;
+  unsigned c = cell_char(row, x, width, &adv);
+  char *p = e->data + e->len;
+  if (attr != e->attr) {
+    p = put_sgr(p, e->attr, attr);
+    e->attr = attr;
+    e->stats.sgr++;
+  }
+  p += utf8_encode(c, p);
+  e->len = p - e->data;
+  e->stats.cells++;
+  // the terminal's idea of the width of anything beyond the simple
+  // alphabets, and the column after the last one, are not known
+  if ((c >= 0x1100 && adv == 1) || x + adv >= width)
+    e->x = -1;
+  else
+    e->x = x0 + x + adv;
+  return x + adv;
+}
+
+// If the cells [from, to) can be written out again in the current
+// attributes in no more than 'limit' bytes, do so and return 1.
+static int put_gap (vt_encoder *e, const cell_t *row, int from, int to, int width, size_t limit)
+{
+  char buf[64];
+  size_t n = 0;
+  int x, adv;
+  if (limit > sizeof(buf) - 4)
+    limit = sizeof(buf) - 4;
+  for (x=from; x<to; x += adv) {
+    unsigned c = cell_char(row, x, width, &adv);
+    if ((row[x].Attributes & SGR_BITS) != e->attr || c >= 0x1100 || adv != 1)
+      return 0;
+    n += utf8_encode(c, buf + n);
+    if (n > limit)
+      return 0;
+  }
+  memcpy(e->data + e->len, buf, n);
+  e->len += n;
+  e->x += to - from;
+  e->stats.cells += to - from;
+  return 1;
+}
+
+// Append to the stream what turns the screen at (x0, y0) from 'front' into
+// 'back' (both the same size); with 'front' NULL all of 'back' is written.
+// Return 0 if out of memory.
+int vt_encode (vt_encoder *e, const cellbuf *back, const cellbuf *front, int x0, int y0)
+{
+  size_t start = e->len;
+  int x, y, w = back->width;
+  for (y=0; y<back->height; y++) {
+    const cell_t *b = CELLBUF_AT(back, 0, y);
+    const cell_t *f = front ? CELLBUF_AT(front, 0, y) : NULL;
+    size_t first = 0, last = w - 1;
+    if (f && !cellops_compare(f, b, w, &first, &last))
+      continue;
+    if (!reserve(e, (last - first + 1) * CELL_ROOM + CELL_ROOM))
+      return 0;
+    for (x=(int)first; x<=(int)last; ) {
+      if (f && CELL_EQ(f[x], b[x])) {
+        x++;
+        continue;
+      }
+      // the second half of a wide character goes out with the first
+      if ((b[x].Attributes & TRAILING_BYTE) && x > 0 && (b[x-1].Attributes & LEADING_BYTE))
+        x--;
+      if (e->y != y0 + y || e->x != x0 + x) {
+        char mv[32];
+        size_t n = put_move(e, mv, x0 + x, y0 + y) - mv;
+        if (!(e->y == y0 + y && e->x >= x0 && e->x < x0 + x &&
+              put_gap(e, b, e->x - x0, x, w, n))) {
+          memcpy(e->data + e->len, mv, n);
+          e->len += n;
+          e->x = x0 + x;
+          e->y = y0 + y;
+          e->stats.moves++;
+        }
+      }
+      x = put_cell(e, b, x, w, x0);
+    }
+  }
+  e->stats.frames++;
+  e->stats.bytes += e->len - start;
+  return 1;
+}
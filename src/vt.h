@@ -0,0 +1,39 @@
+// vt.h
+// VT/ANSI output: a frame of cells (or its difference from the previous
+// frame) encoded as one escape-sequence stream, for a console with
+// ENABLE_VIRTUAL_TERMINAL_PROCESSING or any xterm-like terminal.
+
+#ifndef VT_H
+#define VT_H
+
+#include "cells.h"
+
+// Characters are taken as UTF-16 units (surrogate pairs spanning two cells
+// are joined) and written as UTF-8. Attributes map to SGR: the 16 console
+// colours to 30-37/90-97 and 40-47/100-107, COMMON_LVB_UNDERSCORE to 4 and
+// COMMON_LVB_REVERSE_VIDEO to 7. The encoder remembers where the cursor is
+// and which attributes are in effect, so each move is the shortest of CUP,
+// CUF/CUB/CUD/CUU, CHA, CR/LF and rewriting the cells in between, and an
+// SGR is only sent for what has changed.
+typedef struct {
+  unsigned long frames;   // vt_encode() calls
+  unsigned long bytes;    // bytes produced
+  unsigned long cells;    // cells written
+  unsigned long moves;    // cursor movements
+  unsigned long sgr;      // attribute changes
+} vt_stats;
+
+typedef struct {
+  char *data;           // the stream: data[0..len)
+  size_t len, cap;
+  int x, y;             // cursor on the screen; -1 if not known
+  int attr;             // attributes in effect; -1 if not known
+  vt_stats stats;
+} vt_encoder;
+
+void vt_init   (vt_encoder *e);
+void vt_free   (vt_encoder *e);
+void vt_reset  (vt_encoder *e);
+int  vt_encode (vt_encoder *e, const cellbuf *back, const cellbuf *front, int x0, int y0);
+
+#endif
@@ -0,0 +1,21 @@
+// width.h
+// Display width of code points in console cells: 0 for combining marks and
+// format and control characters, 2 for East Asian Wide and Fullwidth ones,
+// 1 for the rest (Ambiguous included). The table, in widthtab.c, is
+// generated by makewidth.lua from the Unicode Character Database.
+
+#ifndef WIDTH_H
+#define WIDTH_H
+
+#define WIDTH_BLOCKS  0x1100    // blocks of 256 code points
+
+// stage 1: the stage 2 block of each 256 code points; stage 2: 2 bits per
+// code point, the lowest bits for the lowest one
+extern const unsigned char width_stage1[WIDTH_BLOCKS];
+extern const unsigned char width_stage2[][64];
+
+#define UNICODE_WIDTH(cp) \
+  ((cp) < 0x110000 ? width_stage2[width_stage1[(cp) >> 8]][((cp) & 0xFF) >> 2] \
+                     >> (((cp) & 3) << 1) & 3 : 1)
+
+#endif
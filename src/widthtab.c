@@ -0,0 +1,1063 @@
+// widthtab.c
+// Generated by makewidth.lua from EastAsianWidth.txt and UnicodeData.txt
+// of Unicode 14.0.0; do not edit.
+
+#include "width.h"
+
+const unsigned char width_stage1[WIDTH_BLOCKS] = {
+  0,1,1,2,3,4,5,6,7,8,9,10,11,12,13,14,
+  15,16,17,18,1,1,19,20,21,22,23,24,25,26,1,27,
+  28,29,1,30,31,32,33,34,1,1,1,35,36,37,38,39,
+  40,39,41,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,42,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,43,1,44,45,46,47,48,49,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,50,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,39,39,51,1,52,53,54,
+  55,56,57,58,59,60,1,61,62,63,64,65,66,67,68,69,
+  70,71,72,73,74,75,76,77,78,79,80,39,81,82,83,84,
+  1,1,1,85,86,87,39,39,39,39,39,39,39,39,39,88,
+  1,1,1,1,89,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,1,1,90,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,1,1,91,92,39,39,93,94,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,95,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,96,
+  97,98,99,100,101,102,103,104,1,1,105,39,39,39,39,106,
+  107,108,109,39,39,39,39,110,111,112,39,39,113,114,115,39,
+  116,117,39,118,119,120,121,122,123,124,125,126,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  127,128,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,39,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,129,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,129,
+};
+
+const unsigned char width_stage2[][64] = {
+  {
+    0,0,0,0,0,0,0,0,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,21,
+    0,0,0,0,0,0,0,0,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,85,85,90,85,
+    170,85,149,89,85,85,85,85,101,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    21,0,80,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,86,85,85,85,
+    85,85,85,85,85,149,86,85,85,85,85,85,85,85,85,85,
+    85,85,149,86,2,0,0,0,0,0,0,0,0,0,0,16,
+    65,16,170,170,85,85,85,85,85,85,149,106,85,169,170,170,
+  },
+  {
+    0,80,85,85,0,0,64,84,85,85,85,85,85,85,85,85,
+    85,85,21,0,0,0,0,0,85,85,85,85,84,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,5,0,16,0,20,4,80,85,85,85,85,
+  },
+  {
+    85,85,85,37,81,85,85,85,85,85,85,85,0,0,0,0,
+    0,0,128,86,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,5,0,0,164,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,21,0,0,85,149,82,
+  },
+  {
+    85,85,85,85,85,5,16,0,0,1,1,160,85,85,85,149,
+    85,85,85,85,85,85,1,154,85,85,149,170,85,85,85,85,
+    85,85,85,149,160,170,0,0,85,85,85,85,85,85,85,85,
+    85,85,5,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  },
+  {
+    64,85,85,85,85,85,85,85,85,85,85,85,85,85,69,84,
+    1,0,84,81,1,0,85,85,5,85,85,85,85,85,85,85,
+    81,86,85,105,105,85,85,85,85,85,89,85,153,90,165,84,
+    1,104,105,145,170,106,170,101,5,90,85,85,85,85,85,133,
+  },
+  {
+    66,86,149,106,105,85,85,85,85,85,89,85,89,150,165,88,
+    129,42,40,160,162,170,86,153,170,90,85,85,80,145,170,170,
+    66,86,85,101,101,85,85,85,85,85,89,85,89,86,165,84,
+    1,32,100,161,169,170,170,170,5,90,85,85,165,170,6,0,
+  },
+  {
+    82,86,85,105,105,85,85,85,85,85,89,85,89,86,165,20,
+    1,104,105,161,170,66,170,101,5,90,85,85,85,85,170,170,
+    74,86,149,90,89,165,150,89,106,169,149,90,85,85,165,90,
+    148,90,89,161,169,106,170,170,170,90,85,85,85,85,149,170,
+  },
+  {
+    84,84,85,89,89,85,85,85,85,85,89,85,85,85,165,4,
+    84,9,8,160,170,130,149,166,5,90,85,85,170,106,85,85,
+    81,85,85,89,89,85,85,85,85,85,89,85,85,86,165,20,
+    85,73,89,160,170,150,170,150,5,90,85,85,150,170,170,170,
+  },
+  {
+    80,85,85,89,89,85,85,85,85,85,85,85,85,85,21,84,
+    1,88,89,81,170,85,85,85,5,90,85,85,85,85,85,85,
+    82,86,85,85,85,149,90,85,85,85,85,85,101,85,85,166,
+    85,149,138,106,5,136,85,85,170,90,85,85,90,169,170,170,
+  },
+  {
+    86,85,85,85,85,85,85,85,85,85,85,85,81,0,128,106,
+    85,21,0,64,85,85,85,170,170,170,170,170,170,170,170,170,
+    150,89,149,85,85,85,85,85,85,102,85,85,81,0,0,164,
+    85,153,0,160,85,85,165,85,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,80,85,85,85,85,85,85,17,81,85,
+    85,85,86,85,85,85,85,85,85,85,85,169,2,0,0,64,
+    0,4,85,1,0,0,2,0,0,0,0,0,0,0,0,88,
+    85,69,85,89,85,85,149,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,1,4,0,65,65,
+    85,85,85,85,85,85,80,5,84,85,85,85,1,84,85,85,
+    69,65,85,81,85,85,85,81,85,85,85,85,85,85,85,85,
+    85,101,170,166,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,89,165,85,149,89,165,85,85,85,85,85,85,85,85,
+    85,85,89,165,85,85,85,85,85,85,85,85,89,165,85,149,
+    89,165,85,85,85,149,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,89,165,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,149,2,85,85,85,85,85,85,85,169,
+    85,85,85,85,85,85,165,170,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,165,85,165,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,169,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,169,170,
+  },
+  {
+    85,85,85,85,5,164,170,106,85,85,85,85,5,149,170,170,
+    85,85,85,85,5,170,170,170,85,85,85,89,9,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,16,0,80,
+    85,69,1,0,0,85,85,161,85,85,165,170,85,85,165,170,
+  },
+  {
+    85,85,21,0,85,85,165,170,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,169,170,
+    85,65,85,85,85,85,85,85,85,85,145,170,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,165,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,149,64,21,84,170,69,85,1,170,
+    169,85,85,85,85,85,85,85,85,85,85,165,85,169,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,170,85,85,85,85,
+    85,85,165,170,85,85,149,90,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,21,20,90,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,69,0,128,68,1,0,84,21,0,0,40,
+    85,85,165,170,85,85,165,170,85,85,85,165,0,0,0,0,
+    0,0,0,128,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    0,85,85,85,85,85,85,85,85,85,85,85,85,4,64,84,
+    69,85,85,169,85,85,85,85,85,85,21,0,0,85,85,149,
+    80,85,85,85,85,85,85,85,5,80,16,80,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,69,80,17,80,170,170,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,0,0,5,106,85,
+    85,85,165,86,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,169,170,85,85,85,85,85,85,85,85,85,85,149,86,
+    85,85,170,170,64,0,0,0,4,0,84,81,85,84,144,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  },
+  {
+    85,85,85,85,85,165,85,165,85,85,85,85,85,85,85,85,
+    85,165,85,165,85,85,102,102,85,85,85,85,85,85,85,165,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,89,85,85,
+    85,89,85,85,85,90,85,86,85,85,85,85,90,89,85,149,
+  },
+  {
+    85,85,21,0,85,85,85,85,85,85,5,64,85,85,85,85,
+    85,85,85,85,85,85,85,85,0,8,0,0,165,85,85,85,
+    85,85,85,149,85,85,85,169,85,85,85,85,85,85,85,85,
+    169,170,170,170,0,0,0,0,0,0,0,0,168,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,170,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,165,85,85,85,105,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,169,86,150,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,149,170,170,170,170,170,170,
+    85,85,149,170,170,170,170,170,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,105,
+  },
+  {
+    85,85,85,85,85,90,85,85,85,85,85,85,85,85,85,85,
+    85,85,170,170,170,85,85,85,85,85,85,85,85,85,85,149,
+    85,85,85,85,149,85,85,85,89,85,165,85,85,85,85,105,
+    85,90,85,101,85,86,85,85,85,85,101,85,165,89,101,89,
+  },
+  {
+    85,89,165,85,85,85,85,85,85,85,86,85,85,85,85,85,
+    85,85,85,102,149,154,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,169,85,85,85,85,85,85,86,85,85,149,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,149,86,85,85,85,85,85,85,85,85,
+    85,85,85,85,86,89,85,85,85,85,85,85,85,90,85,85,
+    85,85,85,85,85,101,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,21,80,170,86,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,101,170,166,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,170,106,169,170,170,42,
+    85,85,85,85,85,149,170,170,85,149,85,149,85,149,85,149,
+    85,149,85,149,85,149,85,149,0,0,0,0,0,0,0,0,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,165,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,10,160,170,170,170,106,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,130,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,85,85,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,21,64,0,0,80,
+    85,85,85,85,85,85,85,5,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,80,85,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,149,170,101,86,165,170,170,170,170,170,90,85,85,85,
+  },
+  {
+    69,69,21,85,85,85,85,85,85,65,85,168,85,85,165,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,160,170,90,85,85,165,170,0,0,0,0,80,85,85,21,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,5,0,80,85,85,85,85,
+    85,21,0,0,80,170,170,106,170,170,170,170,170,170,170,170,
+    64,85,85,85,85,85,85,85,85,85,85,85,21,5,80,80,
+    85,85,85,101,85,85,165,90,85,81,85,85,85,85,85,149,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,1,64,65,129,170,170,
+    21,85,85,164,85,85,165,85,85,85,85,85,85,85,85,84,
+    85,85,85,85,85,85,85,85,85,85,85,85,4,20,84,5,
+    145,170,170,170,170,170,106,85,85,85,85,80,85,133,170,170,
+  },
+  {
+    86,149,86,149,86,149,170,170,85,149,85,149,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,170,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,81,84,161,85,85,165,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,85,85,85,85,
+    85,149,106,85,85,85,85,85,85,85,85,85,85,85,85,170,
+  },
+  {
+    85,149,170,170,106,85,170,70,85,85,85,85,85,149,85,153,
+    101,89,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    149,170,170,170,106,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,90,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,170,106,170,170,170,170,170,170,170,170,85,85,85,85,
+  },
+  {
+    0,0,0,0,170,170,170,170,0,0,0,0,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,85,89,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,41,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,86,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,149,
+    90,85,90,85,90,85,90,169,170,170,85,149,170,170,2,165,
+  },
+  {
+    85,85,85,86,85,85,85,85,85,149,85,85,85,85,149,101,
+    85,85,85,165,85,85,85,165,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,149,170,
+  },
+  {
+    149,106,85,85,85,85,85,85,85,85,85,85,85,106,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,149,85,85,85,169,169,170,170,170,170,170,170,170,
+    170,170,170,170,85,85,85,85,85,85,85,85,85,85,85,161,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,169,85,85,85,85,85,85,85,85,
+    85,85,85,85,169,170,170,170,84,85,85,85,85,85,85,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,170,170,86,85,85,85,85,
+    85,85,149,170,85,85,85,85,85,85,85,85,85,5,128,170,
+    85,85,85,85,85,85,85,101,85,85,85,85,85,85,85,85,
+    85,170,85,85,85,165,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,165,85,85,165,170,85,85,85,85,
+    85,85,85,85,85,170,85,85,85,85,85,85,85,85,85,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,170,170,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,170,170,106,85,85,149,85,
+    85,85,149,85,149,101,85,85,101,85,85,85,101,85,101,169,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,149,170,170,
+    85,85,85,85,85,165,170,170,85,85,170,170,170,170,170,170,
+    85,101,85,85,85,85,85,85,85,85,85,85,89,85,149,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,165,89,85,85,85,85,85,85,85,85,85,85,101,169,105,
+    85,85,85,85,85,101,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,149,170,106,85,85,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,85,85,149,165,106,85,
+  },
+  {
+    85,85,85,85,85,85,85,106,85,85,85,85,85,85,165,106,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,170,85,
+    85,85,85,85,90,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    1,130,170,0,85,86,86,85,85,85,85,85,85,165,128,42,
+    85,85,169,170,85,85,169,170,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,129,106,85,85,149,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,165,86,85,
+    85,85,85,85,85,165,85,85,85,85,85,85,149,170,85,85,
+    85,85,85,85,165,170,86,169,170,170,86,85,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,169,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,149,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,149,170,90,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,0,170,170,85,85,165,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,85,85,85,85,85,149,
+    85,85,85,85,85,85,85,85,85,85,37,164,165,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,170,170,85,85,85,85,
+    85,5,0,0,84,85,165,170,170,170,170,170,85,85,85,85,
+    5,80,165,170,170,170,170,170,170,170,170,170,85,85,85,85,
+    85,85,85,170,170,170,170,170,85,85,85,85,85,149,170,170,
+  },
+  {
+    81,85,85,85,85,85,85,85,85,85,85,85,85,85,0,0,
+    0,64,85,165,90,85,85,85,85,85,85,85,20,164,170,42,
+    80,85,85,85,85,85,85,85,85,85,85,85,21,64,65,81,
+    133,170,170,162,85,85,85,85,85,85,169,170,85,85,165,170,
+  },
+  {
+    64,85,85,85,85,85,85,85,85,21,0,1,0,88,85,85,
+    85,85,170,170,85,85,85,85,85,85,85,85,21,149,170,170,
+    80,85,85,85,85,85,85,85,85,85,85,85,85,5,0,64,
+    85,85,1,20,85,85,85,85,86,85,85,85,85,169,170,170,
+  },
+  {
+    85,85,85,85,101,85,85,85,85,85,85,21,80,4,85,133,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,149,89,101,85,85,85,101,85,85,165,170,85,85,85,85,
+    85,85,85,85,85,85,85,21,21,0,128,170,85,85,165,170,
+  },
+  {
+    80,86,85,105,105,85,85,85,85,85,89,85,89,86,37,84,
+    84,105,105,165,169,106,170,86,85,10,0,168,0,168,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,0,0,
+    5,68,85,85,85,85,85,70,165,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,21,0,68,21,
+    4,85,170,170,85,85,165,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,5,160,85,16,
+    84,85,85,85,85,85,85,160,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,21,0,64,17,
+    84,169,170,170,85,85,165,170,85,85,85,169,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,21,81,0,16,165,170,
+    85,85,165,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,149,2,5,16,0,170,85,85,85,85,
+    85,149,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,21,0,0,65,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,149,170,170,106,
+  },
+  {
+    85,149,166,85,85,150,85,85,85,85,85,85,85,101,41,68,
+    21,149,170,170,85,85,165,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,90,85,85,85,85,85,
+    85,85,85,85,85,0,10,85,84,169,170,170,170,170,170,170,
+  },
+  {
+    1,0,64,85,85,85,85,85,85,85,85,85,21,0,20,64,
+    85,21,170,170,1,64,1,85,85,85,85,85,85,85,85,85,
+    85,85,5,0,0,64,80,85,149,170,170,170,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,169,170,
+  },
+  {
+    85,85,89,85,85,85,85,85,85,85,85,85,0,128,0,16,
+    85,165,170,170,85,85,85,85,85,85,85,169,85,85,85,85,
+    85,85,85,85,10,0,0,0,0,0,6,0,4,129,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,149,101,85,85,85,85,85,85,85,85,85,1,128,138,32,
+    0,16,170,170,85,85,165,170,85,101,89,85,85,85,85,85,
+    85,85,85,149,96,17,169,170,85,85,165,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,85,85,21,84,169,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,169,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,165,170,170,106,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,165,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,149,85,169,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,149,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,149,0,0,168,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,149,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,169,170,
+    85,85,85,85,85,85,85,149,85,85,165,90,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,149,
+    85,85,165,170,85,85,85,85,85,85,85,165,0,164,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,0,64,85,85,
+    85,165,170,170,85,85,101,85,101,85,85,85,85,85,170,86,
+    85,85,85,85,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,149,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,149,42,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,170,42,64,85,85,85,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,168,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,149,170,85,85,85,169,
+    85,85,169,170,85,85,165,65,0,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    0,0,0,0,0,0,0,0,0,0,0,160,0,0,0,0,
+    0,128,170,170,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,165,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,149,86,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,21,80,85,21,0,0,0,
+    64,1,0,85,85,85,85,85,85,85,5,80,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,149,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    5,164,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,85,85,85,85,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,149,170,170,85,85,85,85,85,85,169,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,89,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,89,154,150,86,89,85,85,101,86,
+    85,86,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,101,149,86,85,89,85,89,85,85,85,85,85,85,101,149,
+    85,153,90,85,89,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,165,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,90,85,85,85,85,85,85,85,85,85,85,85,85,
+  },
+  {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,64,21,0,
+    0,0,0,0,0,0,0,0,0,0,0,84,85,81,85,85,
+    85,84,85,170,170,170,42,0,2,0,0,0,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,149,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    0,128,0,0,0,0,40,0,32,8,128,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,169,0,64,85,165,
+    85,85,165,90,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,85,85,85,85,85,85,85,133,170,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,0,85,85,165,106,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,85,149,85,150,85,85,85,149,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,105,85,85,0,128,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,0,64,170,85,85,165,90,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,86,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,169,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    86,85,85,85,85,85,85,85,85,85,85,85,85,85,85,165,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,86,85,85,85,85,85,85,150,105,86,85,149,85,102,170,
+    154,106,102,86,150,105,102,102,150,105,149,85,149,85,86,153,
+    85,85,101,85,85,85,85,170,86,86,101,85,85,85,85,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,165,170,170,170,
+  },
+  {
+    85,86,85,85,85,85,85,85,85,85,85,170,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,170,170,170,85,85,85,149,86,85,85,85,
+    86,85,85,149,86,85,85,85,85,85,85,85,85,165,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,101,169,170,106,85,85,85,85,165,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,90,85,85,85,85,85,85,
+  },
+  {
+    170,170,170,170,170,170,170,170,86,85,85,169,170,154,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,166,
+    170,170,170,170,170,85,85,85,170,170,170,170,170,170,170,170,
+    170,170,106,149,170,85,85,85,170,170,170,170,86,86,170,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,106,
+    166,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,150,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,90,
+    85,85,149,106,170,170,170,170,170,170,85,85,85,85,101,85,
+    85,85,85,85,85,105,85,85,85,86,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,149,170,
+  },
+  {
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,85,85,85,85,85,85,85,85,85,85,85,85,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,90,85,86,106,169,170,170,85,85,149,170,85,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,170,170,170,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,169,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,170,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,170,170,85,85,165,170,85,85,85,85,85,85,85,85,
+    85,85,170,170,85,85,85,85,85,85,85,165,165,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,170,170,170,170,170,170,170,170,170,170,170,106,170,
+    170,154,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,170,170,170,85,85,85,165,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,149,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,149,170,170,170,170,170,170,170,170,170,85,85,165,170,
+  },
+  {
+    162,170,170,170,170,170,170,170,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+    170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,170,
+  },
+  {
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+    0,0,0,0,0,0,0,0,0,0,0,0,170,170,170,170,
+  },
+  {
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,
+    85,85,85,85,85,85,85,85,85,85,85,85,85,85,85,165,
+  },
+};
@@ -0,0 +1,80 @@
+// winport.h
+// The Win32 console types used by the portable modules: <windows.h> itself on
+// Windows, a layout-compatible subset elsewhere (for benchmarks and tests).
+
+#ifndef WINPORT_H
+#define WINPORT_H
+
+#ifdef _WIN32
+# include <windows.h>
+#else
+
+typedef int            BOOL;
+typedef char           CHAR;
+typedef short          SHORT;
+typedef unsigned short WORD;
+typedef unsigned short WCHAR;   // UTF-16, unlike wchar_t here
+typedef unsigned int   UINT;
+typedef unsigned int   DWORD;   // 32 bits, as on Windows
+
+typedef struct {
+  SHORT X;
+  SHORT Y;
+} COORD;
+
+typedef struct {
+  BOOL bKeyDown;
+  WORD wRepeatCount;
+  WORD wVirtualKeyCode;
+  WORD wVirtualScanCode;
+  union {
+    WCHAR UnicodeChar;
+    CHAR AsciiChar;
+  } uChar;
+  DWORD dwControlKeyState;
+} KEY_EVENT_RECORD;
+
+typedef struct {
+  COORD dwMousePosition;
+  DWORD dwButtonState;
+  DWORD dwControlKeyState;
+  DWORD dwEventFlags;
+} MOUSE_EVENT_RECORD;
+
+typedef struct {
+  COORD dwSize;
+} WINDOW_BUFFER_SIZE_RECORD;
+
+typedef struct {
+  UINT dwCommandId;
+} MENU_EVENT_RECORD;
+
+typedef struct {
+  BOOL bSetFocus;
+} FOCUS_EVENT_RECORD;
+
+typedef struct {
+  WORD EventType;
+  union {
+    KEY_EVENT_RECORD KeyEvent;
+    MOUSE_EVENT_RECORD MouseEvent;
+    WINDOW_BUFFER_SIZE_RECORD WindowBufferSizeEvent;
+    MENU_EVENT_RECORD MenuEvent;
+    FOCUS_EVENT_RECORD FocusEvent;
+  } Event;
+} INPUT_RECORD;
+
+#define KEY_EVENT                 0x0001
+#define MOUSE_EVENT               0x0002
+#define WINDOW_BUFFER_SIZE_EVENT  0x0004
+#define MENU_EVENT                0x0008
+#define FOCUS_EVENT               0x0010
+
+#define MOUSE_MOVED               0x0001
+#define DOUBLE_CLICK              0x0002
+#define MOUSE_WHEELED             0x0004
+#define MOUSE_HWHEELED            0x0008
+
+#endif // _WIN32
+
+#endif
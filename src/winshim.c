@@ -0,0 +1,915 @@
+// winshim.c
+// An in-memory console behind the Win32 console API: see winshim.h.
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "winshim.h"
+#include "thread.h"
+
+#define MAX_SCREENS   8
+#define QUEUE_SIZE    4096
+
+typedef struct {
+  int used;
+  int width, height;
+  CHAR_INFO *cells;
+  CHAR_INFO *scratch;      // for ScrollConsoleScreenBuffer
+  COORD cursor;
+  SMALL_RECT window;       // the part of the buffer shown
+  CONSOLE_CURSOR_INFO cursor_info;
+  WORD attr;
+  DWORD mode;
+} screen;
+
+typedef struct {
+  INPUT_RECORD queue[QUEUE_SIZE];
+  DWORD head, count;
+  int endless;
+  DWORD mode;
+  sys_mutex lock;
+  sys_event ready;         // set when records are queued
+  char line[256];          // line input read but not yet returned
+  DWORD line_len, line_pos;
+} input;
+
+static screen screens[MAX_SCREENS];
+static screen *active;     // the one shown
+static input in;
+static HANDLE std_handles[3];
+static int initialized;
+static int default_width = 80, default_height = 25;
+static UINT input_cp = 437, output_cp = 437;
+static char title[256] = "";
+static winshim_stats stats;
+
+//---------------------------------------------------------------------------
+// objects
+//---------------------------------------------------------------------------
+// Keep the window inside the buffer: moved back in, then cut to its size.
+static void clamp_window (screen *s)
+{
+  SMALL_RECT *w = &s->window;
+  if (w->Right >= s->width) {
+    w->Left = (SHORT)(w->Left - (w->Right - s->width + 1));
+    w->Right = (SHORT)(s->width - 1);
+  }
+  if (w->Bottom >= s->height) {
+    w->Top = (SHORT)(w->Top - (w->Bottom - s->height + 1));
+    w->Bottom = (SHORT)(s->height - 1);
+  }
+  if (w->Left < 0) w->Left = 0;
+  if (w->Top < 0) w->Top = 0;
+}
+
+// (Re)size the buffer; what fits of the old cells stays, as the console keeps
+// them, and the cursor and the window are kept inside.
+static int screen_alloc (screen *s, int width, int height)
+{
+  size_t n = (size_t)width * height, i;
+  CHAR_INFO *cells = (CHAR_INFO*)malloc(n * sizeof(CHAR_INFO));
+  CHAR_INFO *scratch = (CHAR_INFO*)malloc(n * sizeof(CHAR_INFO));
+  int y;
+  if (!cells || !scratch) {
+    free(cells);
+    free(scratch);
+    return 0;
+  }
+  for (i=0; i<n; i++) {
+    cells[i].Char.UnicodeChar = ' ';
+    cells[i].Attributes = 0x07;
+  }
+  for (y=0; s->cells && y<height && y<s->height; y++)
+    memcpy(cells + (size_t)y * width, s->cells + (size_t)y * s->width,
+      (width < s->width ? width : s->width) * sizeof(CHAR_INFO));
+  free(s->cells);
+  free(s->scratch);
+  s->cells = cells;
+  s->scratch = scratch;
+  s->width = width;
+  s->height = height;
+  if (s->cursor.X >= width) s->cursor.X = (SHORT)(width - 1);
+  if (s->cursor.Y >= height) s->cursor.Y = (SHORT)(height - 1);
+  clamp_window(s);
+  return 1;
+}
+
+static void screen_free (screen *s)
+{
+  free(s->cells);
+  free(s->scratch);
+  memset(s, 0, sizeof(*s));
+}
+
+static int screen_init (screen *s, int width, int height)
+{
+  memset(s, 0, sizeof(*s));
+  s->used = 1;
+  s->attr = 0x07;
+  s->mode = ENABLE_PROCESSED_OUTPUT | ENABLE_WRAP_AT_EOL_OUTPUT;
+  s->cursor_info.dwSize = 25;
+  s->cursor_info.bVisible = TRUE;
+  s->window.Right = (SHORT)(width - 1);
+  s->window.Bottom = (SHORT)(height - 1);
+  return screen_alloc(s, width, height);
+}
+
+// the console is there from the first call on, as for a console program
+static void init (void)
+{
+  if (!initialized)
+    winshim_reset(default_width, default_height);
+}
+
+static screen* get_screen (HANDLE h)
+{
+  screen *s = (screen*)h;
+  init();
+  return s >= screens && s < screens + MAX_SCREENS && s->used ? s : NULL;
+}
+
+static input* get_input (HANDLE h)
+{
+  init();
+  return h == (HANDLE)&in ? &in : NULL;
+}
+
+int winshim_reset (int width, int height)
+{
+  int i;
+  if (!initialized) {
+    in.mode = ENABLE_PROCESSED_INPUT | ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT;
+    sys_mutex_init(&in.lock);
+    sys_event_init(&in.ready);
+    initialized = 1;
+  }
+  for (i=0; i<MAX_SCREENS; i++)
+    screen_free(&screens[i]);
+  if (!screen_init(&screens[0], width, height))
+    return 0;
+  default_width = width;
+  default_height = height;
+  active = &screens[0];
+  std_handles[0] = (HANDLE)&in;
+  std_handles[1] = std_handles[2] = (HANDLE)&screens[0];
+  sys_mutex_lock(&in.lock);
+  in.head = in.count = 0;
+  in.endless = 0;
+  in.line_len = in.line_pos = 0;
+  sys_mutex_unlock(&in.lock);
+  memset(&stats, 0, sizeof(stats));
+  return 1;
+}
+
+void winshim_feed (const INPUT_RECORD *events, DWORD n, int endless)
+{
+  DWORD written;
+  init();
+  WriteConsoleInput((HANDLE)&in, events, n, &written);
+  in.endless = endless;
+}
+
+// The console reports a new buffer size of the screen shown as an input
+// record, if the input mode asks for it.
+static void report_size (screen *s)
+{
+  INPUT_RECORD ir;
+  DWORD written;
+  if (s != active || !(in.mode & ENABLE_WINDOW_INPUT))
+    return;
+  memset(&ir, 0, sizeof(ir));
+  ir.EventType = WINDOW_BUFFER_SIZE_EVENT;
+  ir.Event.WindowBufferSizeEvent.dwSize.X = (SHORT)s->width;
+  ir.Event.WindowBufferSizeEvent.dwSize.Y = (SHORT)s->height;
+  WriteConsoleInput((HANDLE)&in, &ir, 1, &written);
+}
+
+int winshim_resize (HANDLE h, int width, int height)
+{
+  screen *s = get_screen(h);
+  if (!s || width <= 0 || height <= 0 || width > 0x7FFF || height > 0x7FFF)
+    return 0;
+  s->window.Left = s->window.Top = 0;
+  s->window.Right = (SHORT)(width - 1);
+  s->window.Bottom = (SHORT)(height - 1);
+  if (!screen_alloc(s, width, height))
+    return 0;
+  report_size(s);
+  return 1;
+}
+
+const winshim_stats* winshim_get_stats (void)
+{
+  return &stats;
+}
+
+const CHAR_INFO* winshim_screen (HANDLE h, int *width, int *height)
+{
+  screen *s = get_screen(h);
+  if (!s)
+    return NULL;
+  *width = s->width;
+  *height = s->height;
+  return s->cells;
+}
+
+//---------------------------------------------------------------------------
+// kernel32
+//---------------------------------------------------------------------------
+HANDLE GetStdHandle (DWORD nStdHandle)
+{
+  init();
+  if (nStdHandle >= STD_ERROR_HANDLE && nStdHandle <= STD_INPUT_HANDLE)
+    return std_handles[STD_INPUT_HANDLE - nStdHandle];
+  return INVALID_HANDLE_VALUE;
+}
+
+BOOL SetStdHandle (DWORD nStdHandle, HANDLE h)
+{
+  init();
+  if (nStdHandle >= STD_ERROR_HANDLE && nStdHandle <= STD_INPUT_HANDLE) {
+    std_handles[STD_INPUT_HANDLE - nStdHandle] = h;
+    return TRUE;
+  }
+  return FALSE;
+}
+
+BOOL CloseHandle (HANDLE h)
+{
+  screen *s = get_screen(h);
+  if (s && s != &screens[0]) {
+    if (s == active)
+      active = &screens[0];
+    screen_free(s);
+    return TRUE;
+  }
+  return s || get_input(h);
+}
+
+// a console input handle is signalled while there is input
+DWORD WaitForSingleObject (HANDLE h, DWORD timeout_ms)
+{
+  return WaitForMultipleObjects(1, &h, FALSE, timeout_ms);
+}
+
+// Only console input handles can be waited on. They all stand for the one
+// input queue, so they are signalled together and the first is reported.
+DWORD WaitForMultipleObjects (DWORD n, const HANDLE *handles, BOOL wait_all,
+                              DWORD timeout_ms)
+{
+  DWORD i;
+  (void)wait_all;
+  if (n == 0 || n > MAXIMUM_WAIT_OBJECTS)
+    return WAIT_FAILED;
+  for (i=0; i<n; i++)
+    if (!get_input(handles[i]))
+      return WAIT_FAILED;
+  for (;;) {
+    DWORD count;
+    sys_mutex_lock(&in.lock);
+    count = in.count;
+    sys_mutex_unlock(&in.lock);
+    if (count)
+      return WAIT_OBJECT_0;
+    if (!sys_event_wait(&in.ready, timeout_ms == INFINITE ? -1 : (int)timeout_ms))
+      return WAIT_TIMEOUT;
+  }
+}
+
+void Sleep (DWORD ms)
+{
+  struct timespec ts;
+  ts.tv_sec = ms / 1000;
+  ts.tv_nsec = (long)(ms % 1000) * 1000000;
+  nanosleep(&ts, NULL);
+}
+
+DWORD GetTickCount (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (DWORD)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+//---------------------------------------------------------------------------
+// console
+//---------------------------------------------------------------------------
+BOOL AllocConsole (void)                       { init(); return FALSE; }
+BOOL FreeConsole (void)                        { init(); return TRUE; }
+UINT GetConsoleCP (void)                       { return input_cp; }
+BOOL SetConsoleCP (UINT cp)                    { input_cp = cp; return TRUE; }
+UINT GetConsoleOutputCP (void)                 { return output_cp; }
+BOOL SetConsoleOutputCP (UINT cp)              { output_cp = cp; return TRUE; }
+BOOL GenerateConsoleCtrlEvent (DWORD e, DWORD g) { (void)e; (void)g; return TRUE; }
+
+BOOL SetConsoleCtrlHandler (PHANDLER_ROUTINE handler, BOOL add)
+{
+  (void)handler; (void)add;
+  return TRUE;
+}
+
+BOOL GetNumberOfConsoleMouseButtons (LPDWORD n)
+{
+  *n = 3;
+  return TRUE;
+}
+
+DWORD GetConsoleTitle (LPSTR s, DWORD size)
+{
+  size_t len = strlen(title);
+  if (size == 0)
+    return 0;
+  if (len >= size)
+    len = size - 1;
+  memcpy(s, title, len);
+  s[len] = 0;
+  return (DWORD)len;
+}
+
+BOOL SetConsoleTitle (LPCSTR s)
+{
+  strncpy(title, s, sizeof(title) - 1);
+  title[sizeof(title) - 1] = 0;
+  return TRUE;
+}
+
+HANDLE CreateConsoleScreenBuffer (DWORD access, DWORD share,
+  const SECURITY_ATTRIBUTES *sa, DWORD flags, LPVOID data)
+{
+  int i;
+  (void)access; (void)share; (void)sa; (void)data;
+  init();
+  if (flags != CONSOLE_TEXTMODE_BUFFER)
+    return INVALID_HANDLE_VALUE;
+  for (i=1; i<MAX_SCREENS; i++) {
+    if (!screens[i].used)
+      return screen_init(&screens[i], default_width, default_height) ?
+        (HANDLE)&screens[i] : INVALID_HANDLE_VALUE;
+  }
+  return INVALID_HANDLE_VALUE;
+}
+
+BOOL SetConsoleActiveScreenBuffer (HANDLE h)
+{
+  screen *s = get_screen(h);
+  if (s)
+    active = s;
+  return s != NULL;
+}
+
+BOOL GetConsoleMode (HANDLE h, LPDWORD mode)
+{
+  screen *s = get_screen(h);
+  if (s)
+    *mode = s->mode;
+  else if (get_input(h))
+    *mode = in.mode;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+BOOL SetConsoleMode (HANDLE h, DWORD mode)
+{
+  screen *s = get_screen(h);
+  if (s)
+    s->mode = mode;
+  else if (get_input(h))
+    in.mode = mode;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+//---------------------------------------------------------------------------
+// screen buffer
+//---------------------------------------------------------------------------
+BOOL GetConsoleScreenBufferInfo (HANDLE h, CONSOLE_SCREEN_BUFFER_INFO *info)
+{
+  screen *s = get_screen(h);
+  if (!s)
+    return FALSE;
+  info->dwSize.X = (SHORT)s->width;
+  info->dwSize.Y = (SHORT)s->height;
+  info->dwCursorPosition = s->cursor;
+  info->wAttributes = s->attr;
+  info->srWindow = s->window;
+  info->dwMaximumWindowSize = info->dwSize;
+  return TRUE;
+}
+
+BOOL SetConsoleScreenBufferSize (HANDLE h, COORD size)
+{
+  screen *s = get_screen(h);
+  if (!s || size.X <= 0 || size.Y <= 0 || !screen_alloc(s, size.X, size.Y))
+    return FALSE;
+  report_size(s);
+  return TRUE;
+}
+
+BOOL SetConsoleWindowInfo (HANDLE h, BOOL absolute, const SMALL_RECT *window)
+{
+  screen *s = get_screen(h);
+  SMALL_RECT r;
+  if (!s)
+    return FALSE;
+  r = *window;
+  if (!absolute) {
+    r.Left = (SHORT)(r.Left + s->window.Left);
+    r.Top = (SHORT)(r.Top + s->window.Top);
+    r.Right = (SHORT)(r.Right + s->window.Right);
+    r.Bottom = (SHORT)(r.Bottom + s->window.Bottom);
+  }
+  if (r.Left < 0 || r.Top < 0 || r.Right >= s->width || r.Bottom >= s->height ||
+      r.Left > r.Right || r.Top > r.Bottom)
+    return FALSE;
+  s->window = r;
+  return TRUE;
+}
+
+COORD GetLargestConsoleWindowSize (HANDLE h)
+{
+  COORD c = { 0, 0 };
+  screen *s = get_screen(h);
+  if (s) {
+    c.X = (SHORT)s->width;
+    c.Y = (SHORT)s->height;
+  }
+  return c;
+}
+
+BOOL GetConsoleCursorInfo (HANDLE h, CONSOLE_CURSOR_INFO *info)
+{
+  screen *s = get_screen(h);
+  if (s)
+    *info = s->cursor_info;
+  return s != NULL;
+}
+
+BOOL SetConsoleCursorInfo (HANDLE h, const CONSOLE_CURSOR_INFO *info)
+{
+  screen *s = get_screen(h);
+  if (!s || info->dwSize < 1 || info->dwSize > 100)
+    return FALSE;
+  s->cursor_info = *info;
+  return TRUE;
+}
+
+BOOL SetConsoleCursorPosition (HANDLE h, COORD pos)
+{
+  screen *s = get_screen(h);
+  if (!s || pos.X < 0 || pos.Y < 0 || pos.X >= s->width || pos.Y >= s->height)
+    return FALSE;
+  s->cursor = pos;
+  return TRUE;
+}
+
+BOOL SetConsoleTextAttribute (HANDLE h, WORD attr)
+{
+  screen *s = get_screen(h);
+  if (s)
+    s->attr = attr;
+  return s != NULL;
+}
+
+//---------------------------------------------------------------------------
+// input
+//---------------------------------------------------------------------------
+static BOOL read_input (HANDLE h, INPUT_RECORD *buf, DWORD n, LPDWORD read, int remove)
+{
+  DWORD i, k;
+  if (!get_input(h))
+    return FALSE;
+  sys_mutex_lock(&in.lock);
+  k = n < in.count ? n : in.count;
+  for (i=0; i<k; i++)
+    buf[i] = in.queue[(in.head + i) % QUEUE_SIZE];
+  if (remove) {
+    if (in.endless) {
+      for (i=0; i<k; i++)
+        in.queue[(in.head + in.count + i) % QUEUE_SIZE] = buf[i];
+    }
+    else
+      in.count -= k;
+    in.head = (in.head + k) % QUEUE_SIZE;
+    stats.events_read += k;
+  }
+  sys_mutex_unlock(&in.lock);
+  *read = k;
+  return TRUE;
+}
+
+BOOL ReadConsoleInput (HANDLE h, INPUT_RECORD *buf, DWORD n, LPDWORD read)
+{
+  return read_input(h, buf, n, read, 1);
+}
+
+BOOL PeekConsoleInput (HANDLE h, INPUT_RECORD *buf, DWORD n, LPDWORD read)
+{
+  return read_input(h, buf, n, read, 0);
+}
+
+BOOL WriteConsoleInput (HANDLE h, const INPUT_RECORD *buf, DWORD n, LPDWORD written)
+{
+  DWORD i;
+  if (!get_input(h))
+    return FALSE;
+  sys_mutex_lock(&in.lock);
+  if (n > QUEUE_SIZE - in.count)
+    n = QUEUE_SIZE - in.count;
+  for (i=0; i<n; i++)
+    in.queue[(in.head + in.count + i) % QUEUE_SIZE] = buf[i];
+  in.count += n;
+  sys_mutex_unlock(&in.lock);
+  if (n)
+    sys_event_set(&in.ready);
+  *written = n;
+  return TRUE;
+}
+
+BOOL GetNumberOfConsoleInputEvents (HANDLE h, LPDWORD n)
+{
+  if (!get_input(h))
+    return FALSE;
+  sys_mutex_lock(&in.lock);
+  *n = in.count;
+  sys_mutex_unlock(&in.lock);
+  return TRUE;
+}
+
+BOOL FlushConsoleInputBuffer (HANDLE h)
+{
+  if (!get_input(h))
+    return FALSE;
+  sys_mutex_lock(&in.lock);
+  in.head = in.count = 0;
+  sys_mutex_unlock(&in.lock);
+  return TRUE;
+}
+
+static void put_char (screen *s, WCHAR c);
+
+static void echo (const char *s)
+{
+  if (in.mode & ENABLE_ECHO_INPUT)
+    while (*s)
+      put_char(active, (unsigned char)*s++);
+}
+
+// The characters of the key presses queued. With ENABLE_LINE_INPUT they are
+// collected up to Enter (which gives "\r\n"), with backspace editing them,
+// and echoed to the screen shown with ENABLE_ECHO_INPUT; a line longer than
+// 'n' is returned over several calls. Nothing waits for more input: a line
+// cut short by the end of the queue is returned as it is. Each record queued
+// is looked at once at most, so an endless queue cannot loop forever.
+BOOL ReadConsole (HANDLE h, LPVOID buf, DWORD n, LPDWORD read, LPVOID control)
+{
+  INPUT_RECORD ir;
+  DWORD k = 0, got, avail;
+  char *out = (char*)buf;
+  (void)control;
+  if (!GetNumberOfConsoleInputEvents(h, &avail))
+    return FALSE;
+  if (!(in.mode & ENABLE_LINE_INPUT)) {
+    while (k < n && avail-- && ReadConsoleInput(h, &ir, 1, &got) && got) {
+      if (ir.EventType == KEY_EVENT && ir.Event.KeyEvent.bKeyDown &&
+          ir.Event.KeyEvent.uChar.AsciiChar)
+        out[k++] = ir.Event.KeyEvent.uChar.AsciiChar;
+    }
+    *read = k;
+    return TRUE;
+  }
+  if (in.line_pos == in.line_len) {
+    in.line_len = in.line_pos = 0;
+    while (avail-- && ReadConsoleInput(h, &ir, 1, &got) && got) {
+      char c = ir.Event.KeyEvent.uChar.AsciiChar, e[2] = { 0, 0 };
+      if (ir.EventType != KEY_EVENT || !ir.Event.KeyEvent.bKeyDown || !c)
+        continue;
+      if (c == '\b') {
+        if (in.line_len) {
+          in.line_len--;
+          echo("\b \b");
+        }
+      }
+      else if (c == '\r') {
+        in.line[in.line_len++] = '\r';
+        in.line[in.line_len++] = '\n';
+        echo("\r\n");
+        break;
+      }
+      else if (in.line_len < sizeof(in.line) - 2) {
+        in.line[in.line_len++] = e[0] = c;
+        echo(e);
+      }
+    }
+  }
+  while (k < n && in.line_pos < in.line_len)
+    out[k++] = in.line[in.line_pos++];
+  *read = k;
+  return TRUE;
+}
+
+//---------------------------------------------------------------------------
+// output
+//---------------------------------------------------------------------------
+// the cursor to the start of the next line, scrolling at the bottom
+static void new_line (screen *s)
+{
+  s->cursor.X = 0;
+  if (++s->cursor.Y == s->height) {
+    int i;
+    CHAR_INFO *last = s->cells + (size_t)(s->height - 1) * s->width;
+    memmove(s->cells, s->cells + s->width, (size_t)(s->height - 1) * s->width * sizeof(CHAR_INFO));
+    for (i=0; i<s->width; i++) {
+      last[i].Char.UnicodeChar = ' ';
+      last[i].Attributes = s->attr;
+    }
+    s->cursor.Y--;
+  }
+}
+
+// Without ENABLE_WRAP_AT_EOL_OUTPUT the cursor stays in the last column and
+// what follows overwrites it.
+static void put_glyph (screen *s, WCHAR c)
+{
+  CHAR_INFO *p = s->cells + s->cursor.Y * s->width + s->cursor.X;
+  p->Char.UnicodeChar = c;
+  p->Attributes = s->attr;
+  stats.cells_written++;
+  if (s->cursor.X < s->width - 1)
+    s->cursor.X++;
+  else if (s->mode & ENABLE_WRAP_AT_EOL_OUTPUT)
+    new_line(s);
+}
+
+// Teletype output. With ENABLE_PROCESSED_OUTPUT, CR, LF, BS, TAB (to the next
+// multiple of 8) and BEL are acted on; without it they are shown as any other
+// character.
+static void put_char (screen *s, WCHAR c)
+{
+  if (!(s->mode & ENABLE_PROCESSED_OUTPUT))
+    put_glyph(s, c);
+  else if (c == '\r')
+    s->cursor.X = 0;
+  else if (c == '\n')
+    new_line(s);
+  else if (c == '\b') {
+    if (s->cursor.X > 0)
+      s->cursor.X--;
+  }
+  else if (c == '\t') {
+    int y = s->cursor.Y;
+    do put_glyph(s, ' ');
+    while (s->cursor.X % 8 && s->cursor.Y == y && s->cursor.X < s->width - 1);
+  }
+  else if (c != '\a')
+    put_glyph(s, c);
+}
+
+BOOL WriteConsole (HANDLE h, LPCVOID buf, DWORD n, LPDWORD written, LPVOID reserved)
+{
+  screen *s = get_screen(h);
+  DWORD i;
+  (void)reserved;
+  if (!s)
+    return FALSE;
+  for (i=0; i<n; i++)
+    put_char(s, ((const unsigned char*)buf)[i]);
+  *written = n;
+  return TRUE;
+}
+
+BOOL WriteConsoleW (HANDLE h, LPCVOID buf, DWORD n, LPDWORD written, LPVOID reserved)
+{
+  screen *s = get_screen(h);
+  DWORD i;
+  (void)reserved;
+  if (!s)
+    return FALSE;
+  for (i=0; i<n; i++)
+    put_char(s, ((const WCHAR*)buf)[i]);
+  *written = n;
+  return TRUE;
+}
+
+// Copy between a buffer and the screen rectangle 'region', clipped to both;
+// 'region' is set to what was copied.
+static BOOL copy_rect (screen *s, CHAR_INFO *buf, COORD size, COORD from,
+  SMALL_RECT *region, int to_screen)
+{
+  int left = region->Left, top = region->Top, y;
+  int right = region->Right, bottom = region->Bottom;
+  if (!s || from.X < 0 || from.Y < 0 || from.X >= size.X || from.Y >= size.Y)
+    return FALSE;
+  if (left < 0) left = 0;
+  if (top < 0) top = 0;
+  if (right > s->width - 1) right = s->width - 1;
+  if (bottom > s->height - 1) bottom = s->height - 1;
+  if (right > region->Left + size.X - 1 - from.X) right = region->Left + size.X - 1 - from.X;
+  if (bottom > region->Top + size.Y - 1 - from.Y) bottom = region->Top + size.Y - 1 - from.Y;
+  for (y=top; y<=bottom && left<=right; y++) {
+    CHAR_INFO *p = s->cells + (size_t)y * s->width + left;
+    CHAR_INFO *q = buf + (size_t)(from.Y + y - region->Top) * size.X + from.X + left - region->Left;
+    size_t n = (size_t)(right - left + 1);
+    if (to_screen) {
+      memcpy(p, q, n * sizeof(CHAR_INFO));
+      stats.cells_written += n;
+    }
+    else {
+      memcpy(q, p, n * sizeof(CHAR_INFO));
+      stats.cells_read += n;
+    }
+  }
+  region->Left = (SHORT)left;
+  region->Top = (SHORT)top;
+  region->Right = (SHORT)right;
+  region->Bottom = (SHORT)bottom;
+  return TRUE;
+}
+
+BOOL WriteConsoleOutput (HANDLE h, const CHAR_INFO *buf, COORD size, COORD from,
+  SMALL_RECT *region)
+{
+  return copy_rect(get_screen(h), (CHAR_INFO*)buf, size, from, region, 1);
+}
+
+BOOL WriteConsoleOutputW (HANDLE h, const CHAR_INFO *buf, COORD size, COORD from,
+  SMALL_RECT *region)
+{
+  return copy_rect(get_screen(h), (CHAR_INFO*)buf, size, from, region, 1);
+}
+
+BOOL ReadConsoleOutput (HANDLE h, CHAR_INFO *buf, COORD size, COORD from,
+  SMALL_RECT *region)
+{
+  return copy_rect(get_screen(h), buf, size, from, region, 0);
+}
+
+BOOL ReadConsoleOutputW (HANDLE h, CHAR_INFO *buf, COORD size, COORD from,
+  SMALL_RECT *region)
+{
+  return copy_rect(get_screen(h), buf, size, from, region, 0);
+}
+
+// The cells from 'pos' on, row after row, as far as n or the end of the
+// screen; NULL if 'pos' is outside.
+static CHAR_INFO* run_at (screen *s, COORD pos, DWORD *n)
+{
+  size_t start, total;
+  if (!s || pos.X < 0 || pos.Y < 0 || pos.X >= s->width || pos.Y >= s->height)
+    return NULL;
+  start = (size_t)pos.Y * s->width + pos.X;
+  total = (size_t)s->width * s->height;
+  if (*n > total - start)
+    *n = (DWORD)(total - start);
+  return s->cells + start;
+}
+
+BOOL WriteConsoleOutputCharacter (HANDLE h, LPCSTR str, DWORD n, COORD pos, LPDWORD written)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    p[i].Char.UnicodeChar = (unsigned char)str[i];
+  stats.cells_written += n;
+  *written = n;
+  return TRUE;
+}
+
+BOOL WriteConsoleOutputCharacterW (HANDLE h, LPCWSTR str, DWORD n, COORD pos, LPDWORD written)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    p[i].Char.UnicodeChar = str[i];
+  stats.cells_written += n;
+  *written = n;
+  return TRUE;
+}
+
+BOOL WriteConsoleOutputAttribute (HANDLE h, const WORD *attr, DWORD n, COORD pos,
+  LPDWORD written)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    p[i].Attributes = attr[i];
+  stats.cells_written += n;
+  *written = n;
+  return TRUE;
+}
+
+BOOL ReadConsoleOutputCharacter (HANDLE h, LPSTR str, DWORD n, COORD pos, LPDWORD read)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    str[i] = p[i].Char.AsciiChar;
+  stats.cells_read += n;
+  *read = n;
+  return TRUE;
+}
+
+BOOL ReadConsoleOutputAttribute (HANDLE h, LPWORD attr, DWORD n, COORD pos, LPDWORD read)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    attr[i] = p[i].Attributes;
+  stats.cells_read += n;
+  *read = n;
+  return TRUE;
+}
+
+BOOL FillConsoleOutputCharacter (HANDLE h, CHAR ch, DWORD n, COORD pos, LPDWORD written)
+{
+  return FillConsoleOutputCharacterW(h, (unsigned char)ch, n, pos, written);
+}
+
+BOOL FillConsoleOutputCharacterW (HANDLE h, WCHAR ch, DWORD n, COORD pos, LPDWORD written)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    p[i].Char.UnicodeChar = ch;
+  stats.cells_written += n;
+  *written = n;
+  return TRUE;
+}
+
+BOOL FillConsoleOutputAttribute (HANDLE h, WORD attr, DWORD n, COORD pos, LPDWORD written)
+{
+  CHAR_INFO *p = run_at(get_screen(h), pos, &n);
+  DWORD i;
+  if (!p)
+    return FALSE;
+  for (i=0; i<n; i++)
+    p[i].Attributes = attr;
+  stats.cells_written += n;
+  *written = n;
+  return TRUE;
+}
+
+static int clip (SMALL_RECT *r, const SMALL_RECT *c)
+{
+  if (r->Left < c->Left) r->Left = c->Left;
+  if (r->Top < c->Top) r->Top = c->Top;
+  if (r->Right > c->Right) r->Right = c->Right;
+  if (r->Bottom > c->Bottom) r->Bottom = c->Bottom;
+  return r->Left <= r->Right && r->Top <= r->Bottom;
+}
+
+// The source is saved, filled, then written at 'dest'; clipping limits what
+// changes on the screen.
+BOOL ScrollConsoleScreenBuffer (HANDLE h, const SMALL_RECT *scroll, const SMALL_RECT *clip_rect,
+  COORD dest, const CHAR_INFO *fill)
+{
+  screen *s = get_screen(h);
+  SMALL_RECT src, bounds, fr, dr;
+  int x, y, w;
+  if (!s)
+    return FALSE;
+  bounds.Left = bounds.Top = 0;
+  bounds.Right = (SHORT)(s->width - 1);
+  bounds.Bottom = (SHORT)(s->height - 1);
+  src = *scroll;
+  if (!clip(&src, &bounds))
+    return FALSE;
+  if (clip_rect && !clip(&bounds, clip_rect))
+    return TRUE;
+  w = src.Right - src.Left + 1;
+  for (y=src.Top; y<=src.Bottom; y++)
+    memcpy(s->scratch + (size_t)(y - src.Top) * w, s->cells + (size_t)y * s->width + src.Left,
+      w * sizeof(CHAR_INFO));
+  fr = src;
+  if (clip(&fr, &bounds)) {
+    for (y=fr.Top; y<=fr.Bottom; y++)
+      for (x=fr.Left; x<=fr.Right; x++)
+        s->cells[(size_t)y * s->width + x] = *fill;
+  }
+  dr.Left = dest.X;
+  dr.Top = dest.Y;
+  dr.Right = (SHORT)(dest.X + w - 1);
+  dr.Bottom = (SHORT)(dest.Y + src.Bottom - src.Top);
+  if (clip(&dr, &bounds)) {
+    for (y=dr.Top; y<=dr.Bottom; y++) {
+      memcpy(s->cells + (size_t)y * s->width + dr.Left,
+        s->scratch + (size_t)(y - dest.Y) * w + (dr.Left - dest.X),
+        (dr.Right - dr.Left + 1) * sizeof(CHAR_INFO));
+      stats.cells_written += dr.Right - dr.Left + 1;
+    }
+  }
+  return TRUE;
+}
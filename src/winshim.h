@@ -0,0 +1,38 @@
+// winshim.h
+// An in-memory console behind the Win32 console API (shim/windows.h,
+// shim/wincon.h), so that the binding layer builds and can be measured where
+// there is no console, and so that the module itself runs there (the headless
+// build, see CONS_HEADLESS in cons.c). The calls do what the console would,
+// minus drawing: screen buffers of cells with a cursor, a window and the
+// console modes, an active screen buffer, and an input queue.
+
+#ifndef WINSHIM_H
+#define WINSHIM_H
+
+#include <windows.h>
+
+typedef struct {
+  unsigned long cells_written;  // cells stored by output functions
+  unsigned long cells_read;     // cells copied out by ReadConsoleOutput*
+  unsigned long events_read;    // input records handed out
+} winshim_stats;
+
+// Start over: screen buffers of width x height, blank; empty input; stats
+// cleared.
+int  winshim_reset (int width, int height);
+
+// Queue input records; with 'endless' set, the records read are queued again,
+// so the queue never runs dry.
+void winshim_feed  (const INPUT_RECORD *events, DWORD n, int endless);
+
+// Resize screen buffer h and its window to width x height, as when the user
+// resizes the console window: what fits stays, and if h is shown and the
+// input mode has ENABLE_WINDOW_INPUT a WINDOW_BUFFER_SIZE_EVENT is queued.
+int  winshim_resize (HANDLE h, int width, int height);
+
+const winshim_stats* winshim_get_stats (void);
+
+// the cells of a screen buffer handle (NULL if it is not one)
+const CHAR_INFO* winshim_screen (HANDLE h, int *width, int *height);
+
+#endif